@@ -0,0 +1,301 @@
+#include "pch.h"
+#include "allocator.h"
+#include "exceptions.h"
+
+guest_allocator::guest_allocator(heap& heap) : m_heap(heap), m_footprint(0), m_in_use(0), m_peak(0), m_live_blocks(0), m_total_mallocs(0), m_total_frees(0) {
+	// 8 byte steps up to 128 bytes, then four classes per power of two. Keeps the rounding waste below 25%
+	for (uint32_t size = 8; size <= 128; size += 8) {
+		m_class_sizes.push_back(size);
+	}
+	for (uint32_t base = 128; base < ALLOC_MAX_SMALL; base *= 2) {
+		for (uint32_t step = 1; step <= 4; step++) {
+			m_class_sizes.push_back(base + step * (base / 4));
+		}
+	}
+	m_free_lists.resize(m_class_sizes.size());
+
+	for (uint32_t i = 0; i < m_small_lookup.size(); i++) {
+		m_small_lookup[i] = uint8_t(std::lower_bound(m_class_sizes.begin(), m_class_sizes.end(), std::max(i * 8, 1u)) - m_class_sizes.begin());
+	}
+}
+
+uint32_t guest_allocator::size_class_for(uint32_t size) {
+	if (size <= (m_small_lookup.size() - 1) * 8) {
+		return m_small_lookup[(size + 7) / 8];
+	}
+	return uint32_t(std::lower_bound(m_class_sizes.begin(), m_class_sizes.end(), size) - m_class_sizes.begin());
+}
+
+// takes page aligned memory from the end of the heap, 0 if the heap is exhausted
+uint32_t guest_allocator::grow(uint32_t bytes) {
+	// guest sbrk calls can leave the break anywhere
+	uint32_t brk = m_heap.brk();
+	uint32_t pad = (ALLOC_PAGE_SIZE - (brk - m_heap.start()) % ALLOC_PAGE_SIZE) % ALLOC_PAGE_SIZE;
+	if (uint64_t(bytes) + pad > uint64_t(std::numeric_limits<int32_t>::max())) {
+		return 0;
+	}
+
+	try {
+		m_heap.sbrk(int32_t(pad + bytes));
+	}
+	catch (const std::runtime_error&) {
+		return 0;
+	}
+
+	m_footprint += pad + bytes;
+	m_pages.resize(page_index(brk + pad + bytes), page_info{ 0, 0 });
+	return brk + pad;
+}
+
+bool guest_allocator::refill(uint32_t size_class) {
+	uint32_t span = grow(ALLOC_SPAN_SIZE);
+	if (!span) {
+		return false;
+	}
+
+	uint32_t first_page = page_index(span);
+	for (uint32_t i = 0; i < ALLOC_SPAN_SIZE / ALLOC_PAGE_SIZE; i++) {
+		m_pages[first_page + i] = page_info{ uint16_t(size_class + 1), uint16_t(i) };
+	}
+
+	mark_span(span, size_class, false);
+
+	// pushed backwards so the lowest address is handed out first
+	uint32_t block_size = m_class_sizes[size_class];
+	std::vector<uint32_t>& free_list = m_free_lists[size_class];
+	for (uint32_t count = ALLOC_SPAN_SIZE / block_size; count > 0; count--) {
+		free_list.push_back(span + (count - 1) * block_size);
+	}
+	return true;
+}
+
+void guest_allocator::mark_span(uint32_t span, uint32_t size_class, bool live) {
+	uint32_t blocks = ALLOC_SPAN_SIZE / m_class_sizes[size_class];
+	std::vector<uint64_t>& bits = m_live_small[span];
+	bits.assign((blocks + 63) / 64, live ? ~uint64_t(0) : 0);
+}
+
+uint32_t guest_allocator::malloc(uint32_t size) {
+	uint32_t addr = 0;
+	uint32_t block_size = 0;
+
+	if (size <= ALLOC_MAX_SMALL) {
+		uint32_t size_class = size_class_for(size);
+		std::vector<uint32_t>& free_list = m_free_lists[size_class];
+		if (free_list.empty() && !refill(size_class)) {
+			return 0;
+		}
+
+		addr = free_list.back();
+		free_list.pop_back();
+		block_size = m_class_sizes[size_class];
+
+		uint32_t span = span_start(addr, m_pages[page_index(addr)]);
+		uint32_t block = (addr - span) / block_size;
+		m_live_small[span][block / 64] |= uint64_t(1) << (block % 64);
+	}
+	else {
+		if (size > std::numeric_limits<uint32_t>::max() - ALLOC_PAGE_SIZE) {
+			return 0;
+		}
+		block_size = (size + ALLOC_PAGE_SIZE - 1) & ~(ALLOC_PAGE_SIZE - 1);
+		if (!(addr = alloc_large(block_size))) {
+			return 0;
+		}
+		m_large[addr] = block_size;
+	}
+
+	m_in_use += block_size;
+	m_peak = std::max(m_peak, m_in_use);
+	m_live_blocks++;
+	m_total_mallocs++;
+	return addr;
+}
+
+uint32_t guest_allocator::usable_size(uint32_t addr) {
+	if (addr < m_heap.start() || page_index(addr) >= m_pages.size()) {
+		throw mips_exception_syscall("Invalid pointer " + std::to_string(addr) + ", not returned by MALLOC");
+	}
+
+	page_info& page = m_pages[page_index(addr)];
+	if (page.size_class) {
+		uint32_t span = span_start(addr, page);
+		uint32_t block_size = m_class_sizes[page.size_class - 1];
+		uint32_t block = (addr - span) / block_size;
+		if ((addr - span) % block_size) {
+			throw mips_exception_syscall("Invalid pointer " + std::to_string(addr) + ", not returned by MALLOC");
+		}
+		if (!(m_live_small[span][block / 64] & (uint64_t(1) << (block % 64)))) {
+			throw mips_exception_syscall("Invalid pointer " + std::to_string(addr) + ", already freed");
+		}
+		return block_size;
+	}
+
+	auto large = m_large.find(addr);
+	if (large == m_large.end()) {
+		throw mips_exception_syscall("Invalid pointer " + std::to_string(addr) + ", not returned by MALLOC");
+	}
+	return large->second;
+}
+
+void guest_allocator::free(uint32_t addr) {
+	if (!addr) {
+		return;
+	}
+
+	uint32_t block_size = usable_size(addr);
+	page_info& page = m_pages[page_index(addr)];
+	if (page.size_class) {
+		uint32_t span = span_start(addr, page);
+		uint32_t block = (addr - span) / block_size;
+		m_live_small[span][block / 64] &= ~(uint64_t(1) << (block % 64));
+		m_free_lists[page.size_class - 1].push_back(addr);
+	}
+	else {
+		m_large.erase(addr);
+		free_large(addr, block_size);
+	}
+
+	m_in_use -= block_size;
+	m_live_blocks--;
+	m_total_frees++;
+}
+
+uint32_t guest_allocator::alloc_large(uint32_t size) {
+	// best fit among the freed runs, the rest of the run stays free
+	auto fit = m_free_runs_by_size.lower_bound(std::make_pair(size, 0u));
+	if (fit == m_free_runs_by_size.end()) {
+		return grow(size);
+	}
+
+	uint32_t run_size = fit->first;
+	uint32_t addr = fit->second;
+	m_free_runs_by_size.erase(fit);
+	m_free_runs.erase(addr);
+
+	if (run_size > size) {
+		m_free_runs[addr + size] = run_size - size;
+		m_free_runs_by_size.insert(std::make_pair(run_size - size, addr + size));
+	}
+	return addr;
+}
+
+void guest_allocator::free_large(uint32_t addr, uint32_t size) {
+	// merge with the free runs right after and right before
+	auto next = m_free_runs.find(addr + size);
+	if (next != m_free_runs.end()) {
+		m_free_runs_by_size.erase(std::make_pair(next->second, next->first));
+		size += next->second;
+		m_free_runs.erase(next);
+	}
+
+	auto prev = m_free_runs.lower_bound(addr);
+	if (prev != m_free_runs.begin() && (--prev)->first + prev->second == addr) {
+		m_free_runs_by_size.erase(std::make_pair(prev->second, prev->first));
+		addr = prev->first;
+		size += prev->second;
+		m_free_runs.erase(prev);
+	}
+
+	m_free_runs[addr] = size;
+	m_free_runs_by_size.insert(std::make_pair(size, addr));
+}
+
+std::string guest_allocator::stats() {
+	uint64_t cached_small = 0;
+	for (size_t i = 0; i < m_free_lists.size(); i++) {
+		cached_small += uint64_t(m_free_lists[i].size()) * m_class_sizes[i];
+	}
+	uint64_t free_large = 0;
+	for (auto& run : m_free_runs) {
+		free_large += run.second;
+	}
+
+	// everything taken from the heap that isn't handed out: cached blocks, free runs, span tails and alignment padding
+	double fragmentation = m_footprint ? 100.0 * (m_footprint - m_in_use) / m_footprint : 0.0;
+
+	char buf[512];
+	snprintf(buf, sizeof(buf), "\n--- heap stats ---\n"
+		"in use:        %u bytes in %u blocks (peak %u bytes)\n"
+		"footprint:     %u bytes (heap break 0x%08X)\n"
+		"free:          %llu bytes in size classes, %llu bytes in %u page runs\n"
+		"fragmentation: %.1f%% of the footprint not in use\n"
+		"calls:         %llu mallocs, %llu frees\n",
+		m_in_use, m_live_blocks, m_peak, m_footprint, m_heap.brk(), (unsigned long long)cached_small, (unsigned long long)free_large, uint32_t(m_free_runs.size()),
+		fragmentation, (unsigned long long)m_total_mallocs, (unsigned long long)m_total_frees);
+	return buf;
+}
+
+void guest_allocator::save(snapshot_writer& out) {
+	out.put(uint32_t(m_pages.size()));
+	out.put_bytes(m_pages.data(), m_pages.size() * sizeof(page_info));
+
+	for (const std::vector<uint32_t>& list : m_free_lists) {
+		out.put(uint32_t(list.size()));
+		out.put_bytes(list.data(), list.size() * sizeof(uint32_t));
+	}
+
+	out.put(uint32_t(m_large.size()));
+	for (auto& block : m_large) {
+		out.put(block.first);
+		out.put(block.second);
+	}
+	out.put(uint32_t(m_free_runs.size()));
+	for (auto& run : m_free_runs) {
+		out.put(run.first);
+		out.put(run.second);
+	}
+
+	out.put(m_footprint);
+	out.put(m_in_use);
+	out.put(m_peak);
+	out.put(m_live_blocks);
+	out.put(m_total_mallocs);
+	out.put(m_total_frees);
+}
+
+void guest_allocator::restore(snapshot_reader& in) {
+	m_pages.resize(in.get<uint32_t>());
+	in.get_bytes(m_pages.data(), m_pages.size() * sizeof(page_info));
+
+	for (std::vector<uint32_t>& list : m_free_lists) {
+		list.resize(in.get<uint32_t>());
+		in.get_bytes(list.data(), list.size() * sizeof(uint32_t));
+	}
+
+	// a small block is handed out unless it is on its free list
+	m_live_small.clear();
+	for (uint32_t i = 0; i < m_pages.size(); i++) {
+		if (m_pages[i].size_class && m_pages[i].span_page == 0) {
+			mark_span(m_heap.start() + i * ALLOC_PAGE_SIZE, m_pages[i].size_class - 1, true);
+		}
+	}
+	for (uint32_t size_class = 0; size_class < m_free_lists.size(); size_class++) {
+		for (uint32_t addr : m_free_lists[size_class]) {
+			uint32_t span = span_start(addr, m_pages[page_index(addr)]);
+			uint32_t block = (addr - span) / m_class_sizes[size_class];
+			m_live_small[span][block / 64] &= ~(uint64_t(1) << (block % 64));
+		}
+	}
+
+	m_large.clear();
+	for (uint32_t n = in.get<uint32_t>(); n; n--) {
+		uint32_t addr = in.get<uint32_t>();
+		m_large[addr] = in.get<uint32_t>();
+	}
+	m_free_runs.clear();
+	m_free_runs_by_size.clear();
+	for (uint32_t n = in.get<uint32_t>(); n; n--) {
+		uint32_t addr = in.get<uint32_t>();
+		uint32_t size = in.get<uint32_t>();
+		m_free_runs[addr] = size;
+		m_free_runs_by_size.insert(std::make_pair(size, addr));
+	}
+
+	m_footprint = in.get<uint32_t>();
+	m_in_use = in.get<uint32_t>();
+	m_peak = in.get<uint32_t>();
+	m_live_blocks = in.get<uint32_t>();
+	m_total_mallocs = in.get<uint64_t>();
+	m_total_frees = in.get<uint64_t>();
+}
\ No newline at end of file
@@ -0,0 +1,67 @@
+#pragma once
+#include "pch.h"
+#include "memory.h"
+#include "snapshot.h"
+
+constexpr uint32_t ALLOC_PAGE_SHIFT = 12;
+constexpr uint32_t ALLOC_PAGE_SIZE = 1 << ALLOC_PAGE_SHIFT;
+constexpr uint32_t ALLOC_SPAN_SIZE = 0x10000; // small blocks of one size class are carved out of 64 KiB spans
+constexpr uint32_t ALLOC_MAX_SMALL = 0x8000; // bigger requests get their own run of pages
+
+// Native malloc/free for the guest that hands out addresses in the sbrk heap. All bookkeeping is kept on the host,
+// so allocating never touches guest memory and the guest can't corrupt the allocator. Frees of anything but a live block are rejected.
+// Small blocks come from per size class free lists, large blocks are page runs that get coalesced when freed.
+class guest_allocator {
+public:
+	guest_allocator(heap& heap);
+
+	uint32_t malloc(uint32_t size); // returns 0 if the heap is exhausted
+	void free(uint32_t addr);
+	uint32_t usable_size(uint32_t addr);
+
+	uint32_t in_use() { return m_in_use; }
+	uint32_t peak() { return m_peak; }
+	// the HeapStats report
+	std::string stats();
+
+	// the bookkeeping, the heap itself is saved separately (see checkpoint.h)
+	void save(snapshot_writer& out);
+	void restore(snapshot_reader& in);
+
+private:
+	// which allocation a heap page belongs to
+	struct page_info {
+		uint16_t size_class; // size class + 1 for pages of a small span, 0 otherwise
+		uint16_t span_page; // index of the page inside its span
+	};
+
+	uint32_t size_class_for(uint32_t size);
+	uint32_t span_start(uint32_t addr, const page_info& page) { return (addr & ~(ALLOC_PAGE_SIZE - 1)) - page.span_page * ALLOC_PAGE_SIZE; }
+	void mark_span(uint32_t span, uint32_t size_class, bool live); // every block of a span handed out or not
+	bool refill(uint32_t size_class);
+	uint32_t grow(uint32_t bytes);
+	uint32_t page_index(uint32_t addr) { return (addr - m_heap.start()) >> ALLOC_PAGE_SHIFT; }
+
+	uint32_t alloc_large(uint32_t size);
+	void free_large(uint32_t addr, uint32_t size);
+
+	heap& m_heap;
+
+	std::vector<uint32_t> m_class_sizes;
+	std::array<uint8_t, 1024 / 8 + 1> m_small_lookup; // (size + 7) / 8 -> size class, for sizes up to 1 KiB
+	std::vector<std::vector<uint32_t>> m_free_lists; // per size class, most recently freed block is reused first
+	std::unordered_map<uint32_t, std::vector<uint64_t>> m_live_small; // span address -> a bit per block, set while it is handed out
+
+	std::vector<page_info> m_pages; // indexed by heap page
+	std::unordered_map<uint32_t, uint32_t> m_large; // live large blocks, address -> size
+	std::map<uint32_t, uint32_t> m_free_runs; // free page runs, address -> size
+	std::set<std::pair<uint32_t, uint32_t>> m_free_runs_by_size; // (size, address), for best fit
+
+	// statistics
+	uint32_t m_footprint; // bytes taken from the heap
+	uint32_t m_in_use; // bytes handed out, rounded up to the block size
+	uint32_t m_peak;
+	uint32_t m_live_blocks;
+	uint64_t m_total_mallocs;
+	uint64_t m_total_frees;
+};
\ No newline at end of file
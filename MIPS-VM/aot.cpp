@@ -0,0 +1,63 @@
+#include "pch.h"
+#include "aot.h"
+#include "executor.h"
+
+void aot_block_table::build(const aot_program& program, const std::array<section, NUM_SECTIONS>& sections) {
+	m_ranges.clear();
+	for (int i : { TEXT, KTEXT }) {
+		const section& sect = sections[i];
+		if (!sect.sect.size()) {
+			continue;
+		}
+
+		range r;
+		r.base = sect.address;
+		r.blocks.resize(sect.sect.size() / 4, nullptr);
+		for (uint32_t b = 0; b < program.num_blocks; b++) {
+			uint32_t addr = program.blocks[b].addr;
+			if (addr >= sect.address && addr - sect.address < sect.sect.size()) {
+				r.blocks[(addr - sect.address) / 4] = program.blocks[b].fn;
+			}
+		}
+		m_ranges.push_back(std::move(r));
+	}
+}
+
+uint32_t* aot_runtime::regs(executor& vm) {
+	return vm.m_regs.regs;
+}
+
+registers& aot_runtime::state(executor& vm) {
+	return vm.m_regs;
+}
+
+uint64_t aot_runtime::tick(executor& vm) {
+	return vm.m_tick;
+}
+
+uint8_t* aot_runtime::access(executor& vm, uint32_t addr, uint32_t size, bool store) {
+	// the same checks as the interpreter's loads and stores, anything they would reject (or report) is left to it
+	section* sect = vm.get_section_for_address(addr);
+	if (!sect || (store && !(sect->flags & MUTABLE)) || (sect->flags & (WATCHED | DEVICE)) || !vm.is_safe_access(sect, addr, size)
+		|| (vm.m_machine->big_endian && (sect->flags & EXECUTABLE))) {
+		return nullptr;
+	}
+	return sect->sect.data() + vm.get_offset_for_section(sect, addr);
+}
+
+bool aot_runtime::interpret(executor& vm, uint64_t tick, uint32_t pc, uint32_t inst) {
+	vm.m_tick = tick;
+	vm.m_regs.pc = pc;
+
+	bool advanced = vm.dispatch(instruction(inst));
+	if (advanced) {
+		vm.m_regs.pc += 0x4;
+	}
+	vm.m_regs.regs[0] = 0;
+	return advanced;
+}
+
+void aot_runtime::leave(executor& vm, uint64_t last, uint32_t pc) {
+	vm.m_tick = last;
+	vm.m_regs.pc = pc;
+}
\ No newline at end of file
@@ -0,0 +1,87 @@
+#pragma once
+#include "pch.h"
+#include "registers.h"
+#include "sections.h"
+#include "byte_order.h"
+
+class executor;
+
+// Ahead-of-time translated code. The translator (translator.h) turns every basic block of .text and .ktext into a C++
+// function and writes them out together with the section files and a main, which compiled against the VM sources
+// (with MIPS_VM_NO_MAIN) gives a native runner for that one program.
+
+// runs one translated basic block on the hart and leaves pc at whatever comes next.
+// Returns false if the block ended in a taken branch or jump, just like executor::dispatch
+using aot_block_fn = bool(*)(executor& vm);
+
+struct aot_block {
+	uint32_t addr;
+	aot_block_fn fn;
+};
+
+// bumped whenever generated code would no longer fit the runtime, cached native code of another version is rebuilt
+constexpr uint32_t AOT_ABI_VERSION = 2;
+
+// the generated source exports `const aot_program* mips_vm_translation()`, a translation cache loads it from there
+#define AOT_PROGRAM_SYMBOL "mips_vm_translation"
+
+// everything the generated source hands to vm_main
+struct aot_program {
+	uint32_t version; // AOT_ABI_VERSION
+	uint64_t key; // translation_cache::key of the sections it was translated from
+	const char* name;
+	const uint8_t* sections[NUM_SECTIONS]; // section file contents (address followed by the data), nullptr if the program has none
+	uint32_t section_sizes[NUM_SECTIONS];
+	const aot_block* blocks; // the generated address to block table
+	uint32_t num_blocks;
+	uint32_t big_endian; // the blocks swap loaded and stored values, see byte_order.h
+};
+
+// Address to block lookup for the interpreter loop, a dense array per executable section so jumps (JR/JALR) resolve
+// in constant time. Addresses without a block (eg. the middle of one) are interpreted until they reach one.
+class aot_block_table {
+public:
+	void build(const aot_program& program, const std::array<section, NUM_SECTIONS>& sections);
+	bool empty() const { return m_ranges.empty(); }
+
+	aot_block_fn lookup(uint32_t pc) const {
+		for (const range& r : m_ranges) {
+			uint32_t index = (pc - r.base) / 4;
+			if (pc >= r.base && index < r.blocks.size()) {
+				return r.blocks[index];
+			}
+		}
+		return nullptr;
+	}
+
+private:
+	struct range {
+		uint32_t base;
+		std::vector<aot_block_fn> blocks; // one slot per instruction
+	};
+
+	std::vector<range> m_ranges;
+};
+
+// What translated blocks call into. Everything they don't translate themselves (syscalls, coprocessor access, traps,
+// faulting or watched memory accesses) is handed to the interpreter one instruction at a time, so both share the
+// memory model, syscalls and exception semantics. `tick` is the instruction count at the block's first instruction,
+// blocks set m_tick and pc absolutely before anything that can look at them.
+struct aot_runtime {
+	static uint32_t* regs(executor& vm);
+	static registers& state(executor& vm);
+	static uint64_t tick(executor& vm);
+
+	// guest memory for a plain load or store, nullptr if the interpreter has to do it (invalid, read-only, watched, a device,
+	// or code of a big-endian program which is kept in host order)
+	static uint8_t* access(executor& vm, uint32_t addr, uint32_t size, bool store);
+
+	// executes the instruction at pc (the index-th of the block) in the interpreter, the result is dispatch's
+	static bool interpret(executor& vm, uint64_t tick, uint32_t pc, uint32_t inst);
+
+	// block is done, last is the instruction count at its last instruction (step() counts that one)
+	static void leave(executor& vm, uint64_t last, uint32_t pc);
+};
+
+// the VM's main. A translated runner passes its program, the regular VM passes nullptr and loads the section files
+int vm_main(int argc, char** argv, const aot_program* program);
\ No newline at end of file
@@ -0,0 +1,92 @@
+#pragma once
+#include "pch.h"
+#include "sections.h"
+
+#ifdef _MSC_VER
+#include <stdlib.h>
+#endif
+
+// Host byte swaps, a single instruction on x86 and ARM
+inline uint16_t swap_bytes(uint16_t v) {
+#ifdef _MSC_VER
+	return _byteswap_ushort(v);
+#else
+	return __builtin_bswap16(v);
+#endif
+}
+
+inline uint32_t swap_bytes(uint32_t v) {
+#ifdef _MSC_VER
+	return _byteswap_ulong(v);
+#else
+	return __builtin_bswap32(v);
+#endif
+}
+
+// any 1, 2 or 4 byte integer
+template<class T>
+inline T swap_bytes_as(T v) {
+	if constexpr (sizeof(T) == 1) {
+		return v;
+	}
+	else if constexpr (sizeof(T) == 2) {
+		return T(swap_bytes(uint16_t(v)));
+	}
+	else {
+		return T(swap_bytes(uint32_t(v)));
+	}
+}
+
+// How loads and stores see guest memory. The interpreter is instantiated once per byte order and the one matching the
+// program is picked at startup, so an access never checks the byte order.
+//
+// Instruction words are always kept in host order, a big-endian program's executable sections are swapped once when
+// they are loaded so fetching costs nothing. Data loads from those sections have to undo that.
+struct little_endian_memory {
+	static constexpr bool big_endian = false;
+
+	template<class T>
+	static T load(section* sect, uint32_t offset) {
+		return *reinterpret_cast<T*>(sect->sect.data() + offset);
+	}
+
+	template<class T>
+	static void store(section* sect, uint32_t offset, T value) {
+		*reinterpret_cast<T*>(sect->sect.data() + offset) = value;
+	}
+
+	// a word between guest memory and a register, for the atomics
+	static uint32_t word(uint32_t value) { return value; }
+
+	// where a sub-word access lands in the device registers, which hold their words in host order
+	static uint32_t device_address(uint32_t addr, uint32_t size) { return addr; }
+};
+
+struct big_endian_memory {
+	static constexpr bool big_endian = true;
+
+	template<class T>
+	static T load(section* sect, uint32_t offset) {
+		if (sect->flags & EXECUTABLE) {
+			// host order words, byte n of a guest word is byte 3 - n of the host word
+			const uint8_t* mem = sect->sect.data();
+			uint32_t value = 0;
+			for (uint32_t i = 0; i < sizeof(T); i++) {
+				value = (value << 8) | mem[(offset + i) ^ 0x3];
+			}
+			return T(value);
+		}
+		return swap_bytes_as(*reinterpret_cast<T*>(sect->sect.data() + offset));
+	}
+
+	// executable sections are never writable by the guest
+	template<class T>
+	static void store(section* sect, uint32_t offset, T value) {
+		*reinterpret_cast<T*>(sect->sect.data() + offset) = swap_bytes_as(value);
+	}
+
+	static uint32_t word(uint32_t value) { return swap_bytes(value); }
+
+	// byte 0 of a big-endian word is its most significant byte, the highest of the host word
+	static uint32_t device_address(uint32_t addr, uint32_t size) { return size < sizeof(uint32_t) ? addr ^ (sizeof(uint32_t) - size) : addr; }
+};
\ No newline at end of file
@@ -0,0 +1,282 @@
+#include "pch.h"
+#include "checkpoint.h"
+#include "executor.h"
+
+static const char CHECKPOINT_MAGIC[8] = { 'M', 'I', 'P', 'S', 'V', 'M', 'K', 0 };
+constexpr uint32_t CHECKPOINT_VERSION = 1;
+constexpr const char* CHECKPOINT_FILE = "checkpoint.mvk";
+
+constexpr uint64_t NO_CHECK = std::numeric_limits<uint64_t>::max();
+constexpr uint64_t CLOCK_CHECK_INSTRUCTIONS = 1 << 22; // how often the clock is looked at for timed checkpoints
+
+#ifdef _WIN32
+#include <windows.h>
+
+static bool sync_file(FILE* file) {
+	return _commit(_fileno(file)) == 0;
+}
+
+static bool replace_file(const std::string& from, const std::string& to) {
+	return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+}
+
+static std::string temp_name(const std::string& file) {
+	return file + ".tmp" + std::to_string(GetCurrentProcessId());
+}
+#else
+#include <sys/wait.h>
+
+static bool sync_file(FILE* file) {
+	return fsync(fileno(file)) == 0;
+}
+
+static bool replace_file(const std::string& from, const std::string& to) {
+	return rename(from.c_str(), to.c_str()) == 0; // atomic, a crash leaves the old or the new checkpoint
+}
+
+static std::string temp_name(const std::string& file) {
+	return file + ".tmp" + std::to_string(getpid());
+}
+#endif
+
+checkpoint::checkpoint(const checkpoint_options& options, uint64_t key, uint64_t tick) : m_path(options.dir + "/" + CHECKPOINT_FILE), m_key(key), m_every(options.every),
+	m_interval(std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(options.interval))) {
+#ifndef _WIN32
+	m_writer = 0;
+#endif
+	m_next_tick = m_every ? tick + m_every : NO_CHECK;
+	m_next_time = std::chrono::steady_clock::now() + m_interval;
+	schedule(tick);
+}
+
+checkpoint::~checkpoint() {
+	writer_done(true);
+}
+
+void checkpoint::schedule(uint64_t tick) {
+	m_next_check = m_next_tick;
+	if (m_interval.count()) {
+		m_next_check = std::min(m_next_check, tick + CLOCK_CHECK_INSTRUCTIONS);
+	}
+}
+
+bool checkpoint::due(uint64_t tick) {
+	if (tick < m_next_check) {
+		return false;
+	}
+	if (tick >= m_next_tick || (m_interval.count() && std::chrono::steady_clock::now() >= m_next_time)) {
+		return true;
+	}
+
+	schedule(tick);
+	return false;
+}
+
+bool checkpoint::writer_done(bool wait) {
+#ifndef _WIN32
+	if (m_writer) {
+		int status = 0;
+		pid_t res;
+		do {
+			res = waitpid(m_writer, &status, wait ? 0 : WNOHANG);
+		} while (res < 0 && errno == EINTR);
+		if (res == 0) {
+			return false;
+		}
+		m_writer = 0; // it reported its own errors
+	}
+#endif
+	return true;
+}
+
+void checkpoint::take(executor& hart) {
+	// the next one is counted from now, a checkpoint that has to be skipped doesn't make the next one come sooner
+	m_next_tick = m_every ? hart.m_tick + m_every : NO_CHECK;
+	m_next_time = std::chrono::steady_clock::now() + m_interval;
+	schedule(hart.m_tick);
+
+	if (!writer_done(false)) {
+		return;
+	}
+
+#ifdef _WIN32
+	write(hart);
+#else
+	pid_t pid = fork();
+	if (pid == 0) {
+		_exit(write(hart) ? 0 : 1); // no atexit handlers or stdio flushes, those belong to the parent
+	}
+	if (pid < 0) {
+		write(hart);
+		return;
+	}
+	m_writer = pid;
+#endif
+}
+
+bool checkpoint::write(executor& hart) {
+	// errors go to stderr, printing to stdout from the child would flush the parent's buffered output a second time
+	std::string tmp = temp_name(m_path);
+	FILE* file = fopen(tmp.c_str(), "wb");
+	if (!file) {
+		fprintf(stderr, "Failed to create checkpoint '%s'\n", tmp.c_str());
+		return false;
+	}
+
+	snapshot_writer out(file);
+	save(hart, out);
+	bool written = out.finish() && sync_file(file);
+	if (fclose(file) != 0 || !written || !replace_file(tmp, m_path)) {
+		fprintf(stderr, "Failed to write checkpoint '%s'\n", m_path.c_str());
+		remove(tmp.c_str());
+		return false;
+	}
+	return true;
+}
+
+void checkpoint::save(executor& hart, snapshot_writer& out) {
+	machine& vm = *hart.m_machine;
+
+	out.put_bytes(CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+	out.put(CHECKPOINT_VERSION);
+	out.put(m_key);
+	const memory_layout& layout = vm.layout;
+	out.put(layout.stack_top);
+	out.put(layout.stack_size);
+	out.put(layout.heap_start);
+	out.put(layout.heap_size);
+	out.put(layout.mmio_base);
+	out.put(layout.memory_limit);
+	out.put(vm.num_harts);
+
+	// the hart
+	out.put(hart.m_tick);
+	out.put(hart.m_regs);
+	hart.m_syscall_frames.save(out);
+	out.put(hart.m_kernelmode);
+	out.put(hart.m_thread->id);
+	out.put(hart.m_timer_deadline);
+	out.put(hart.m_count_offset);
+	out.put(hart.m_compare);
+	out.put(hart.m_ll_addr);
+	out.put(hart.m_ll_value);
+	out.put(hart.m_ll_valid);
+	out.put(hart.m_exit_code);
+	out.put(hart.m_stats.syscalls);
+	out.put(hart.m_stats.exceptions);
+	out.put(uint32_t(hart.m_stats.high_syscalls.size()));
+	for (auto& count : hart.m_stats.high_syscalls) {
+		out.put(count.first);
+		out.put(count.second);
+	}
+
+	// guest memory
+	for (section& sect : hart.m_sections) {
+		if ((sect.flags & MUTABLE) && sect.sect.size()) {
+			out.put_memory(sect.address, sect.sect.data(), uint32_t(sect.sect.size()));
+		}
+	}
+	vm.heap_area.save(out);
+	vm.allocator.save(out);
+	vm.stack_area.save(out);
+	vm.mappings.save(out);
+	vm.devices.save(out);
+	vm.timer.save(out);
+
+	// host resources behind the syscalls
+	vm.rng.save(out);
+	vm.files.save(out);
+	vm.syscalls.save(out);
+	vm.scheduler.save(out);
+	out.put(vm.input->consumed());
+}
+
+void checkpoint::restore(executor& hart, snapshot_reader& in, uint64_t key) {
+	machine& vm = *hart.m_machine;
+
+	char magic[sizeof(CHECKPOINT_MAGIC)];
+	in.get_bytes(magic, sizeof(magic));
+	if (memcmp(magic, CHECKPOINT_MAGIC, sizeof(magic)) || in.get<uint32_t>() != CHECKPOINT_VERSION) {
+		throw std::runtime_error("not a checkpoint of this version of the VM");
+	}
+	if (in.get<uint64_t>() != key) {
+		throw std::runtime_error("checkpoint is of a different program");
+	}
+	const memory_layout& layout = vm.layout;
+	if (in.get<uint32_t>() != layout.stack_top || in.get<uint32_t>() != layout.stack_size || in.get<uint32_t>() != layout.heap_start || in.get<uint32_t>() != layout.heap_size ||
+		in.get<uint32_t>() != layout.mmio_base || in.get<uint64_t>() != layout.memory_limit || in.get<uint32_t>() != vm.num_harts) {
+		throw std::runtime_error("checkpoint was taken with a different memory layout or number of harts");
+	}
+
+	// the hart
+	hart.m_tick = in.get<uint64_t>();
+	hart.m_regs = in.get<registers>();
+	hart.m_syscall_frames.restore(in);
+	hart.m_kernelmode = in.get<bool>();
+	uint32_t thread = in.get<uint32_t>();
+	hart.m_timer_deadline = in.get<uint64_t>();
+	hart.m_count_offset = in.get<uint32_t>();
+	hart.m_compare = in.get<uint32_t>();
+	hart.m_ll_addr = in.get<uint32_t>();
+	hart.m_ll_value = in.get<uint32_t>();
+	hart.m_ll_valid = in.get<bool>();
+	hart.m_exit_code = in.get<int32_t>();
+	hart.m_stats.syscalls = in.get<decltype(hart.m_stats.syscalls)>();
+	hart.m_stats.exceptions = in.get<decltype(hart.m_stats.exceptions)>();
+	for (uint32_t n = in.get<uint32_t>(); n; n--) {
+		uint32_t num = in.get<uint32_t>();
+		hart.m_stats.high_syscalls[num] = in.get<uint64_t>();
+	}
+
+	// guest memory
+	for (section& sect : hart.m_sections) {
+		if ((sect.flags & MUTABLE) && sect.sect.size()) {
+			in.get_memory(sect);
+		}
+	}
+	vm.heap_area.restore(in);
+	vm.allocator.restore(in);
+	vm.stack_area.restore(in);
+	vm.mappings.restore(in);
+	vm.devices.restore(in);
+	vm.timer.restore(in);
+
+	// host resources behind the syscalls
+	vm.rng.restore(in);
+	vm.files.restore(in);
+	vm.syscalls.restore(in);
+	vm.scheduler.init(vm.num_harts);
+	vm.scheduler.restore(in);
+	hart.m_thread = vm.scheduler.find(thread);
+	if (!hart.m_thread) {
+		throw std::runtime_error("checkpoint's running guest thread doesn't exist");
+	}
+
+	uint64_t consumed = in.get<uint64_t>();
+	if (vm.input->skip(consumed) != consumed) {
+		throw std::runtime_error("the input ends before where the program had read it to");
+	}
+	hart.schedule_events();
+}
+
+bool checkpoint::resume(executor& hart, const std::string& dir, uint64_t key) {
+	std::string path = dir + "/" + CHECKPOINT_FILE;
+	snapshot_reader in;
+	if (!in.open(path)) {
+		printf("No complete checkpoint '%s' to resume from\n", path.c_str());
+		return false;
+	}
+
+	try {
+		restore(hart, in, key);
+	}
+	catch (const std::exception& e) {
+		printf("Can't resume from checkpoint '%s': %s\n", path.c_str(), e.what());
+		return false;
+	}
+
+	if (!hart.m_machine->quiet) {
+		printf("Resuming from checkpoint '%s' after %llu instructions\n", path.c_str(), (unsigned long long)hart.m_tick);
+	}
+	return true;
+}
\ No newline at end of file
@@ -0,0 +1,64 @@
+#pragma once
+#include "pch.h"
+#include "snapshot.h"
+
+class executor;
+
+// Settings of periodic checkpoints, filled in from the command line (--checkpoint and friends)
+struct checkpoint_options {
+	checkpoint_options() : every(0), interval(0) {}
+
+	std::string dir; // directory the checkpoint is kept in, empty for none
+	uint64_t every; // instructions between two checkpoints, 0 to not count them
+	double interval; // seconds between two checkpoints, 0 to not time them
+	std::string resume; // continue the program from the checkpoint in this directory
+};
+
+// Periodic checkpoints of a long running program, and resuming it from the latest one.
+//
+// A checkpoint is due like a timer event (see executor::handle_events) and taken between two blocks. The hart forks, the child
+// holds a copy-on-write image of the machine at that instant and writes it out while the hart goes on right away, so all the
+// hart pays is the fork and copying the pages it writes to while the child still runs. The file is written under a temporary
+// name and renamed over the previous checkpoint once complete, the directory always holds one consistent checkpoint.
+// Windows can't fork, the hart writes the checkpoint itself there.
+//
+// A checkpoint has the hart, the guest memory (pages that are all zero left out, of the stack only what was touched), the
+// allocator, the guest threads, open files and mappings by path, random streams, guest syscall handlers, devices and how far
+// stdin was read. It is resumed by the same build with the same program, options and input. Plugin state isn't part of it,
+// and console output after the checkpoint is printed again. Single hart only.
+class checkpoint {
+public:
+	// `key` identifies the program as loaded, see translation_cache::key
+	checkpoint(const checkpoint_options& options, uint64_t key, uint64_t tick);
+	~checkpoint(); // waits for a checkpoint still being written
+
+	// instruction count at which the hart next has to ask due()
+	uint64_t next_check() const { return m_next_check; }
+	// true if a checkpoint is due, otherwise next_check() moves on
+	bool due(uint64_t tick);
+	// a checkpoint of the hart's machine as it is now. If the last one is still being written this one is skipped
+	void take(executor& hart);
+
+	// restores the machine of a hart that was just set up, false after printing why it can't
+	static bool resume(executor& hart, const std::string& dir, uint64_t key);
+
+private:
+	void schedule(uint64_t tick);
+	// false while the last checkpoint is still being written, `wait` for it to finish
+	bool writer_done(bool wait);
+
+	bool write(executor& hart);
+	void save(executor& hart, snapshot_writer& out);
+	static void restore(executor& hart, snapshot_reader& in, uint64_t key);
+
+	std::string m_path;
+	uint64_t m_key;
+	uint64_t m_every;
+	std::chrono::steady_clock::duration m_interval;
+	uint64_t m_next_tick; // by instruction count
+	std::chrono::steady_clock::time_point m_next_time; // by time
+	uint64_t m_next_check;
+#ifndef _WIN32
+	pid_t m_writer; // child writing the last checkpoint, 0 if there is none
+#endif
+};
\ No newline at end of file
@@ -0,0 +1,124 @@
+#include "pch.h"
+#include "code_analysis.h"
+#include "exceptions.h"
+#include "helper.h"
+
+static bool is_branch(instruction inst) {
+	switch (inst.i.opcode) {
+	case uint32_t(instructions::BEQ):
+	case uint32_t(instructions::BNE):
+	case uint32_t(instructions::BLEZ):
+	case uint32_t(instructions::BGTZ):
+		return true;
+	}
+	return false;
+}
+
+static bool is_jump(instruction inst) {
+	return inst.j.opcode == uint32_t(instructions::J) || inst.j.opcode == uint32_t(instructions::JAL);
+}
+
+// control leaves the straight line (or may, in the case of the syscall and exception related ones)
+static bool ends_block(instruction inst) {
+	if (is_branch(inst) || is_jump(inst)) {
+		return true;
+	}
+	if (inst.r.opcode == uint32_t(instructions::ERET)) {
+		return inst.r.funct == 0x18;
+	}
+	if (inst.r.opcode == uint32_t(instructions::R_FORMAT)) {
+		switch (inst.r.funct) {
+		case uint32_t(funct::JR):
+		case uint32_t(funct::JALR):
+		case uint32_t(funct::SYSCALL):
+		case uint32_t(funct::BREAK):
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool is_code(const std::array<section, NUM_SECTIONS>& sections, uint32_t addr) {
+	for (int i : { TEXT, KTEXT }) {
+		const section& sect = sections[i];
+		if (sect.sect.size() && addr >= sect.address && addr - sect.address < sect.sect.size() && !(addr & 0x3)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void code_analysis::analyze(const std::array<section, NUM_SECTIONS>& sections) {
+	m_own_instructions.clear();
+	m_own_blocks.clear();
+
+	// decode, the leaders are marked in a second pass since branches may go backwards
+	std::set<uint32_t> leaders;
+	for (int i : { TEXT, KTEXT }) {
+		const section& sect = sections[i];
+		if (!sect.sect.size()) {
+			continue;
+		}
+
+		leaders.insert(sect.address);
+		for (uint32_t offset = 0; offset < sect.sect.size(); offset += 4) {
+			uint32_t pc = sect.address + offset;
+			instruction inst(*reinterpret_cast<const uint32_t*>(sect.sect.data() + offset));
+			decoded_instruction decoded = { inst.hex, 0, 0 };
+
+			if (ends_block(inst)) {
+				decoded.flags |= DECODED_ENDS_BLOCK;
+				leaders.insert(pc + 4);
+			}
+			if (is_branch(inst) || is_jump(inst)) {
+				decoded.flags |= DECODED_STATIC_TARGET;
+				decoded.target = is_branch(inst) ? pc + 4 + bit_cast<int16_t>(inst.i.imm) * 4 : (inst.j.p_addr * 4) | ((pc + 4) & 0xF0000000);
+				if (is_code(sections, decoded.target)) {
+					leaders.insert(decoded.target);
+				}
+				else {
+					decoded.flags |= DECODED_INVALID_TARGET;
+				}
+			}
+			m_own_instructions.push_back(decoded);
+		}
+	}
+	if (is_code(sections, EXCEPTION_HANDLER)) {
+		leaders.insert(EXCEPTION_HANDLER);
+	}
+
+	// every leader starts a block that runs up to the next leader (or the end of its section)
+	uint32_t index = 0;
+	for (int i : { TEXT, KTEXT }) {
+		const section& sect = sections[i];
+		for (uint32_t offset = 0; offset < sect.sect.size(); offset += 4, index++) {
+			uint32_t pc = sect.address + offset;
+			if (!leaders.count(pc)) {
+				continue;
+			}
+
+			m_own_instructions[index].flags |= DECODED_LEADER;
+			if (!m_own_blocks.empty() && m_own_blocks.back().sect == uint32_t(i)) {
+				m_own_blocks.back().end = pc;
+			}
+			m_own_blocks.push_back({ uint32_t(i), pc, sect.address + uint32_t(sect.sect.size()), index });
+		}
+	}
+
+	view(m_own_instructions.data(), uint32_t(m_own_instructions.size()), m_own_blocks.data(), uint32_t(m_own_blocks.size()));
+}
+
+void code_analysis::view(const decoded_instruction* instructions, uint32_t num_instructions, const code_block* blocks, uint32_t num_blocks) {
+	m_instructions = instructions;
+	m_num_instructions = num_instructions;
+	m_blocks = blocks;
+	m_num_blocks = num_blocks;
+}
+
+uint32_t code_analysis::invalid_targets() const {
+	uint32_t count = 0;
+	for (uint32_t i = 0; i < m_num_instructions; i++) {
+		count += (m_instructions[i].flags & DECODED_INVALID_TARGET) != 0;
+	}
+	return count;
+}
\ No newline at end of file
@@ -0,0 +1,56 @@
+#pragma once
+#include "pch.h"
+#include "sections.h"
+#include "instruction.h"
+
+enum DECODED_FLAGS : uint32_t {
+	DECODED_LEADER = 1 << 0, // starts a basic block
+	DECODED_ENDS_BLOCK = 1 << 1, // branch, jump, SYSCALL, BREAK or ERET
+	DECODED_STATIC_TARGET = 1 << 2, // branch or J/JAL, `target` is where it goes
+	DECODED_INVALID_TARGET = 1 << 3, // ... and that isn't code (CFG validation)
+};
+
+struct decoded_instruction {
+	uint32_t hex;
+	uint32_t target;
+	uint32_t flags;
+};
+
+struct code_block {
+	uint32_t sect;
+	uint32_t start;
+	uint32_t end; // first address after the block
+	uint32_t first; // index of its first instruction in the decoded stream
+};
+
+// What the translator needs to know about a program's .text and .ktext: the predecoded instruction stream (.text
+// followed by .ktext), the basic blocks and the result of checking every static branch and jump target.
+// Either worked out from the sections or a view of a translation cache entry (translation_cache.h), the arrays are
+// plain data so they can be mapped straight from disk.
+//
+// Leaders are the section starts, the exception handler, branch and jump targets and every instruction after a
+// branch, jump, SYSCALL, BREAK or ERET.
+class code_analysis {
+public:
+	code_analysis() : m_instructions(nullptr), m_num_instructions(0), m_blocks(nullptr), m_num_blocks(0) {}
+
+	void analyze(const std::array<section, NUM_SECTIONS>& sections);
+	void view(const decoded_instruction* instructions, uint32_t num_instructions, const code_block* blocks, uint32_t num_blocks);
+
+	const decoded_instruction* instructions() const { return m_instructions; }
+	uint32_t num_instructions() const { return m_num_instructions; }
+	const code_block* blocks() const { return m_blocks; }
+	uint32_t num_blocks() const { return m_num_blocks; }
+
+	// static branches and jumps whose target isn't in .text or .ktext
+	uint32_t invalid_targets() const;
+
+private:
+	std::vector<decoded_instruction> m_own_instructions;
+	std::vector<code_block> m_own_blocks;
+
+	const decoded_instruction* m_instructions;
+	uint32_t m_num_instructions;
+	const code_block* m_blocks;
+	uint32_t m_num_blocks;
+};
\ No newline at end of file
@@ -0,0 +1,482 @@
+#include "pch.h"
+#include "debugger.h"
+#include "executor.h"
+#include "disassembler.h"
+
+void debugger::load_symbols(const std::string& file) {
+    std::ifstream in(file);
+    if (!in.is_open()) {
+        return;
+    }
+
+    // one "label address" pair per line
+    std::string label, address;
+    while (in >> label >> address) {
+        uint32_t addr = uint32_t(strtoul(address.c_str(), nullptr, 0));
+        m_symbols[addr] = label;
+        m_labels[label] = addr;
+    }
+
+    printf("Loaded %u symbols from %s\n", uint32_t(m_labels.size()), file.c_str());
+}
+
+bool debugger::read_word(uint32_t addr, uint32_t& out) {
+    section* sect = m_vm.get_section_for_address(addr, true);
+    if (!sect || !m_vm.is_safe_access(sect, addr, sizeof(uint32_t))) {
+        return false;
+    }
+
+    out = m_vm.read_guest(sect, addr, sizeof(uint32_t));
+    return true;
+}
+
+bool debugger::write_text_word(uint32_t addr, uint32_t val) {
+    section* sect = m_vm.get_section_for_address(addr, true);
+    if (!sect || !(sect->flags & EXECUTABLE) || (addr & 0x3) || !m_vm.is_safe_access(sect, addr, sizeof(uint32_t))) {
+        return false;
+    }
+
+    memcpy(sect->sect.data() + m_vm.get_offset_for_section(sect, addr), &val, sizeof(uint32_t));
+    return true;
+}
+
+bool debugger::parse_address(const std::string& str, uint32_t& addr) {
+    auto label = m_labels.find(str);
+    if (label != m_labels.end()) {
+        addr = label->second;
+        return true;
+    }
+
+    // register contents, eg. "$sp"
+    if (str.size() > 1 && str[0] == '$') {
+        for (uint32_t i = 0; i < 32; i++) {
+            if (str.compare(1, std::string::npos, register_name(i)) == 0) {
+                addr = m_vm.m_regs.regs[i];
+                return true;
+            }
+        }
+        return false;
+    }
+
+    char* end = nullptr;
+    addr = uint32_t(strtoul(str.c_str(), &end, 0));
+    return !str.empty() && *end == '\0';
+}
+
+std::string debugger::symbolize(uint32_t addr) {
+    auto it = m_symbols.upper_bound(addr);
+    if (it == m_symbols.begin()) {
+        return "";
+    }
+    --it;
+
+    char buf[32];
+    snprintf(buf, sizeof(buf), "+0x%X", addr - it->first);
+    return " <" + it->second + (addr != it->first ? buf : "") + ">";
+}
+
+bool debugger::set_breakpoint(uint32_t addr) {
+    if (is_breakpoint(addr)) {
+        return true;
+    }
+
+    uint32_t original = 0;
+    if (!read_word(addr, original) || !write_text_word(addr, BREAKPOINT_TRAP)) {
+        return false; // not an address in executable memory
+    }
+
+    m_breakpoints[addr] = original;
+    return true;
+}
+
+bool debugger::remove_breakpoint(uint32_t addr) {
+    auto bp = m_breakpoints.find(addr);
+    if (bp == m_breakpoints.end()) {
+        return false;
+    }
+
+    write_text_word(addr, bp->second);
+    m_breakpoints.erase(bp);
+    return true;
+}
+
+bool debugger::read_value(uint32_t addr, uint32_t size, uint32_t& out) {
+    section* sect = m_vm.get_section_for_address(addr, true);
+    if (!sect || !m_vm.is_safe_access(sect, addr, size)) {
+        return false;
+    }
+
+    out = m_vm.read_guest(sect, addr, size);
+    return true;
+}
+
+static const char* watch_type_name(watch_type type) {
+    switch (type) {
+    case watch_type::read:
+        return "read";
+    case watch_type::write:
+        return "write";
+    default:
+        return "change";
+    }
+}
+
+bool debugger::add_watchpoint(uint32_t addr, uint32_t len, watch_type type) {
+    if (!len || uint64_t(addr) + len > 0x100000000ULL || !m_vm.get_section_for_address(addr, true)) {
+        return false;
+    }
+
+    watchpoint wp;
+    wp.addr = addr;
+    wp.len = len;
+    wp.type = type;
+    m_watchpoints.push_back(wp);
+
+    update_watched_pages();
+    return true;
+}
+
+bool debugger::remove_watchpoint(uint32_t index) {
+    if (index >= m_watchpoints.size()) {
+        return false;
+    }
+
+    m_watchpoints.erase(m_watchpoints.begin() + index);
+    update_watched_pages();
+    return true;
+}
+
+// Flags every section that contains a watched page and marks the page in the section's bitmap. Loads and stores only
+// call into the debugger for accesses that land on a marked page, those are compared against the watchpoints.
+void debugger::update_watched_pages() {
+    for (uint32_t addr : m_flagged_addrs) {
+        section* sect = m_vm.get_section_for_address(addr, true);
+        if (sect) {
+            sect->flags &= ~WATCHED;
+            sect->watched_pages.clear();
+        }
+    }
+    m_flagged_addrs.clear();
+
+    for (auto& wp : m_watchpoints) {
+        uint32_t last = wp.addr + wp.len - 1;
+        for (uint32_t page = wp.addr >> WATCH_PAGE_SHIFT; page <= (last >> WATCH_PAGE_SHIFT); page++) {
+            // probe the first and last watched byte in this page, the section doesn't have to start at a page boundary
+            uint32_t page_start = page << WATCH_PAGE_SHIFT;
+            uint32_t page_last = page_start + ((1u << WATCH_PAGE_SHIFT) - 1);
+            for (uint32_t probe : { std::max(page_start, wp.addr), std::min(page_last, last) }) {
+                section* sect = m_vm.get_section_for_address(probe, true);
+                if (sect) {
+                    uint32_t index = page - (sect->address >> WATCH_PAGE_SHIFT);
+                    if (sect->watched_pages.size() <= index / 64) {
+                        sect->watched_pages.resize(index / 64 + 1);
+                    }
+                    sect->watched_pages[index / 64] |= 1ull << (index % 64);
+                    sect->flags |= WATCHED;
+                    m_flagged_addrs.push_back(probe);
+                }
+            }
+
+            if (page == 0xFFFFFFFF >> WATCH_PAGE_SHIFT) {
+                break;
+            }
+        }
+    }
+}
+
+void debugger::on_watched_access(uint32_t addr, uint32_t size, bool store, uint32_t value) {
+    registers& regs = m_vm.m_regs;
+    uint32_t mask = size >= sizeof(uint32_t) ? 0xFFFFFFFF : (1u << (size * 8)) - 1;
+    value &= mask;
+
+    bool hit = false;
+    for (size_t i = 0; i < m_watchpoints.size(); i++) {
+        watchpoint& wp = m_watchpoints[i];
+        if (uint64_t(addr) + size <= wp.addr || uint64_t(addr) >= uint64_t(wp.addr) + wp.len) {
+            continue; // no overlap
+        }
+        if ((wp.type == watch_type::read) == store) {
+            continue; // wrong kind of access
+        }
+
+        uint32_t old = 0;
+        read_value(addr, size, old);
+        if (wp.type == watch_type::change && old == value) {
+            continue;
+        }
+
+        if (store) {
+            printf("\nWatchpoint %u (%s) hit at pc 0x%08X%s: [0x%08X] %0*X -> %0*X    (%llu instructions executed)\n",
+                uint32_t(i), watch_type_name(wp.type), regs.pc, symbolize(regs.pc).c_str(), addr, int(size * 2), old, int(size * 2), value, (unsigned long long)m_vm.m_tick);
+        }
+        else {
+            printf("\nWatchpoint %u (%s) hit at pc 0x%08X%s: [0x%08X] = %0*X    (%llu instructions executed)\n",
+                uint32_t(i), watch_type_name(wp.type), regs.pc, symbolize(regs.pc).c_str(), addr, int(size * 2), old, (unsigned long long)m_vm.m_tick);
+        }
+        hit = true;
+    }
+
+    // loads and stores always continue at the next instruction, stop there once this one has completed
+    if (hit && !m_stepping && !m_watch_stop) {
+        uint32_t next = regs.pc + 0x4;
+        if (!is_breakpoint(next) && set_breakpoint(next)) {
+            m_watch_stop = next;
+        }
+    }
+}
+
+step_result debugger::step_once() {
+    registers& regs = m_vm.m_regs;
+
+    // stopped on the guest's own BREAK, skip it or we would stop on it forever
+    if (m_guest_break) {
+        m_guest_break = false;
+        regs.pc += 0x4;
+        m_vm.m_tick++;
+        return step_result::running;
+    }
+
+    auto bp = m_breakpoints.find(regs.pc);
+    if (bp == m_breakpoints.end()) {
+        return m_vm.step();
+    }
+
+    // execute the original instruction for one step, then plant the trap again
+    uint32_t addr = bp->first;
+    write_text_word(addr, bp->second);
+    step_result result = m_vm.step();
+    write_text_word(addr, BREAKPOINT_TRAP);
+
+    return result;
+}
+
+void debugger::print_location(const char* reason) {
+    uint32_t pc = m_vm.m_regs.pc;
+
+    uint32_t word = 0;
+    std::string inst = "<invalid pc>";
+    if (read_word(pc, word)) {
+        auto bp = m_breakpoints.find(pc);
+        if (bp != m_breakpoints.end()) {
+            word = bp->second;
+        }
+        inst = disassemble(instruction(word), pc);
+    }
+
+    if (!reason) {
+        reason = m_guest_break ? "break instruction" : is_breakpoint(pc) ? "breakpoint" : "stopped";
+    }
+    printf("[%s] 0x%08X%s: %s    (%llu instructions executed)\n", reason, pc, symbolize(pc).c_str(), inst.c_str(), (unsigned long long)m_vm.m_tick);
+}
+
+void debugger::print_registers(bool fpu) {
+    registers& regs = m_vm.m_regs;
+
+    for (uint32_t i = 0; i < 32; i++) {
+        printf("$%-4s %08X%s", register_name(i), regs.regs[i], (i % 4 == 3) ? "\n" : "    ");
+    }
+    printf("pc    %08X    hi    %08X    lo    %08X\n", regs.pc, regs.hi, regs.lo);
+    printf("vaddr %08X    status %08X   cause %08X    epc   %08X    (%s mode)\n", regs.vaddr, regs.status, regs.cause, regs.epc, m_vm.m_kernelmode ? "kernel" : "user");
+
+    if (fpu) {
+        for (uint32_t i = 0; i < 32; i++) {
+            printf("$f%-3u %-14g%s", i, regs.f[i], (i % 4 == 3) ? "\n" : "    ");
+        }
+    }
+}
+
+void debugger::dump_memory(uint32_t addr, uint32_t words) {
+    addr &= ~0x3u;
+    for (uint32_t i = 0; i < words; i += 4) {
+        uint32_t line = addr + i * sizeof(uint32_t);
+        printf("0x%08X:", line);
+
+        std::string ascii;
+        for (uint32_t j = 0; j < 4 && i + j < words; j++) {
+            uint32_t val = 0;
+            if (!read_word(line + j * sizeof(uint32_t), val)) {
+                printf(" ????????");
+                ascii += "....";
+                continue;
+            }
+
+            printf(" %08X", val);
+            for (uint32_t b = 0; b < sizeof(uint32_t); b++) {
+                char c = char(val >> (b * 8));
+                ascii += isprint((unsigned char)c) ? c : '.';
+            }
+        }
+        printf("  |%s|\n", ascii.c_str());
+    }
+}
+
+// Walks the frame pointer chain. Expects the usual frame layout where a function saves
+// its return address at -4($fp) and the caller's $fp at -8($fp). Without a frame pointer only $ra is known.
+void debugger::backtrace() {
+    registers& regs = m_vm.m_regs;
+    printf("#0  0x%08X%s\n", regs.pc, symbolize(regs.pc).c_str());
+
+    uint32_t fp = regs.regs[int(register_names::fp)];
+    if (!fp) {
+        printf("#1  0x%08X%s ($ra)\n", regs.regs[int(register_names::ra)], symbolize(regs.regs[int(register_names::ra)]).c_str());
+        return;
+    }
+
+    for (int depth = 1; depth < 64; depth++) {
+        uint32_t ra = 0, caller_fp = 0;
+        if (!read_word(fp - 4, ra) || !read_word(fp - 8, caller_fp)) {
+            break;
+        }
+
+        printf("#%-2d 0x%08X%s\n", depth, ra, symbolize(ra).c_str());
+
+        // the stack grows down, so the caller's frame has to be above ours
+        if (caller_fp <= fp) {
+            break;
+        }
+        fp = caller_fp;
+    }
+}
+
+bool debugger::interact() {
+    disable_conio_mode();
+
+    // remove the one-shot stop planted by a watchpoint hit
+    bool watch_hit = m_watch_stop && m_vm.m_regs.pc == m_watch_stop;
+    if (m_watch_stop) {
+        remove_breakpoint(m_watch_stop);
+        m_watch_stop = 0;
+    }
+    print_location(watch_hit ? "watchpoint" : nullptr);
+
+    std::string line;
+    while (true) {
+        printf("(mips-dbg) ");
+        fflush(stdout);
+
+        if (!input_source::host_stdin().read_line(line)) {
+            m_vm.m_exit_reason = "debugger input closed";
+            return false;
+        }
+
+        std::istringstream ss(line);
+        std::string cmd, arg;
+        ss >> cmd >> arg;
+        if (cmd.empty()) {
+            continue;
+        }
+
+        if (cmd == "s" || cmd == "step") {
+            uint32_t count = arg.empty() ? 1 : uint32_t(strtoul(arg.c_str(), nullptr, 0));
+            step_result result = step_result::running;
+            m_stepping = true;
+            for (uint32_t i = 0; i < count && result == step_result::running; i++) {
+                result = step_once();
+            }
+            m_stepping = false;
+
+            if (result == step_result::finished) {
+                return false;
+            }
+            print_location();
+        }
+        else if (cmd == "c" || cmd == "continue") {
+            // get off the current breakpoint before handing back to the run loop
+            step_result result = step_once();
+            if (result == step_result::finished) {
+                return false;
+            }
+            if (result == step_result::running) {
+                return true;
+            }
+            print_location();
+        }
+        else if (cmd == "b" || cmd == "break") {
+            uint32_t addr = 0;
+            if (!parse_address(arg, addr) || !set_breakpoint(addr)) {
+                printf("Can't set a breakpoint at '%s'\n", arg.c_str());
+                continue;
+            }
+            printf("Breakpoint at 0x%08X%s\n", addr, symbolize(addr).c_str());
+        }
+        else if (cmd == "d" || cmd == "delete") {
+            uint32_t addr = 0;
+            if (!parse_address(arg, addr) || !remove_breakpoint(addr)) {
+                printf("No breakpoint at '%s'\n", arg.c_str());
+            }
+        }
+        else if (cmd == "w" || cmd == "watch") {
+            // watch <addr> [len] [r|w|c]
+            uint32_t addr = 0, len = sizeof(uint32_t);
+            std::string token, mode = "w";
+            if (ss >> token) {
+                char* end = nullptr;
+                unsigned long value = strtoul(token.c_str(), &end, 0);
+                if (isdigit(uint8_t(token[0])) && *end == '\0') {
+                    len = uint32_t(value);
+                    ss >> mode;
+                }
+                else {
+                    mode = token;
+                }
+            }
+
+            watch_type type = mode == "r" ? watch_type::read : mode == "c" ? watch_type::change : watch_type::write;
+            bool valid_mode = mode == "r" || mode == "w" || mode == "c";
+            if (!valid_mode || !parse_address(arg, addr) || !add_watchpoint(addr, len, type)) {
+                printf("Can't watch '%s'\n", arg.c_str());
+                continue;
+            }
+            printf("Watchpoint %u (%s) on 0x%08X-0x%08X\n", uint32_t(m_watchpoints.size() - 1), watch_type_name(type), addr, addr + len - 1);
+        }
+        else if (cmd == "uw" || cmd == "unwatch") {
+            if (!remove_watchpoint(uint32_t(strtoul(arg.c_str(), nullptr, 0)))) {
+                printf("No watchpoint '%s'\n", arg.c_str());
+            }
+        }
+        else if (cmd == "i" || cmd == "info") {
+            for (auto& bp : m_breakpoints) {
+                printf("Breakpoint at 0x%08X%s\n", bp.first, symbolize(bp.first).c_str());
+            }
+            for (size_t i = 0; i < m_watchpoints.size(); i++) {
+                watchpoint& wp = m_watchpoints[i];
+                printf("Watchpoint %u (%s) on 0x%08X-0x%08X\n", uint32_t(i), watch_type_name(wp.type), wp.addr, wp.addr + wp.len - 1);
+            }
+        }
+        else if (cmd == "r" || cmd == "regs") {
+            print_registers(arg == "f" || arg == "fpu");
+        }
+        else if (cmd == "x") {
+            uint32_t addr = 0;
+            if (!parse_address(arg, addr)) {
+                printf("Invalid address '%s'\n", arg.c_str());
+                continue;
+            }
+            uint32_t words = 16;
+            ss >> words;
+            dump_memory(addr, words);
+        }
+        else if (cmd == "bt" || cmd == "backtrace") {
+            backtrace();
+        }
+        else if (cmd == "q" || cmd == "quit") {
+            m_vm.m_exit_reason = "quit from debugger";
+            return false;
+        }
+        else {
+            printf("Commands:\n"
+                "  s, step [n]        execute n instructions (default 1)\n"
+                "  c, continue        run until the next breakpoint\n"
+                "  b, break <addr>    set a breakpoint at an address, label or $register\n"
+                "  d, delete <addr>   remove a breakpoint\n"
+                "  w, watch <addr> [len] [r|w|c]\n"
+                "                     stop on reads, writes or value changes of len bytes (default 4 bytes, w)\n"
+                "  uw, unwatch <n>    remove watchpoint n\n"
+                "  i, info            list breakpoints and watchpoints\n"
+                "  r, regs [f]        show registers (f: include FPU registers)\n"
+                "  x <addr> [n]       dump n words of memory (default 16)\n"
+                "  bt, backtrace      show the call stack ($ra at -4($fp), caller $fp at -8($fp))\n"
+                "  q, quit            end execution\n");
+        }
+    }
+}
\ No newline at end of file
@@ -0,0 +1,85 @@
+#pragma once
+#include "pch.h"
+#include "instruction.h"
+
+class executor;
+
+// breakpoints are planted by overwriting the instruction with this BREAK (all ones break code), the
+// original instruction is kept on the side. Code without breakpoints never runs any debugger checks.
+constexpr uint32_t BREAKPOINT_TRAP = 0x03FFFFCD;
+
+enum class watch_type : int {
+	read,
+	write,
+	change // write that changes the stored value
+};
+
+enum class step_result : int {
+	running,
+	stopped, // stopped at a breakpoint, hand over to the debugger
+	finished
+};
+
+// Interactive debugger: step, continue, breakpoints, register/memory inspection and backtraces.
+class debugger {
+public:
+	debugger(executor& vm) : m_vm(vm), m_enabled(false), m_guest_break(false), m_stepping(false), m_watch_stop(0) {}
+
+	void enable() { m_enabled = true; }
+	bool enabled() { return m_enabled; }
+
+	void load_symbols(const std::string& file);
+
+	// called by the BREAK instruction, true if the trap at pc is one of our breakpoints
+	bool is_breakpoint(uint32_t pc) { return m_breakpoints.find(pc) != m_breakpoints.end(); }
+
+	// called when the guest executes a BREAK of its own which would otherwise terminate it
+	void on_guest_break() { m_guest_break = true; m_enabled = true; } // the prompt can plant breakpoints from now on
+
+	// called by loads and stores on sections flagged WATCHED that touch a watched page, before the access happens
+	void on_watched_access(uint32_t addr, uint32_t size, bool store, uint32_t value);
+
+	// command loop, entered whenever execution stops. Returns false if the user wants to end execution.
+	bool interact();
+
+private:
+	friend class gdb_stub;
+
+	bool set_breakpoint(uint32_t addr);
+	bool remove_breakpoint(uint32_t addr);
+
+	bool add_watchpoint(uint32_t addr, uint32_t len, watch_type type);
+	bool remove_watchpoint(uint32_t index);
+	void update_watched_pages();
+	bool read_value(uint32_t addr, uint32_t size, uint32_t& out);
+
+	step_result step_once();
+	void print_location(const char* reason = nullptr);
+	void print_registers(bool fpu);
+	void dump_memory(uint32_t addr, uint32_t words);
+	void backtrace();
+
+	bool read_word(uint32_t addr, uint32_t& out);
+	bool write_text_word(uint32_t addr, uint32_t val);
+	bool parse_address(const std::string& str, uint32_t& addr);
+	std::string symbolize(uint32_t addr);
+
+	executor& m_vm;
+	bool m_enabled;
+	bool m_guest_break; // stopped on a guest BREAK, resuming skips over it
+
+	bool m_stepping; // single stepping, watchpoint hits stop by themselves
+	uint32_t m_watch_stop; // one-shot breakpoint planted after an instruction that hit a watchpoint
+
+	struct watchpoint {
+		uint32_t addr;
+		uint32_t len;
+		watch_type type;
+	};
+	std::vector<watchpoint> m_watchpoints;
+	std::vector<uint32_t> m_flagged_addrs; // addresses whose sections were flagged WATCHED
+
+	std::unordered_map<uint32_t, uint32_t> m_breakpoints; // address -> original instruction
+	std::map<uint32_t, std::string> m_symbols; // address -> label
+	std::unordered_map<std::string, uint32_t> m_labels; // label -> address
+};
\ No newline at end of file
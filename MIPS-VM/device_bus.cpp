@@ -0,0 +1,194 @@
+#include "pch.h"
+#include "device_bus.h"
+#include "exceptions.h"
+
+constexpr uint32_t DEVICE_PAGE_SHIFT = 12;
+
+bool device_bus::overlaps(uint64_t start, uint64_t end, bool pages) {
+	for (const device_region& region : m_regions) {
+		// the gaps between the registers on a page are free for other registers
+		if (region.page && pages) {
+			for (const mapping& m : region.devices) {
+				if (start < uint64_t(m.address) + m.size && m.address < end) {
+					return true;
+				}
+			}
+		}
+		else if (start < region.sect.address + uint64_t(region.sect.sect.size()) && region.sect.address < end) {
+			return true;
+		}
+	}
+	return false;
+}
+
+bool device_bus::map(uint32_t address, uint32_t size, mmio_device* device) {
+	uint64_t end = uint64_t(address) + size;
+	if (!size || end > 0x100000000ull || (address >> DEVICE_PAGE_SHIFT) != ((end - 1) >> DEVICE_PAGE_SHIFT) || overlaps(address, end, true)) {
+		return false; // the registers of a device have to be on one page
+	}
+
+	uint32_t number = address >> DEVICE_PAGE_SHIFT;
+	auto it = std::find_if(m_regions.begin(), m_regions.end(), [number](const device_region& region) { return region.page && (region.sect.address >> DEVICE_PAGE_SHIFT) == number; });
+	if (it == m_regions.end()) {
+		device_region region;
+		region.sect.flags = MUTABLE | DEVICE;
+		region.sect.address = address;
+		region.page = true;
+		m_regions.push_back(std::move(region));
+		it = m_regions.end() - 1;
+	}
+
+	// grow the page's section to cover the new registers as well, the registers already there keep their values
+	device_region& page = *it;
+	uint32_t old_start = page.sect.address, old_size = uint32_t(page.sect.sect.size());
+	uint32_t start = std::min(old_start, address);
+	uint32_t new_size = uint32_t(std::max(uint64_t(old_start) + old_size, end) - start);
+	if (new_size != old_size) {
+		section_memory mem(new_size);
+		if (old_size) {
+			memcpy(mem.data() + (old_start - start), page.sect.sect.data(), old_size);
+		}
+		page.sect.sect = std::move(mem);
+		page.sect.address = start;
+
+		for (const mapping& m : page.devices) {
+			m.device->attach(page.sect.sect.data() + (m.address - start));
+		}
+	}
+
+	page.devices.push_back({ address, size, device });
+	device->attach(page.sect.sect.data() + (address - start));
+	return true;
+}
+
+bool device_bus::map(uint32_t address, section_memory&& memory, mmio_device* device) {
+	uint64_t end = uint64_t(address) + memory.size();
+	if (!memory.size() || end > 0x100000000ull || overlaps(address, end, false)) {
+		return false;
+	}
+
+	device_region region;
+	region.sect.flags = MUTABLE | DEVICE;
+	region.sect.address = address;
+	region.sect.sect = std::move(memory);
+	region.devices.push_back({ address, uint32_t(end - address), device });
+	region.page = false;
+	m_regions.push_back(std::move(region));
+
+	device->attach(m_regions.back().sect.sect.data());
+	return true;
+}
+
+const device_bus::mapping* device_bus::find(device_region& region, uint32_t addr) {
+	for (const mapping& m : region.devices) {
+		if (addr - m.address < m.size) {
+			return &m;
+		}
+	}
+	return nullptr; // between two devices, just memory
+}
+
+device_bus::device_region& device_bus::region_for(section* sect) {
+	for (device_region& region : m_regions) {
+		if (&region.sect == sect) {
+			return region;
+		}
+	}
+	throw std::runtime_error("Section isn't a device section");
+}
+
+uint32_t device_bus::load(section* sect, uint32_t addr, uint32_t size) {
+	const mapping* m = find(region_for(sect), addr);
+	std::unique_lock<std::mutex> lock(m_mutex, std::defer_lock);
+	if (!m || !m->device->thread_safe()) {
+		lock.lock();
+	}
+
+	uint8_t* mem = sect->sect.data();
+	if (m) {
+		m->device->load(mem + (m->address - sect->address), addr - m->address, size);
+	}
+
+	uint32_t value = 0;
+	memcpy(&value, mem + (addr - sect->address), size);
+	return value;
+}
+
+void device_bus::store(section* sect, uint32_t addr, uint32_t size, uint32_t value) {
+	const mapping* m = find(region_for(sect), addr);
+	std::unique_lock<std::mutex> lock(m_mutex, std::defer_lock);
+	if (!m || !m->device->thread_safe()) {
+		lock.lock();
+	}
+
+	uint8_t* mem = sect->sect.data();
+	memcpy(mem + (addr - sect->address), &value, size);
+
+	if (m) {
+		m->device->store(mem + (m->address - sect->address), addr - m->address, size);
+	}
+}
+
+void keyboard_device::load(uint8_t* regs, uint32_t offset, uint32_t size) {
+	if (offset >= sizeof(uint32_t)) {
+		*reinterpret_cast<uint32_t*>(regs) &= ~0x1u; // the key was read, clear ready
+	}
+}
+
+void keyboard_device::receive(char c) {
+	*reinterpret_cast<uint32_t*>(m_regs + sizeof(uint32_t)) = uint8_t(c);
+	*reinterpret_cast<uint32_t*>(m_regs) |= 0x1;
+}
+
+void display_device::attach(uint8_t* regs) {
+	*reinterpret_cast<uint32_t*>(regs) |= 0x1; // always ready to transmit
+}
+
+void display_device::store(uint8_t* regs, uint32_t offset, uint32_t size) {
+	if (offset < sizeof(uint32_t)) {
+		*reinterpret_cast<uint32_t*>(regs) |= 0x1; // ready is read-only
+		return;
+	}
+	if (offset == sizeof(uint32_t)) {
+		char c = char(regs[sizeof(uint32_t)]);
+		if (!m_output->write(&c, 1)) {
+			throw output_rejected();
+		}
+	}
+}
+
+void device_bus::save(snapshot_writer& out) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	out.put(uint32_t(m_regions.size()));
+	for (device_region& region : m_regions) {
+		out.put_memory(region.sect.address, region.sect.sect.data(), uint32_t(region.sect.sect.size()));
+	}
+}
+
+void device_bus::restore(snapshot_reader& in) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (in.get<uint32_t>() != m_regions.size()) {
+		throw std::runtime_error("checkpoint was taken with different devices");
+	}
+	for (device_region& region : m_regions) {
+		in.get_memory(region.sect);
+	}
+}
+
+void timer_device::load(uint8_t* regs, uint32_t offset, uint32_t size) {
+	if (offset >= sizeof(uint32_t)) {
+		return; // the high word was latched by the last read of the low word
+	}
+
+	uint64_t ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - m_start).count();
+	reinterpret_cast<uint32_t*>(regs)[0] = uint32_t(ms);
+	reinterpret_cast<uint32_t*>(regs)[1] = uint32_t(ms >> 32);
+}
+
+void timer_device::save(snapshot_writer& out) {
+	out.put(int64_t(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - m_start).count()));
+}
+
+void timer_device::restore(snapshot_reader& in) {
+	m_start = std::chrono::steady_clock::now() - std::chrono::milliseconds(in.get<int64_t>());
+}
\ No newline at end of file
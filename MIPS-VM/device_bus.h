@@ -0,0 +1,130 @@
+#pragma once
+#include "pch.h"
+#include "sections.h"
+#include "memory.h"
+#include "guest_io.h"
+#include "snapshot.h"
+
+// A memory mapped device. Its registers are plain bytes of guest memory (so the debuggers see them), the device
+// gets told about guest loads and stores to them to implement side effects. `regs` points at the device's first
+// register, `offset` is relative to it. Called with the bus lock held, unless the device is thread safe.
+class mmio_device {
+public:
+	virtual ~mmio_device() {}
+
+	// when the device is mapped (the registers start out zeroed), and again if its registers move in host memory
+	virtual void attach(uint8_t* regs) {}
+	// before the guest reads the registers, eg. to latch a value
+	virtual void load(uint8_t* regs, uint32_t offset, uint32_t size) {}
+	// after the guest wrote the registers
+	virtual void store(uint8_t* regs, uint32_t offset, uint32_t size) {}
+
+	// load and store only touch the device's own synchronized state, accesses from several harts don't have to wait for each other
+	virtual bool thread_safe() const { return false; }
+};
+
+// Routes guest loads and stores to devices. Every page that has device registers on it gets a section flagged DEVICE
+// that covers them, and so does every device that brings its own memory (a framebuffer). Ordinary loads and stores never
+// look at the bus, only those that land on a device section do.
+class device_bus {
+public:
+	// maps `device` at [address, address + size), fails if that overlaps another device. Its registers are
+	// allocated by the bus and have to be on one page
+	bool map(uint32_t address, uint32_t size, mmio_device* device);
+	// maps `device` at `address` with `memory` as its registers, it can be any size
+	bool map(uint32_t address, section_memory&& memory, mmio_device* device);
+
+	// the device section containing addr, nullptr if it isn't a device register
+	section* get_section(uint32_t addr) {
+		for (device_region& region : m_regions) {
+			if (addr - region.sect.address < region.sect.sect.size()) {
+				return &region.sect;
+			}
+		}
+		return nullptr;
+	}
+
+	// loads and stores on sections flagged DEVICE, `size` is 1, 2 or 4 and the access lies inside the section
+	uint32_t load(section* sect, uint32_t addr, uint32_t size);
+	void store(section* sect, uint32_t addr, uint32_t size, uint32_t value);
+
+	// held while devices run, for the host side of a device (eg. a key arriving) to update registers
+	std::mutex& mutex() { return m_mutex; }
+
+	// the registers and device memory of every region, see checkpoint.h. Restoring needs the same devices mapped
+	void save(snapshot_writer& out);
+	void restore(snapshot_reader& in);
+
+private:
+	struct mapping {
+		uint32_t address;
+		uint32_t size;
+		mmio_device* device;
+	};
+
+	struct device_region {
+		section sect; // a page of registers spans from the first to the end of the last register on it
+		std::vector<mapping> devices;
+		bool page; // registers allocated by the bus, more devices can be added to the page
+	};
+
+	bool overlaps(uint64_t start, uint64_t end, bool pages);
+	const mapping* find(device_region& region, uint32_t addr);
+	device_region& region_for(section* sect);
+
+	std::deque<device_region> m_regions; // sections are handed out by pointer, a deque doesn't move them
+	std::mutex m_mutex;
+};
+
+// MARS compatible keyboard receiver: control (bit 0 ready, bit 1 interrupt enable) and data. Reading the data
+// register clears ready. Keys come from the keyboard interrupt, see executor::keyboard_interrupt.
+class keyboard_device : public mmio_device {
+public:
+	keyboard_device() : m_regs(nullptr) {}
+
+	void attach(uint8_t* regs) override { m_regs = regs; }
+	void load(uint8_t* regs, uint32_t offset, uint32_t size) override;
+
+	bool interrupts_enabled() const { return m_regs && (*reinterpret_cast<const uint32_t*>(m_regs) & 0x2); }
+	// a key was pressed, with the bus lock held
+	void receive(char c);
+
+private:
+	uint8_t* m_regs;
+};
+
+// MARS compatible display transmitter: control (bit 0 ready, always set) and data. A byte stored to the data
+// register is printed like PRINT_CHAR.
+class display_device : public mmio_device {
+public:
+	// the machine's output, it may be swapped after the device was created
+	display_device(output_sink*& output) : m_output(output) {}
+
+	void attach(uint8_t* regs) override;
+	void store(uint8_t* regs, uint32_t offset, uint32_t size) override;
+
+private:
+	output_sink*& m_output;
+};
+
+// Milliseconds since the program started, as a 64 bit value in two words. Reading the low word latches the high word,
+// so reading low then high gives a consistent value.
+class timer_device : public mmio_device {
+public:
+	timer_device() : m_start(std::chrono::steady_clock::now()) {}
+
+	void load(uint8_t* regs, uint32_t offset, uint32_t size) override;
+
+	// the time the program has been running, a resumed program goes on from there
+	void save(snapshot_writer& out);
+	void restore(snapshot_reader& in);
+
+private:
+	std::chrono::steady_clock::time_point m_start;
+};
+
+// where the standard devices live, relative to memory_layout::mmio_base
+constexpr uint32_t MMIO_KEYBOARD = 0x0;
+constexpr uint32_t MMIO_DISPLAY = 0x8;
+constexpr uint32_t MMIO_TIMER = 0x10;
+constexpr uint32_t MMIO_FRAME = 0x18; // bitmap display frame register, with --display
\ No newline at end of file
@@ -0,0 +1,178 @@
+#include "pch.h"
+#include "disassembler.h"
+#include "helper.h"
+
+static const char* reg_names[32] = {
+    "zero", "at", "v0", "v1", "a0", "a1", "a2", "a3",
+    "t0", "t1", "t2", "t3", "t4", "t5", "t6", "t7",
+    "s0", "s1", "s2", "s3", "s4", "s5", "s6", "s7",
+    "t8", "t9", "k0", "k1", "gp", "sp", "fp", "ra"
+};
+
+const char* register_name(uint32_t index) {
+    return reg_names[index & 0x1F];
+}
+
+static std::string format(const char* fmt, ...) {
+    char buf[128];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    return buf;
+}
+
+static std::string disassemble_funct(instruction inst) {
+    const char* rs = reg_names[inst.r.rs];
+    const char* rt = reg_names[inst.r.rt];
+    const char* rd = reg_names[inst.r.rd];
+
+    switch (inst.r.funct) {
+    case uint32_t(funct::SYSCALL):
+        return "syscall";
+    case uint32_t(funct::SYNC):
+        return "sync";
+    case uint32_t(funct::BREAK):
+        return format("break 0x%X", (inst.hex >> 6) & 0xFFFFF);
+    case uint32_t(funct::SLL):
+        if (inst.hex == 0) {
+            return "nop";
+        }
+        return format("sll $%s, $%s, %u", rd, rt, inst.r.shift);
+    case uint32_t(funct::SRL):
+        return format("srl $%s, $%s, %u", rd, rt, inst.r.shift);
+    case uint32_t(funct::SRA):
+        return format("sra $%s, $%s, %u", rd, rt, inst.r.shift);
+    case uint32_t(funct::JR):
+        return format("jr $%s", rs);
+    case uint32_t(funct::JALR):
+        return format("jalr $%s", rs);
+    case uint32_t(funct::MFHI):
+        return format("mfhi $%s", rd);
+    case uint32_t(funct::MTHI):
+        return format("mthi $%s", rs);
+    case uint32_t(funct::MFLO):
+        return format("mflo $%s", rd);
+    case uint32_t(funct::MTLO):
+        return format("mtlo $%s", rs);
+    case uint32_t(funct::DIV):
+        return format("div $%s, $%s", rs, rt);
+    case uint32_t(funct::DIVU):
+        return format("divu $%s, $%s", rs, rt);
+    case uint32_t(funct::MULT):
+        return format("mult $%s, $%s", rs, rt);
+    case uint32_t(funct::MULTU):
+        return format("multu $%s, $%s", rs, rt);
+    case uint32_t(funct::TGE):
+        return format("tge $%s, $%s", rs, rt);
+    case uint32_t(funct::TGEU):
+        return format("tgeu $%s, $%s", rs, rt);
+    case uint32_t(funct::TLT):
+        return format("tlt $%s, $%s", rs, rt);
+    case uint32_t(funct::TLTU):
+        return format("tltu $%s, $%s", rs, rt);
+    case uint32_t(funct::TEQ):
+        return format("teq $%s, $%s", rs, rt);
+    case uint32_t(funct::TNE):
+        return format("tne $%s, $%s", rs, rt);
+    }
+
+    const char* name = nullptr;
+    switch (inst.r.funct) {
+    case uint32_t(funct::SLT): name = "slt"; break;
+    case uint32_t(funct::SLTU): name = "sltu"; break;
+    case uint32_t(funct::ADD): name = "add"; break;
+    case uint32_t(funct::ADDU): name = "addu"; break;
+    case uint32_t(funct::SUB): name = "sub"; break;
+    case uint32_t(funct::SUBU): name = "subu"; break;
+    case uint32_t(funct::AND): name = "and"; break;
+    case uint32_t(funct::OR): name = "or"; break;
+    case uint32_t(funct::XOR): name = "xor"; break;
+    case uint32_t(funct::NOR): name = "nor"; break;
+    default:
+        return format(".word 0x%08X", inst.hex);
+    }
+
+    return format("%s $%s, $%s, $%s", name, rd, rs, rt);
+}
+
+std::string disassemble(instruction inst, uint32_t pc) {
+    const char* rs = reg_names[inst.i.rs];
+    const char* rt = reg_names[inst.i.rt];
+    int32_t simm = bit_cast<int16_t>(inst.i.imm);
+    uint32_t branch_target = pc + 4 + simm * 4;
+    uint32_t jump_target = (inst.j.p_addr * 4) | ((pc + 4) & 0xF0000000);
+
+    switch (inst.r.opcode) {
+    case uint32_t(instructions::R_FORMAT):
+        return disassemble_funct(inst);
+    case uint32_t(instructions::TRAPI):
+    {
+        const char* name = nullptr;
+        switch (inst.i.rt) {
+        case uint32_t(imm_trap_instructions::TGEI): name = "tgei"; break;
+        case uint32_t(imm_trap_instructions::TGEIU): name = "tgeiu"; break;
+        case uint32_t(imm_trap_instructions::TLTI): name = "tlti"; break;
+        case uint32_t(imm_trap_instructions::TLTIU): name = "tltiu"; break;
+        case uint32_t(imm_trap_instructions::TEQI): name = "teqi"; break;
+        case uint32_t(imm_trap_instructions::TNEI): name = "tnei"; break;
+        default:
+            return format(".word 0x%08X", inst.hex);
+        }
+        return format("%s $%s, %d", name, rs, simm);
+    }
+    case uint32_t(instructions::MFC0):
+        if (inst.r.funct == 0x18) {
+            return "eret";
+        }
+        return format("%s $%s, $%u", inst.r.rs == 4 ? "mtc0" : "mfc0", reg_names[inst.r.rt], inst.r.rd);
+    case uint32_t(instructions::MFC1):
+        return format("%s $%s, $f%u", inst.r.rs == 4 ? "mtc1" : "mfc1", reg_names[inst.r.rt], inst.r.rd);
+    case uint32_t(instructions::MUL):
+        return format("mul $%s, $%s, $%s", reg_names[inst.r.rd], reg_names[inst.r.rs], reg_names[inst.r.rt]);
+    case uint32_t(instructions::J):
+        return format("j 0x%08X", jump_target);
+    case uint32_t(instructions::JAL):
+        return format("jal 0x%08X", jump_target);
+    case uint32_t(instructions::SLTI):
+        return format("slti $%s, $%s, %d", rt, rs, simm);
+    case uint32_t(instructions::SLTIU):
+        return format("sltiu $%s, $%s, %u", rt, rs, inst.i.imm);
+    case uint32_t(instructions::ANDI):
+        return format("andi $%s, $%s, 0x%X", rt, rs, inst.i.imm);
+    case uint32_t(instructions::ORI):
+        return format("ori $%s, $%s, 0x%X", rt, rs, inst.i.imm);
+    case uint32_t(instructions::LUI):
+        return format("lui $%s, 0x%X", rt, inst.i.imm);
+    case uint32_t(instructions::BEQ):
+        return format("beq $%s, $%s, 0x%08X", rs, rt, branch_target);
+    case uint32_t(instructions::BNE):
+        return format("bne $%s, $%s, 0x%08X", rs, rt, branch_target);
+    case uint32_t(instructions::BLEZ):
+        return format("blez $%s, 0x%08X", rs, branch_target);
+    case uint32_t(instructions::BGTZ):
+        return format("bgtz $%s, 0x%08X", rs, branch_target);
+    case uint32_t(instructions::ADDI):
+        return format("addi $%s, $%s, %d", rt, rs, simm);
+    case uint32_t(instructions::ADDIU):
+        return format("addiu $%s, $%s, %u", rt, rs, inst.i.imm);
+    }
+
+    const char* name = nullptr;
+    switch (inst.i.opcode) {
+    case uint32_t(instructions::LW): name = "lw"; break;
+    case uint32_t(instructions::LB): name = "lb"; break;
+    case uint32_t(instructions::LH): name = "lh"; break;
+    case uint32_t(instructions::LBU): name = "lbu"; break;
+    case uint32_t(instructions::LHU): name = "lhu"; break;
+    case uint32_t(instructions::SW): name = "sw"; break;
+    case uint32_t(instructions::SB): name = "sb"; break;
+    case uint32_t(instructions::SH): name = "sh"; break;
+    case uint32_t(instructions::LL): name = "ll"; break;
+    case uint32_t(instructions::SC): name = "sc"; break;
+    default:
+        return format(".word 0x%08X", inst.hex);
+    }
+
+    return format("%s $%s, %d($%s)", name, rt, simm, rs);
+}
\ No newline at end of file
@@ -0,0 +1,10 @@
+#pragma once
+#include "pch.h"
+#include "instruction.h"
+
+// Turns an instruction into MIPS assembly text, eg. "addi $t0, $t1, -4".
+// `pc` is the address the instruction lives at, it's used to resolve branch and jump targets.
+std::string disassemble(instruction inst, uint32_t pc);
+
+// name of a general purpose register without the leading '$', eg. "t0"
+const char* register_name(uint32_t index);
\ No newline at end of file
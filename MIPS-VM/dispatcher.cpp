@@ -3,7 +3,8 @@
 #include "helper.h"
 #include "file_mgr.h"
 
-bool executor::dispatch(instruction inst) {
+template<class memory>
+bool executor::dispatch_opcode(instruction inst) {
     // get the opcode (opcode is always the first 6 bits, so what format we get the opcode as does not matter)
     switch (inst.r.opcode) {
     case uint32_t(instructions::R_FORMAT):
@@ -73,7 +74,9 @@ bool executor::dispatch(instruction inst) {
             m_regs.pc = m_regs.epc; // go back to epc (caller)
 
             // try to pop kernel frame in case we are in a nested call to a custom syscall
-            if (!m_syscall_mgr.pop_syscall_frame(m_regs)) {
+            m_ll_valid = false; // returning from an exception breaks the LL/SC sequence it interrupted
+
+            if (!m_syscall_frames.pop_syscall_frame(m_regs)) {
                 m_kernelmode = false; // Nothing to pop, we are not nested. Go back to usermode.
             }         
             return false;
@@ -83,6 +86,20 @@ bool executor::dispatch(instruction inst) {
         // rt - register index
         // rd - coproc0 index
 
+        // Count ($9) and Compare ($11) are backed by the instruction counter
+        if (inst.r.rd == 9 || inst.r.rd == 11) {
+            if (inst.r.rs == 0) {
+                m_regs.regs[inst.r.rt] = inst.r.rd == 9 ? read_count() : m_compare;
+            }
+            else if (inst.r.rs == 4) {
+                inst.r.rd == 9 ? write_count(m_regs.regs[inst.r.rt]) : write_compare(m_regs.regs[inst.r.rt]);
+            }
+            else {
+                throw std::runtime_error("Invalid MC0 operation");
+            }
+            break;
+        }
+
         uint32_t* c0_reg = nullptr;
         switch (inst.r.rd) {
         case 8:
@@ -97,6 +114,12 @@ bool executor::dispatch(instruction inst) {
         case 14:
             c0_reg = &m_regs.epc;
             break;
+        case 15:
+            if (inst.r.rs == 4) {
+                throw std::runtime_error("Coproc0 register 15 (EBase) is read-only");
+            }
+            c0_reg = &m_regs.ebase;
+            break;
         default:
             throw std::runtime_error("Invalid coproc0 register index for MC0 instruction");
         }
@@ -241,8 +264,17 @@ bool executor::dispatch(instruction inst) {
             throw mips_exception_load("Invalid memory access for LW operation", addr);
         }
 
+        if ((sect->flags & WATCHED) && sect->is_watched(addr, sizeof(uint32_t))) {
+            m_debugger.on_watched_access(addr, sizeof(uint32_t), false, 0);
+        }
+
+        if (sect->flags & DEVICE) {
+            m_regs.regs[inst.i.rt] = m_devices.load(sect, memory::device_address(addr, sizeof(uint32_t)), sizeof(uint32_t));
+            break;
+        }
+
         uint32_t offset = get_offset_for_section(sect, addr);
-        m_regs.regs[inst.i.rt] = *reinterpret_cast<int32_t*>(sect->sect.data() + offset);
+        m_regs.regs[inst.i.rt] = memory::template load<int32_t>(sect, offset);
     }
     break;
     case uint32_t(instructions::LB):
@@ -254,8 +286,17 @@ bool executor::dispatch(instruction inst) {
             throw mips_exception_load("Invalid memory access for LB operation", addr);
         }
 
+        if ((sect->flags & WATCHED) && sect->is_watched(addr, sizeof(int8_t))) {
+            m_debugger.on_watched_access(addr, sizeof(int8_t), false, 0);
+        }
+
+        if (sect->flags & DEVICE) {
+            m_regs.regs[inst.i.rt] = int8_t(m_devices.load(sect, memory::device_address(addr, sizeof(int8_t)), sizeof(int8_t)));
+            break;
+        }
+
         uint32_t offset = get_offset_for_section(sect, addr);
-        m_regs.regs[inst.i.rt] = *reinterpret_cast<int8_t*>(sect->sect.data() + offset); // sign extend
+        m_regs.regs[inst.i.rt] = memory::template load<int8_t>(sect, offset); // sign extend
     }
     break;
     case uint32_t(instructions::LH):
@@ -267,8 +308,17 @@ bool executor::dispatch(instruction inst) {
             throw mips_exception_load("Invalid memory access for LH operation", addr);
         }
 
+        if ((sect->flags & WATCHED) && sect->is_watched(addr, sizeof(int16_t))) {
+            m_debugger.on_watched_access(addr, sizeof(int16_t), false, 0);
+        }
+
+        if (sect->flags & DEVICE) {
+            m_regs.regs[inst.i.rt] = int16_t(m_devices.load(sect, memory::device_address(addr, sizeof(int16_t)), sizeof(int16_t)));
+            break;
+        }
+
         uint32_t offset = get_offset_for_section(sect, addr);
-        m_regs.regs[inst.i.rt] = *reinterpret_cast<int16_t*>(sect->sect.data() + offset); // sign extend
+        m_regs.regs[inst.i.rt] = memory::template load<int16_t>(sect, offset); // sign extend
     }
     break;
     case uint32_t(instructions::LBU):
@@ -280,8 +330,17 @@ bool executor::dispatch(instruction inst) {
             throw mips_exception_load("Invalid memory access for LBU operation", addr);
         }
 
+        if ((sect->flags & WATCHED) && sect->is_watched(addr, sizeof(uint8_t))) {
+            m_debugger.on_watched_access(addr, sizeof(uint8_t), false, 0);
+        }
+
+        if (sect->flags & DEVICE) {
+            m_regs.regs[inst.i.rt] = m_devices.load(sect, memory::device_address(addr, sizeof(uint8_t)), sizeof(uint8_t));
+            break;
+        }
+
         uint32_t offset = get_offset_for_section(sect, addr);
-        m_regs.regs[inst.i.rt] = *reinterpret_cast<uint8_t*>(sect->sect.data() + offset); // zero extend
+        m_regs.regs[inst.i.rt] = memory::template load<uint8_t>(sect, offset); // zero extend
     }
     break;
     case uint32_t(instructions::LHU):
@@ -293,8 +352,17 @@ bool executor::dispatch(instruction inst) {
             throw mips_exception_load("Invalid memory access for LHU operation", addr);
         }
 
+        if ((sect->flags & WATCHED) && sect->is_watched(addr, sizeof(uint16_t))) {
+            m_debugger.on_watched_access(addr, sizeof(uint16_t), false, 0);
+        }
+
+        if (sect->flags & DEVICE) {
+            m_regs.regs[inst.i.rt] = m_devices.load(sect, memory::device_address(addr, sizeof(uint16_t)), sizeof(uint16_t));
+            break;
+        }
+
         uint32_t offset = get_offset_for_section(sect, addr);
-        m_regs.regs[inst.i.rt] = *reinterpret_cast<uint16_t*>(sect->sect.data() + offset);  // zero extend
+        m_regs.regs[inst.i.rt] = memory::template load<uint16_t>(sect, offset);  // zero extend
     }
     break;
     case uint32_t(instructions::SW):
@@ -306,8 +374,61 @@ bool executor::dispatch(instruction inst) {
             throw mips_exception_store("Invalid memory access for SW operation", addr);
         }
 
+        if ((sect->flags & WATCHED) && sect->is_watched(addr, sizeof(uint32_t))) {
+            m_debugger.on_watched_access(addr, sizeof(uint32_t), true, m_regs.regs[inst.i.rt]);
+        }
+
+        if (sect->flags & DEVICE) {
+            m_devices.store(sect, memory::device_address(addr, sizeof(uint32_t)), sizeof(uint32_t), m_regs.regs[inst.i.rt]);
+            break;
+        }
+
         uint32_t offset = get_offset_for_section(sect, addr);
-        *reinterpret_cast<uint32_t*>(sect->sect.data() + offset) = m_regs.regs[inst.i.rt];
+        memory::template store<uint32_t>(sect, offset, m_regs.regs[inst.i.rt]);
+    }
+    break;
+    case uint32_t(instructions::LL):
+    {
+        uint32_t addr = m_regs.regs[inst.i.rs] + bit_cast<int16_t>(inst.i.imm);
+
+        section* sect = nullptr;
+        if (!(sect = get_section_for_address(addr)) || (sect->flags & DEVICE) || (addr & 0x3) || !is_safe_access(sect, addr, sizeof(uint32_t))) {
+            throw mips_exception_load("Invalid memory access for LL operation", addr);
+        }
+
+        if ((sect->flags & WATCHED) && sect->is_watched(addr, sizeof(uint32_t))) {
+            m_debugger.on_watched_access(addr, sizeof(uint32_t), false, 0);
+        }
+
+        uint32_t offset = get_offset_for_section(sect, addr);
+        m_ll_value = atomic_load32(reinterpret_cast<uint32_t*>(sect->sect.data() + offset)); // as it is in memory, SC compares it
+        m_ll_addr = addr;
+        m_ll_valid = true;
+        m_regs.regs[inst.i.rt] = memory::word(m_ll_value);
+    }
+    break;
+    case uint32_t(instructions::SC):
+    {
+        uint32_t addr = m_regs.regs[inst.i.rs] + bit_cast<int16_t>(inst.i.imm);
+
+        section* sect = nullptr;
+        if (!(sect = get_section_for_address(addr)) || (sect->flags & DEVICE) || !(sect->flags & MUTABLE) || (addr & 0x3) || !is_safe_access(sect, addr, sizeof(uint32_t))) {
+            throw mips_exception_store("Invalid memory access for SC operation", addr);
+        }
+
+        bool success = false;
+        if (m_ll_valid && m_ll_addr == addr) {
+            if ((sect->flags & WATCHED) && sect->is_watched(addr, sizeof(uint32_t))) {
+                m_debugger.on_watched_access(addr, sizeof(uint32_t), true, m_regs.regs[inst.i.rt]);
+            }
+
+            // the store only happens if no other hart changed the word since LL read it
+            uint32_t offset = get_offset_for_section(sect, addr);
+            success = atomic_compare_exchange32(reinterpret_cast<uint32_t*>(sect->sect.data() + offset), m_ll_value, memory::word(m_regs.regs[inst.i.rt]));
+        }
+
+        m_ll_valid = false;
+        m_regs.regs[inst.i.rt] = success;
     }
     break;
     case uint32_t(instructions::SB):
@@ -319,8 +440,17 @@ bool executor::dispatch(instruction inst) {
             throw mips_exception_store("Invalid memory access for SB operation", addr);
         }
 
+        if ((sect->flags & WATCHED) && sect->is_watched(addr, sizeof(uint8_t))) {
+            m_debugger.on_watched_access(addr, sizeof(uint8_t), true, m_regs.regs[inst.i.rt]);
+        }
+
+        if (sect->flags & DEVICE) {
+            m_devices.store(sect, memory::device_address(addr, sizeof(uint8_t)), sizeof(uint8_t), m_regs.regs[inst.i.rt]);
+            break;
+        }
+
         uint32_t offset = get_offset_for_section(sect, addr);
-        *reinterpret_cast<uint8_t*>(sect->sect.data() + offset) = m_regs.regs[inst.i.rt];
+        memory::template store<uint8_t>(sect, offset, uint8_t(m_regs.regs[inst.i.rt]));
     }
     break;
     case uint32_t(instructions::SH):
@@ -332,8 +462,17 @@ bool executor::dispatch(instruction inst) {
             throw mips_exception_store("Invalid memory access for SH operation", addr);
         }
 
+        if ((sect->flags & WATCHED) && sect->is_watched(addr, sizeof(uint16_t))) {
+            m_debugger.on_watched_access(addr, sizeof(uint16_t), true, m_regs.regs[inst.i.rt]);
+        }
+
+        if (sect->flags & DEVICE) {
+            m_devices.store(sect, memory::device_address(addr, sizeof(uint16_t)), sizeof(uint16_t), m_regs.regs[inst.i.rt]);
+            break;
+        }
+
         uint32_t offset = get_offset_for_section(sect, addr);
-        *reinterpret_cast<uint16_t*>(sect->sect.data() + offset) = m_regs.regs[inst.i.rt];
+        memory::template store<uint16_t>(sect, offset, uint16_t(m_regs.regs[inst.i.rt]));
     }
     break;
     default:
@@ -343,6 +482,9 @@ bool executor::dispatch(instruction inst) {
     return true;
 }
 
+template bool executor::dispatch_opcode<little_endian_memory>(instruction inst);
+template bool executor::dispatch_opcode<big_endian_memory>(instruction inst);
+
 bool executor::dispatch_funct(instruction inst) {
     switch (inst.r.funct) {
     case uint32_t(funct::SYSCALL):
@@ -350,8 +492,16 @@ bool executor::dispatch_funct(instruction inst) {
         return dispatch_syscall();
     }
     break;
+    case uint32_t(funct::SYNC):
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst); // order this hart's loads and stores against the other harts
+    }
+    break;
     case uint32_t(funct::BREAK):
     {
+        if (inst.hex == BREAKPOINT_TRAP && m_debugger.is_breakpoint(m_regs.pc)) {
+            throw debugger_break();
+        }
         throw mips_exception_breakpoint("Breakpoint encountered");
     }
     break;
@@ -561,258 +711,55 @@ bool executor::dispatch_funct(instruction inst) {
 
 bool executor::dispatch_syscall() {
     uint32_t syscall_num = m_regs.regs[int(register_names::v0)];
-    uint32_t a0 = m_regs.regs[int(register_names::a0)];
-    uint32_t a1 = m_regs.regs[int(register_names::a1)];
-    uint32_t a2 = m_regs.regs[int(register_names::a2)];
+    m_stats.count_syscall(syscall_num);
 
-    switch (syscall_num) {
-    case uint32_t(syscalls::PRINT_INT):
-    {
-        printf("%i", a0);
-    }
-    break;
-    case uint32_t(syscalls::PRINT_FLOAT):
-    {
-        printf("%f", m_regs.f[12]);
-    }
-    break;
-    case uint32_t(syscalls::PRINT_DBL):
-    {
-        printf("%f", m_regs.f[12]);
+    const syscall_table::entry* entry = m_syscalls.lookup(syscall_num);
+    if (!entry) {
+        throw mips_exception_syscall("Syscall number " + std::to_string(syscall_num) + " not implemented");
     }
-    break;
-    case uint32_t(syscalls::PRINT_STRING):
-    {
-        section* sect = nullptr;
-        if (!(sect = get_section_for_address(a0))) {
-            throw mips_exception_load("Invalid memory access for PRINT_STRING syscall", a0);
-        }
-        uint32_t offset = get_offset_for_section(sect, a0);
-        const char* str = (const char*)(sect->sect.data() + offset);
-
-        // make sure string actually terminates so we don't crash or leak memory
-        if (!string_terminates(str, sect->sect.size() - offset)) {
-            throw mips_exception_load("Invalid string for PRINT_STRING syscall, does not terminate", a0);
-        }
 
-        printf("%s", str);
-    }
-    break;
-    case uint32_t(syscalls::READ_INT):
-    {
-        disable_conio_mode();
-        int32_t in;
-        std::cin >> in;
-        m_regs.regs[int(register_names::v0)] = in;
-        std::cin.clear();
-        std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
-    }
-    break;
-    case uint32_t(syscalls::READ_FLOAT):
-    {
-        disable_conio_mode();
-        float in;
-        std::cin >> in;
-        m_regs.f[0] = in;
-        std::cin.clear();
-        std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
-    }
-    break;
-    case uint32_t(syscalls::READ_DBL):
-    {
-        disable_conio_mode();
-        float in;
-        std::cin >> in;
-        m_regs.f[0] = in;
-        std::cin.clear();
-        std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
-    }
-    break;
-    case uint32_t(syscalls::READ_STRING):
-    {
-        section* sect = nullptr;
-        if (!(sect = get_section_for_address(a0)) || !(sect->flags & MUTABLE) || !is_safe_access(sect, a0, a1)) {
-            throw mips_exception_store("Invalid memory access for READ_STRING syscall", a0);
+    // If a custom syscall is registered to this number, enter its handler
+    uint32_t custom_syscall = entry->guest.load(std::memory_order_acquire);
+    if (custom_syscall) {
+        // If we are already in kernelmode save the frame so we can revert back to it when returning from the syscall
+        if (m_kernelmode) {
+            m_syscall_frames.push_syscall_frame(m_regs);
         }
 
-        disable_conio_mode();
+        m_stats.count_exception(SYSCALL_EXCEPTION);
+        m_regs.status = (1 << 1);
+        m_regs.cause = SYSCALL_EXCEPTION << 2; // syscall exception
+        m_regs.epc = m_regs.pc + 0x4; // save pc instruction after the one who performed the syscall
 
-        std::string in;
-        std::getline(std::cin, in);
-
-        // truncate string to correct length if needed 
-        if (in.length() > a1 - 1) {
-            in.resize(a1 - 1);
-        }
-        // if space exists, add newline
-        if (in.length() < a1 - 1) {
-            in.append("\n");
-        }
-
-        uint32_t offset = get_offset_for_section(sect, a0);
-        memcpy(sect->sect.data() + offset, in.c_str(), in.length() + 1);
-    }
-    break;
-    case uint32_t(syscalls::SBRK):
-    {
-        m_regs.regs[int(register_names::v0)] = m_heap.sbrk(a0);
-    }
-    break;
-    case uint32_t(syscalls::EXIT):
-    {
-        throw mips_exception_exit();
-    }
-    break;
-    case uint32_t(syscalls::PRINT_CHAR):
-    {
-        printf("%c", a0);
+        m_kernelmode = true; // enter kernelmode
+        m_regs.pc = custom_syscall;
+        return false;
     }
-    break;
-    case uint32_t(syscalls::READ_CHAR):
-    {
-        disable_conio_mode();
-        m_regs.regs[int(register_names::v0)] = getchar();
-    }
-    break;
-    case uint32_t(syscalls::OPEN_FILE):
-    {
-        section* sect = nullptr;
-        if (!(sect = get_section_for_address(a0))) {
-            throw mips_exception_load("Invalid memory access for OPEN_FILE syscall", a0);
-        }
-        uint32_t offset = get_offset_for_section(sect, a0);
-        const char* filename = (const char*)(sect->sect.data() + offset);
 
-        // make sure string actually terminates so we don't crash or leak memory
-        if (!string_terminates(filename, sect->sect.size() - offset)) {
-            throw mips_exception_load("Invalid string for OPEN_FILE syscall, does not terminate", a0);
+    if (entry->plugin) {
+        if (entry->exclusive) {
+            std::lock_guard<std::mutex> lock(m_machine->syscall_mutex);
+            plugin_manager::invoke(*this, *entry, syscall_num);
         }
-
-        m_regs.regs[int(register_names::v0)] = m_file_mgr.open_file(filename, a1, a2);
-
-    }
-    break;
-    case uint32_t(syscalls::READ_FILE):
-    {
-        section* sect = nullptr;
-        if (!(sect = get_section_for_address(a1)) || !(sect->flags & MUTABLE) || !is_safe_access(sect, a1, a2)) {
-            throw mips_exception_store("Invalid memory access for READ_FILE syscall", a1);
+        else {
+            plugin_manager::invoke(*this, *entry, syscall_num);
         }
-
-        uint32_t offset = get_offset_for_section(sect, a1);
-        m_regs.regs[int(register_names::v0)] = m_file_mgr.read_file(a0, sect->sect.data() + offset, a2);
+        return true;
     }
-    break;
-    case uint32_t(syscalls::WRITE_FILE):
-    {
-        section* sect = nullptr;
-        if (!(sect = get_section_for_address(a1)) || !is_safe_access(sect, a1, a2)) {
-            throw mips_exception_store("Invalid memory access for READ_FILE syscall", a1);
-        }
 
-        uint32_t offset = get_offset_for_section(sect, a1);
-        m_regs.regs[int(register_names::v0)] = m_file_mgr.write_file(a0, sect->sect.data() + offset, a2);
-    }
-    break;
-    case uint32_t(syscalls::CLOSE_FILE):
-    {
-        m_file_mgr.close_file(a0);
-    }
-    break;
-    case uint32_t(syscalls::EXIT2):
-    {
-        throw mips_exception_exit("EXIT syscall invoked, terminating with value " + std::to_string(a0));
-    }
-    break;
-    case uint32_t(syscalls::TIME):
-    {
-        // get time since epoch
-        uint64_t timestamp = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
-        m_regs.regs[int(register_names::a0)] = (uint32_t)(timestamp & 0xFFFFFFFF);
-        m_regs.regs[int(register_names::a1)] = (uint32_t)((timestamp >> 32) & 0xFFFFFFFF);
-    }
-    break;
-    case uint32_t(syscalls::SLEEP):
-    {
-        std::this_thread::sleep_for(std::chrono::milliseconds(a0));
-    }
-    break;
-    case uint32_t(syscalls::PRINT_HEX):
-    {
-        printf("%X", a0);
-    }
-    break;
-    case uint32_t(syscalls::PRINT_BINARY):
-    {
-        std::stringstream ss;
-        ss << std::bitset<32>(a0);
-        printf("%s", ss.str().c_str());
-    }
-    break;
-    case uint32_t(syscalls::PRINT_UNSIGNED):
-    {
-        printf("%u", a0);
-    }
-    break;
-    case uint32_t(syscalls::SET_SEED):
-    {
-        m_random_mgr.set_seed(a0, a1);
-    }
-    break;
-    case uint32_t(syscalls::RAND_INT):
-    {
-        m_regs.regs[int(register_names::a0)] = m_random_mgr.get_int(a0);
-    }
-    break;
-    case uint32_t(syscalls::RAND_INT_RANGE):
-    {
-        m_regs.regs[int(register_names::a0)] = m_random_mgr.get_int_range(a0, a1);
-    }
-    break;
-    case uint32_t(syscalls::RAND_FLOAT):
-    {
-        m_regs.f[0] = m_random_mgr.get_float(a0);
-    }
-    break;
-    case uint32_t(syscalls::RAND_DBL):
-    {
-        m_regs.f[0] = m_random_mgr.get_float(a0);
-    }
-    break;
-    case uint32_t(syscalls::REGISTER_SYSCALL):
-    {
-        if (a0 < 50) { // first 50 syscalls are reserved
-            throw mips_exception_syscall("Syscalls 1-49 are reserved, can't register new syscall with number " + std::to_string(a0));
-        }
-        section* sect = nullptr;
-        if (!(sect = get_section_for_address(a1, true)) || !(sect->flags & EXECUTABLE) || !(sect->flags & KERNEL)) {
-            throw mips_exception_store("Invalid address for custom syscall handler", a1);
-        }
-
-        m_syscall_mgr.register_syscall(a0, a1);
+    if (!entry->native) {
+        throw mips_exception_syscall("Syscall number " + std::to_string(syscall_num) + " not implemented");
     }
-    break;
-    default:
-    {
-        // If a custom syscall is registered to this number, use it, otherwise throw exception.
-        uint32_t custom_syscall = m_syscall_mgr.get_syscall_addr(syscall_num);
-        if (custom_syscall) {
-            // If we are already in kernelmode save the frame so we can revert back to it when returning from the syscall
-            if (m_kernelmode) {
-                m_syscall_mgr.push_syscall_frame(m_regs);
-            }
 
-            m_regs.status = (1 << 1);
-            m_regs.cause = SYSCALL_EXCEPTION << 2; // syscall exception
-            m_regs.epc = m_regs.pc + 0x4; // save pc instruction after the one who performed the syscall
+    uint32_t a0 = m_regs.regs[int(register_names::a0)];
+    uint32_t a1 = m_regs.regs[int(register_names::a1)];
+    uint32_t a2 = m_regs.regs[int(register_names::a2)];
 
-            m_kernelmode = true; // enter kernelmode
-            m_regs.pc = custom_syscall;
-            return false;
-        }
-        throw mips_exception_syscall("Syscall number " + std::to_string(syscall_num) + " not implemented");
-    }
+    if (!entry->exclusive) {
+        return (this->*entry->native)(a0, a1, a2);
     }
 
-    return true;
+    // syscalls share host state (files, streams, the heap break, stdio) between the harts
+    std::lock_guard<std::mutex> lock(m_machine->syscall_mutex);
+    return (this->*entry->native)(a0, a1, a2);
 }
\ No newline at end of file
@@ -0,0 +1,135 @@
+#include "pch.h"
+#include "display.h"
+#include "helper.h"
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+std::string display_options::validate(const memory_layout& layout) const {
+	if (!width || !height || width > MIPS_VM_DISPLAY_MAX_SIZE || height > MIPS_VM_DISPLAY_MAX_SIZE) {
+		return "display size has to be between 1x1 and " + std::to_string(MIPS_VM_DISPLAY_MAX_SIZE) + "x" + std::to_string(MIPS_VM_DISPLAY_MAX_SIZE);
+	}
+	if (address & 0xFFF) {
+		return "framebuffer address has to be page aligned";
+	}
+
+	auto overlaps = [](uint64_t start_a, uint64_t end_a, uint64_t start_b, uint64_t end_b) { return start_a < end_b && start_b < end_a; };
+	uint64_t end = uint64_t(address) + uint64_t(width) * height * sizeof(uint32_t);
+	if (end > 0x100000000ull) {
+		return "framebuffer doesn't fit into the address space";
+	}
+	if (overlaps(address, end, layout.heap_start, layout.heap_end()) || overlaps(address, end, layout.stack_bottom(), layout.stack_top) ||
+		overlaps(address, end, layout.mapping_area_start(), layout.mapping_area_end()) || overlaps(address, end, layout.mmio_base, uint64_t(layout.mmio_base) + MMIO_SIZE)) {
+		return "framebuffer overlaps the heap, the stack, the file mapping area or the MMIO registers";
+	}
+	return "";
+}
+
+bitmap_display::~bitmap_display() {
+#ifndef _WIN32
+	if (m_shared) {
+		munmap(m_header, m_size);
+		shm_unlink(m_options.shm.c_str());
+	}
+#endif
+}
+
+bool bitmap_display::create() {
+	m_size = MIPS_VM_DISPLAY_PIXELS_OFFSET + pixels_size();
+
+	if (m_options.shm.empty()) {
+		m_memory.assign(m_size, 0);
+		m_header = reinterpret_cast<mips_vm_display_header*>(m_memory.data());
+	}
+	else {
+#ifdef _WIN32
+		printf("Sharing the display is only supported on Linux/POSIX\n");
+		return false;
+#else
+		// a viewer may already wait for the object, so reuse it if it exists
+		int fd = shm_open(m_options.shm.c_str(), O_CREAT | O_RDWR, 0600);
+		if (fd < 0) {
+			printf("Can't create shared memory object '%s': %s\n", m_options.shm.c_str(), strerror(errno));
+			return false;
+		}
+
+		void* mem = MAP_FAILED;
+		if (ftruncate(fd, off_t(m_size)) == 0) {
+			mem = mmap(nullptr, m_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		}
+		close(fd);
+		if (mem == MAP_FAILED) {
+			printf("Can't map shared memory object '%s': %s\n", m_options.shm.c_str(), strerror(errno));
+			shm_unlink(m_options.shm.c_str());
+			return false;
+		}
+
+		m_header = reinterpret_cast<mips_vm_display_header*>(mem);
+		m_shared = true;
+		memset(mem, 0, m_size); // left over from an earlier run
+#endif
+	}
+
+	m_pixels = reinterpret_cast<uint8_t*>(m_header) + MIPS_VM_DISPLAY_PIXELS_OFFSET;
+	m_header->version = MIPS_VM_DISPLAY_VERSION;
+	m_header->width = m_options.width;
+	m_header->height = m_options.height;
+	m_header->running = 1;
+	std::atomic_thread_fence(std::memory_order_release);
+	memcpy(m_header->magic, MIPS_VM_DISPLAY_MAGIC, sizeof(m_header->magic));
+	return true;
+}
+
+void bitmap_display::store(uint8_t* regs, uint32_t offset, uint32_t size) {
+	// an unaligned store may touch two rows
+	uint32_t stride = m_options.width * sizeof(uint32_t);
+	for (uint32_t row = offset / stride; row <= (offset + size - 1) / stride && row < m_options.height; row++) {
+		uint32_t* word = &m_header->dirty[row / 32];
+		uint32_t bit = 1u << (row % 32);
+
+		// only the first store to a clean row has to do an atomic update, the viewer clears the bits
+		if (!(atomic_load32(word) & bit) && !(atomic_fetch_or32(word, bit) & bit)) {
+			atomic_fetch_add32(&m_header->changes, 1);
+		}
+	}
+}
+
+void bitmap_display::present() {
+	uint32_t frame = atomic_fetch_add32(&m_header->frame, 1) + 1;
+	if (!m_options.dump.empty()) {
+		char number[16];
+		snprintf(number, sizeof(number), "-%04u", frame);
+		write_ppm(m_options.dump + number + ".ppm");
+	}
+}
+
+void bitmap_display::finish() {
+	if (!m_options.dump.empty()) {
+		write_ppm(m_options.dump + ".ppm");
+	}
+	atomic_fetch_add32(&m_header->changes, 1);
+	m_header->running = 0;
+}
+
+bool bitmap_display::write_ppm(const std::string& file) {
+	std::ofstream out(file, std::ios::binary);
+	if (!out.is_open()) {
+		printf("Can't write display frame to '%s'\n", file.c_str());
+		return false;
+	}
+
+	out << "P6\n" << m_options.width << " " << m_options.height << "\n255\n";
+	std::vector<uint8_t> row(size_t(m_options.width) * 3);
+	const uint32_t* pixels = reinterpret_cast<const uint32_t*>(m_pixels);
+	for (uint32_t y = 0; y < m_options.height; y++) {
+		for (uint32_t x = 0; x < m_options.width; x++) {
+			uint32_t pixel = pixels[size_t(y) * m_options.width + x];
+			row[x * 3] = uint8_t(pixel >> 16);
+			row[x * 3 + 1] = uint8_t(pixel >> 8);
+			row[x * 3 + 2] = uint8_t(pixel);
+		}
+		out.write(reinterpret_cast<const char*>(row.data()), row.size());
+	}
+	return out.good();
+}
\ No newline at end of file
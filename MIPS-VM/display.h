@@ -0,0 +1,64 @@
+#pragma once
+#include "pch.h"
+#include "device_bus.h"
+#include "display_shm.h"
+
+// Settings of the bitmap display, filled in from the command line (--display and friends)
+struct display_options {
+	display_options() : width(0), height(0), address(0x18000000) {}
+
+	uint32_t width; // in pixels, 0 for no display
+	uint32_t height;
+	uint32_t address; // guest address of the framebuffer, page aligned
+	std::string shm; // POSIX shared memory object the framebuffer is exported through for a viewer, eg. "/mips_vm_display"
+	std::string dump; // file name prefix, frames are written as <dump>-<frame>.ppm and the last one as <dump>.ppm
+
+	// empty if the display fits into the layout, otherwise what is wrong with it
+	std::string validate(const memory_layout& layout) const;
+};
+
+// MARS style bitmap display: a framebuffer of 0x00RRGGBB words, row by row, mapped into the guest address space.
+// The framebuffer is memory of the display_shm.h layout, shared with a viewer process through a POSIX shared memory
+// object if one is given. Stores to it mark their rows dirty there, so a viewer only redraws what changed and the
+// guest draws with plain stores. The program tells a frame is complete by storing to the frame register.
+class bitmap_display : public mmio_device {
+public:
+	bitmap_display(const display_options& options) : m_options(options), m_header(nullptr), m_pixels(nullptr), m_size(0), m_shared(false), m_frame_register(*this) {}
+	~bitmap_display();
+
+	// creates the framebuffer and the shared memory object, prints what went wrong if it can't
+	bool create();
+	// the framebuffer for the device bus to map at options.address, it stays owned by the display
+	section_memory framebuffer() { return section_memory(m_pixels, pixels_size(), nullptr); }
+	// the frame register at mmio_base + MMIO_FRAME
+	mmio_device* frame_register() { return &m_frame_register; }
+
+	void store(uint8_t* regs, uint32_t offset, uint32_t size) override;
+	bool thread_safe() const override { return true; }
+
+	// the program ended, dumps the last frame and tells the viewer
+	void finish();
+
+private:
+	// a store to it completes a frame
+	class frame_device : public mmio_device {
+	public:
+		frame_device(bitmap_display& display) : m_display(display) {}
+		void store(uint8_t* regs, uint32_t offset, uint32_t size) override { m_display.present(); }
+
+	private:
+		bitmap_display& m_display;
+	};
+
+	size_t pixels_size() const { return size_t(m_options.width) * m_options.height * sizeof(uint32_t); }
+	void present();
+	bool write_ppm(const std::string& file);
+
+	display_options m_options;
+	mips_vm_display_header* m_header; // at the start of the memory, the pixels follow at MIPS_VM_DISPLAY_PIXELS_OFFSET
+	uint8_t* m_pixels;
+	size_t m_size;
+	bool m_shared; // m_header is the mapped shared memory object
+	std::vector<uint8_t> m_memory; // without a shared memory object
+	frame_device m_frame_register;
+};
\ No newline at end of file
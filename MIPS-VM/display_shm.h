@@ -0,0 +1,36 @@
+#pragma once
+// Layout of the shared memory object the bitmap display exports its framebuffer through (--display-shm <name>).
+// This header is all a viewer needs, it doesn't depend on anything else in the VM.
+//
+// The object starts with a mips_vm_display_header, the pixels follow at MIPS_VM_DISPLAY_PIXELS_OFFSET: `height` rows
+// of `width` 0x00RRGGBB words (little endian, so the bytes of a pixel are blue, green, red, 0). The VM writes the
+// header fields last, a viewer should check `magic` and `version` before using the rest.
+//
+// A viewer maps the object read/write and polls `changes`. When it moved, the viewer atomically swaps each word of
+// `dirty` with 0 and redraws the rows whose bits were set (bit n of word n / 32 is row n). The VM sets a row's bit
+// after every store to it, so a row changed while the viewer copies it gets marked again.
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MIPS_VM_DISPLAY_MAGIC "MIPSVMFB"
+#define MIPS_VM_DISPLAY_VERSION 1
+#define MIPS_VM_DISPLAY_MAX_SIZE 4096 // width and height
+#define MIPS_VM_DISPLAY_PIXELS_OFFSET 4096
+
+typedef struct mips_vm_display_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t width;
+	uint32_t height;
+	uint32_t running; // 1 while the program runs, 0 once it ended
+	uint32_t frame; // frames the program completed, see the display's frame register
+	uint32_t changes; // bumped whenever a clean row gets dirty
+	uint32_t dirty[MIPS_VM_DISPLAY_MAX_SIZE / 32]; // a bit per row
+} mips_vm_display_header;
+
+#ifdef __cplusplus
+}
+#endif
\ No newline at end of file
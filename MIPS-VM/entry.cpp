@@ -1,9 +1,34 @@
 #include "pch.h"
 #include "executor.h"
 #include "helper.h"
+#include "test_runner.h"
+#include "lockstep.h"
+#include "random_program.h"
+#include "fuzz.h"
 
+// byte count with an optional k, m or g suffix, or an address in any base strtoull understands ("0x..." for hex)
+static bool parse_size(const char* str, uint64_t max, uint64_t& out) {
+    char* end = nullptr;
+    uint64_t value = strtoull(str, &end, 0);
+    if (end == str) {
+        return false;
+    }
 
-int main(int argc, char** argv) {
+    switch (tolower(*end)) {
+    case 'k': value <<= 10; end++; break;
+    case 'm': value <<= 20; end++; break;
+    case 'g': value <<= 30; end++; break;
+    }
+
+    if (*end || value > max) {
+        return false;
+    }
+    out = value;
+    return true;
+}
+
+
+int vm_main(int argc, char** argv, const aot_program* program) {
     //int32_t i = 0x012a0036;
     //int32_t i2 = 0x052e0064;
     //instruction inst(i);
@@ -14,30 +39,202 @@ int main(int argc, char** argv) {
     //printf("0x%02X | %i\n", inst.j.opcode, inst.j.p_addr);
     //printf("%X | %i | %i | %i | %i\n", inst2.r.opcode, inst2.r.rs, inst2.r.rt, inst2.r.rd, inst2.r.funct);
 
-    std::string program;
-    if (argc < 2) {
-        printf("Enter name of the program: ");
-        std::getline(std::cin, program);
+    vm_options options;
+    options.translated = program;
+    if (program) {
+        options.program = program->name;
     }
-    else {
-        program = std::string(argv[1]);
+
+    std::string translate_path, test_dir, generate_path, fuzz_path;
+    uint32_t jobs = 0;
+    bool diff = false;
+    uint64_t diff_every = 0, seed = std::random_device()(), length = 1000;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "-d" || arg == "--debug") {
+            options.debug = true;
+        }
+        else if (arg == "-EB" || arg == "--big-endian") {
+            options.big_endian = true;
+        }
+        else if (arg == "--symbols" && i + 1 < argc) {
+            options.symbols = argv[++i];
+        }
+        else if (arg == "--harts" && i + 1 < argc) {
+            options.harts = uint32_t(strtoul(argv[++i], nullptr, 10));
+        }
+        else if (arg == "--gdb" && i + 1 < argc) {
+            options.gdb = argv[++i];
+        }
+        else if (arg == "--plugin" && i + 1 < argc) {
+            options.plugins.push_back(argv[++i]);
+        }
+        else if (arg == "--report" && i + 1 < argc) {
+            options.report = argv[++i];
+        }
+        else if (arg == "--cache" && i + 1 < argc) {
+            options.cache = argv[++i];
+        }
+        else if (arg == "--translate" && i + 1 < argc) {
+            translate_path = argv[++i];
+        }
+        else if (arg == "--test" && i + 1 < argc) {
+            test_dir = argv[++i];
+        }
+        else if (arg == "--jobs" && i + 1 < argc) {
+            jobs = uint32_t(strtoul(argv[++i], nullptr, 10));
+        }
+        else if (arg == "--diff") {
+            diff = true;
+        }
+        else if (arg == "--diff-every" && i + 1 < argc) {
+            if (!parse_size(argv[++i], std::numeric_limits<uint64_t>::max(), diff_every) || !diff_every) {
+                printf("Invalid instruction count '%s' for %s\n", argv[i], arg.c_str());
+                return 1;
+            }
+            diff = true;
+        }
+        else if (arg == "--generate" && i + 1 < argc) {
+            generate_path = argv[++i];
+        }
+        else if (arg == "--seed" && i + 1 < argc) {
+            seed = strtoull(argv[++i], nullptr, 0);
+        }
+        else if (arg == "--length" && i + 1 < argc) {
+            if (!parse_size(argv[++i], 1 << 24, length) || !length) {
+                printf("Invalid instruction count '%s' for %s\n", argv[i], arg.c_str());
+                return 1;
+            }
+        }
+        else if (arg == "--fuzz" && i + 1 < argc) {
+            fuzz_path = argv[++i];
+        }
+        else if (arg == "--display" && i + 1 < argc) {
+            if (sscanf(argv[++i], "%ux%u", &options.display.width, &options.display.height) != 2) {
+                printf("Invalid display size '%s', expected <width>x<height>\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (arg == "--display-address" && i + 1 < argc) {
+            options.display.address = uint32_t(strtoul(argv[++i], nullptr, 0));
+        }
+        else if (arg == "--display-shm" && i + 1 < argc) {
+            options.display.shm = argv[++i];
+        }
+        else if (arg == "--display-dump" && i + 1 < argc) {
+            options.display.dump = argv[++i];
+        }
+        else if (arg == "--checkpoint" && i + 1 < argc) {
+            options.checkpoint.dir = argv[++i];
+        }
+        else if (arg == "--checkpoint-every" && i + 1 < argc) {
+            if (!parse_size(argv[++i], std::numeric_limits<uint64_t>::max(), options.checkpoint.every) || !options.checkpoint.every) {
+                printf("Invalid instruction count '%s' for %s\n", argv[i], arg.c_str());
+                return 1;
+            }
+        }
+        else if (arg == "--checkpoint-interval" && i + 1 < argc) {
+            options.checkpoint.interval = strtod(argv[++i], nullptr);
+            if (!(options.checkpoint.interval > 0)) {
+                printf("Invalid number of seconds '%s' for %s\n", argv[i], arg.c_str());
+                return 1;
+            }
+        }
+        else if (arg == "--resume" && i + 1 < argc) {
+            options.checkpoint.resume = argv[++i];
+        }
+        else if ((arg == "--stack-size" || arg == "--stack-top" || arg == "--heap-size" || arg == "--heap-start" || arg == "--mmio-base" || arg == "--memory-limit") && i + 1 < argc) {
+            uint64_t value = 0;
+            if (!parse_size(argv[++i], arg == "--memory-limit" ? std::numeric_limits<uint64_t>::max() : std::numeric_limits<uint32_t>::max(), value)) {
+                printf("Invalid value '%s' for %s\n", argv[i], arg.c_str());
+                return 1;
+            }
+
+            memory_layout& layout = options.layout;
+            if (arg == "--stack-size") layout.stack_size = uint32_t(value);
+            else if (arg == "--stack-top") layout.stack_top = uint32_t(value);
+            else if (arg == "--heap-size") layout.heap_size = uint32_t(value);
+            else if (arg == "--heap-start") layout.heap_start = uint32_t(value);
+            else if (arg == "--mmio-base") layout.mmio_base = uint32_t(value);
+            else layout.memory_limit = value;
+        }
+        else if (!program) {
+            options.program = arg;
+        }
+    }
+
+    // neither count nor time given, checkpoint once a minute
+    if (!options.checkpoint.dir.empty() && !options.checkpoint.every && !options.checkpoint.interval) {
+        options.checkpoint.interval = 60;
+    }
+
+    // a random program for differential runs, nothing is run
+    if (!generate_path.empty()) {
+        random_program generated(seed, uint32_t(length));
+        if (!generated.write(generate_path)) {
+            return 1;
+        }
+        printf("Generated %s with %u instructions from seed %llu\n", generate_path.c_str(), generated.size(), (unsigned long long)seed);
+        return 0;
+    }
+
+    // inputs of the fuzz target, each one is its own program
+    if (!fuzz_path.empty()) {
+        return replay_fuzz_inputs(fuzz_path) ? 0 : 1;
+    }
+
+    if (options.program.empty()) {
+        printf("Enter name of the program: ");
+        input_source::host_stdin().read_line(options.program);
     }
     
     // set up signal handling for conio on Linux
     setup_signal_interceptor();
 
 
+    if (!test_dir.empty()) {
+        test_runner tests(options, test_dir, jobs);
+        return tests.run() ? 0 : 1;
+    }
+
+    if (diff) {
+        lockstep engines(options, diff_every);
+        if (!engines.can_run()) {
+            printf("Error: MIPS Virtual Machine could not be initialized\n");
+            disable_conio_mode();
+            return 1;
+        }
+        bool agreed = engines.run();
+        disable_conio_mode();
+        return agreed ? 0 : 1;
+    }
+
     // start the vm with the specified input file
-    executor vm(program);
+    executor vm(options);
     if (!vm.can_run()) {
         printf("Error: MIPS Virtual Machine could not be initialized\n");
         disable_conio_mode();
         return 1;
     }
 
+    if (!translate_path.empty()) {
+        bool translated = vm.translate(translate_path);
+        if (translated) {
+            printf("Build the native runner with: g++ -O2 -std=c++17 -pthread -DMIPS_VM_NO_MAIN -IMIPS-VM %s MIPS-VM/*.cpp -o %s -ldl\n", translate_path.c_str(), (options.program + "_native").c_str());
+        }
+        disable_conio_mode();
+        return translated ? 0 : 1;
+    }
+
     vm.run();
 
     disable_conio_mode();
-    std::getchar();
+    input_source::host_stdin().read_char();
     return 0;
 } 
+
+#if !defined(MIPS_VM_NO_MAIN) && !defined(MIPS_VM_FUZZ)
+int main(int argc, char** argv) {
+    return vm_main(argc, argv, nullptr);
+}
+#endif
\ No newline at end of file
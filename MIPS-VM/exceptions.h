@@ -5,6 +5,8 @@
 
 constexpr uint32_t EXCEPTION_HANDLER = 0x80000180;
 
+constexpr uint32_t CAUSE_IP_TIMER = (1 << 15); // IP7 in cause, pending Count/Compare timer interrupt
+
 enum EXCEPTION_TYPES : int32_t {
 	INVALID_EXCEPTION = -1,
 	INTERRUPT_EXCEPTION = 0,
@@ -157,4 +159,22 @@ public:
 class mips_exception_exit : public std::runtime_error {
 public:
 	mips_exception_exit(std::string reason = "EXIT syscall invoked") : std::runtime_error((char const* const)reason.c_str()) {}
-};
\ No newline at end of file
+};
+
+// Raised when execution hits a breakpoint planted by the debugger, hands control to the debugger and is never seen by the guest.
+class debugger_break : public std::runtime_error {
+public:
+	debugger_break(std::string reason = "Breakpoint hit") : std::runtime_error(reason.c_str()) {}
+};
+
+// Not a MIPS exception. Thrown when the output sink rejected guest output (the test runner saw a mismatch), ends the run
+class output_rejected : public std::runtime_error {
+public:
+	output_rejected(std::string reason = "output does not match") : std::runtime_error(reason.c_str()) {}
+};
+
+// Not a MIPS exception. Thrown when a hart has no guest thread left to run
+class hart_idle : public std::runtime_error {
+public:
+	hart_idle(std::string reason = "No guest thread left to run") : std::runtime_error(reason.c_str()) {}
+};
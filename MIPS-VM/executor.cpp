@@ -2,30 +2,85 @@
 #include "executor.h"
 #include "helper.h"
 #include "file_mgr.h"
+#include "translator.h"
+
+constexpr uint64_t NO_EVENT = std::numeric_limits<uint64_t>::max();
+
+executor::executor(const vm_options& options) : executor(std::make_shared<machine>(options.layout), 0) {
+    const std::string& file = options.program;
+    const memory_layout& layout = m_machine->layout;
+
+    std::string layout_error = layout.validate();
+    if (!layout_error.empty()) {
+        printf("Invalid memory layout: %s\n", layout_error.c_str());
+        return;
+    }
+
+    m_machine->quiet = options.quiet;
+    m_machine->sandbox = options.sandbox;
+    m_machine->big_endian = options.big_endian || (options.translated && options.translated->big_endian);
+    if (m_machine->big_endian) {
+        m_dispatch = &executor::dispatch_opcode<big_endian_memory>;
+    }
+    if (options.input) {
+        m_machine->input_buffer.set_buffer(*options.input);
+        m_machine->input = &m_machine->input_buffer;
+    }
+    if (options.output) {
+        m_machine->output = options.output;
+    }
+
+    register_native_syscalls();
+    for (const std::string& plugin : options.plugins) {
+        if (!m_machine->plugins.load(plugin)) {
+            return;
+        }
+    }
 
-executor::executor(std::string file): m_can_run(false), m_tick(0), m_kernelmode(false), m_has_exception_handler(false) {
     // load all existing sections
     for (int i = 0; i < NUM_SECTIONS; i++) {
-        std::ifstream bin(file + section_names[i], std::ios::binary);
-        if (!bin.is_open()) {
-            continue;
+        std::vector<uint8_t> buf;
+        if (options.translated) { // a translated runner carries its section files
+            const uint8_t* data = options.translated->sections[i];
+            if (!data) {
+                continue;
+            }
+            buf.assign(data, data + options.translated->section_sizes[i]);
         }
+        else {
+            std::ifstream bin(file + section_names[i], std::ios::binary);
+            if (!bin.is_open()) {
+                continue;
+            }
 
-        // read the binary file into a buffer
-        m_sections[i].sect = std::vector<uint8_t>(std::istreambuf_iterator<char>(bin), {});
+            // read the binary file into a buffer
+            buf = std::vector<uint8_t>(std::istreambuf_iterator<char>(bin), {});
+        }
         m_sections[i].flags = section_protection[i]; // get the protection flags for this section
 
         // make sure executable sections are aligned to 4 bytes and a nonzero size (4 first bytes of the buffer is used for the section address)
-        if ((m_sections[i].flags & EXECUTABLE && m_sections[i].sect.size() & 0x3) || m_sections[i].sect.size() - 4 <= 0) {
-            printf("Size of binary file '%s%s' too small or unaligned (%X bytes)\n", file.c_str(), section_names[i], uint32_t(m_sections[i].sect.size()) - 4);
+        if ((m_sections[i].flags & EXECUTABLE && buf.size() & 0x3) || buf.size() <= 4) {
+            printf("Size of binary file '%s%s' too small or unaligned (%X bytes)\n", file.c_str(), section_names[i], uint32_t(buf.size()) - 4);
             m_sections[i] = section();
             continue;
         }
 
         // read the first 4 bytes of the loaded file, it denotes the address of the section
-        m_sections[i].address = *reinterpret_cast<uint32_t*>(m_sections[i].sect.data());
+        m_sections[i].address = *reinterpret_cast<uint32_t*>(buf.data());
         // remove the 4 byte section address at the start of the buffer
-        m_sections[i].sect.erase(m_sections[i].sect.begin(), m_sections[i].sect.begin() + 4);
+        buf.erase(buf.begin(), buf.begin() + 4);
+
+        // a big-endian image, instructions are swapped once here so fetching them doesn't have to
+        if (m_machine->big_endian) {
+            m_sections[i].address = swap_bytes(m_sections[i].address);
+            if (m_sections[i].flags & EXECUTABLE) {
+                for (size_t word = 0; word < buf.size(); word += sizeof(uint32_t)) {
+                    uint32_t* inst = reinterpret_cast<uint32_t*>(buf.data() + word);
+                    *inst = swap_bytes(*inst);
+                }
+            }
+        }
+        m_sections[i].sect = section_memory(std::move(buf));
     }
 
     if (!m_sections[TEXT].address) {
@@ -33,23 +88,159 @@ executor::executor(std::string file): m_can_run(false), m_tick(0), m_kernelmode(
         return;
     }
 
+    // the loaded sections and the stack count against the memory limit right away, the heap as it grows
+    uint64_t static_size = layout.stack_size;
+    for (int i = 0; i < NUM_SECTIONS; i++) {
+        const section& sect = m_sections[i];
+        if (!sect.sect.size()) {
+            continue;
+        }
+
+        uint64_t start = sect.address, end = start + sect.sect.size();
+        if ((start < layout.heap_end() && layout.heap_start < end) || (start < layout.stack_top && layout.stack_bottom() < end) ||
+            (start < uint64_t(layout.mmio_base) + MMIO_SIZE && layout.mmio_base < end)) {
+            printf("Section %s at 0x%08X overlaps the heap, the stack or the MMIO registers\n", section_names[i], sect.address);
+            return;
+        }
+        static_size += sect.sect.size();
+    }
+    if (!m_machine->budget.take(static_size)) {
+        printf("Program and stack need %llu bytes, more than the memory limit of %llu bytes\n", (unsigned long long)static_size, (unsigned long long)layout.memory_limit);
+        return;
+    }
+
+    if (options.translated && !options.interpret) {
+        m_machine->translated.build(*options.translated, m_sections);
+    }
+    else if (!options.cache.empty()) {
+        m_machine->cache = std::make_unique<translation_cache>(options.cache);
+        m_machine->cache->open(m_sections, file, m_machine->big_endian);
+        if (m_machine->cache->native()) {
+            m_machine->translated.build(*m_machine->cache->native(), m_sections);
+        }
+    }
+
     // check if exception handler exists
     section* ktext = get_section_for_address(EXCEPTION_HANDLER, true);
     if (ktext && ktext->address == m_sections[KTEXT].address) {
         m_has_exception_handler = true; // address 0x80000180 (exception handler) is valid and in .ktext, exception handler exists.
     }
 
-    // create MMIO section
-    m_mmio.sect.resize(2 * sizeof(uint32_t), 0); // 8 bytes
-    m_mmio.flags = MUTABLE;
-    m_mmio.address = 0xFFFF0000;
+    // map the standard devices, their registers are where MARS has them by default
+    m_devices.map(layout.mmio_base + MMIO_KEYBOARD, 2 * sizeof(uint32_t), &m_machine->keyboard);
+    m_devices.map(layout.mmio_base + MMIO_DISPLAY, 2 * sizeof(uint32_t), &m_machine->display);
+    m_devices.map(layout.mmio_base + MMIO_TIMER, 2 * sizeof(uint32_t), &m_machine->timer);
+
+    // the bitmap display's framebuffer is device memory of its own, next to the sections
+    if (options.display.width) {
+        const display_options& display = options.display;
+        std::string display_error = display.validate(layout);
+        uint64_t display_end = uint64_t(display.address) + uint64_t(display.width) * display.height * sizeof(uint32_t);
+        for (int i = 0; display_error.empty() && i < NUM_SECTIONS; i++) {
+            const section& sect = m_sections[i];
+            if (sect.sect.size() && display.address < sect.address + uint64_t(sect.sect.size()) && sect.address < display_end) {
+                display_error = std::string("framebuffer overlaps ") + section_names[i];
+            }
+        }
+        if (display_error.empty() && !m_machine->budget.take(display_end - display.address)) {
+            display_error = "framebuffer exceeds the memory limit";
+        }
+        if (!display_error.empty()) {
+            printf("Invalid display: %s\n", display_error.c_str());
+            return;
+        }
+
+        m_machine->bitmap = std::make_unique<bitmap_display>(display);
+        if (!m_machine->bitmap->create()) {
+            return;
+        }
+        m_devices.map(display.address, m_machine->bitmap->framebuffer(), m_machine->bitmap.get());
+        m_devices.map(layout.mmio_base + MMIO_FRAME, sizeof(uint32_t), m_machine->bitmap->frame_register());
+    }
     
-    m_regs.regs[int(register_names::sp)] = 0x7FFFEFFC;
-    m_regs.pc = m_sections[TEXT].address;
+    if (options.harts < 1 || options.harts > MAX_HARTS) {
+        printf("Number of harts must be between 1 and %u\n", MAX_HARTS);
+        return;
+    }
+    m_machine->num_harts = options.harts;
+    init_hart();
+
+    m_program = file;
+    m_report_path = options.report;
+
+    m_debugger.load_symbols(options.symbols.empty() ? file + ".sym" : options.symbols);
+    if (options.debug) {
+        m_debugger.enable();
+    }
+
+    if (options.harts > 1 && (options.debug || !options.gdb.empty())) {
+        printf("Debugging is only supported with a single hart\n");
+        return;
+    }
+
+    // checkpoints are taken between blocks, which stop the hart for the debuggers as well
+    const checkpoint_options& checkpoints = options.checkpoint;
+    if ((!checkpoints.dir.empty() || !checkpoints.resume.empty()) && options.harts > 1) {
+        printf("Checkpoints are only supported with a single hart\n");
+        return;
+    }
+    if (!checkpoints.dir.empty() && (options.debug || !options.gdb.empty())) {
+        printf("Checkpoints can't be taken while debugging\n");
+        return;
+    }
+    if (!checkpoints.dir.empty() && !options.display.shm.empty()) {
+        printf("Checkpoints can't be taken with a shared display, its framebuffer keeps changing while a checkpoint is written\n");
+        return;
+    }
+    uint64_t program_key = translation_cache::key(m_sections, m_machine->big_endian); // the program as loaded, its .data changes while it runs
+    if (!checkpoints.resume.empty() && !checkpoint::resume(*this, checkpoints.resume, program_key)) {
+        return;
+    }
+    if (!checkpoints.dir.empty()) {
+        std::error_code error;
+        std::filesystem::create_directories(checkpoints.dir, error);
+        if (error) {
+            printf("Failed to create checkpoint directory '%s': %s\n", checkpoints.dir.c_str(), error.message().c_str());
+            return;
+        }
+        m_checkpoint = std::make_unique<checkpoint>(checkpoints, program_key, m_tick);
+        schedule_events();
+    }
+
+    if (!options.gdb.empty()) {
+        m_gdb = std::make_unique<gdb_stub>(*this);
+        if (!m_gdb->listen(options.gdb)) {
+            return;
+        }
+    }
 
     m_can_run = true;
 }
 
+executor::executor(std::shared_ptr<machine> shared, uint32_t hart_id) : m_machine(std::move(shared)), m_sections(m_machine->sections), m_devices(m_machine->devices),
+    m_heap(m_machine->heap_area), m_stack(m_machine->stack_area), m_syscalls(m_machine->syscalls), m_random_mgr(m_machine->rng), m_file_mgr(m_machine->files),
+    m_mapping_mgr(m_machine->mappings), m_has_exception_handler(m_machine->has_exception_handler), m_hart_id(hart_id), m_thread(nullptr),
+    m_dispatch(m_machine->big_endian ? &executor::dispatch_opcode<big_endian_memory> : &executor::dispatch_opcode<little_endian_memory>), m_tick(0), m_next_event(NO_EVENT), m_unmaps_seen(0), m_timer_deadline(NO_EVENT), m_count_offset(0), m_compare(0), m_ll_addr(0), m_ll_value(0), m_ll_valid(false),
+    m_debugger(*this), m_exit_code(0), m_stop_request(false), m_kernelmode(false), m_can_run(false) {
+    // the boot hart loads the program first, secondary harts start out on an already loaded machine
+    if (hart_id != 0) {
+        init_hart();
+        m_can_run = true;
+    }
+}
+
+void executor::init_hart() {
+    uint32_t num_harts = m_machine->num_harts;
+
+    // every hart starts at the entry point with its own equal slice of the stack region
+    m_regs.pc = m_sections[TEXT].address;
+    const memory_layout& layout = m_machine->layout;
+    m_regs.regs[int(register_names::sp)] = layout.stack_top - sizeof(uint32_t) - m_hart_id * ((layout.stack_size / num_harts) & ~0xFu);
+    m_regs.ebase = m_hart_id;
+    m_regs.regs[int(register_names::a0)] = m_hart_id;
+    m_regs.regs[int(register_names::a1)] = num_harts;
+}
+
 uint32_t executor::get_offset_for_section(section* sect, uint32_t addr) {
     return addr - sect->address;
 }
@@ -77,14 +268,25 @@ section* executor::get_section_for_address(uint32_t addr, bool kernelmode_overri
     else if (m_stack.get_section_if_valid_stack(addr)) {
         return m_stack.get_section_if_valid_stack(addr);
     }
-
-    // finally check MMIO
-    if (addr >= m_mmio.address && addr < m_mmio.address + m_mmio.sect.size()) {
-        return &m_mmio;
+    else if (m_mapping_mgr.get_section_if_valid_mapping(addr)) {
+        return m_mapping_mgr.get_section_if_valid_mapping(addr);
     }
 
-    // Invalid address, return null
-    return nullptr;
+    // finally check the device registers, invalid address if it isn't one either
+    return m_devices.get_section(addr);
+}
+
+uint32_t executor::read_guest(section* sect, uint32_t addr, uint32_t size) {
+    uint32_t offset = get_offset_for_section(sect, addr);
+    bool big = m_machine->big_endian;
+    switch (size) {
+    case 1:
+        return big ? big_endian_memory::load<uint8_t>(sect, offset) : little_endian_memory::load<uint8_t>(sect, offset);
+    case 2:
+        return big ? big_endian_memory::load<uint16_t>(sect, offset) : little_endian_memory::load<uint16_t>(sect, offset);
+    default:
+        return big ? big_endian_memory::load<uint32_t>(sect, offset) : little_endian_memory::load<uint32_t>(sect, offset);
+    }
 }
 
 bool executor::is_safe_access(section* sect, uint32_t addr, uint32_t size) {
@@ -98,92 +300,470 @@ bool executor::is_safe_access(section* sect, uint32_t addr, uint32_t size) {
     return true;
 }
 
+uint8_t* executor::guest_memory(uint32_t addr, uint32_t size, bool store) {
+    section* sect = get_section_for_address(addr);
+    if (!sect || (store && !(sect->flags & MUTABLE)) || (sect->flags & DEVICE) || (m_machine->big_endian && (sect->flags & EXECUTABLE)) ||
+        !is_safe_access(sect, addr, size)) {
+        return nullptr;
+    }
+    return sect->sect.data() + get_offset_for_section(sect, addr);
+}
+
+uint8_t* executor::guest_buffer(uint32_t addr, uint32_t size, bool store, const char* syscall) {
+    uint8_t* mem = guest_memory(addr, size, store);
+    if (!mem) {
+        std::string error = std::string("Invalid memory access for ") + syscall + " syscall";
+        if (store) {
+            throw mips_exception_store(error, addr);
+        }
+        throw mips_exception_load(error, addr);
+    }
+    return mem;
+}
+
+std::string_view executor::guest_string(uint32_t addr, const char* syscall) {
+    // the whole rest of the section is readable, the string is the part up to the first NUL in it
+    section* sect = get_section_for_address(addr);
+    uint8_t* str = guest_memory(addr, 1, false);
+    if (!str) {
+        throw mips_exception_load(std::string("Invalid memory access for ") + syscall + " syscall", addr);
+    }
+
+    size_t available = sect->sect.size() - get_offset_for_section(sect, addr);
+    size_t length = find_byte(str, available, 0);
+    if (length == available) { // make sure string actually terminates so we don't crash or leak memory
+        throw mips_exception_load(std::string("Invalid string for ") + syscall + " syscall, does not terminate", addr);
+    }
+    return std::string_view(reinterpret_cast<const char*>(str), length);
+}
+
+std::vector<std::unique_ptr<executor>> executor::prepare_harts() {
+    // secondary harts share everything but their registers with this one and run on their own host threads
+    std::vector<std::unique_ptr<executor>> secondary_harts;
+    m_machine->harts.push_back(this);
+    for (uint32_t i = 1; i < m_machine->num_harts; i++) {
+        secondary_harts.emplace_back(new executor(m_machine, i));
+        m_machine->harts.push_back(secondary_harts.back().get());
+    }
+
+    // each hart starts out running its own guest thread and is a worker for the threads spawned later. A resumed program has its threads already
+    if (!m_thread) {
+        m_machine->scheduler.init(m_machine->num_harts);
+        for (executor* hart : m_machine->harts) {
+            hart->m_thread = m_machine->scheduler.create_thread();
+            hart->m_thread->status = guest_thread::state::running;
+        }
+    }
+
+    return secondary_harts;
+}
+
 void executor::run() {
-    for (int i = 0; i < NUM_SECTIONS; i++) {
-        printf("%s @ 0x%08X, length %X\n", section_names[i], m_sections[i].address, uint32_t(m_sections[i].sect.size()));
+    if (!m_machine->quiet) {
+        for (int i = 0; i < NUM_SECTIONS; i++) {
+            printf("%s @ 0x%08X, length %X\n", section_names[i], m_sections[i].address, uint32_t(m_sections[i].sect.size()));
+        }
+
+        printf("\nExecuting bytecode...\n\n===========================================\n");
     }
 
-    printf("\nExecuting bytecode...\n\n===========================================\n");
+    std::vector<std::unique_ptr<executor>> secondary_harts = prepare_harts();
 
-    std::string exit_reason;
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (auto& hart : secondary_harts) {
+        threads.emplace_back(&executor::run_hart, hart.get());
+    }
+
+    run_hart();
+
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    std::chrono::duration<double> wall = std::chrono::steady_clock::now() - start;
+
+    if (m_gdb) {
+        m_gdb->on_exit(m_exit_code);
+    }
+
+    // the program ends when a hart exits (or fails), or once every hart dropped off the bottom
+    if (m_machine->halted) {
+        m_exit_reason = m_machine->exit_reason;
+    }
+    if (m_machine->bitmap) {
+        m_machine->bitmap->finish();
+    }
+    if (!m_machine->quiet) {
+        printf("\n===========================================\nFinished executing (%s)\n", m_exit_reason.c_str());
+    }
+
+    for (executor* hart : m_machine->harts) {
+        m_machine->instructions += hart->m_tick;
+    }
+    if (!m_report_path.empty()) {
+        write_report(m_exit_reason, wall.count());
+    }
+    m_machine->harts.clear();
+}
+
+void executor::write_report(const std::string& reason, double wall_seconds) {
+    run_report report;
+    report.program = m_program;
+    report.exit_reason = reason;
+    report.exit_code = m_machine->halted ? m_machine->exit_code : m_exit_code;
+    report.failed = m_machine->halted && m_machine->failed;
+    report.wall_seconds = wall_seconds;
+
+    for (executor* hart : m_machine->harts) {
+        report.instructions.push_back(hart->m_tick);
+        report.stats.merge(hart->m_stats);
+    }
+
+    report.heap_peak = m_heap.brk() - m_heap.start(); // the break never moves down
+    report.stack_depth = m_stack.touched_depth();
+    report.sample_host_usage();
+
+    if (!report.write(m_report_path)) {
+        printf("Failed to write the run report to '%s'\n", m_report_path.c_str());
+    }
+}
+
+void executor::write_output(const char* data, size_t size) {
+    if (!m_machine->output->write(data, size)) {
+        throw output_rejected();
+    }
+}
+
+void executor::print(const char* format, ...) {
+    char buf[512];
+    va_list args;
+    va_start(args, format);
+    int size = vsnprintf(buf, sizeof(buf), format, args);
+    va_end(args);
+
+    if (size < 0) {
+        return;
+    }
+    if (size_t(size) < sizeof(buf)) {
+        write_output(buf, size_t(size));
+        return;
+    }
+
+    // didn't fit, format again into a big enough buffer (floats can print hundreds of digits)
+    std::vector<char> big(size_t(size) + 1);
+    va_start(args, format);
+    vsnprintf(big.data(), big.size(), format, args);
+    va_end(args);
+    write_output(big.data(), size_t(size));
+}
+
+bool executor::translate(const std::string& path) {
+    // the cache has (or keeps) the analysis
+    code_analysis analysis;
+    if (!m_machine->cache) {
+        analysis.analyze(m_sections);
+    }
+
+    translator generator(m_sections, m_machine->cache ? m_machine->cache->analysis(m_sections) : analysis, m_program, translation_cache::key(m_sections, m_machine->big_endian),
+        m_machine->big_endian);
+    if (!generator.write(path)) {
+        return false;
+    }
+
+    printf("Translated %s to %s\n", generator.summary().c_str(), path.c_str());
+    return true;
+}
+
+void executor::run_hart() {
+    // the loop only leaves the tight stepping loop when execution stops (breakpoint, BREAK) or finishes
+    bool keep_running = !(m_gdb || m_debugger.enabled()) || handle_stop();
+    while (keep_running) {
+        step_result result;
+        do {
+            result = step();
+        } while (result == step_result::running);
+
+        keep_running = result == step_result::stopped && handle_stop();
+    }
+    m_unmaps_seen.store(std::numeric_limits<uint64_t>::max(), std::memory_order_release); // done with guest memory for good
+}
+
+void executor::save_context(uint32_t resume_pc) {
+    m_thread->regs = m_regs;
+    m_thread->regs.pc = resume_pc;
+    m_thread->frames = std::move(m_syscall_frames);
+    m_thread->kernelmode = m_kernelmode;
+}
+
+void executor::load_context(guest_thread* thread) {
+    m_thread = thread;
+    m_regs = thread->regs;
+    m_regs.ebase = m_hart_id; // threads migrate between harts
+    m_syscall_frames = std::move(thread->frames);
+    m_kernelmode = thread->kernelmode;
+    m_ll_valid = false;
+}
+
+// the current thread is saved (and possibly already picked up by another hart), continue with the next one
+void executor::switch_thread() {
+    guest_thread* next = m_machine->scheduler.next(m_hart_id);
+    if (!next) {
+        throw hart_idle();
+    }
+    load_context(next);
+}
+
+void executor::exit_thread(uint32_t value) {
+    guest_thread* joiner = m_machine->scheduler.exit_thread(m_thread, value);
+    m_thread = nullptr; // may already be gone
+    if (joiner) {
+        m_machine->scheduler.push(m_hart_id, joiner);
+    }
+    switch_thread();
+}
+
+void executor::halt_all(const std::string& reason, bool failed) {
+    if (m_machine->halted.exchange(true)) {
+        return; // another hart ended the program first
+    }
+
+    m_machine->exit_reason = m_machine->num_harts > 1 ? reason + " on hart " + std::to_string(m_hart_id) : reason;
+    m_machine->exit_code = m_exit_code;
+    m_machine->failed = failed;
+    m_machine->scheduler.halt(); // wakes up idle harts
+    for (executor* hart : m_machine->harts) {
+        if (hart != this) {
+            hart->request_stop();
+        }
+    }
+}
+
+// execution stopped, hand control to whoever is debugging
+bool executor::handle_stop() {
+    if (m_machine->halted) {
+        m_exit_reason = "halted";
+        return false;
+    }
+    // stopped for a checkpoint (see handle_events), it goes on right after
+    if (m_checkpoint && !m_debugger.enabled() && m_checkpoint->due(m_tick)) {
+        m_checkpoint->take(*this);
+        schedule_events();
+        return true;
+    }
+    return m_gdb ? m_gdb->on_stop() : m_debugger.interact();
+}
+
+step_result executor::step() {
+    std::string error;
+    bool stop = false;
+    bool translated = false;
     instruction inst(0x0);
 
-    while (true) {
-        bool error_state = false;
-        std::exception err;
+    try {
+        section* section = get_section_for_address(m_regs.pc);
+        if (!section || !(section->flags & EXECUTABLE) || (m_regs.pc & 0x3)) { // trying to execute invalid memory (Invalid address, not an executable section or address not 4-aligned)
+            throw std::runtime_error("Invalid PC, tried executing invalid, protected or non-aligned memory");
+        }
+        // get_section_for_address will not return a kernelmode address if we are currently in usermode, but we don't want to execute usermode .text from kernelmode either
+        if (m_kernelmode && section->address == m_sections[TEXT].address) {
+            throw std::runtime_error("Tried executing usermode memory from kernelmode");
+        }
 
-        try {
-            section* section = get_section_for_address(m_regs.pc);
-            if (!section || !(section->flags & EXECUTABLE) || (m_regs.pc & 0x3)) { // trying to execute invalid memory (Invalid address, not an executable section or address not 4-aligned)
-                throw std::runtime_error("Invalid PC, tried executing invalid, protected or non-aligned memory");
-            }
-            // get_section_for_address will not return a kernelmode address if we are currently in usermode, but we don't want to execute usermode .text from kernelmode either
-            if (m_kernelmode && section->address == m_sections[TEXT].address) {
-                throw std::runtime_error("Tried executing usermode memory from kernelmode");
-            }
+        // a translated runner executes whole basic blocks natively, unless something has to see every instruction
+        // (debugger breakpoints and single stepping, the keyboard interrupt which is polled per instruction)
+        aot_block_fn block = m_machine->translated.empty() || m_gdb || m_debugger.enabled() || (m_hart_id == 0 && m_machine->keyboard.interrupts_enabled()) ?
+            nullptr : m_machine->translated.lookup(m_regs.pc);
 
+        bool advanced;
+        if (block) {
+            translated = true;
+            advanced = block(*this); // leaves pc and m_tick at the block's last instruction
+        }
+        else {
             uint32_t offset = get_offset_for_section(section, m_regs.pc);
             // read next instruction to execute 
             inst = instruction(*reinterpret_cast<uint32_t*>(section->sect.data() + offset));
 
             // dispatch instruction now
-            if (dispatch(inst)) {
+            advanced = dispatch(inst);
+            if (advanced) {
                 m_regs.pc += 0x4; // next instruction - if dispatch returns false dont increase pc (eg. jump/ret instructions)
             }
-            m_regs.regs[0] = 0; // in case if someone wrote to $zero, make sure to reset it immediately
+        }
+
+        m_regs.regs[0] = 0; // in case if someone wrote to $zero, make sure to reset it immediately, before an event can raise an interrupt
+
+        if (!advanced && m_tick >= m_next_event.load(std::memory_order_relaxed)) {
+            // end of a basic block and an event is due (timer, stop request). Straight-line code never looks
+            stop = handle_events();
+        }
 
-            // check keyboard interrupt(s)
+        // check keyboard interrupt(s), the keyboard belongs to the boot hart
+        if (m_hart_id == 0) {
             keyboard_interrupt();
+        }
 
-            // check if we reached end of .text 
-            if (m_regs.pc == m_sections[TEXT].address + m_sections[TEXT].sect.size() || (m_sections[KTEXT].address && m_regs.pc == m_sections[KTEXT].address + m_sections[KTEXT].sect.size())) {
-                exit_reason = "dropped off bottom";
-                break; // exit graccefully
-            }
+        // check if we reached end of .text 
+        if (m_regs.pc == m_sections[TEXT].address + m_sections[TEXT].sect.size() || (m_sections[KTEXT].address && m_regs.pc == m_sections[KTEXT].address + m_sections[KTEXT].sect.size())) {
+            m_exit_reason = "dropped off bottom";
+            exit_thread(0); // like THREAD_EXIT, continues with the next guest thread if there is one
         }
-        catch (const mips_exception_exit& e) { // EXIT syscall
-            exit_reason = std::string(e.what());
-            break;
+    }
+    catch (const debugger_break&) { // breakpoint planted by the debugger, the instruction was not executed
+        return step_result::stopped;
+    }
+    catch (const hart_idle&) { // every guest thread finished (exit gracefully), or the rest are blocked forever
+        if (m_machine->scheduler.deadlocked()) {
+            m_exit_reason = "deadlock, every guest thread is blocked";
+            halt_all(m_exit_reason, true);
         }
-        catch (const mips_exception& e) { // generic exception that a exception handler could handle
-            if (m_has_exception_handler && !m_kernelmode) {
-                if (e.invalid_memory_address()) {
-                    m_regs.vaddr = e.get_vaddr(); // set vaddr to invalid address if the exception was an invalid memory address
-                }
+        return step_result::finished;
+    }
+    catch (const mips_exception_exit& e) { // EXIT syscall
+        m_exit_reason = std::string(e.what());
+        halt_all(m_exit_reason);
+        return step_result::finished;
+    }
+    catch (const mips_exception& e) { // generic exception that a exception handler could handle
+        if (m_has_exception_handler && !m_kernelmode) {
+            m_stats.count_exception(e.exception_type()); // only exceptions the handler gets are counted as taken
+            if (e.invalid_memory_address()) {
+                m_regs.vaddr = e.get_vaddr(); // set vaddr to invalid address if the exception was an invalid memory address
+            }
 
-                m_regs.status = (1 << 1); // bit 1 is set
-                m_regs.cause = e.exception_type() << 2; // bits 2-6 of cause is exception type. bit 8 is pending interrupt. Shift left by 2 to make it the correct bits.
-                m_regs.epc = m_regs.pc; // save pc of instruction which caused exception
+            m_regs.status = (1 << 1); // bit 1 is set
+            m_regs.cause = (m_regs.cause & CAUSE_IP_TIMER) | (e.exception_type() << 2); // bits 2-6 of cause is exception type. bit 8 is pending interrupt. Shift left by 2 to make it the correct bits.
+            m_regs.epc = m_regs.pc; // save pc of instruction which caused exception
 
-                m_kernelmode = true; // enter kernelmode
-                m_regs.pc = EXCEPTION_HANDLER;
-            }
-            else {
-                err = e;
-                error_state = true;
-            }
+            m_kernelmode = true; // enter kernelmode
+            m_regs.pc = EXCEPTION_HANDLER;
+        }
+        else if (e.exception_type() == BREAKPOINT_EXCEPTION && m_machine->num_harts == 1 && (m_gdb || m_debugger.enabled())) {
+            // nothing handles the BREAK, drop into the debugger that is already attached instead of terminating
+            m_debugger.on_guest_break();
+            return step_result::stopped;
         }
-        catch (const std::exception& e) {
-            err = e;
-            error_state = true;          
+        else {
+            error = e.what();
         }
+    }
+    catch (const output_rejected& e) { // the test runner saw wrong output, no point in going on
+        m_exit_reason = e.what();
+        halt_all(m_exit_reason, true);
+        return step_result::finished;
+    }
+    catch (const std::exception& e) {
+        error = e.what();
+    }
+
+    if (!error.empty() && m_machine->quiet) {
+        m_exit_reason = "error occured during execution: " + error;
+        halt_all(m_exit_reason, true);
+        return step_result::finished;
+    }
+    if (!error.empty()) {
+        section* section = translated ? get_section_for_address(m_regs.pc) : nullptr;
+        if (section && (section->flags & EXECUTABLE)) {
+            inst = instruction(*reinterpret_cast<uint32_t*>(section->sect.data() + get_offset_for_section(section, m_regs.pc))); // the block left pc at the failing instruction
+        }
+
+        printf("Error: %s\n", error.c_str());
+        printf("Error on instruction %02X (0x%08X) with PC: 0x%08X\n", inst.r.opcode, inst.hex, m_regs.pc);
+        m_exit_reason = "error occured during execution";
+        halt_all(m_exit_reason, true);
+        return step_result::finished;
+    }
+
+    m_tick++;
+    return stop ? step_result::stopped : step_result::running;
+}
+
+// at a block boundary once m_tick reached m_next_event. Returns true if execution should stop
+bool executor::handle_events() {
+    m_unmaps_seen.store(m_mapping_mgr.unmaps(), std::memory_order_release); // no guest memory is in use between blocks
+
+    if (m_tick >= m_timer_deadline) {
+        m_regs.cause |= CAUSE_IP_TIMER; // Count reached Compare
+        m_timer_deadline += uint64_t(1) << 32; // and will again once Count wrapped around
+    }
+
+    // a checkpoint is taken once the step finished (handle_stop), if it isn't due yet the next check moves on.
+    // A guest BREAK that brought up the debugger turns them off
+    bool checkpoint_due = m_checkpoint && !m_debugger.enabled() && m_checkpoint->due(m_tick);
+    schedule_events();
+
+    // asynchronous stop requests (gdb's ^C, another hart ending the program)
+    if (m_stop_request.load()) {
+        return true;
+    }
 
-        if (error_state) {
-            printf("Error: %s\n", err.what());
-            printf("Error on instruction %02X (0x%08X) with PC: 0x%08X\n", inst.r.opcode, inst.hex, m_regs.pc);
-            exit_reason = "error occured during execution";
-            break;
+    // the timer interrupt stays pending until Compare is written, it is taken as soon as we're in usermode
+    if ((m_regs.cause & CAUSE_IP_TIMER) && m_has_exception_handler && !m_kernelmode) {
+        throw mips_exception_interrupt("Timer interrupt");
+    }
+    return checkpoint_due;
+}
+
+void executor::release_unmapped_files() {
+    uint64_t seen = m_mapping_mgr.unmaps();
+    for (executor* hart : m_machine->harts) {
+        if (hart == this) {
+            continue; // in a syscall, not using any
+        }
+        uint64_t hart_seen = hart->m_unmaps_seen.load(std::memory_order_acquire);
+        if (hart_seen < seen) {
+            hart->m_next_event.store(0); // have it check in at its next block boundary, the next call can release them then
         }
+        seen = std::min(seen, hart_seen);
+    }
+    m_mapping_mgr.release_unmapped(seen);
+}
 
-        m_tick++;
+void executor::schedule_events() {
+    // while an interrupt is pending every block boundary checks whether it can be taken yet
+    bool pending = (m_regs.cause & CAUSE_IP_TIMER) && m_has_exception_handler;
+    uint64_t next = m_timer_deadline;
+    if (m_checkpoint && !m_debugger.enabled()) {
+        next = std::min(next, m_checkpoint->next_check());
     }
+    m_next_event.store(pending ? 0 : next);
 
-    printf("\n===========================================\nFinished executing (%s)\n", exit_reason.c_str());
+    // a stop request racing with the store above must not get lost
+    if (m_stop_request.load()) {
+        m_next_event.store(0);
+    }
+}
+
+uint32_t executor::read_count() {
+    return uint32_t(m_tick) + m_count_offset;
+}
+
+void executor::write_count(uint32_t value) {
+    m_count_offset = value - uint32_t(m_tick);
+    if (m_timer_deadline != NO_EVENT) {
+        arm_timer();
+    }
+}
+
+void executor::write_compare(uint32_t value) {
+    m_compare = value;
+    m_regs.cause &= ~CAUSE_IP_TIMER; // acknowledges the timer interrupt
+    arm_timer();
+}
+
+void executor::arm_timer() {
+    // Count matches Compare again after this many instructions (a full wrap around if they're equal right now)
+    uint64_t delta = uint32_t(m_compare - read_count());
+    m_timer_deadline = m_tick + (delta ? delta : uint64_t(1) << 32);
+    schedule_events();
 }
 
 void executor::keyboard_interrupt() {
-    bool controller = *reinterpret_cast<uint32_t*>(m_mmio.sect.data()) & 0x2; // check bit 1 for "Keyboard interrupt enable"
-    if (!controller) {
+    if (!m_machine->input->is_host_stdin()) {
+        return; // the keyboard is the host's stdin, a run with its own input has no keyboard
+    }
+
+    if (!m_machine->keyboard.interrupts_enabled()) {
         disable_conio_mode(); // if keyboard interrupts are disabled, disable conio mode (linux)
         return;
     }
@@ -195,13 +775,21 @@ void executor::keyboard_interrupt() {
         return;
     }
 
-    char c = getch_noblock(); // read a character from stdin stream
+    int c = EOF;
+    {
+        // read a character from stdin, which the READ_* syscalls on other harts share
+        std::lock_guard<std::mutex> lock(m_machine->input_mutex);
+        c = m_machine->input->poll_char();
+    }
     if (c == EOF) {
         return; // no character to read 
     }
 
-    // write the character into mmio reciever data
-    *reinterpret_cast<char*>(m_mmio.sect.data() + sizeof(uint32_t)) = c;
+    // write the character into the receiver data register
+    {
+        std::lock_guard<std::mutex> lock(m_devices.mutex());
+        m_machine->keyboard.receive(c);
+    }
 
     // Throw interrupt exception
     throw mips_exception_interrupt("Keyboard interrupt");
@@ -6,43 +6,196 @@
 #include "exceptions.h"
 #include "file_mgr.h"
 #include "random_mgr.h"
-#include "custom_syscall_mgr.h"
+#include "mapping_mgr.h"
+#include "syscall_table.h"
+#include "machine.h"
+#include "byte_order.h"
+#include "debugger.h"
+#include "gdb_stub.h"
+#include "options.h"
+#include "run_report.h"
+#include "checkpoint.h"
+
+constexpr uint32_t MAX_HARTS = 64;
 
 class executor {
 public:
-	executor(std::string file);
+	executor(const vm_options& options);
 	~executor() {}
 
 	void run();
+	// writes the program as C++ source for a native runner, see translator.h
+	bool translate(const std::string& path);
+
+	// how the last run() ended
+	const std::string& exit_reason() const { return m_exit_reason; }
+	bool failed() const { return m_machine->halted && m_machine->failed; }
+	uint64_t instructions() const { return m_machine->instructions; }
 	bool can_run() { return m_can_run; }
+
+	// thread safe, execution stops at the next jump or taken branch
+	void request_stop() {
+		m_stop_request.store(true);
+		m_next_event.store(0);
+	}
+	void clear_stop_request() {
+		m_stop_request.store(false);
+		schedule_events();
+	}
 private:
+	friend class debugger;
+	friend class gdb_stub;
+	friend class plugin_manager;
+	friend struct aot_runtime;
+	friend class checkpoint;
+	friend class lockstep;
+	friend class fuzz_target;
+
+	// secondary hart, shares the boot hart's machine
+	executor(std::shared_ptr<machine> shared, uint32_t hart_id);
+
+	void init_hart();
+	// registers the harts with the machine and gives each its first guest thread, returns the secondary harts for the caller to run
+	std::vector<std::unique_ptr<executor>> prepare_harts();
+	void run_hart();
+	void halt_all(const std::string& reason, bool failed = false);
+	void write_report(const std::string& reason, double wall_seconds);
+
+	step_result step();
+	bool handle_stop();
+
+	bool handle_events();
+	void schedule_events();
+	// releases unmapped files no other hart can still be using, and hurries the others to a block boundary otherwise
+	void release_unmapped_files();
+
+	uint32_t read_count();
+	void write_count(uint32_t value);
+	void write_compare(uint32_t value);
+	void arm_timer();
 
-	bool dispatch(instruction inst);
+	// runs one instruction, false if it set pc itself
+	bool dispatch(instruction inst) { return (this->*m_dispatch)(inst); }
+	template<class memory> bool dispatch_opcode(instruction inst); // memory is little_endian_memory or big_endian_memory
 	bool dispatch_funct(instruction inst);
 	bool dispatch_syscall();
 
+	// native syscall handlers, registered in the syscall table (syscalls.cpp)
+	void register_native_syscalls();
+	bool syscall_print_int(uint32_t a0, uint32_t a1, uint32_t a2);
+	bool syscall_print_float(uint32_t a0, uint32_t a1, uint32_t a2);
+	bool syscall_print_dbl(uint32_t a0, uint32_t a1, uint32_t a2);
+	bool syscall_print_string(uint32_t a0, uint32_t a1, uint32_t a2);
+	bool syscall_read_int(uint32_t a0, uint32_t a1, uint32_t a2);
+	bool syscall_read_float(uint32_t a0, uint32_t a1, uint32_t a2);
+	bool syscall_read_dbl(uint32_t a0, uint32_t a1, uint32_t a2);
+	bool syscall_read_string(uint32_t a0, uint32_t a1, uint32_t a2);
+	bool syscall_sbrk(uint32_t a0, uint32_t a1, uint32_t a2);
+	bool syscall_malloc(uint32_t a0, uint32_t a1, uint32_t a2);
+	bool syscall_free(uint32_t a0, uint32_t a1, uint32_t a2);
+	bool syscall_realloc(uint32_t a0, uint32_t a1, uint32_t a2);
+	bool syscall_calloc(uint32_t a0, uint32_t a1, uint32_t a2);
+	bool syscall_heap_stats(uint32_t a0, uint32_t a1, uint32_t a2);
+	bool syscall_exit(uint32_t a0, uint32_t a1, uint32_t a2);
+	bool syscall_print_char(uint32_t a0, uint32_t a1, uint32_t a2);
+	bool syscall_read_char(uint32_t a0, uint32_t a1, uint32_t a2);
+	bool syscall_open_file(uint32_t a0, uint32_t a1, uint32_t a2);
+	bool syscall_read_file(uint32_t a0, uint32_t a1, uint32_t a2);
+	bool syscall_write_file(uint32_t a0, uint32_t a1, uint32_t a2);
+	bool syscall_close_file(uint32_t a0, uint32_t a1, uint32_t a2);
+	bool syscall_exit2(uint32_t a0, uint32_t a1, uint32_t a2);
+	bool syscall_time(uint32_t a0, uint32_t a1, uint32_t a2);
+	bool syscall_mmap_file(uint32_t a0, uint32_t a1, uint32_t a2);
+	bool syscall_munmap(uint32_t a0, uint32_t a1, uint32_t a2);
+	bool syscall_sleep(uint32_t a0, uint32_t a1, uint32_t a2);
+	bool syscall_print_hex(uint32_t a0, uint32_t a1, uint32_t a2);
+	bool syscall_print_binary(uint32_t a0, uint32_t a1, uint32_t a2);
+	bool syscall_print_unsigned(uint32_t a0, uint32_t a1, uint32_t a2);
+	bool syscall_set_seed(uint32_t a0, uint32_t a1, uint32_t a2);
+	bool syscall_rand_int(uint32_t a0, uint32_t a1, uint32_t a2);
+	bool syscall_rand_int_range(uint32_t a0, uint32_t a1, uint32_t a2);
+	bool syscall_rand_float(uint32_t a0, uint32_t a1, uint32_t a2);
+	bool syscall_rand_dbl(uint32_t a0, uint32_t a1, uint32_t a2);
+	bool syscall_rand_fill(uint32_t a0, uint32_t a1, uint32_t a2);
+	bool syscall_register_syscall(uint32_t a0, uint32_t a1, uint32_t a2);
+	bool syscall_spawn(uint32_t a0, uint32_t a1, uint32_t a2);
+	bool syscall_join(uint32_t a0, uint32_t a1, uint32_t a2);
+	bool syscall_yield(uint32_t a0, uint32_t a1, uint32_t a2);
+	bool syscall_futex_wait(uint32_t a0, uint32_t a1, uint32_t a2);
+	bool syscall_futex_wake(uint32_t a0, uint32_t a1, uint32_t a2);
+	bool syscall_thread_exit(uint32_t a0, uint32_t a1, uint32_t a2);
+
+	void save_context(uint32_t resume_pc);
+	void load_context(guest_thread* thread);
+	void switch_thread();
+	void exit_thread(uint32_t value);
+
 	void keyboard_interrupt();
 
+	// guest console output, throws output_rejected if the sink doesn't take it
+	void write_output(const char* data, size_t size);
+	void print(const char* format, ...);
+
 	uint32_t get_offset_for_section(section* sect, uint32_t addr);
 	section* get_section_for_address(uint32_t addr, bool kernelmode_override = false);
 	bool is_safe_access(section* sect, uint32_t addr, uint32_t size);
+	// a 1, 2 or 4 byte value in guest memory the way a load sees it, for the debuggers
+	uint32_t read_guest(section* sect, uint32_t addr, uint32_t size);
 
-	registers m_regs;
+	// Guest memory the host reads or writes in place (syscalls, plugins). A buffer or string lies in one section, which is one
+	// block of host memory, so no page boundary inside it matters. Device registers and the host order code of a big-endian
+	// program aren't plain memory and can't be viewed.
+	// [addr, addr + size), nullptr if the guest can't access all of it (or write it, with `store`)
+	uint8_t* guest_memory(uint32_t addr, uint32_t size, bool store);
+	// the same for a syscall argument, raises the syscall's address error instead of returning nullptr
+	uint8_t* guest_buffer(uint32_t addr, uint32_t size, bool store, const char* syscall);
+	// the NUL terminated string at addr, the view ends before the NUL. Scanned once, up to the end of its section at most
+	std::string_view guest_string(uint32_t addr, const char* syscall);
 
-	std::array<section, NUM_SECTIONS> m_sections;
+	// shared by all harts
+	std::shared_ptr<machine> m_machine;
+	std::array<section, NUM_SECTIONS>& m_sections;
+	device_bus& m_devices;
+	heap& m_heap;
+	stack& m_stack;
+	syscall_table& m_syscalls;
+	random_mgr& m_random_mgr;
+	file_manager& m_file_mgr;
+	mapping_manager& m_mapping_mgr;
+	bool& m_has_exception_handler;
 
-	section m_mmio;
+	// owned by this hart
+	uint32_t m_hart_id;
+	guest_thread* m_thread; // guest thread currently running on this hart, its saved context is stale while it runs
+	registers m_regs;
+	syscall_frame_stack m_syscall_frames;
+	bool (executor::*m_dispatch)(instruction inst); // dispatch_opcode for the program's byte order
+
+	uint64_t m_tick;
+	run_stats m_stats;
 
-	heap m_heap;
-	stack m_stack;
+	// m_tick at which the next block boundary has to look at the timer and stop requests. Checking it is the only cost while nothing is pending
+	std::atomic<uint64_t> m_next_event;
+	std::atomic<uint64_t> m_unmaps_seen; // mapping_manager::unmaps() at the last block boundary that handled events
+	uint64_t m_timer_deadline; // m_tick at which Count reaches Compare, never while the timer is unarmed
+	uint32_t m_count_offset; // Count ($9) = m_tick + m_count_offset
+	uint32_t m_compare; // Compare ($11), writing it arms the timer
 
-	uint32_t m_tick;
+	// LL reservation, SC only succeeds while the reserved word still holds the value LL read
+	uint32_t m_ll_addr;
+	uint32_t m_ll_value;
+	bool m_ll_valid;
 
-	custom_syscall_mgr m_syscall_mgr;
-	random_mgr m_random_mgr;
-	file_manager m_file_mgr;
+	debugger m_debugger;
+	std::string m_exit_reason;
+	int32_t m_exit_code;
+	std::atomic<bool> m_stop_request;
+	std::string m_program;
+	std::string m_report_path;
+	std::unique_ptr<checkpoint> m_checkpoint; // with --checkpoint
 
-	bool m_has_exception_handler;
 	bool m_kernelmode;
 	bool m_can_run;
+
+	std::unique_ptr<gdb_stub> m_gdb; // declared last so the server thread is gone before anything it touches
 };
\ No newline at end of file
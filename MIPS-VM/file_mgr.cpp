@@ -1,113 +1,228 @@
 #include "pch.h"
 #include "file_mgr.h"
 
+// transfers of at least this size additionally hint the kernel to read ahead the next window of the file
+constexpr uint32_t LARGE_IO_SIZE = 1 << 20;
+
+#ifdef _WIN32
+static int sys_open(const char* file, int flags) { return _open(file, flags | _O_BINARY, _S_IREAD | _S_IWRITE); }
+static int sys_close(int fd) { return _close(fd); }
+static int64_t sys_read(int fd, uint8_t* buf, uint32_t count, int64_t offset) {
+	if (offset >= 0) {
+		_lseeki64(fd, offset, SEEK_SET);
+	}
+	return _read(fd, buf, count);
+}
+static int64_t sys_write(int fd, const uint8_t* buf, uint32_t count, int64_t offset) {
+	if (offset >= 0) {
+		_lseeki64(fd, offset, SEEK_SET);
+	}
+	return _write(fd, buf, count);
+}
+static bool sys_seekable(int fd) { return _lseeki64(fd, 0, SEEK_CUR) != -1; }
+static int64_t sys_size(int fd) { return _filelengthi64(fd); }
+static bool sys_truncate(int fd, int64_t size) { return _chsize_s(fd, size) == 0; }
+static void sys_advise_sequential(int fd) {}
+static void sys_advise_willneed(int fd, int64_t offset, uint32_t len) {}
+#else
+#include <sys/stat.h>
+
+static int sys_open(const char* file, int flags) { return open(file, flags | O_CLOEXEC, 0666); }
+static int sys_close(int fd) { return close(fd); }
+static int64_t sys_read(int fd, uint8_t* buf, uint32_t count, int64_t offset) {
+	int64_t res;
+	do {
+		res = offset >= 0 ? pread(fd, buf, count, offset) : read(fd, buf, count);
+	} while (res < 0 && errno == EINTR);
+	return res;
+}
+static int64_t sys_write(int fd, const uint8_t* buf, uint32_t count, int64_t offset) {
+	int64_t res;
+	do {
+		res = offset >= 0 ? pwrite(fd, buf, count, offset) : write(fd, buf, count);
+	} while (res < 0 && errno == EINTR);
+	return res;
+}
+static bool sys_seekable(int fd) { return lseek(fd, 0, SEEK_CUR) != -1; }
+static int64_t sys_size(int fd) {
+	struct stat st;
+	return fstat(fd, &st) == 0 && S_ISREG(st.st_mode) ? int64_t(st.st_size) : -1;
+}
+static bool sys_truncate(int fd, int64_t size) { return ftruncate(fd, off_t(size)) == 0; }
+#ifdef POSIX_FADV_SEQUENTIAL
+static void sys_advise_sequential(int fd) { posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL); }
+static void sys_advise_willneed(int fd, int64_t offset, uint32_t len) { posix_fadvise(fd, offset, len, POSIX_FADV_WILLNEED); }
+#else
+static void sys_advise_sequential(int fd) {}
+static void sys_advise_willneed(int fd, int64_t offset, uint32_t len) {}
+#endif
+#endif
 
 file_manager::~file_manager() {
 	for (auto& it : m_open_fds) {
-		fclose(it.second); // close all files we've opened
+		sys_close(it.second.fd); // close all files we've opened
 	}
 }
 
-FILE* file_manager::get_fd(int32_t handle) {
-	switch (handle) {
-	case 0:
-		return stdin;
-	case 1:
-		return stdout;
-	case 2:
-		return stderr;
-	}
-
+file_manager::file_handle* file_manager::get_file(int32_t handle) {
 	auto fd = m_open_fds.find(handle);
 	if (fd == m_open_fds.end()) {
-		return  (FILE*)-1; // return -1 if this fd does not correspond to file handle
+		return nullptr; // this fd does not correspond to file handle
 	}
 
-	return fd->second;
+	return &fd->second;
 }
 
-int32_t file_manager::open_file(std::string file, int32_t flags, int32_t mode) {
-	std::string file_mode;
+// host open flags for the guest's, -1 if they aren't valid. Opening a file again (resuming a checkpoint) doesn't truncate it
+static int host_flags(int32_t flags, bool reopen) {
 	switch (flags) {
 	case 0:
-	{
-		file_mode = "r";
-	}
-	break;
+		return O_RDONLY;
 	case 1:
-	{
-		file_mode = "w";
-	}
-	break;
+		return O_WRONLY | O_CREAT | (reopen ? 0 : O_TRUNC);
 	case 9:
-	{
-		file_mode = "a";
-	}
-	break;
+		return O_WRONLY | O_CREAT | O_APPEND;
 	default:
 		return -1;
 	}
+}
+
+int32_t file_manager::open_file(const char* file, int32_t flags, int32_t mode) {
+	int open_flags = host_flags(flags, false);
+	if (open_flags < 0) {
+		return -1;
+	}
 
-	FILE* f;
-#ifdef _MSC_VER
-	fopen_s(&f, file.c_str(), file_mode.c_str());
-#else
-	f = fopen(file.c_str(), file_mode.c_str());
-#endif
-	if (!f) {
+	int fd = sys_open(file, open_flags);
+	if (fd < 0) {
 		return -1;
 	}
 
-	int32_t fd = m_fd_num++;
-	m_open_fds[fd] = f;
+	file_handle f;
+	f.fd = fd;
+	f.offset = (flags != 9 && sys_seekable(fd)) ? 0 : -1;
+	f.flags = flags;
+	std::error_code error;
+	f.path = std::filesystem::absolute(file, error).string();
+	if (flags == 0) {
+		sys_advise_sequential(fd); // guest programs almost always read input files front to back
+	}
+
+	int32_t handle = m_fd_num++;
+	m_open_fds[handle] = f;
 
-	return fd;
+	return handle;
 }
 
 int32_t file_manager::read_file(int32_t handle, uint8_t* buf, uint32_t max_chars) {
-	FILE* f = get_fd(handle);
-	if (f == (FILE*)-1) {
+	file_handle* f = get_file(handle);
+	if (!f) {
 		return -1; // invalid fd
 	}
 
-	int32_t read_bytes;
-#ifdef _MSC_VER
-	read_bytes = (int32_t)fread_s(buf, max_chars, 1, max_chars, f);
-#else
-	read_bytes = (int32_t)fread(buf, 1, max_chars, f);
-#endif
-
-	if (read_bytes != max_chars) {
-		if (feof(f)) {
-			return 0; // indicate EOF
-		}
-		else {
+	// read straight into guest memory. A regular file can come up short on a signal, keep going until EOF. A pipe or fifo
+	// returns what the writer has sent so far, waiting for the rest could block forever, so the first data is returned
+	uint32_t read_bytes = 0;
+	while (read_bytes < max_chars) {
+		int64_t res = sys_read(f->fd, buf + read_bytes, max_chars - read_bytes, f->offset >= 0 ? f->offset + read_bytes : -1);
+		if (res < 0) {
+			if (read_bytes) {
+				break; // return what we have, the error shows up again on the next call
+			}
 			return -1; // indicate ERROR
 		}
+		if (res == 0) {
+			break; // EOF, return the bytes read so far (0 if there were none)
+		}
+		read_bytes += uint32_t(res);
+		if (f->offset < 0) {
+			break; // not seekable (pipe, fifo, terminal)
+		}
+	}
+
+	if (f->offset >= 0) {
+		if (max_chars >= LARGE_IO_SIZE && read_bytes == max_chars) {
+			sys_advise_willneed(f->fd, f->offset + read_bytes, max_chars); // start fetching the next chunk while the guest works on this one
+		}
+		f->offset += read_bytes;
 	}
 
-	return read_bytes;
+	return int32_t(read_bytes);
 }
 
-int32_t file_manager::write_file(int32_t handle, uint8_t* buf, uint32_t max_chars) {
-	FILE* f = get_fd(handle);
-	if (f == (FILE*)-1) {
+int32_t file_manager::write_file(int32_t handle, const uint8_t* buf, uint32_t max_chars) {
+	file_handle std_file;
+	file_handle* f = nullptr;
+	if (handle == 1 || handle == 2) {
+		fflush(stdout); // PRINT_* syscalls go through stdio, flush it so output stays in order
+		std_file.fd = handle;
+		std_file.offset = -1;
+		f = &std_file;
+	}
+	else if (!(f = get_file(handle))) {
 		return -1; // invalid fd
 	}
 
-	int32_t written = (int32_t)fwrite(buf, 1, max_chars, f);
-	if (written != max_chars) {
-		return -1; // indicate ERROR
+	uint32_t written = 0;
+	while (written < max_chars) {
+		int64_t res = sys_write(f->fd, buf + written, max_chars - written, f->offset >= 0 ? f->offset + written : -1);
+		if (res <= 0) {
+			if (written == 0) {
+				return -1; // indicate ERROR
+			}
+			break; // like write(2), report what made it out, the error shows up on the next call
+		}
+		written += uint32_t(res);
+	}
 
+	if (f->offset >= 0) {
+		f->offset += written;
 	}
 
-	return written;
+	return int32_t(written);
 }
 
 void file_manager::close_file(int32_t handle) {
 	auto it = m_open_fds.find(handle);
 	if (it != m_open_fds.end()) {
-		fclose(it->second); // close handle
+		sys_close(it->second.fd); // close handle
 		m_open_fds.erase(it); // erase from hashmap
 	}
+}
+
+void file_manager::save(snapshot_writer& out) {
+	out.put(m_fd_num);
+	out.put(uint32_t(m_open_fds.size()));
+	for (auto& it : m_open_fds) {
+		const file_handle& f = it.second;
+		out.put(it.first);
+		out.put(f.flags);
+		out.put_string(f.path);
+		out.put(f.offset);
+		out.put(f.flags ? sys_size(f.fd) : int64_t(-1)); // what has been written so far
+	}
+}
+
+void file_manager::restore(snapshot_reader& in) {
+	m_fd_num = in.get<int32_t>();
+	for (uint32_t n = in.get<uint32_t>(); n; n--) {
+		int32_t handle = in.get<int32_t>();
+		file_handle f;
+		f.flags = in.get<int32_t>();
+		f.path = in.get_string();
+		f.offset = in.get<int64_t>();
+		int64_t size = in.get<int64_t>();
+
+		int open_flags = host_flags(f.flags, true);
+		f.fd = open_flags < 0 ? -1 : sys_open(f.path.c_str(), open_flags);
+		if (f.fd < 0) {
+			throw std::runtime_error("can't open '" + f.path + "' again");
+		}
+		m_open_fds[handle] = f;
+
+		// the run that wrote the checkpoint may have written more before it ended, that gets written again
+		if (size >= 0 && !sys_truncate(f.fd, size)) {
+			throw std::runtime_error("can't truncate '" + f.path + "' to where it was");
+		}
+	}
 }
\ No newline at end of file
@@ -1,18 +1,30 @@
 #pragma once
 #include "pch.h"
+#include "snapshot.h"
 
 class file_manager {
 public:
 	file_manager(): m_fd_num(3) {}
 	~file_manager();
 
-	int32_t open_file(std::string file, int32_t flags, int32_t mode);
+	int32_t open_file(const char* file, int32_t flags, int32_t mode);
 	int32_t read_file(int32_t handle, uint8_t* buf, uint32_t max_chars);
-	int32_t write_file(int32_t handle, uint8_t* buf, uint32_t max_chars);
+	int32_t write_file(int32_t handle, const uint8_t* buf, uint32_t max_chars);
 	void close_file(int32_t handle);
+
+	// the open files by path and position, restoring opens them again (see checkpoint.h)
+	void save(snapshot_writer& out);
+	void restore(snapshot_reader& in);
 private:
-	FILE* get_fd(int32_t handle);
+	struct file_handle {
+		int fd;
+		int64_t offset; // file position for positional I/O, -1 if the file is not seekable (pipes, fifos) or opened for append
+		int32_t flags; // as the guest opened it
+		std::string path; // absolute
+	};
+
+	file_handle* get_file(int32_t handle);
 
-	std::unordered_map<int32_t, FILE*> m_open_fds;
+	std::unordered_map<int32_t, file_handle> m_open_fds;
 	int32_t m_fd_num;
 };
\ No newline at end of file
@@ -0,0 +1,176 @@
+#include "pch.h"
+#include "fuzz.h"
+#include "executor.h"
+#include "byte_order.h"
+
+constexpr uint32_t TEXT_ADDRESS = 0x00400000;
+constexpr uint32_t DATA_ADDRESS = 0x10010000;
+
+constexpr uint8_t FLAG_BIG_ENDIAN = 0x1;
+constexpr uint8_t FLAG_NO_HANDLER = 0x2;
+
+// goes on after the faulting instruction: mfc0 $k0, $14; addiu $k0, $k0, 4; mtc0 $k0, $14; eret
+static const uint32_t exception_handler[] = { 0x401A7000, 0x275A0004, 0x409A7000, 0x42000018 };
+
+class discarding_sink : public output_sink {
+public:
+	bool write(const char* data, size_t size) override { return true; }
+};
+
+static uint16_t read_u16(const uint8_t* data) {
+	return uint16_t(data[0] | (data[1] << 8));
+}
+
+// section file: the address, then the data, both in the image's byte order
+static void make_section(std::vector<uint8_t>& out, uint32_t address, const uint8_t* data, size_t size, bool big_endian) {
+	if (big_endian) {
+		address = swap_bytes(address);
+	}
+	out.resize(sizeof(address) + size);
+	memcpy(out.data(), &address, sizeof(address));
+	memcpy(out.data() + sizeof(address), data, size);
+}
+
+fuzz_target::fuzz_target(uint64_t budget) : m_budget(budget), m_output(std::make_unique<discarding_sink>()) {
+	// small enough that a program can't make the host run out of memory, the stack and heap are zeroed between inputs
+	memory_layout& layout = m_options.layout;
+	layout.stack_size = 0x10000;
+	layout.heap_size = 0x100000;
+	layout.memory_limit = 0x400000;
+	recycle_guest_memory(true);
+
+	m_options.quiet = true;
+	m_options.interpret = true;
+	m_options.output = m_output.get();
+	m_options.input = &m_input;
+
+	std::error_code error;
+	std::filesystem::path sandbox = std::filesystem::temp_directory_path(error) / ("mips_vm_fuzz_" + std::to_string(std::random_device()()));
+	std::filesystem::create_directories(sandbox, error);
+	m_options.sandbox = sandbox.string();
+}
+
+fuzz_target::~fuzz_target() {
+	std::error_code error;
+	std::filesystem::remove_all(m_options.sandbox, error);
+	recycle_guest_memory(false);
+}
+
+uint64_t fuzz_target::run(const uint8_t* data, size_t size) {
+	m_exit_reason.clear();
+	if (size < 3 + sizeof(uint32_t)) {
+		return 0; // not even one instruction
+	}
+
+	uint8_t flags = data[0];
+	bool big_endian = flags & FLAG_BIG_ENDIAN;
+	size_t text_size = std::max<size_t>(std::min<size_t>(read_u16(data + 1), (size - 3) / sizeof(uint32_t)), 1) * sizeof(uint32_t);
+	const uint8_t* pos = data + 3;
+	const uint8_t* end = data + size;
+
+	// a translated runner's program without blocks, the sections come from memory and are interpreted
+	aot_program program = aot_program();
+	program.big_endian = big_endian;
+	auto add_section = [&](int index, uint32_t address, const uint8_t* bytes, size_t length) {
+		make_section(m_sections[index], address, bytes, length, big_endian);
+		program.sections[index] = m_sections[index].data();
+		program.section_sizes[index] = uint32_t(m_sections[index].size());
+	};
+
+	add_section(TEXT, TEXT_ADDRESS, pos, text_size);
+	pos += text_size;
+	if (end - pos >= 2) {
+		size_t data_size = std::min<size_t>(read_u16(pos), end - pos - 2);
+		pos += 2;
+		if (data_size) {
+			add_section(DATA, DATA_ADDRESS, pos, data_size);
+			pos += data_size;
+		}
+	}
+	if (!(flags & FLAG_NO_HANDLER)) {
+		uint32_t handler[sizeof(exception_handler) / sizeof(uint32_t)];
+		for (size_t i = 0; i < sizeof(handler) / sizeof(uint32_t); i++) {
+			handler[i] = big_endian ? swap_bytes(exception_handler[i]) : exception_handler[i];
+		}
+		add_section(KTEXT, EXCEPTION_HANDLER, reinterpret_cast<const uint8_t*>(handler), sizeof(handler));
+	}
+	m_input.assign(reinterpret_cast<const char*>(pos), end - pos);
+
+	m_options.translated = &program;
+	executor hart(m_options);
+	m_options.translated = nullptr;
+	if (!hart.can_run()) {
+		m_exit_reason = "the program can't run";
+		return 0;
+	}
+
+	machine& vm = *hart.m_machine;
+	vm.rng.seed(0);
+	hart.prepare_harts(); // a single hart, the options never ask for more
+
+	while (hart.m_tick < m_budget && hart.step() == step_result::running) {
+	}
+	m_exit_reason = hart.m_exit_reason;
+
+	// the next input starts out with an empty scratch directory
+	if (hart.m_stats.syscalls[uint32_t(syscalls::OPEN_FILE)]) {
+		std::error_code error;
+		for (const auto& entry : std::filesystem::directory_iterator(m_options.sandbox, error)) {
+			std::filesystem::remove_all(entry.path(), error);
+		}
+	}
+	return hart.m_tick;
+}
+
+bool replay_fuzz_inputs(const std::string& path) {
+	std::vector<std::filesystem::path> files;
+	std::error_code error;
+	if (std::filesystem::is_directory(path, error)) {
+		for (const auto& entry : std::filesystem::directory_iterator(path, error)) {
+			if (entry.is_regular_file(error)) {
+				files.push_back(entry.path());
+			}
+		}
+		std::sort(files.begin(), files.end());
+	}
+	else {
+		files.push_back(path);
+	}
+
+	std::vector<std::string> inputs;
+	for (const auto& file : files) {
+		std::ifstream in(file, std::ios::binary);
+		if (!in.is_open()) {
+			printf("Failed to open fuzz input '%s'\n", file.string().c_str());
+			return false;
+		}
+		inputs.emplace_back(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+	}
+	if (inputs.empty()) {
+		printf("No fuzz inputs in '%s'\n", path.c_str());
+		return false;
+	}
+
+	fuzz_target target(FUZZ_BUDGET);
+	uint64_t instructions = 0;
+	double seconds = 0;
+	for (size_t i = 0; i < inputs.size(); i++) {
+		auto start = std::chrono::steady_clock::now();
+		uint64_t executed = target.run(reinterpret_cast<const uint8_t*>(inputs[i].data()), inputs[i].size());
+		seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		instructions += executed;
+
+		const std::string& reason = target.exit_reason();
+		printf("%s: %llu instructions, %s\n", files[i].string().c_str(), (unsigned long long)executed, reason.empty() ? "out of budget" : reason.c_str());
+	}
+	printf("Ran %zu inputs (%llu instructions) in %.3f s, %.0f per second\n", inputs.size(), (unsigned long long)instructions, seconds, inputs.size() / std::max(seconds, 1e-9));
+	return true;
+}
+
+#ifdef MIPS_VM_FUZZ
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+	static fuzz_target target(FUZZ_BUDGET);
+	target.run(data, size);
+	return 0;
+}
+#endif
\ No newline at end of file
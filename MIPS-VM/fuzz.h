@@ -0,0 +1,44 @@
+#pragma once
+#include "pch.h"
+#include "options.h"
+
+constexpr uint64_t FUZZ_BUDGET = 1 << 14; // instructions an input may run, for LLVMFuzzerTestOneInput and --fuzz
+
+// In-process fuzzing of everything a guest program can reach: the instruction decoder, the syscalls and their argument
+// checks, and the host resources behind them (files, mappings, the heap allocator). Every input is a program that runs on
+// a fresh machine for at most `budget` instructions. The machines get a small memory layout whose stack and heap
+// reservations are recycled (recycle_guest_memory), so setting one up only zeroes the pages the last input dirtied.
+//
+// An input is laid out as
+//   byte 0        flags: bit 0 the program is big-endian, bit 1 it has no exception handler
+//   bytes 1-2     number of .text words (little-endian), cut down to what the input holds
+//   .text         at 0x00400000, at least one word
+//   bytes 0-1     number of .data bytes (little-endian), cut down to what is left
+//   .data         at 0x10010000
+//   the rest      the program's stdin
+// Unless bit 1 is set the .ktext exception handler skips the faulting instruction, so programs keep going after an
+// exception. Output is discarded, files the program opens or maps have to be in a scratch directory that is emptied
+// after every input that opened one, SLEEP doesn't wait and random streams are seeded the same way every time.
+//
+// Built with MIPS_VM_FUZZ the VM has no main and exports LLVMFuzzerTestOneInput for libFuzzer style drivers, without it
+// `--fuzz` replays inputs.
+class fuzz_target {
+public:
+	fuzz_target(uint64_t budget);
+	~fuzz_target();
+
+	// instructions the input's program executed, it ended with exit_reason() unless it ran out of budget
+	uint64_t run(const uint8_t* data, size_t size);
+	const std::string& exit_reason() const { return m_exit_reason; }
+
+private:
+	uint64_t m_budget;
+	vm_options m_options;
+	std::unique_ptr<output_sink> m_output;
+	std::string m_input;
+	std::vector<uint8_t> m_sections[NUM_SECTIONS]; // section files, address followed by the data
+	std::string m_exit_reason;
+};
+
+// --fuzz: runs a file, or every file in a directory, as fuzz inputs and prints how each ended. False if there was none
+bool replay_fuzz_inputs(const std::string& path);
\ No newline at end of file
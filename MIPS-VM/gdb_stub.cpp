@@ -0,0 +1,638 @@
+#include "pch.h"
+#include "gdb_stub.h"
+#include "executor.h"
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#endif
+
+// gdb's register numbering for 32-bit MIPS: 0-31 GPRs, sr, lo, hi, bad, cause, pc, f0-f31, fcsr, fir
+constexpr uint32_t GDB_REG_STATUS = 32;
+constexpr uint32_t GDB_REG_LO = 33;
+constexpr uint32_t GDB_REG_HI = 34;
+constexpr uint32_t GDB_REG_BADVADDR = 35;
+constexpr uint32_t GDB_REG_CAUSE = 36;
+constexpr uint32_t GDB_REG_PC = 37;
+constexpr uint32_t GDB_REG_F0 = 38;
+constexpr uint32_t GDB_REG_FCSR = 70;
+constexpr uint32_t GDB_REG_FIR = 71;
+constexpr uint32_t GDB_NUM_REGS = 72;
+
+// largest packet gdb may send or expect back, advertised in qSupported (in hex there)
+constexpr uint32_t GDB_PACKET_SIZE = 0x4000;
+
+constexpr int GDB_SIGINT = 2;
+constexpr int GDB_SIGTRAP = 5;
+
+static const char hex_digits[] = "0123456789abcdef";
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static std::string to_hex(const uint8_t* data, size_t len) {
+    std::string out;
+    out.reserve(len * 2);
+    for (size_t i = 0; i < len; i++) {
+        out += hex_digits[data[i] >> 4];
+        out += hex_digits[data[i] & 0xF];
+    }
+    return out;
+}
+
+static bool from_hex(const std::string& str, size_t pos, size_t len, uint8_t* out) {
+    if (pos + len * 2 > str.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < len; i++) {
+        int hi = hex_value(str[pos + i * 2]), lo = hex_value(str[pos + i * 2 + 1]);
+        if (hi < 0 || lo < 0) {
+            return false;
+        }
+        out[i] = uint8_t((hi << 4) | lo);
+    }
+    return true;
+}
+
+// register values are sent in target byte order, see gdb_stub::target_order
+static std::string reg_to_hex(uint32_t val) {
+    return to_hex(reinterpret_cast<const uint8_t*>(&val), sizeof(uint32_t));
+}
+
+gdb_stub::gdb_stub(executor& vm) : m_vm(vm), m_shutdown(false), m_listen_fd(-1), m_client_fd(-1), m_wake_pipe{ -1, -1 }, m_stopped(false), m_interrupted(false), m_reply_pending(false), m_action(resume_action::none) {}
+
+uint32_t gdb_stub::read_register(uint32_t index, bool& valid) {
+    registers& regs = m_vm.m_regs;
+    valid = true;
+
+    if (index < 32) {
+        return regs.regs[index];
+    }
+    if (index >= GDB_REG_F0 && index < GDB_REG_F0 + 32) {
+        uint32_t bits;
+        memcpy(&bits, &regs.f[index - GDB_REG_F0], sizeof(uint32_t));
+        return bits;
+    }
+
+    switch (index) {
+    case GDB_REG_STATUS: return regs.status;
+    case GDB_REG_LO: return regs.lo;
+    case GDB_REG_HI: return regs.hi;
+    case GDB_REG_BADVADDR: return regs.vaddr;
+    case GDB_REG_CAUSE: return regs.cause;
+    case GDB_REG_PC: return regs.pc;
+    case GDB_REG_FCSR:
+    case GDB_REG_FIR:
+        return 0; // no FPU control registers yet
+    }
+
+    valid = false;
+    return 0;
+}
+
+bool gdb_stub::write_register(uint32_t index, uint32_t value) {
+    registers& regs = m_vm.m_regs;
+
+    if (index < 32) {
+        regs.regs[index] = index ? value : 0;
+        return true;
+    }
+    if (index >= GDB_REG_F0 && index < GDB_REG_F0 + 32) {
+        memcpy(&regs.f[index - GDB_REG_F0], &value, sizeof(uint32_t));
+        return true;
+    }
+
+    switch (index) {
+    case GDB_REG_STATUS: regs.status = value; return true;
+    case GDB_REG_LO: regs.lo = value; return true;
+    case GDB_REG_HI: regs.hi = value; return true;
+    case GDB_REG_BADVADDR: regs.vaddr = value; return true;
+    case GDB_REG_CAUSE: regs.cause = value; return true;
+    case GDB_REG_PC: regs.pc = value; return true;
+    case GDB_REG_FCSR:
+    case GDB_REG_FIR:
+        return true;
+    }
+
+    return false;
+}
+
+std::string gdb_stub::read_registers() {
+    std::string out;
+    for (uint32_t i = 0; i < GDB_NUM_REGS; i++) {
+        bool valid = false;
+        uint32_t val = read_register(i, valid);
+        out += valid ? reg_to_hex(target_order(val)) : "xxxxxxxx";
+    }
+    return out;
+}
+
+uint32_t gdb_stub::target_order(uint32_t val) {
+    return m_vm.m_machine->big_endian ? swap_bytes(val) : val;
+}
+
+uint32_t gdb_stub::code_byte(section* sect, uint32_t addr) {
+    // instructions of a big-endian program are kept in host order, see byte_order.h
+    bool swapped = m_vm.m_machine->big_endian && (sect->flags & EXECUTABLE);
+    return swapped ? (addr & 0x3) ^ 0x3 : addr & 0x3;
+}
+
+bool gdb_stub::read_memory(uint32_t addr, uint8_t& out) {
+    section* sect = m_vm.get_section_for_address(addr, true);
+    if (!sect || !m_vm.is_safe_access(sect, addr, 1)) {
+        return false;
+    }
+    uint32_t byte = code_byte(sect, addr);
+    out = sect->sect.data()[m_vm.get_offset_for_section(sect, addr & ~0x3u) + byte];
+
+    // hide our breakpoint traps, gdb expects to see the original code
+    auto bp = m_vm.m_debugger.m_breakpoints.find(addr & ~0x3u);
+    if (bp != m_vm.m_debugger.m_breakpoints.end()) {
+        out = uint8_t(bp->second >> (byte * 8));
+    }
+    return true;
+}
+
+bool gdb_stub::write_memory(uint32_t addr, uint8_t val) {
+    section* sect = m_vm.get_section_for_address(addr, true);
+    if (!sect || !m_vm.is_safe_access(sect, addr, 1)) {
+        return false;
+    }
+
+    // writes into a word holding one of our traps go to the saved original instruction
+    uint32_t byte = code_byte(sect, addr);
+    auto bp = m_vm.m_debugger.m_breakpoints.find(addr & ~0x3u);
+    if (bp != m_vm.m_debugger.m_breakpoints.end()) {
+        uint32_t shift = byte * 8;
+        bp->second = (bp->second & ~(0xFFu << shift)) | (uint32_t(val) << shift);
+        return true;
+    }
+
+    sect->sect.data()[m_vm.get_offset_for_section(sect, addr & ~0x3u) + byte] = val;
+    return true;
+}
+
+#ifndef _WIN32
+
+gdb_stub::~gdb_stub() {
+    m_shutdown = true;
+
+    if (m_thread.joinable()) {
+        char wake = 0;
+        while (write(m_wake_pipe[1], &wake, 1) < 0 && errno == EINTR) {} // wakes the server thread out of poll
+        m_thread.join();
+    }
+
+    for (int fd : { m_listen_fd, m_wake_pipe[0], m_wake_pipe[1] }) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    if (!m_unix_path.empty()) {
+        unlink(m_unix_path.c_str());
+    }
+}
+
+bool gdb_stub::listen(const std::string& address) {
+    if (address.compare(0, 5, "unix:") == 0) {
+        m_unix_path = address.substr(5);
+
+        sockaddr_un addr = {};
+        if (m_unix_path.empty() || m_unix_path.size() >= sizeof(addr.sun_path)) {
+            printf("Invalid gdb socket path '%s'\n", m_unix_path.c_str());
+            return false;
+        }
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, m_unix_path.c_str());
+        unlink(m_unix_path.c_str());
+
+        m_listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (m_listen_fd < 0 || bind(m_listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+            printf("Could not bind gdb socket '%s': %s\n", m_unix_path.c_str(), strerror(errno));
+            m_unix_path.clear();
+            return false;
+        }
+    }
+    else {
+        // "port" or "host:port", local only by default
+        std::string host = "127.0.0.1";
+        std::string port = address;
+        size_t colon = address.rfind(':');
+        if (colon != std::string::npos) {
+            host = address.substr(0, colon);
+            port = address.substr(colon + 1);
+        }
+
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(uint16_t(strtoul(port.c_str(), nullptr, 10)));
+        if (inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1 || !addr.sin_port) {
+            printf("Invalid gdb address '%s'\n", address.c_str());
+            return false;
+        }
+
+        m_listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int one = 1;
+        setsockopt(m_listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (m_listen_fd < 0 || bind(m_listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+            printf("Could not bind gdb socket '%s': %s\n", address.c_str(), strerror(errno));
+            return false;
+        }
+    }
+
+    if (::listen(m_listen_fd, 1) != 0) {
+        printf("Could not listen on gdb socket '%s': %s\n", address.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (pipe(m_wake_pipe) != 0) {
+        printf("Could not create gdb wake pipe: %s\n", strerror(errno));
+        return false;
+    }
+
+    printf("Waiting for GDB connection on %s\n", address.c_str());
+    m_thread = std::thread(&gdb_stub::serve, this);
+    return true;
+}
+
+void gdb_stub::send_raw(const std::string& data) {
+    size_t sent = 0;
+    while (m_client_fd >= 0 && sent < data.size()) {
+        ssize_t res = send(m_client_fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (res <= 0) {
+            if (res < 0 && errno == EINTR) {
+                continue;
+            }
+            return; // the server thread notices the dead connection on its next recv
+        }
+        sent += size_t(res);
+    }
+}
+
+// blocks until fd is readable, false once the stub is shutting down
+bool gdb_stub::wait_readable(int fd) {
+    pollfd fds[2] = { { fd, POLLIN, 0 }, { m_wake_pipe[0], POLLIN, 0 } };
+    while (!m_shutdown) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        if (fds[1].revents) {
+            return false;
+        }
+        if (fds[0].revents) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void gdb_stub::serve() {
+    while (wait_readable(m_listen_fd)) {
+        int fd = accept4(m_listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            return; // listening socket is broken, nothing more to serve
+        }
+
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); // fails harmlessly on Unix sockets
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_client_fd = fd;
+            m_reply_pending = false; // a fresh gdb starts by asking with '?'
+        }
+
+        std::string buf;
+        char chunk[4096];
+        while (wait_readable(fd)) {
+            ssize_t res = recv(fd, chunk, sizeof(chunk), 0);
+            if (res < 0 && errno == EINTR) {
+                continue;
+            }
+            if (res <= 0) {
+                break;
+            }
+            buf.append(chunk, size_t(res));
+
+            size_t pos = 0;
+            while (pos < buf.size()) {
+                char c = buf[pos];
+                if (c == 0x03) { // ^C, out of band interrupt while the program runs
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    if (!m_stopped) {
+                        m_interrupted = true;
+                        m_vm.request_stop();
+                    }
+                    pos++;
+                    continue;
+                }
+                if (c != '$') {
+                    pos++; // acks and noise
+                    continue;
+                }
+
+                size_t hash = buf.find('#', pos);
+                if (hash == std::string::npos || hash + 2 >= buf.size()) {
+                    break; // wait for the rest of the packet
+                }
+
+                std::string payload = buf.substr(pos + 1, hash - pos - 1);
+                uint8_t checksum = 0;
+                for (char p : payload) {
+                    checksum += uint8_t(p);
+                }
+                uint8_t expected = 0;
+                bool valid = from_hex(buf, hash + 1, 1, &expected) && expected == checksum;
+                pos = hash + 3;
+
+                std::lock_guard<std::mutex> lock(m_mutex);
+                send_raw(valid ? "+" : "-");
+                if (valid) {
+                    handle_packet(payload);
+                }
+            }
+            buf.erase(0, pos);
+        }
+
+        // gdb went away, let the program run on as if it had detached
+        std::lock_guard<std::mutex> lock(m_mutex);
+        close(fd);
+        m_client_fd = -1;
+        m_reply_pending = false;
+        if (m_stopped) {
+            m_action = resume_action::cont;
+            m_cv.notify_all();
+        }
+    }
+}
+
+#else
+
+gdb_stub::~gdb_stub() {}
+
+bool gdb_stub::listen(const std::string& address) {
+    printf("The GDB stub is not supported on Windows\n");
+    return false;
+}
+
+void gdb_stub::send_raw(const std::string& data) {}
+bool gdb_stub::wait_readable(int fd) { return false; }
+void gdb_stub::serve() {}
+
+#endif
+
+void gdb_stub::send_packet(const std::string& data) {
+    uint8_t checksum = 0;
+    for (char c : data) {
+        checksum += uint8_t(c);
+    }
+
+    std::string packet = "$" + data + "#";
+    packet += hex_digits[checksum >> 4];
+    packet += hex_digits[checksum & 0xF];
+    send_raw(packet);
+}
+
+void gdb_stub::send_stop_reply() {
+    char reply[8];
+    snprintf(reply, sizeof(reply), "S%02x", m_interrupted ? GDB_SIGINT : GDB_SIGTRAP);
+    send_packet(reply);
+}
+
+// runs on the server thread with m_mutex held
+void gdb_stub::handle_packet(const std::string& packet) {
+    if (packet.empty()) {
+        send_packet("");
+        return;
+    }
+
+    // everything but queries needs the interpreter parked, gdb doesn't send anything else while the program runs
+    if (!m_stopped && packet[0] != 'q') {
+        send_packet("E01");
+        return;
+    }
+
+    switch (packet[0]) {
+    case '?':
+        send_stop_reply();
+        return;
+    case 'g':
+        send_packet(read_registers());
+        return;
+    case 'G':
+    {
+        for (uint32_t i = 0; i < GDB_NUM_REGS && 1 + (i + 1) * 8 <= packet.size(); i++) {
+            uint32_t val = 0;
+            if (from_hex(packet, 1 + i * 8, sizeof(uint32_t), reinterpret_cast<uint8_t*>(&val))) {
+                write_register(i, target_order(val));
+            }
+        }
+        send_packet("OK");
+        return;
+    }
+    case 'p':
+    {
+        bool valid = false;
+        uint32_t val = read_register(uint32_t(strtoul(packet.c_str() + 1, nullptr, 16)), valid);
+        send_packet(valid ? reg_to_hex(target_order(val)) : "xxxxxxxx");
+        return;
+    }
+    case 'P':
+    {
+        size_t eq = packet.find('=');
+        uint32_t val = 0;
+        if (eq == std::string::npos || !from_hex(packet, eq + 1, sizeof(uint32_t), reinterpret_cast<uint8_t*>(&val)) ||
+            !write_register(uint32_t(strtoul(packet.c_str() + 1, nullptr, 16)), target_order(val))) {
+            send_packet("E01");
+            return;
+        }
+        send_packet("OK");
+        return;
+    }
+    case 'm':
+    {
+        char* end = nullptr;
+        uint32_t addr = uint32_t(strtoul(packet.c_str() + 1, &end, 16));
+        uint32_t len = (*end == ',') ? uint32_t(strtoul(end + 1, nullptr, 16)) : 0;
+        len = std::min(len, GDB_PACKET_SIZE / 2); // two hex digits per byte have to fit into the reply, gdb asks again for the rest
+
+        std::vector<uint8_t> data;
+        for (uint32_t i = 0; i < len; i++) {
+            uint8_t byte;
+            if (!read_memory(addr + i, byte)) {
+                break; // partial reads are fine, gdb asks again for the rest
+            }
+            data.push_back(byte);
+        }
+        send_packet(data.empty() && len ? "E14" : to_hex(data.data(), data.size()));
+        return;
+    }
+    case 'M':
+    {
+        char* end = nullptr;
+        uint32_t addr = uint32_t(strtoul(packet.c_str() + 1, &end, 16));
+        uint32_t len = (*end == ',') ? uint32_t(strtoul(end + 1, &end, 16)) : 0;
+        size_t data_pos = packet.find(':');
+
+        // the payload has two hex digits per byte, a length it can't hold is rejected before anything is allocated for it
+        if (data_pos == std::string::npos || len > (packet.size() - data_pos - 1) / 2) {
+            send_packet("E01");
+            return;
+        }
+        std::vector<uint8_t> data(len);
+        if (!from_hex(packet, data_pos + 1, len, data.data())) {
+            send_packet("E01");
+            return;
+        }
+        for (uint32_t i = 0; i < len; i++) {
+            if (!write_memory(addr + i, data[i])) {
+                send_packet("E14");
+                return;
+            }
+        }
+        send_packet("OK");
+        return;
+    }
+    case 'c':
+    case 's':
+    {
+        if (packet.size() > 1) {
+            m_vm.m_regs.pc = uint32_t(strtoul(packet.c_str() + 1, nullptr, 16)); // resume at address
+        }
+        m_action = packet[0] == 'c' ? resume_action::cont : resume_action::step;
+        m_cv.notify_all();
+        return; // the stop reply is sent once the program stops again
+    }
+    case 'Z':
+    case 'z':
+    {
+        // software (0) and hardware (1) breakpoints both become trap markers, watchpoints are left to gdb
+        if (packet.size() < 2 || (packet[1] != '0' && packet[1] != '1')) {
+            send_packet("");
+            return;
+        }
+        // Z0,addr,kind
+        char* end = nullptr;
+        uint32_t addr = packet.size() > 3 && packet[2] == ',' ? uint32_t(strtoul(packet.c_str() + 3, &end, 16)) : 0;
+        if (!end || end == packet.c_str() + 3) {
+            send_packet("E01");
+            return;
+        }
+        bool ok = packet[0] == 'Z' ? m_vm.m_debugger.set_breakpoint(addr) : (m_vm.m_debugger.remove_breakpoint(addr), true);
+        send_packet(ok ? "OK" : "E01");
+        return;
+    }
+    case 'k':
+        m_action = resume_action::kill;
+        m_cv.notify_all();
+        return;
+    case 'D':
+        send_packet("OK");
+        m_action = resume_action::cont;
+        m_cv.notify_all();
+        return;
+    case 'H':
+    case 'T':
+        send_packet("OK"); // single thread
+        return;
+    case 'q':
+        if (packet.compare(0, 10, "qSupported") == 0) {
+            char features[32];
+            snprintf(features, sizeof(features), "PacketSize=%X", GDB_PACKET_SIZE);
+            send_packet(features);
+        }
+        else if (packet == "qAttached") {
+            send_packet("1");
+        }
+        else if (packet == "qC") {
+            send_packet("QC1");
+        }
+        else if (packet == "qfThreadInfo") {
+            send_packet("m1");
+        }
+        else if (packet == "qsThreadInfo") {
+            send_packet("l");
+        }
+        else if (packet.compare(0, 6, "qRcmd,") == 0) {
+            // "monitor cp0" prints the coprocessor 0 registers, epc has no slot in gdb's MIPS register layout
+            std::string cmd(( packet.size() - 6) / 2, '\0');
+            from_hex(packet, 6, cmd.size(), reinterpret_cast<uint8_t*>(&cmd[0]));
+            if (cmd != "cp0" || !m_stopped) {
+                send_packet("E01");
+                return;
+            }
+
+            registers& regs = m_vm.m_regs;
+            char text[128];
+            snprintf(text, sizeof(text), "vaddr %08X status %08X cause %08X epc %08X (%s mode)\n", regs.vaddr, regs.status, regs.cause, regs.epc, m_vm.m_kernelmode ? "kernel" : "user");
+            send_packet("O" + to_hex(reinterpret_cast<const uint8_t*>(text), strlen(text)));
+            send_packet("OK");
+        }
+        else {
+            send_packet("");
+        }
+        return;
+    default:
+        send_packet(""); // unsupported
+        return;
+    }
+}
+
+bool gdb_stub::on_stop() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    while (true) {
+        m_vm.clear_stop_request();
+        m_stopped = true;
+        if (m_reply_pending) {
+            send_stop_reply(); // answer the c/s that resumed us
+            m_reply_pending = false;
+        }
+
+        m_cv.wait(lock, [this] { return m_action != resume_action::none; });
+        resume_action action = m_action;
+        m_action = resume_action::none;
+        m_stopped = false;
+        m_interrupted = false;
+        m_reply_pending = action != resume_action::kill && m_client_fd >= 0;
+
+        if (action == resume_action::kill) {
+            m_vm.m_exit_reason = "killed by gdb";
+            return false;
+        }
+
+        // move off the current breakpoint (or execute the single step) without holding the lock
+        lock.unlock();
+        step_result result = m_vm.m_debugger.step_once();
+        lock.lock();
+
+        if (result == step_result::finished) {
+            return false;
+        }
+        if (action == resume_action::cont && result == step_result::running) {
+            return true; // back to the run loop at full speed
+        }
+    }
+}
+
+void gdb_stub::on_exit(int32_t code) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    char reply[8];
+    snprintf(reply, sizeof(reply), "W%02x", uint32_t(code) & 0xFF);
+    send_packet(reply);
+}
\ No newline at end of file
@@ -0,0 +1,64 @@
+#pragma once
+#include "pch.h"
+
+class executor;
+struct section;
+
+// GDB remote serial protocol server, so gdb-multiarch (or anything speaking RSP) can debug the VM.
+// Packets are read and answered on a separate thread. The interpreter only talks to the stub when execution stops,
+// and an interrupt (^C) from gdb is noticed at the next jump or taken branch, so a continuing VM runs at full speed.
+class gdb_stub {
+public:
+	gdb_stub(executor& vm);
+	~gdb_stub();
+
+	// "port" or "host:port" for TCP, "unix:/path" for a Unix socket
+	bool listen(const std::string& address);
+
+	// interpreter thread: execution stopped, serve gdb until it resumes. Returns false if execution should end.
+	bool on_stop();
+
+	// interpreter thread: execution finished, tell gdb the program exited
+	void on_exit(int32_t code);
+
+private:
+	enum class resume_action : int {
+		none,
+		cont,
+		step,
+		kill
+	};
+
+	void serve();
+	bool wait_readable(int fd);
+	void handle_packet(const std::string& packet);
+	void send_raw(const std::string& data);
+	void send_packet(const std::string& data);
+	void send_stop_reply();
+
+	std::string read_registers();
+	bool write_register(uint32_t index, uint32_t value);
+	uint32_t read_register(uint32_t index, bool& valid);
+	// register values in the program's byte order and back
+	uint32_t target_order(uint32_t val);
+	// which byte of the host word at addr & ~3 holds the guest byte at addr
+	uint32_t code_byte(section* sect, uint32_t addr);
+	bool read_memory(uint32_t addr, uint8_t& out);
+	bool write_memory(uint32_t addr, uint8_t val);
+
+	executor& m_vm;
+	std::thread m_thread;
+	std::atomic<bool> m_shutdown;
+
+	int m_listen_fd;
+	int m_client_fd;
+	int m_wake_pipe[2]; // written on shutdown to get the server thread out of poll
+	std::string m_unix_path;
+
+	std::mutex m_mutex; // guards everything below, and serializes writes to the client socket
+	std::condition_variable m_cv;
+	bool m_stopped; // interpreter is parked in on_stop, VM state may be accessed from the server thread
+	bool m_interrupted; // stop was requested by gdb (^C), reported as SIGINT instead of SIGTRAP
+	bool m_reply_pending; // gdb resumed execution and waits for a stop reply
+	resume_action m_action;
+};
\ No newline at end of file
@@ -0,0 +1,355 @@
+#include "pch.h"
+#include "guest_io.h"
+#include "helper.h"
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <poll.h>
+#endif
+
+bool expected_output_sink::write(const char* data, size_t size) {
+	if (m_mismatch) {
+		return false;
+	}
+
+	size_t available = m_expected.size() - size_t(m_written);
+	size_t compare = std::min(size, available);
+	const char* expected = m_expected.data() + m_written;
+	if (memcmp(data, expected, compare) != 0) {
+		// find the exact byte
+		size_t i = 0;
+		while (data[i] == expected[i]) {
+			i++;
+		}
+		m_written += i;
+		m_mismatch = true;
+		return false;
+	}
+
+	m_written += compare;
+	if (size > available) {
+		m_mismatch = true; // more output than expected
+		return false;
+	}
+	return true;
+}
+
+// read buffer for a pipe or a terminal, a terminal returns a line per read anyway
+constexpr size_t INPUT_BUFFER_SIZE = 1 << 16;
+
+#ifdef _WIN32
+static int64_t sys_read_stdin(char* buf, size_t size) { return _read(0, buf, unsigned(std::min<size_t>(size, std::numeric_limits<int>::max()))); }
+static char* sys_map_stdin(size_t& size, size_t& offset) { return nullptr; }
+static void sys_unmap(char* mem, size_t size) {}
+#else
+static int64_t sys_read_stdin(char* buf, size_t size) {
+	int64_t res;
+	do {
+		res = read(STDIN_FILENO, buf, size);
+	} while (res < 0 && errno == EINTR);
+	return res;
+}
+// a regular file is read from its current offset to the end, straight out of the page cache
+static char* sys_map_stdin(size_t& size, size_t& offset) {
+	struct stat st;
+	off_t pos = lseek(STDIN_FILENO, 0, SEEK_CUR);
+	if (fstat(STDIN_FILENO, &st) != 0 || !S_ISREG(st.st_mode) || pos < 0 || st.st_size <= pos || uint64_t(st.st_size) > std::numeric_limits<size_t>::max()) {
+		return nullptr;
+	}
+	void* mem = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, STDIN_FILENO, 0);
+	if (mem == MAP_FAILED) {
+		return nullptr;
+	}
+	madvise(mem, size_t(st.st_size), MADV_SEQUENTIAL);
+	size = size_t(st.st_size);
+	offset = size_t(pos);
+	return static_cast<char*>(mem);
+}
+static void sys_unmap(char* mem, size_t size) { munmap(mem, size); }
+static bool sys_stdin_ready() {
+	struct pollfd p = { STDIN_FILENO, POLLIN, 0 };
+	return poll(&p, 1, 0) > 0;
+}
+#endif
+
+input_source::~input_source() {
+	if (m_mapping) {
+		sys_unmap(m_mapping, m_mapping_size);
+	}
+}
+
+input_source& input_source::host_stdin() {
+	static input_source* host = [] {
+		static input_source source;
+		source.m_host = true;
+		return &source;
+	}();
+	return *host;
+}
+
+void input_source::set_buffer(const std::string& data) {
+	m_pos = m_begin = data.data();
+	m_end = data.data() + data.size();
+	m_consumed = 0;
+	m_host = false;
+}
+
+bool input_source::fill() {
+	if (!m_host) {
+		return false;
+	}
+
+	if (!m_started) {
+		m_started = true;
+		size_t offset = 0;
+		m_mapping = sys_map_stdin(m_mapping_size, offset);
+		if (m_mapping) {
+			m_pos = m_begin = m_mapping + offset;
+			m_end = m_mapping + m_mapping_size;
+			return m_pos < m_end;
+		}
+		m_storage.resize(INPUT_BUFFER_SIZE);
+	}
+	if (m_mapping) {
+		return false; // the whole file was there from the start
+	}
+
+	// not sticky, a terminal can have more after an end of file
+	int64_t res = sys_read_stdin(m_storage.data(), m_storage.size());
+	if (res <= 0) {
+		return false;
+	}
+	m_consumed += uint64_t(m_end - m_begin);
+	m_pos = m_begin = m_storage.data();
+	m_end = m_storage.data() + res;
+	return true;
+}
+
+int input_source::skip_space() {
+	int c = peek();
+	while (c == ' ' || (c >= '\t' && c <= '\r')) {
+		m_pos++;
+		c = peek();
+	}
+	return c;
+}
+
+int32_t input_source::read_int() {
+	int c = skip_space();
+	bool negative = c == '-';
+	if (c == '-' || c == '+') {
+		m_pos++;
+		c = peek();
+	}
+	if (c < '0' || c > '9') {
+		return 0;
+	}
+
+	// like operator>>, a value out of range ends up as the closest one
+	const uint64_t limit = negative ? uint64_t(1) << 31 : (uint64_t(1) << 31) - 1;
+	uint64_t value = 0;
+	do {
+		if (value <= limit) {
+			value = value * 10 + uint32_t(c - '0');
+		}
+		m_pos++;
+		c = peek();
+	} while (c >= '0' && c <= '9');
+
+	value = std::min(value, limit);
+	return negative ? int32_t(-int64_t(value)) : int32_t(value);
+}
+
+float input_source::read_float() {
+	// powers of ten that are exact as floats (5^10 < 2^24)
+	static const float powers[] = { 1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f };
+
+	int c = skip_space();
+	m_token.clear();
+	auto take = [&]() {
+		m_token += char(c);
+		m_pos++;
+		c = peek();
+	};
+
+	bool negative = c == '-';
+	if (c == '-' || c == '+') {
+		take();
+	}
+
+	// the digits as an integer and the power of ten to scale it by, as long as they fit
+	uint64_t mantissa = 0;
+	int32_t scale = 0;
+	uint32_t digits = 0;
+	bool exact = true;
+	auto digit = [&](bool fraction) {
+		if (mantissa < (uint64_t(1) << 32)) {
+			mantissa = mantissa * 10 + uint32_t(c - '0');
+			if (fraction) {
+				scale--;
+			}
+		}
+		else {
+			exact = false;
+		}
+		digits++;
+		take();
+	};
+	while (c >= '0' && c <= '9') {
+		digit(false);
+	}
+	if (c == '.') {
+		take();
+		while (c >= '0' && c <= '9') {
+			digit(true);
+		}
+	}
+	if (!digits) {
+		return 0.0f;
+	}
+
+	// like operator>>, an exponent without digits makes the whole number invalid
+	if (c == 'e' || c == 'E') {
+		take();
+		bool negative_exponent = c == '-';
+		if (c == '-' || c == '+') {
+			take();
+		}
+		if (c < '0' || c > '9') {
+			return 0.0f;
+		}
+		int32_t exponent = 0;
+		while (c >= '0' && c <= '9') {
+			exponent = std::min(exponent * 10 + (c - '0'), 100000);
+			take();
+		}
+		scale += negative_exponent ? -exponent : exponent;
+	}
+
+	// one multiplication or division of exact values rounds correctly, everything else is left to strtof
+	if (exact && mantissa <= (uint64_t(1) << 24) && scale >= -10 && scale <= 10) {
+		float value = scale >= 0 ? float(mantissa) * powers[scale] : float(mantissa) / powers[-scale];
+		return negative ? -value : value;
+	}
+	// and out of range values end up as the largest float, not infinity
+	float value = strtof(m_token.c_str(), nullptr);
+	if (std::isinf(value)) {
+		value = negative ? -std::numeric_limits<float>::max() : std::numeric_limits<float>::max();
+	}
+	return value;
+}
+
+void input_source::skip_line() {
+	while (m_pos < m_end || fill()) {
+		size_t available = size_t(m_end - m_pos);
+		size_t line_end = find_byte(reinterpret_cast<const uint8_t*>(m_pos), available, '\n');
+		if (line_end < available) {
+			m_pos += line_end + 1;
+			return;
+		}
+		m_pos = m_end;
+	}
+}
+
+size_t input_source::read_line(char* buf, size_t size) {
+	if (!size) {
+		return 0;
+	}
+
+	size_t length = 0;
+	while (m_pos < m_end || fill()) {
+		size_t available = size_t(m_end - m_pos);
+		size_t line_end = find_byte(reinterpret_cast<const uint8_t*>(m_pos), available, '\n');
+		size_t copy = std::min(line_end, size - 1 - length);
+		memcpy(buf + length, m_pos, copy);
+		length += copy;
+		m_pos += copy;
+		if (copy < line_end) {
+			skip_line(); // the buffer is full
+			break;
+		}
+		if (line_end < available) {
+			m_pos++; // the line break
+			break;
+		}
+	}
+	buf[length] = 0;
+	return length;
+}
+
+bool input_source::read_line(std::string& line) {
+	line.clear();
+	bool any = false;
+	while (m_pos < m_end || fill()) {
+		any = true;
+		size_t available = size_t(m_end - m_pos);
+		size_t line_end = find_byte(reinterpret_cast<const uint8_t*>(m_pos), available, '\n');
+		line.append(m_pos, line_end);
+		m_pos += line_end;
+		if (line_end < available) {
+			m_pos++;
+			break;
+		}
+	}
+	return any;
+}
+
+int input_source::read_char() {
+	int c = peek();
+	if (c != EOF) {
+		m_pos++;
+	}
+	return c;
+}
+
+size_t input_source::read(uint8_t* buf, size_t size) {
+	size_t done = 0;
+	while (done < size) {
+		if (m_pos == m_end) {
+			// the buffer is used up, the rest of a big read goes straight into buf
+			if (m_host && m_started && !m_mapping && size - done >= m_storage.size()) {
+				int64_t res = sys_read_stdin(reinterpret_cast<char*>(buf + done), size - done);
+				if (res <= 0) {
+					break;
+				}
+				done += size_t(res);
+				m_consumed += uint64_t(res);
+				continue;
+			}
+			if (!fill()) {
+				break;
+			}
+		}
+
+		size_t copy = std::min(size - done, size_t(m_end - m_pos));
+		memcpy(buf + done, m_pos, copy);
+		m_pos += copy;
+		done += copy;
+	}
+	return done;
+}
+
+uint64_t input_source::skip(uint64_t bytes) {
+	uint64_t done = 0;
+	while (done < bytes && (m_pos < m_end || fill())) {
+		size_t step = size_t(std::min<uint64_t>(bytes - done, uint64_t(m_end - m_pos)));
+		m_pos += step;
+		done += step;
+	}
+	return done;
+}
+
+int input_source::poll_char() {
+	if (m_pos < m_end) {
+		return uint8_t(*m_pos++);
+	}
+	if (!m_host || (m_started && m_mapping)) {
+		return EOF;
+	}
+#ifdef _WIN32
+	return _kbhit() ? _getch() : EOF; // the console, which doesn't go through the read buffer
+#else
+	return sys_stdin_ready() ? read_char() : EOF;
+#endif
+}
\ No newline at end of file
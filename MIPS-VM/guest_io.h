@@ -0,0 +1,106 @@
+#pragma once
+#include "pch.h"
+
+// Guest console output: the PRINT_* syscalls and WRITE_FILE to stdout (fd 1). Goes to the host's stdout unless
+// something else (the test runner) wants to see it.
+class output_sink {
+public:
+	virtual ~output_sink() {}
+
+	// false if the output is rejected, the run then ends with an error
+	virtual bool write(const char* data, size_t size) = 0;
+	// WRITE_FILE to fd 1 and 2 goes straight to the host file descriptors when this is the host's stdout
+	virtual bool is_host_stdout() const { return false; }
+};
+
+class stdout_sink : public output_sink {
+public:
+	bool write(const char* data, size_t size) override {
+		fwrite(data, 1, size, stdout);
+		return true;
+	}
+	bool is_host_stdout() const override { return true; }
+};
+
+// Compares the output with the expected output while it is produced and rejects it at the first byte that differs,
+// so a wrong answer doesn't run to completion.
+class expected_output_sink : public output_sink {
+public:
+	expected_output_sink(const std::string& expected) : m_expected(expected), m_written(0), m_mismatch(false) {}
+
+	bool write(const char* data, size_t size) override;
+
+	// everything matched and nothing is missing
+	bool matched() const { return !m_mismatch && m_written == m_expected.size(); }
+	// offset of the first byte that differs (or is missing), only meaningful if !matched()
+	uint64_t divergence() const { return m_written; }
+	// false if the output only stopped early
+	bool mismatched() const { return m_mismatch; }
+
+private:
+	const std::string& m_expected;
+	uint64_t m_written; // bytes that matched so far
+	bool m_mismatch;
+};
+
+// Guest console input: the READ_* syscalls, READ_FILE from stdin (fd 0) and the keyboard. A buffered reader over the host's
+// stdin or a buffer in memory. Numbers are parsed straight out of the buffer and a line is copied into guest memory once,
+// there are no streams in between. A regular file on the host's stdin is mapped into memory instead of read.
+// Everything that reads the host's stdin (the program name prompt, the debugger, the guest) goes through host_stdin(),
+// so nothing is buffered ahead where another reader can't see it.
+class input_source {
+public:
+	input_source() : m_pos(nullptr), m_end(nullptr), m_begin(nullptr), m_consumed(0), m_host(false), m_started(false), m_mapping(nullptr), m_mapping_size(0) {}
+	~input_source();
+
+	input_source(const input_source&) = delete;
+	input_source& operator=(const input_source&) = delete;
+
+	// the process's stdin
+	static input_source& host_stdin();
+	bool is_host_stdin() const { return m_host; }
+
+	// reads `data` instead, it has to outlive the source
+	void set_buffer(const std::string& data);
+
+	// READ_INT: skips whitespace (line breaks too) and parses a decimal integer, clamped to the int32 range. 0 if there is none
+	int32_t read_int();
+	// READ_FLOAT: the same for a decimal floating point number
+	float read_float();
+	// drops the rest of the current line, the line based READ_* syscalls take one value per line
+	void skip_line();
+	// READ_STRING: up to size - 1 characters of the line, NUL terminated, returns their number. The line break is consumed
+	// but not stored, the rest of a longer line is dropped
+	size_t read_line(char* buf, size_t size);
+	// a whole line without the line break, false at the end of the input
+	bool read_line(std::string& line);
+	// READ_CHAR, EOF at the end
+	int read_char();
+	// READ_FILE, returns the bytes read (0 at the end). Waits until it has all of them or the input ends
+	size_t read(uint8_t* buf, size_t size);
+	// the keyboard, a character if there is one without waiting, EOF otherwise
+	int poll_char();
+
+	// bytes read so far, a resumed program skips them (see checkpoint.h)
+	uint64_t consumed() const { return m_consumed + uint64_t(m_pos - m_begin); }
+	// drops `bytes` of input, returns how many there were
+	uint64_t skip(uint64_t bytes);
+
+private:
+	int peek() { return m_pos < m_end || fill() ? uint8_t(*m_pos) : EOF; }
+	int skip_space();
+	// more input into the buffer once it's used up, false at the end
+	bool fill();
+
+	const char* m_pos;
+	const char* m_end;
+	const char* m_begin; // of the current buffer
+	uint64_t m_consumed; // bytes before m_begin
+	bool m_host;
+	bool m_started; // the host's stdin was looked at (and mapped if it's a file)
+
+	std::vector<char> m_storage; // read buffer for the host's stdin
+	char* m_mapping; // the host's stdin when it's a regular file
+	size_t m_mapping_size;
+	std::string m_token; // a number that has to go through strtof
+};
\ No newline at end of file
@@ -26,12 +26,74 @@ static To bit_cast(const From& in) {
     return (To)in;
 }
 
-static bool string_terminates(const char* str, size_t buf_size) {
-    for (size_t i = 0; i < buf_size; i++) {
-        if (str[i] == 0) {
-            return true;
+// index of the first `value` in [data, data + size), `size` if there is none. Never reads outside the range,
+// 16 bytes per step with SSE2 so scanning a guest string costs about as much as copying it
+static size_t find_byte(const uint8_t* data, size_t size, uint8_t value) {
+    size_t i = 0;
+#ifdef MIPS_VM_SSE2
+    const __m128i needle = _mm_set1_epi8(char(value));
+    for (; i + 16 <= size; i += 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        uint32_t mask = uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle)));
+        if (mask) {
+#ifdef _MSC_VER
+            unsigned long first;
+            _BitScanForward(&first, mask);
+            return i + first;
+#else
+            return i + __builtin_ctz(mask);
+#endif
         }
     }
+#endif
+    for (; i < size; i++) {
+        if (data[i] == value) {
+            return i;
+        }
+    }
+    return size;
+}
+
+// FNV-1a, a longer input is hashed piecewise by passing the previous result as `hash`
+constexpr uint64_t HASH_SEED = 0xCBF29CE484222325ull;
+
+static uint64_t hash_bytes(uint64_t hash, const void* data, size_t size) {
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001B3ull;
+    }
+    return hash;
+}
+
+// atomic accesses to guest memory that other harts may access at the same time
+static uint32_t atomic_load32(uint32_t* ptr) {
+#ifdef _MSC_VER
+    return *reinterpret_cast<volatile uint32_t*>(ptr); // aligned loads are atomic on x86
+#else
+    return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+#endif
+}
+
+static bool atomic_compare_exchange32(uint32_t* ptr, uint32_t expected, uint32_t desired) {
+#ifdef _MSC_VER
+    return uint32_t(_InterlockedCompareExchange(reinterpret_cast<volatile long*>(ptr), long(desired), long(expected))) == expected;
+#else
+    return __atomic_compare_exchange_n(ptr, &expected, desired, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+#endif
+}
+
+static uint32_t atomic_fetch_or32(uint32_t* ptr, uint32_t bits) {
+#ifdef _MSC_VER
+    return uint32_t(_InterlockedOr(reinterpret_cast<volatile long*>(ptr), long(bits)));
+#else
+    return __atomic_fetch_or(ptr, bits, __ATOMIC_SEQ_CST);
+#endif
+}
 
-    return false;
+static uint32_t atomic_fetch_add32(uint32_t* ptr, uint32_t value) {
+#ifdef _MSC_VER
+    return uint32_t(_InterlockedExchangeAdd(reinterpret_cast<volatile long*>(ptr), long(value)));
+#else
+    return __atomic_fetch_add(ptr, value, __ATOMIC_SEQ_CST);
+#endif
 }
\ No newline at end of file
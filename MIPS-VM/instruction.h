@@ -66,11 +66,14 @@ enum class instructions : int {
 	LHU = 0x25,
 	SB = 0x28,
 	SH = 0x29,
+	LL = 0x30,
+	SC = 0x38,
 };
 
 enum class funct : int {
 	SYSCALL = 0x0C,
 	BREAK = 0x0D,
+	SYNC = 0x0F,
 	SLL = 0x00,
 	DIV = 0x1A,
 	DIVU = 0x1B,
@@ -121,6 +124,19 @@ enum class syscalls : int {
 	CLOSE_FILE = 16,
 	EXIT2 = 17,
 	TIME,
+	MMAP_FILE = 19,
+	MUNMAP = 20,
+	SPAWN = 21,
+	JOIN = 22,
+	YIELD = 23,
+	FUTEX_WAIT = 24,
+	FUTEX_WAKE = 25,
+	THREAD_EXIT = 26,
+	MALLOC = 27,
+	FREE = 28,
+	REALLOC = 29,
+	CALLOC = 30,
+	HEAP_STATS = 31,
 	SLEEP = 32,
 	PRINT_HEX = 34,
 	PRINT_BINARY = 35,
@@ -130,6 +146,7 @@ enum class syscalls : int {
 	RAND_INT_RANGE = 42,
 	RAND_FLOAT = 43,
 	RAND_DBL = 44,
+	RAND_FILL = 45,
 	REGISTER_SYSCALL = 49,
 };
 
@@ -0,0 +1,369 @@
+#include "pch.h"
+#include "lockstep.h"
+#include "helper.h"
+#include "disassembler.h"
+
+constexpr size_t TRACE_LIMIT = 1 << 16; // instructions kept for the report, the oldest are dropped with a large compare_every
+constexpr size_t REPORT_CONTEXT = 8; // instructions shown before the first mismatching one
+
+constexpr uint64_t HI_BIT = uint64_t(1) << 32;
+constexpr uint64_t LO_BIT = uint64_t(1) << 33;
+constexpr uint64_t ANY_REGISTER = ~uint64_t(0);
+
+// prints the translated machine's console output and keeps it for the interpreter's to be compared with
+class printing_sink : public output_sink {
+public:
+	printing_sink(std::string& printed) : m_printed(printed) {}
+
+	bool write(const char* data, size_t size) override {
+		fwrite(data, 1, size, stdout);
+		m_printed.append(data, size);
+		return true;
+	}
+
+private:
+	std::string& m_printed;
+};
+
+static std::string format(const char* fmt, ...) {
+	char buf[256];
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, args);
+	va_end(args);
+	return buf;
+}
+
+// registers the instruction writes, bits as in lockstep::difference. A SYSCALL can write anything
+static uint64_t written_registers(instruction inst) {
+	switch (inst.r.opcode) {
+	case uint32_t(instructions::R_FORMAT):
+		switch (inst.r.funct) {
+		case uint32_t(funct::SYSCALL):
+			return ANY_REGISTER;
+		case uint32_t(funct::JALR):
+			return uint64_t(1) << int(register_names::ra);
+		case uint32_t(funct::MTHI):
+			return HI_BIT;
+		case uint32_t(funct::MTLO):
+			return LO_BIT;
+		case uint32_t(funct::MULT):
+		case uint32_t(funct::MULTU):
+		case uint32_t(funct::DIV):
+		case uint32_t(funct::DIVU):
+			return HI_BIT | LO_BIT;
+		case uint32_t(funct::BREAK):
+		case uint32_t(funct::SYNC):
+		case uint32_t(funct::JR):
+		case uint32_t(funct::TGE):
+		case uint32_t(funct::TGEU):
+		case uint32_t(funct::TLT):
+		case uint32_t(funct::TLTU):
+		case uint32_t(funct::TEQ):
+		case uint32_t(funct::TNE):
+			return 0;
+		default:
+			return uint64_t(1) << inst.r.rd;
+		}
+	case uint32_t(instructions::MFC0):
+	case uint32_t(instructions::MFC1):
+		return inst.r.rs == 0 && inst.r.funct != 0x18 ? uint64_t(1) << inst.r.rt : 0;
+	case uint32_t(instructions::MUL):
+		return uint64_t(1) << inst.r.rd;
+	case uint32_t(instructions::JAL):
+		return uint64_t(1) << int(register_names::ra);
+	case uint32_t(instructions::SLTI):
+	case uint32_t(instructions::SLTIU):
+	case uint32_t(instructions::ANDI):
+	case uint32_t(instructions::ORI):
+	case uint32_t(instructions::LUI):
+	case uint32_t(instructions::ADDI):
+	case uint32_t(instructions::ADDIU):
+	case uint32_t(instructions::LW):
+	case uint32_t(instructions::LB):
+	case uint32_t(instructions::LH):
+	case uint32_t(instructions::LBU):
+	case uint32_t(instructions::LHU):
+	case uint32_t(instructions::LL):
+	case uint32_t(instructions::SC):
+		return uint64_t(1) << inst.i.rt;
+	default:
+		return 0;
+	}
+}
+
+// bytes a store writes, 0 for anything else
+static uint32_t stored_bytes(instruction inst) {
+	switch (inst.r.opcode) {
+	case uint32_t(instructions::SW):
+	case uint32_t(instructions::SC):
+		return 4;
+	case uint32_t(instructions::SH):
+		return 2;
+	case uint32_t(instructions::SB):
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+lockstep::lockstep(const vm_options& options, uint64_t compare_every) : m_compare_every(compare_every), m_compared(0), m_comparisons(0), m_can_run(false) {
+	// the two machines have to be alone with their program, nothing may look at them or share host state between them
+	if (options.harts > 1 || options.debug || !options.gdb.empty() || !options.plugins.empty() || !options.checkpoint.dir.empty() ||
+		!options.checkpoint.resume.empty() || options.display.width) {
+		printf("Differential runs need a single hart and no debugger, plugins, checkpoints or display\n");
+		return;
+	}
+
+	// both machines read the same input, all of it is read up front. Through the VM's own stdin reader, it may have
+	// buffered (or mapped) some already
+	if (options.input) {
+		m_input = *options.input;
+	}
+	else {
+		input_source& in = input_source::host_stdin();
+		std::vector<uint8_t> chunk(1 << 16);
+		while (size_t size = in.read(chunk.data(), chunk.size())) {
+			m_input.append(reinterpret_cast<const char*>(chunk.data()), size);
+		}
+	}
+
+	m_output = std::make_unique<printing_sink>(m_printed);
+	m_reference_output = std::make_unique<expected_output_sink>(m_printed);
+
+	vm_options translated = options;
+	translated.input = &m_input;
+	translated.output = m_output.get();
+	m_translated = std::make_unique<executor>(translated);
+	if (!m_translated->can_run()) {
+		return;
+	}
+	if (m_translated->m_machine->translated.empty()) {
+		printf("No translated code to compare with the interpreter, run a native runner or use a --cache entry that has native code\n");
+		return;
+	}
+
+	vm_options reference = translated;
+	reference.cache.clear();
+	reference.interpret = true;
+	reference.quiet = true;
+	reference.report.clear();
+	reference.output = m_reference_output.get();
+	m_reference = std::make_unique<executor>(reference);
+	if (!m_reference->can_run()) {
+		return;
+	}
+	m_reference->m_machine->rng = m_translated->m_machine->rng; // random streams without a seed start out the same
+
+	m_can_run = true;
+}
+
+void lockstep::start(executor& hart) {
+	hart.prepare_harts(); // a single hart, the constructor refused more
+}
+
+step_result lockstep::step_reference() {
+	executor& hart = *m_reference;
+	traced entry = traced();
+	entry.tick = hart.m_tick;
+	entry.pc = hart.m_regs.pc;
+
+	section* sect = hart.get_section_for_address(entry.pc);
+	if (sect && (sect->flags & EXECUTABLE) && !(entry.pc & 0x3)) {
+		entry.hex = *reinterpret_cast<uint32_t*>(sect->sect.data() + hart.get_offset_for_section(sect, entry.pc));
+		instruction inst(entry.hex);
+		entry.store = hart.m_regs.regs[inst.i.rs] + bit_cast<int16_t>(inst.i.imm);
+	}
+
+	bool kernelmode = hart.m_kernelmode;
+	step_result result = hart.step();
+	entry.raised = !kernelmode && hart.m_kernelmode && hart.m_regs.pc == EXCEPTION_HANDLER;
+
+	m_trace.push_back(entry);
+	if (m_trace.size() > TRACE_LIMIT) {
+		m_trace.pop_front();
+	}
+	return result;
+}
+
+bool lockstep::run() {
+	start(*m_translated);
+	start(*m_reference);
+	printf("Running %s on translated code and the interpreter in lockstep...\n\n===========================================\n", m_translated->m_program.c_str());
+
+	while (true) {
+		step_result result = m_translated->step();
+
+		// the interpreter catches up. Once the translated machine ended it runs the instruction that ended it as well, which isn't counted
+		step_result reference = step_result::running;
+		while (reference == step_result::running &&
+			(m_reference->m_tick < m_translated->m_tick || (result != step_result::running && m_reference->m_tick == m_translated->m_tick))) {
+			reference = step_reference();
+		}
+
+		bool ended = result != step_result::running || reference != step_result::running;
+		if (!ended && m_compare_every && m_translated->m_tick - m_compared < m_compare_every) {
+			continue;
+		}
+
+		difference diff = compare();
+		if (ended) {
+			const machine& a = *m_translated->m_machine;
+			const machine& b = *m_reference->m_machine;
+			if (result != reference || a.halted != b.halted || a.failed != b.failed || a.exit_code != b.exit_code) {
+				diff.control = true;
+				diff.lines.push_back(reference == step_result::running ? format("ended with '%s', the interpreter goes on", m_translated->m_exit_reason.c_str()) :
+					format("ended with '%s', the interpreter with '%s'", m_translated->m_exit_reason.c_str(), m_reference->m_exit_reason.c_str()));
+			}
+		}
+		if (!diff.lines.empty()) {
+			report(diff);
+			return false;
+		}
+
+		m_compared = m_translated->m_tick;
+		m_comparisons++;
+		m_trace.clear();
+		if (ended) {
+			break;
+		}
+	}
+
+	printf("\n===========================================\nFinished executing (%s)\n", m_translated->m_exit_reason.c_str());
+	printf("Translated code and the interpreter agree on all %llu instructions (%llu comparisons)\n", (unsigned long long)m_translated->m_tick,
+		(unsigned long long)m_comparisons);
+	return true;
+}
+
+lockstep::difference lockstep::compare() {
+	executor& a = *m_translated;
+	executor& b = *m_reference;
+	const registers& x = a.m_regs;
+	const registers& y = b.m_regs;
+	difference diff;
+
+	for (uint32_t i = 0; i < 32; i++) {
+		if (x.regs[i] != y.regs[i]) {
+			diff.registers |= uint64_t(1) << i;
+			diff.lines.push_back(format("$%s is 0x%08X, the interpreter has 0x%08X", register_name(i), x.regs[i], y.regs[i]));
+		}
+	}
+	if (x.hi != y.hi) {
+		diff.registers |= HI_BIT;
+		diff.lines.push_back(format("hi is 0x%08X, the interpreter has 0x%08X", x.hi, y.hi));
+	}
+	if (x.lo != y.lo) {
+		diff.registers |= LO_BIT;
+		diff.lines.push_back(format("lo is 0x%08X, the interpreter has 0x%08X", x.lo, y.lo));
+	}
+	for (uint32_t i = 0; i < 32; i++) {
+		if (memcmp(&x.f[i], &y.f[i], sizeof(float))) { // the bits, NaNs never compare equal
+			diff.control = true;
+			diff.lines.push_back(format("$f%u is %g, the interpreter has %g", i, x.f[i], y.f[i]));
+		}
+	}
+
+	const struct {
+		const char* name;
+		uint32_t translated, reference;
+	} control[] = {
+		{ "pc", x.pc, y.pc }, { "vaddr", x.vaddr, y.vaddr }, { "status", x.status, y.status }, { "cause", x.cause, y.cause },
+		{ "epc", x.epc, y.epc }, { "kernelmode", a.m_kernelmode, b.m_kernelmode },
+	};
+	for (const auto& reg : control) {
+		if (reg.translated != reg.reference) {
+			diff.control = true;
+			diff.lines.push_back(format("%s is 0x%08X, the interpreter has 0x%08X", reg.name, reg.translated, reg.reference));
+		}
+	}
+	if (a.m_tick != b.m_tick) {
+		diff.control = true;
+		diff.lines.push_back(format("the interpreter stopped after %llu instructions", (unsigned long long)b.m_tick));
+	}
+
+	// the memory the guest can write
+	for (int i = 0; i < NUM_SECTIONS; i++) {
+		const section& sect = a.m_sections[i];
+		if ((sect.flags & MUTABLE) && sect.sect.size()) {
+			compare_memory(diff, sect.address, sect.sect.data(), b.m_sections[i].sect.data(), sect.sect.size());
+		}
+	}
+	if (a.m_heap.brk() != b.m_heap.brk()) {
+		diff.memory = true;
+		diff.lines.push_back(format("the heap ends at 0x%08X, the interpreter's at 0x%08X", a.m_heap.brk(), b.m_heap.brk()));
+	}
+	else if (a.m_heap.brk() != a.m_heap.start()) {
+		compare_memory(diff, a.m_heap.start(), a.m_heap.get_section_if_valid_heap(a.m_heap.start())->sect.data(),
+			b.m_heap.get_section_if_valid_heap(b.m_heap.start())->sect.data(), a.m_heap.brk() - a.m_heap.start());
+	}
+	uint32_t depth = std::max(a.m_stack.touched_depth(), b.m_stack.touched_depth());
+	if (depth) {
+		uint32_t top = a.m_machine->layout.stack_top;
+		const section* stack = a.m_stack.get_section_if_valid_stack(top - 1);
+		size_t offset = stack->sect.size() - depth;
+		compare_memory(diff, top - depth, stack->sect.data() + offset, b.m_stack.get_section_if_valid_stack(top - 1)->sect.data() + offset, depth);
+	}
+
+	if (m_reference_output->mismatched() || m_reference_output->divergence() != m_printed.size()) {
+		diff.control = true;
+		diff.lines.push_back(format("the console output differs from byte %llu on", (unsigned long long)m_reference_output->divergence()));
+	}
+	return diff;
+}
+
+void lockstep::compare_memory(difference& diff, uint32_t address, const uint8_t* translated, const uint8_t* reference, size_t size) {
+	if (diff.memory || !memcmp(translated, reference, size)) {
+		return; // the first difference is enough
+	}
+
+	size_t i = 0;
+	while (translated[i] == reference[i]) {
+		i++;
+	}
+	diff.memory = true;
+	diff.address = address + uint32_t(i);
+	diff.lines.push_back(format("the byte at 0x%08X is 0x%02X, the interpreter has 0x%02X", diff.address, translated[i], reference[i]));
+}
+
+void lockstep::report(const difference& diff) {
+	printf("\n===========================================\nTranslated code and the interpreter differ after %llu instructions, they last agreed after %llu:\n",
+		(unsigned long long)m_translated->m_tick, (unsigned long long)m_compared);
+	for (const std::string& line : diff.lines) {
+		printf("  %s\n", line.c_str());
+	}
+
+	// the first instruction since the last comparison that writes something that differs. A difference in control (pc, coprocessor 0,
+	// how the program ended) comes from an exception one of them raised, or else the branch the translated block ended with
+	uint32_t epc = m_translated->m_regs.epc;
+	bool epc_differs = epc != m_reference->m_regs.epc;
+	size_t culprit = m_trace.size();
+	for (size_t i = 0; i < m_trace.size() && culprit == m_trace.size(); i++) {
+		const traced& entry = m_trace[i];
+		instruction inst(entry.hex);
+		uint32_t stored = stored_bytes(inst);
+		bool syscall = inst.r.opcode == uint32_t(instructions::R_FORMAT) && inst.r.funct == uint32_t(funct::SYSCALL);
+
+		if ((written_registers(inst) & diff.registers) || (diff.memory && (syscall || (stored && diff.address - entry.store < stored))) ||
+			(diff.control && (syscall || entry.raised || (epc_differs && entry.pc == epc)))) {
+			culprit = i;
+		}
+	}
+	if (culprit == m_trace.size() && diff.control && !m_trace.empty()) {
+		culprit = m_trace.size() - 1;
+	}
+
+	if (culprit == m_trace.size()) {
+		printf("No instruction since the last comparison writes what differs, the last ones were:\n");
+	}
+	else {
+		const traced& entry = m_trace[culprit];
+		printf("First mismatching instruction, number %llu at 0x%08X: %s\n", (unsigned long long)entry.tick + 1, entry.pc, disassemble(instruction(entry.hex), entry.pc).c_str());
+	}
+
+	size_t last = culprit == m_trace.size() ? m_trace.size() : culprit + 1;
+	size_t first = last > REPORT_CONTEXT ? last - REPORT_CONTEXT : 0;
+	for (size_t i = first; i < last; i++) {
+		const traced& entry = m_trace[i];
+		printf("%s 0x%08X  %s\n", i == culprit ? " >" : "  ", entry.pc, disassemble(instruction(entry.hex), entry.pc).c_str());
+	}
+}
\ No newline at end of file
@@ -0,0 +1,62 @@
+#pragma once
+#include "pch.h"
+#include "options.h"
+#include "executor.h"
+
+// Differential testing of the execution engines. The program runs twice side by side, once on its translated blocks (a
+// native runner or a translation cache's native code) and once on the interpreter, which is the reference. After every
+// translated block, or once every `compare_every` instructions, the interpreter catches up to the same instruction count
+// one instruction at a time and both machines are compared: registers, coprocessor 0, kernelmode, the memory the guest can
+// write (.data, .kdata, the heap up to the break and the touched stack) and the console output.
+//
+// At the first difference the run stops and reports what differs and the first instruction since the last comparison that
+// writes any of it, with the instructions leading up to it. Both machines get the same input (stdin is read up front) and
+// random streams, anything else from the host (TIME, files written by the program, devices) is up to the program.
+class lockstep {
+public:
+	lockstep(const vm_options& options, uint64_t compare_every);
+
+	bool can_run() const { return m_can_run; }
+	// true if the program ran to the end on both engines without them ever differing
+	bool run();
+
+private:
+	// an instruction the interpreter ran since the last comparison
+	struct traced {
+		uint64_t tick;
+		uint32_t pc;
+		uint32_t hex;
+		uint32_t store; // address a store wrote to
+		bool raised; // it raised an exception (the handler came next)
+	};
+
+	// what differs, empty if nothing
+	struct difference {
+		difference() : registers(0), memory(false), address(0), control(false) {}
+
+		std::vector<std::string> lines;
+		uint64_t registers; // general purpose registers, bit 32 is hi and bit 33 lo
+		bool memory;
+		uint32_t address; // the first differing byte
+		bool control; // pc, kernelmode or coprocessor 0
+	};
+
+	void start(executor& hart);
+	step_result step_reference();
+	difference compare();
+	void compare_memory(difference& diff, uint32_t address, const uint8_t* translated, const uint8_t* reference, size_t size);
+	void report(const difference& diff);
+
+	std::string m_input;
+	std::unique_ptr<output_sink> m_output; // the translated machine's, prints and keeps what it printed
+	std::string m_printed;
+	std::unique_ptr<expected_output_sink> m_reference_output; // the interpreter has to print the same
+
+	std::unique_ptr<executor> m_translated;
+	std::unique_ptr<executor> m_reference;
+	uint64_t m_compare_every;
+	uint64_t m_compared; // instruction count at the last comparison
+	uint64_t m_comparisons;
+	std::deque<traced> m_trace;
+	bool m_can_run;
+};
\ No newline at end of file
@@ -0,0 +1,71 @@
+#pragma once
+#include "pch.h"
+#include "sections.h"
+#include "memory.h"
+#include "file_mgr.h"
+#include "random_mgr.h"
+#include "mapping_mgr.h"
+#include "syscall_table.h"
+#include "scheduler.h"
+#include "allocator.h"
+#include "plugin_mgr.h"
+#include "aot.h"
+#include "translation_cache.h"
+#include "guest_io.h"
+#include "device_bus.h"
+#include "display.h"
+
+class executor;
+
+// Guest state shared by all harts: the address space, devices and the host resources behind the syscalls.
+// Everything a hart owns by itself (registers, kernelmode, syscall frames, LL reservation) lives in its executor.
+struct machine {
+	machine(const memory_layout& memory) : layout(memory), budget(memory.memory_limit), heap_area(layout, budget), stack_area(layout), allocator(heap_area),
+		plugins(syscalls), mappings(layout, budget), input(&input_source::host_stdin()), output(&host_output), display(output), has_exception_handler(false), quiet(false), big_endian(false), num_harts(1), halted(false), exit_code(0), failed(false), instructions(0) {}
+
+	memory_layout layout;
+	memory_budget budget; // everything below that holds guest memory takes it from here
+
+	std::array<section, NUM_SECTIONS> sections;
+
+	heap heap_area;
+	stack stack_area;
+	guest_allocator allocator; // MALLOC and friends, on top of the sbrk heap
+
+	syscall_table syscalls;
+	plugin_manager plugins; // native syscalls from shared libraries, registered into the syscall table
+	random_mgr rng;
+	file_manager files;
+	mapping_manager mappings;
+	guest_scheduler scheduler;
+
+	input_source input_buffer;
+	input_source* input; // the guest's stdin, the host's unless the run was given its input in input_buffer
+	stdout_sink host_output;
+	output_sink* output; // the guest's stdout, host_output unless the run was given a sink
+
+	device_bus devices; // memory mapped devices, the standard ones live at layout.mmio_base
+	keyboard_device keyboard;
+	display_device display;
+	timer_device timer;
+	std::unique_ptr<bitmap_display> bitmap; // with --display
+
+	std::unique_ptr<translation_cache> cache; // with --cache
+	aot_block_table translated; // blocks of a translated runner or the cache's native code, empty when interpreting
+
+	bool has_exception_handler;
+	bool quiet; // see vm_options::quiet
+	std::string sandbox; // see vm_options::sandbox
+	bool big_endian; // the program is big-endian, see byte_order.h
+	uint32_t num_harts;
+
+	std::vector<executor*> harts; // index is the hart id, harts[0] is the boot hart
+	std::mutex syscall_mutex; // native syscalls touch host state above, they run one at a time
+	std::mutex input_mutex; // input and the terminal mode, held while a READ_* syscall waits for stdin (never with syscall_mutex)
+
+	std::atomic<bool> halted; // a hart ended the program (EXIT or an error), the others stop at their next block boundary
+	std::string exit_reason; // written once by the hart that set halted
+	int32_t exit_code;
+	bool failed; // halted because of an error or a deadlock
+	uint64_t instructions; // executed by all harts, once the run finished
+};
\ No newline at end of file
@@ -0,0 +1,182 @@
+#include "pch.h"
+#include "mapping_mgr.h"
+
+#ifdef _WIN32
+#include <windows.h>
+
+static void release_mapping(uint8_t* mem, size_t size) {
+	UnmapViewOfFile(mem);
+}
+
+static uint8_t* map_host_file(const char* file, bool copy_on_write, uint64_t& size) {
+	HANDLE f = CreateFileA(file, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (f == INVALID_HANDLE_VALUE) {
+		return nullptr;
+	}
+
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(f, &file_size) || file_size.QuadPart == 0) {
+		CloseHandle(f);
+		return nullptr;
+	}
+	size = file_size.QuadPart;
+
+	HANDLE mapping = CreateFileMappingA(f, nullptr, copy_on_write ? PAGE_WRITECOPY : PAGE_READONLY, 0, 0, nullptr);
+	CloseHandle(f);
+	if (!mapping) {
+		return nullptr;
+	}
+
+	void* mem = MapViewOfFile(mapping, copy_on_write ? FILE_MAP_COPY : FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping); // the view keeps the mapping alive
+	return reinterpret_cast<uint8_t*>(mem);
+}
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static void release_mapping(uint8_t* mem, size_t size) {
+	munmap(mem, size);
+}
+
+static uint8_t* map_host_file(const char* file, bool copy_on_write, uint64_t& size) {
+	int fd = open(file, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return nullptr;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+		close(fd);
+		return nullptr;
+	}
+	size = uint64_t(st.st_size);
+
+	// MAP_PRIVATE gives copy-on-write semantics for the writable variant, for read-only it makes no difference
+	void* mem = mmap(nullptr, size, copy_on_write ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd); // the mapping keeps the file alive
+	if (mem == MAP_FAILED) {
+		return nullptr;
+	}
+
+	madvise(mem, size, MADV_WILLNEED);
+	return reinterpret_cast<uint8_t*>(mem);
+}
+#endif
+
+uint32_t mapping_manager::find_free_range(uint32_t size) {
+	uint64_t aligned_size = (uint64_t(size) + MAPPING_ALIGNMENT - 1) & ~uint64_t(MAPPING_ALIGNMENT - 1);
+
+	// first fit, walk the gaps between the existing mappings in address order
+	uint64_t candidate = m_area_start;
+	for (auto& it : m_mappings) {
+		if (candidate + aligned_size <= it.first) {
+			break;
+		}
+		uint64_t end = uint64_t(it.first) + it.second.sect.size();
+		candidate = (end + MAPPING_ALIGNMENT - 1) & ~uint64_t(MAPPING_ALIGNMENT - 1);
+	}
+
+	if (candidate + aligned_size > m_area_end) {
+		return 0; // no gap big enough
+	}
+
+	return uint32_t(candidate);
+}
+
+uint32_t mapping_manager::map_file(const char* file, int32_t flags, uint32_t& size) {
+	return map(file, flags, 0, size);
+}
+
+uint32_t mapping_manager::map(const char* file, int32_t flags, uint32_t at, uint32_t& size) {
+	if (flags != GUEST_MAP_READONLY && flags != GUEST_MAP_COPY_ON_WRITE) {
+		return 0;
+	}
+
+	uint64_t file_size = 0;
+	uint8_t* mem = map_host_file(file, flags == GUEST_MAP_COPY_ON_WRITE, file_size);
+	if (!mem) {
+		return 0;
+	}
+
+	std::unique_lock<std::shared_mutex> lock(m_mutex);
+
+	// a restored mapping goes back where it was, nothing else has been mapped yet then
+	uint32_t addr = 0;
+	if (file_size <= m_area_end - m_area_start) {
+		addr = !at ? find_free_range(uint32_t(file_size)) : at >= m_area_start && at + file_size <= m_area_end ? at : 0;
+	}
+	if (!addr) {
+		release_mapping(mem, file_size); // doesn't fit into the guest address space
+		return 0;
+	}
+	if (!m_budget.take(file_size)) {
+		release_mapping(mem, file_size); // over the memory limit
+		return 0;
+	}
+
+	section& mapping = m_mappings[addr];
+	mapping.address = addr;
+	mapping.flags = flags == GUEST_MAP_COPY_ON_WRITE ? MUTABLE : 0;
+	mapping.sect = section_memory(mem, file_size, release_mapping);
+	std::error_code error;
+	m_paths[addr] = std::filesystem::absolute(file, error).string();
+
+	size = uint32_t(file_size);
+	return addr;
+}
+
+bool mapping_manager::unmap(uint32_t addr) {
+	std::unique_lock<std::shared_mutex> lock(m_mutex);
+
+	auto it = m_mappings.find(addr);
+	if (it == m_mappings.end()) {
+		return false;
+	}
+
+	m_budget.give_back(it->second.sect.size());
+	uint64_t number = m_unmaps.load(std::memory_order_relaxed) + 1;
+	m_unmapped.emplace_back(number, std::move(it->second));
+	m_mappings.erase(it);
+	m_paths.erase(addr);
+	m_unmaps.store(number, std::memory_order_release); // after it is gone, a hart that sees the number can't find it anymore
+	return true;
+}
+
+void mapping_manager::release_unmapped(uint64_t seen) {
+	std::unique_lock<std::shared_mutex> lock(m_mutex);
+	auto released = std::find_if(m_unmapped.begin(), m_unmapped.end(), [seen](const std::pair<uint64_t, section>& unmapped) { return unmapped.first > seen; });
+	m_unmapped.erase(m_unmapped.begin(), released); // section_memory releases the host mapping
+}
+
+void mapping_manager::save(snapshot_writer& out) {
+	out.put(uint32_t(m_mappings.size()));
+	for (auto& it : m_mappings) {
+		const section& mapping = it.second;
+		out.put_string(m_paths[it.first]);
+		out.put(int32_t(mapping.flags & MUTABLE ? GUEST_MAP_COPY_ON_WRITE : GUEST_MAP_READONLY));
+		out.put(mapping.address);
+		out.put(uint32_t(mapping.sect.size()));
+		if (mapping.flags & MUTABLE) {
+			out.put_memory(mapping.address, mapping.sect.data(), uint32_t(mapping.sect.size()));
+		}
+	}
+}
+
+void mapping_manager::restore(snapshot_reader& in) {
+	for (uint32_t n = in.get<uint32_t>(); n; n--) {
+		std::string path = in.get_string();
+		int32_t flags = in.get<int32_t>();
+		uint32_t addr = in.get<uint32_t>();
+		uint32_t size = in.get<uint32_t>();
+
+		// the file has to be the same size, what it holds isn't checked
+		uint32_t mapped_size = 0;
+		if (map(path.c_str(), flags, addr, mapped_size) != addr || mapped_size != size) {
+			throw std::runtime_error("can't map '" + path + "' again");
+		}
+		if (flags == GUEST_MAP_COPY_ON_WRITE) {
+			in.get_memory(m_mappings[addr]);
+		}
+	}
+}
\ No newline at end of file
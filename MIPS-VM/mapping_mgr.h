@@ -0,0 +1,76 @@
+#pragma once
+#include "pch.h"
+#include "sections.h"
+#include "memory.h"
+#include "snapshot.h"
+
+constexpr uint32_t MAPPING_ALIGNMENT = 0x1000;
+
+enum MAPPING_FLAGS : int32_t {
+	GUEST_MAP_READONLY = 0,
+	GUEST_MAP_COPY_ON_WRITE = 1, // writable, but writes are private to the guest and never reach the file
+};
+
+// Maps host files into the guest address space. Every mapping is its own section which is backed
+// directly by the host mapping, so loads and stores on it take the same path as on any other section.
+class mapping_manager {
+public:
+	// files get mapped into the gap between the heap and the stack, see memory_layout::mapping_area_start
+	mapping_manager(const memory_layout& layout, memory_budget& budget) : m_area_start(layout.mapping_area_start()), m_area_end(layout.mapping_area_end()), m_budget(budget), m_unmaps(0) {}
+
+	// returns the guest address of the mapping, or 0 if the file could not be mapped
+	uint32_t map_file(const char* file, int32_t flags, uint32_t& size);
+	// the guest range is gone right away, but a load or store on another hart may still be using the host memory. It
+	// stays mapped until release_unmapped is told every hart passed a block boundary since
+	bool unmap(uint32_t addr);
+
+	// mappings unmapped so far. A hart that read this at a block boundary holds no pointer into any of them
+	uint64_t unmaps() const { return m_unmaps.load(std::memory_order_acquire); }
+	// releases the host memory of the first `seen` unmapped mappings
+	void release_unmapped(uint64_t seen);
+
+	// the mappings by file, with what the guest wrote to copy-on-write ones. Restoring maps the files again (see checkpoint.h)
+	void save(snapshot_writer& out);
+	void restore(snapshot_reader& in);
+
+	section* get_section_if_valid_mapping(uint32_t addr) {
+		if (addr < m_area_start || addr >= m_area_end) {
+			return nullptr;
+		}
+
+		// other harts may map or unmap files at the same time. The returned section's memory stays valid until
+		// this hart reaches the next block boundary, see unmap
+		std::shared_lock<std::shared_mutex> lock(m_mutex);
+		if (m_mappings.empty()) {
+			return nullptr;
+		}
+
+		// find the last mapping starting at or below addr
+		auto it = m_mappings.upper_bound(addr);
+		if (it == m_mappings.begin()) {
+			return nullptr;
+		}
+		--it;
+
+		if (addr - it->second.address < it->second.sect.size()) {
+			return &it->second;
+		}
+
+		return nullptr;
+	}
+
+private:
+	uint32_t find_free_range(uint32_t size);
+	// map_file at `at`, or wherever there is room if it is 0
+	uint32_t map(const char* file, int32_t flags, uint32_t at, uint32_t& size);
+
+	uint32_t m_area_start;
+	uint32_t m_area_end;
+	memory_budget& m_budget; // mapped files count against the memory limit
+
+	std::map<uint32_t, section> m_mappings; // keyed by guest start address
+	std::map<uint32_t, std::string> m_paths; // absolute path of the file behind each mapping
+	std::vector<std::pair<uint64_t, section>> m_unmapped; // waiting to be released, with their number (m_unmaps once they were unmapped)
+	std::atomic<uint64_t> m_unmaps;
+	std::shared_mutex m_mutex;
+};
\ No newline at end of file
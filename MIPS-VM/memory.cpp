@@ -1,22 +1,286 @@
 #include "pch.h"
 #include "memory.h"
 
-#define STACK_SIZE 0x20000000 // about 500 mb
-#define STACK_TOP 0x7FFFF000
-#define STACK_BOTTOM STACK_TOP - STACK_SIZE
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
 
-stack::stack() {
+// Windows can't overcommit, address space is reserved here and committed as the region grows (see commit_memory and
+// commit_on_access)
+static uint8_t* reserve_memory(size_t size) {
+	return reinterpret_cast<uint8_t*>(VirtualAlloc(nullptr, size, MEM_RESERVE, PAGE_NOACCESS));
+}
+
+static bool commit_memory(uint8_t* mem, size_t size) {
+	return size == 0 || VirtualAlloc(mem, size, MEM_COMMIT, PAGE_READWRITE) != nullptr;
+}
+
+// reservations whose pages are committed by the first access to them, the stack can't tell in advance how deep it goes
+static std::shared_mutex on_access_mutex;
+static std::vector<std::pair<uint8_t*, size_t>> on_access_regions;
+
+static LONG CALLBACK commit_on_access(EXCEPTION_POINTERS* info) {
+	EXCEPTION_RECORD* record = info->ExceptionRecord;
+	if (record->ExceptionCode != EXCEPTION_ACCESS_VIOLATION || record->NumberParameters < 2) {
+		return EXCEPTION_CONTINUE_SEARCH;
+	}
+
+	uint8_t* addr = reinterpret_cast<uint8_t*>(record->ExceptionInformation[1]);
+	std::shared_lock<std::shared_mutex> lock(on_access_mutex);
+	for (auto& region : on_access_regions) {
+		if (addr >= region.first && size_t(addr - region.first) < region.second) {
+			SYSTEM_INFO system;
+			GetSystemInfo(&system);
+			uint8_t* page = region.first + (size_t(addr - region.first) & ~size_t(system.dwPageSize - 1));
+			return commit_memory(page, system.dwPageSize) ? EXCEPTION_CONTINUE_EXECUTION : EXCEPTION_CONTINUE_SEARCH;
+		}
+	}
+	return EXCEPTION_CONTINUE_SEARCH;
+}
+
+static void commit_memory_on_access(uint8_t* mem, size_t size) {
+	static std::once_flag installed;
+	std::call_once(installed, [] { AddVectoredExceptionHandler(1, commit_on_access); });
+
+	std::unique_lock<std::shared_mutex> lock(on_access_mutex);
+	for (auto& region : on_access_regions) {
+		if (region.first == mem) {
+			return; // a recycled stack
+		}
+	}
+	on_access_regions.emplace_back(mem, size);
+}
+
+static void release_memory(uint8_t* mem, size_t size) {
+	{
+		std::unique_lock<std::shared_mutex> lock(on_access_mutex);
+		on_access_regions.erase(std::remove_if(on_access_regions.begin(), on_access_regions.end(), [mem](auto& region) { return region.first == mem; }), on_access_regions.end());
+	}
+	VirtualFree(mem, 0, MEM_RELEASE);
+}
+
+// the range reads as zero again, without holding host pages. Whoever reuses it commits it again, the heap in sbrk and the
+// stack on access
+static void discard_memory(uint8_t* mem, size_t size) {
+	if (size) {
+		VirtualFree(mem, size, MEM_DECOMMIT);
+	}
+}
+
+// lowest page of the range the process has touched (is in the working set), size if there is none
+static size_t lowest_touched_page(uint8_t* mem, size_t size) {
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	size_t page_size = info.dwPageSize;
+
+	std::vector<PSAPI_WORKING_SET_EX_INFORMATION> pages(size / page_size);
+	for (size_t i = 0; i < pages.size(); i++) {
+		pages[i].VirtualAddress = mem + i * page_size;
+	}
+	if (pages.empty() || !K32QueryWorkingSetEx(GetCurrentProcess(), pages.data(), DWORD(pages.size() * sizeof(pages[0])))) {
+		return size;
+	}
+
+	for (size_t i = 0; i < pages.size(); i++) {
+		if (pages[i].VirtualAttributes.Valid) {
+			return i * page_size;
+		}
+	}
+	return size;
+}
+#else
+#include <sys/mman.h>
+
+// zeroed memory that only takes up host pages once they are touched, MAP_NORESERVE keeps big reservations
+// from counting against the overcommit limit
+static uint8_t* reserve_memory(size_t size) {
+	void* mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	return mem == MAP_FAILED ? nullptr : reinterpret_cast<uint8_t*>(mem);
+}
+
+static bool commit_memory(uint8_t* mem, size_t size) {
+	return true; // pages are committed on first touch
+}
+
+static void commit_memory_on_access(uint8_t* mem, size_t size) {
+}
+
+static void release_memory(uint8_t* mem, size_t size) {
+	munmap(mem, size);
+}
+
+// the range reads as zero again, without holding host pages
+static void discard_memory(uint8_t* mem, size_t size) {
+	if (size) {
+		madvise(mem, size, MADV_DONTNEED);
+	}
+}
+
+// lowest page of the range the process has touched (is resident), size if there is none
+static size_t lowest_touched_page(uint8_t* mem, size_t size) {
+	size_t page_size = size_t(sysconf(_SC_PAGESIZE));
+	std::vector<unsigned char> resident((size + page_size - 1) / page_size);
+#ifdef __APPLE__
+	int result = mincore(mem, size, reinterpret_cast<char*>(resident.data()));
+#else
+	int result = mincore(mem, size, resident.data());
+#endif
+	if (result != 0) {
+		return size;
+	}
+
+	for (size_t i = 0; i < resident.size(); i++) {
+		if (resident[i] & 1) {
+			return i * page_size;
+		}
+	}
+	return size;
+}
+#endif
+
+// reservations kept by recycle_guest_memory, a few are enough for a host that runs one machine at a time
+constexpr size_t MAX_RECYCLED = 8;
+
+static std::atomic<bool> recycling(false);
+static std::mutex recycled_mutex;
+static std::vector<std::pair<uint8_t*, size_t>> recycled;
+
+void recycle_guest_memory(bool enable) {
+	recycling = enable;
+	if (enable) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(recycled_mutex);
+	for (auto& region : recycled) {
+		release_memory(region.first, region.second);
+	}
+	recycled.clear();
+}
+
+// a recycled reservation of that size, its pages are all zero. Otherwise a new one
+static uint8_t* reuse_memory(size_t size) {
+	{
+		std::lock_guard<std::mutex> lock(recycled_mutex);
+		for (size_t i = 0; i < recycled.size(); i++) {
+			if (recycled[i].second == size) {
+				uint8_t* mem = recycled[i].first;
+				recycled.erase(recycled.begin() + i);
+				return mem;
+			}
+		}
+	}
+	return reserve_memory(size);
+}
+
+// the owner zeroed what its guest dirtied
+static void recycle_memory(uint8_t* mem, size_t size) {
+	std::lock_guard<std::mutex> lock(recycled_mutex);
+	if (recycling && recycled.size() < MAX_RECYCLED) {
+		recycled.emplace_back(mem, size);
+	}
+	else {
+		release_memory(mem, size);
+	}
+}
+
+static std::string to_hex(uint32_t value) {
+	char buf[16];
+	snprintf(buf, sizeof(buf), "%08X", value);
+	return buf;
+}
+
+uint32_t memory_layout::mapping_area_start() const {
+	uint64_t start = 0x20000000;
+	if (heap_end() > start && heap_start < stack_bottom()) {
+		start = (heap_end() + 0xFFF) & ~uint64_t(0xFFF); // heap reaches into the default mapping area, map above it
+	}
+
+	return uint32_t(std::min<uint64_t>(start, stack_bottom()));
+}
+
+std::string memory_layout::validate() const {
+	auto overlaps = [](uint64_t a_start, uint64_t a_end, uint64_t b_start, uint64_t b_end) {
+		return a_start < b_end && b_start < a_end;
+	};
+
+	if (stack_size == 0 || stack_size > stack_top) {
+		return "stack of " + std::to_string(stack_size) + " bytes doesn't fit below its top 0x" + to_hex(stack_top);
+	}
+	if ((stack_top & 0xFFF) || (stack_size & 0xFFF) || (heap_start & 0xFFF)) {
+		return "stack top, stack size and heap start have to be page aligned";
+	}
+	if (heap_start == 0 || heap_end() > 0x100000000ull) {
+		return "heap of " + std::to_string(heap_size) + " bytes at 0x" + to_hex(heap_start) + " doesn't fit into the address space";
+	}
+	if ((mmio_base & 0x3) || uint64_t(mmio_base) + MMIO_SIZE > 0x100000000ull) {
+		return "MMIO base 0x" + to_hex(mmio_base) + " has to be word aligned with room for the device registers";
+	}
+	if (overlaps(heap_start, heap_end(), stack_bottom(), stack_top)) {
+		return "heap and stack overlap";
+	}
+	if (overlaps(mmio_base, uint64_t(mmio_base) + MMIO_SIZE, heap_start, heap_end()) || overlaps(mmio_base, uint64_t(mmio_base) + MMIO_SIZE, stack_bottom(), stack_top)) {
+		return "MMIO registers overlap the heap or the stack";
+	}
+
+	return "";
+}
+
+bool memory_budget::take(uint64_t bytes) {
+	uint64_t used = m_used.load(std::memory_order_relaxed);
+	do {
+		if (m_limit && (bytes > m_limit || used > m_limit - bytes)) {
+			return false;
+		}
+	} while (!m_used.compare_exchange_weak(used, used + bytes, std::memory_order_relaxed));
+
+	return true;
+}
+
+void memory_budget::give_back(uint64_t bytes) {
+	m_used.fetch_sub(bytes, std::memory_order_relaxed);
+}
+
+stack::stack(const memory_layout& layout) : m_recycled(recycling) {
 	m_stack = section();
-	m_stack.address = STACK_BOTTOM;
-	m_stack.sect.resize(STACK_SIZE, 0);
+	m_stack.address = layout.stack_bottom();
+
+	// most programs use a few pages of the stack, it is committed as the guest reaches them
+	uint8_t* mem = m_recycled ? reuse_memory(layout.stack_size) : reserve_memory(layout.stack_size);
+	if (!mem) {
+		throw std::runtime_error("Failed to reserve " + std::to_string(layout.stack_size) + " bytes for the stack");
+	}
+	commit_memory_on_access(mem, layout.stack_size);
+	m_stack.sect = section_memory(mem, layout.stack_size, m_recycled ? recycle_memory : release_memory);
 }
 
 stack::~stack() {
+	if (m_recycled) {
+		// zeroing the touched pages keeps them, dropping them would cost the next machine a page fault each. The host may have
+		// paged out some of the rest, that is dropped
+		uint32_t depth = touched_depth();
+		size_t untouched = m_stack.sect.size() - depth;
+		discard_memory(m_stack.sect.data(), untouched);
+		memset(m_stack.sect.data() + untouched, 0, depth);
+	}
+}
+
+uint32_t stack::touched_depth() {
+	size_t size = m_stack.sect.size();
+	return uint32_t(size - lowest_touched_page(m_stack.sect.data(), size));
+}
 
+void stack::save(snapshot_writer& out) {
+	uint32_t depth = touched_depth();
+	out.put_memory(m_stack.address + uint32_t(m_stack.sect.size()) - depth, m_stack.sect.data() + m_stack.sect.size() - depth, depth);
+}
+
+void stack::restore(snapshot_reader& in) {
+	in.get_memory(m_stack);
 }
 
 section* stack::get_section_if_valid_stack(uint32_t addr) {
-	if (addr >= STACK_BOTTOM && addr < STACK_TOP) {
+	if (addr >= m_stack.address && addr - m_stack.address < m_stack.sect.size()) {
 		return &m_stack;
 	}
 
@@ -24,8 +288,8 @@ section* stack::get_section_if_valid_stack(uint32_t addr) {
 }
 
 bool stack::is_safe_access(uint32_t addr, uint32_t size) {
-	if (addr < STACK_BOTTOM || addr >= STACK_TOP ||
-		addr + size < STACK_BOTTOM || addr + size > STACK_TOP) {
+	uint64_t end = uint64_t(m_stack.address) + m_stack.sect.size();
+	if (addr < m_stack.address || uint64_t(addr) + size > end) {
 		return false;
 	}
 
@@ -33,37 +297,75 @@ bool stack::is_safe_access(uint32_t addr, uint32_t size) {
 }
 
 
-#define SBRK_HEAP_START 0x01000000
-#define SBRK_HEAP_END 0x04000000
-
-heap::heap() {
-	m_heap_offset = 0;
-
+heap::heap(const memory_layout& layout, memory_budget& budget) : m_budget(budget), m_limit(layout.heap_size), m_recycled(recycling) {
 	m_heap = section();
-	m_heap.address = SBRK_HEAP_START;
-	m_heap.sect.resize(SBRK_HEAP_END - SBRK_HEAP_START, 0);
+	m_heap.address = layout.heap_start;
+
+	// reserve the whole limit up front so the heap never has to move, it starts out empty
+	uint8_t* mem = m_limit ? (m_recycled ? reuse_memory(m_limit) : reserve_memory(m_limit)) : nullptr;
+	if (m_limit && !mem) {
+		throw std::runtime_error("Failed to reserve " + std::to_string(m_limit) + " bytes for the heap");
+	}
+	m_heap.sect = section_memory(mem, 0, m_limit, m_recycled ? recycle_memory : release_memory);
 }
 
 heap::~heap() {
-
+	if (m_recycled && m_heap.sect.data()) {
+		memset(m_heap.sect.data(), 0, m_heap.sect.size()); // the guest can't reach past the break, and it never goes down
+	}
 }
 
 uint32_t heap::sbrk(int32_t bytes) {
 	if (bytes < 0) {
 		throw std::runtime_error("Can't allocate negative amount of bytes with sbrk");
 	}
-	if (bytes > m_heap.sect.size() - m_heap_offset) {
-		throw std::runtime_error("Out of heap memory for sbrk");
+
+	uint32_t size = uint32_t(m_heap.sect.size());
+	if (uint32_t(bytes) > m_limit - size) {
+		throw std::runtime_error("Out of heap memory for sbrk (heap limit is " + std::to_string(m_limit) + " bytes)");
+	}
+	if (!m_budget.take(uint32_t(bytes))) {
+		throw std::runtime_error("Out of guest memory for sbrk (memory limit is " + std::to_string(m_budget.limit()) + " bytes)");
+	}
+	if (!commit_memory(m_heap.sect.data() + size, bytes)) {
+		m_budget.give_back(uint32_t(bytes));
+		throw std::runtime_error("Host is out of memory for sbrk");
 	}
 
-	uint32_t addr = SBRK_HEAP_START + m_heap_offset;
-	m_heap_offset += bytes;
+	uint32_t addr = m_heap.address + size;
+	m_heap.sect.resize(size + bytes); // publishes the new break, other harts' lookups see committed memory behind it
 
 	return addr;
 }
 
+uint32_t heap::start() {
+	return m_heap.address;
+}
+
+uint32_t heap::brk() {
+	return m_heap.address + uint32_t(m_heap.sect.size());
+}
+
+uint32_t heap::limit() {
+	return m_limit;
+}
+
+void heap::save(snapshot_writer& out) {
+	out.put(uint32_t(m_heap.sect.size()));
+	out.put_memory(m_heap.address, m_heap.sect.data(), uint32_t(m_heap.sect.size()));
+}
+
+void heap::restore(snapshot_reader& in) {
+	uint32_t size = in.get<uint32_t>();
+	if (size < m_heap.sect.size()) {
+		throw std::runtime_error("checkpoint's heap is smaller than the heap already in use");
+	}
+	sbrk(int32_t(size - m_heap.sect.size()));
+	in.get_memory(m_heap);
+}
+
 section* heap::get_section_if_valid_heap(uint32_t addr) {
-	if (addr >= SBRK_HEAP_START && addr < SBRK_HEAP_END) {
+	if (addr >= m_heap.address && addr - m_heap.address < m_heap.sect.size()) {
 		return &m_heap;
 	}
 
@@ -71,8 +373,8 @@ section* heap::get_section_if_valid_heap(uint32_t addr) {
 }
 
 bool heap::is_safe_access(uint32_t addr, uint32_t size) {
-	if (addr < SBRK_HEAP_START || addr >= SBRK_HEAP_END ||
-		addr + size < SBRK_HEAP_START || addr + size > SBRK_HEAP_END) {
+	uint64_t end = uint64_t(m_heap.address) + m_heap.sect.size();
+	if (addr < m_heap.address || uint64_t(addr) + size > end) {
 		return false;
 	}
 
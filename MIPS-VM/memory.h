@@ -1,34 +1,98 @@
 #pragma once
 #include "pch.h"
 #include "sections.h"
+#include "snapshot.h"
 
+constexpr uint32_t MMIO_SIZE = 0x1C; // registers of the standard devices at memory_layout::mmio_base, see device_bus.h
 
-// stack has a maximum size of 500mbs
+// Placement and size limits of the stack, the sbrk heap and the MMIO registers in the guest address space.
+// The defaults are the classic layout, every field can be changed from the command line.
+struct memory_layout {
+	memory_layout() : stack_top(0x7FFFF000), stack_size(0x20000000), heap_start(0x01000000), heap_size(0x03000000), mmio_base(0xFFFF0000), memory_limit(0) {}
+
+	uint32_t stack_top; // first address above the stack
+	uint32_t stack_size;
+	uint32_t heap_start;
+	uint32_t heap_size; // the heap grows on demand up to this size
+	uint32_t mmio_base;
+	uint64_t memory_limit; // total guest memory (sections, stack, heap and mapped files), 0 for no limit
+
+	uint32_t stack_bottom() const { return stack_top - stack_size; }
+	uint64_t heap_end() const { return uint64_t(heap_start) + heap_size; }
+
+	// guest range host files get mapped into, the gap between the heap (or 0x20000000, whichever is higher) and the stack
+	uint32_t mapping_area_start() const;
+	uint32_t mapping_area_end() const { return stack_bottom(); }
+
+	// empty if the layout is usable, otherwise what is wrong with it
+	std::string validate() const;
+};
+
+// Accounts guest memory against memory_layout::memory_limit. The heap and the mapping manager take from it
+// under different locks, so it is atomic by itself.
+class memory_budget {
+public:
+	memory_budget(uint64_t limit) : m_limit(limit), m_used(0) {}
+
+	bool take(uint64_t bytes);
+	void give_back(uint64_t bytes);
+
+	uint64_t used() const { return m_used.load(std::memory_order_relaxed); }
+	uint64_t limit() const { return m_limit; }
+
+private:
+	uint64_t m_limit; // 0 for no limit
+	std::atomic<uint64_t> m_used;
+};
+
+// Keep the stack and heap reservations of machines that went away for the next machine with the same sizes instead of giving
+// them back to the host. Only the pages the guest dirtied are zeroed again, so a new machine costs no fresh page faults either.
+// For hosts that set up one short-lived machine after another (fuzz.h), off by default
+void recycle_guest_memory(bool enable);
+
+// the stack is reserved in full, but host pages only get committed once the guest touches them
 class stack {
 public:
-	stack();
+	stack(const memory_layout& layout);
 	~stack();
 
 	section* get_section_if_valid_stack(uint32_t addr);
 	bool is_safe_access(uint32_t addr, uint32_t size);
+	// bytes from the stack top down to the lowest page the guest touched, asks the host so it costs nothing while running.
+	// A recycled stack counts what earlier machines touched as well
+	uint32_t touched_depth();
+
+	// the touched part, see checkpoint.h
+	void save(snapshot_writer& out);
+	void restore(snapshot_reader& in);
 
 private:
 
 	section m_stack;
+	bool m_recycled; // goes back to recycle_guest_memory's regions
 };
 
-// heap has a maximum size of about 50mbs
+// the heap reserves address space for its whole limit, sbrk moves the break and only memory below the break is accessible
 class heap {
 public:
-	heap();
+	heap(const memory_layout& layout, memory_budget& budget);
 	~heap();
 
 	uint32_t sbrk(int32_t bytes);
+	uint32_t start();
+	uint32_t brk(); // current end of the heap
+	uint32_t limit(); // maximum size the heap may grow to
 	section* get_section_if_valid_heap(uint32_t addr);
 	bool is_safe_access(uint32_t addr, uint32_t size);
+
+	// the break and everything below it, see checkpoint.h
+	void save(snapshot_writer& out);
+	void restore(snapshot_reader& in);
 	
 private:
 
-	uint32_t m_heap_offset;
+	memory_budget& m_budget;
+	uint32_t m_limit;
 	section m_heap;
+	bool m_recycled;
 };
\ No newline at end of file
@@ -0,0 +1,31 @@
+#pragma once
+#include "pch.h"
+#include "memory.h"
+#include "aot.h"
+#include "guest_io.h"
+#include "display.h"
+#include "checkpoint.h"
+
+// Settings for a VM instance, filled in from the command line by entry.cpp
+struct vm_options {
+	vm_options() : debug(false), harts(1), big_endian(false), quiet(false), interpret(false), translated(nullptr), input(nullptr), output(nullptr) {}
+
+	std::string program;
+	std::string symbols; // "label address" file for the debugger, defaults to <program>.sym
+	bool debug; // stop in the debugger before the first instruction
+	uint32_t harts; // number of hardware threads sharing the address space, each runs on its own host thread
+	std::string gdb; // serve the GDB remote protocol on this address instead of using the built-in debugger
+	std::vector<std::string> plugins; // native syscall plugins (shared libraries) to load
+	std::string report; // write a JSON (or CSV, by extension) run report to this file at exit
+	bool big_endian; // the program is a big-endian MIPS image
+	memory_layout layout; // where the stack, heap and MMIO live and how much memory the guest may use
+	std::string cache; // translation cache directory, see translation_cache.h
+	display_options display; // bitmap display, off unless it has a size
+	checkpoint_options checkpoint; // periodic checkpoints and resuming from one
+	bool quiet; // no banners, errors only end up in the exit reason (the test runner runs many programs at once)
+	bool interpret; // never run translated blocks, the interpreter of a differential run (lockstep.h)
+	const aot_program* translated; // set by a translated runner, sections come from it and its blocks run natively
+	const std::string* input; // the guest's stdin, nullptr for the host's
+	output_sink* output; // the guest's stdout, nullptr for the host's
+	std::string sandbox; // for an untrusted guest (fuzz.h): files it opens or maps have to be below this directory and SLEEP doesn't wait
+};
\ No newline at end of file
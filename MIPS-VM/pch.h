@@ -6,6 +6,9 @@
 #include <fstream>
 #include <sstream>
 #include <unordered_map>
+#include <unordered_set>
+#include <map>
+#include <set>
 #include <algorithm>
 #include <limits>
 #include <thread>
@@ -15,10 +18,31 @@
 #include <bitset>
 #include <random>
 #include <stack>
+#include <deque>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cerrno>
+#include <cstdarg>
+#include <filesystem>
+#include <string_view>
+
+// SSE2 is part of every x86-64 target, helper.h uses it for scanning guest memory
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define MIPS_VM_SSE2
+#include <emmintrin.h>
+#endif
 
 // Platform specific includes used for getch and kbhit
 #ifdef _WIN32
 #include <conio.h>
+#include <intrin.h>
+#include <io.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #else
 #include <termios.h>
 #include <unistd.h>
@@ -0,0 +1,73 @@
+#pragma once
+// C ABI for native syscall plugins. This header is all a plugin needs, it doesn't depend on anything else in the VM.
+//
+// A plugin is a shared library exporting `mips_vm_plugin_init`. The VM calls it once per process (--plugin <file>),
+// and the plugin registers its syscalls through the host API it is handed. Syscall handlers get an opaque guest
+// handle for the hart that made the call, all register and memory access goes through the bounds checked host API.
+//
+// The ABI only grows: new host functions are appended to mips_vm_host_api and `size` tells which ones exist.
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MIPS_VM_PLUGIN_API_VERSION 1
+
+#ifdef _WIN32
+#define MIPS_VM_PLUGIN_EXPORT __declspec(dllexport)
+#else
+#define MIPS_VM_PLUGIN_EXPORT __attribute__((visibility("default")))
+#endif
+
+// register indices for get_reg/set_reg, 0-31 are the general purpose registers
+#define MIPS_VM_REG_V0 2
+#define MIPS_VM_REG_V1 3
+#define MIPS_VM_REG_A0 4
+#define MIPS_VM_REG_A1 5
+#define MIPS_VM_REG_A2 6
+#define MIPS_VM_REG_A3 7
+#define MIPS_VM_REG_HI 32
+#define MIPS_VM_REG_LO 33
+
+// flags for register_syscall
+#define MIPS_VM_SYSCALL_THREAD_SAFE 1 // the handler only touches guest memory and its own synchronized state, other harts may run syscalls at the same time
+
+// opaque, the hart running the syscall. Only valid during the handler call
+typedef struct mips_vm_guest mips_vm_guest;
+
+// returns 0 on success. On failure the VM raises the address error of the failed memory access that caused it,
+// or a syscall exception with the message passed to set_error
+typedef int (*mips_vm_syscall_fn)(mips_vm_guest* guest, void* user);
+
+typedef struct mips_vm_host_api {
+	uint32_t version; // MIPS_VM_PLUGIN_API_VERSION of the VM
+	uint32_t size; // sizeof(mips_vm_host_api) of the VM
+
+	// syscall numbers from 50 up, the same range RegisterUserSyscall uses. Returns 0 on success, -1 if the number is taken or out of range
+	int (*register_syscall)(void* host, uint32_t number, mips_vm_syscall_fn fn, void* user, uint32_t flags);
+	void* host; // passed back to register_syscall, only callable from mips_vm_plugin_init
+
+	uint32_t (*get_reg)(mips_vm_guest* guest, uint32_t index);
+	void (*set_reg)(mips_vm_guest* guest, uint32_t index, uint32_t value);
+
+	// copy between guest memory and a host buffer, 0 on success and -1 if the range isn't accessible
+	int (*read)(mips_vm_guest* guest, uint32_t addr, void* dst, uint32_t size);
+	int (*write)(mips_vm_guest* guest, uint32_t addr, const void* src, uint32_t size);
+
+	// direct pointer to guest memory for [addr, addr + size), NULL if the range isn't accessible (or not writable when asked for).
+	// The range has to lie within one region (a section, the heap, the stack or a mapping). Only valid during the handler call
+	uint8_t* (*map)(mips_vm_guest* guest, uint32_t addr, uint32_t size, int writable);
+
+	// message for the syscall exception raised when the handler fails
+	void (*set_error)(mips_vm_guest* guest, const char* message);
+} mips_vm_host_api;
+
+// exported by the plugin, returns 0 on success. The api pointer stays valid while the plugin is loaded
+typedef int (*mips_vm_plugin_init_fn)(const mips_vm_host_api* api);
+#define MIPS_VM_PLUGIN_INIT_SYMBOL "mips_vm_plugin_init"
+
+#ifdef __cplusplus
+}
+#endif
\ No newline at end of file
@@ -0,0 +1,234 @@
+#include "pch.h"
+#include "plugin_mgr.h"
+#include "executor.h"
+
+#ifdef _WIN32
+#include <windows.h>
+
+static void* open_library(const std::string& file, std::string& error) {
+	HMODULE lib = LoadLibraryA(file.c_str());
+	if (!lib) {
+		error = "error " + std::to_string(GetLastError());
+	}
+	return lib;
+}
+
+static void* find_symbol(void* lib, const char* name) {
+	return reinterpret_cast<void*>(GetProcAddress(reinterpret_cast<HMODULE>(lib), name));
+}
+
+static void close_library(void* lib) {
+	FreeLibrary(reinterpret_cast<HMODULE>(lib));
+}
+#else
+#include <dlfcn.h>
+
+static void* open_library(const std::string& file, std::string& error) {
+	// a bare file name would make dlopen search the library path instead of the current directory
+	std::string path = file.find('/') == std::string::npos ? "./" + file : file;
+	void* lib = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+	if (!lib) {
+		error = dlerror();
+	}
+	return lib;
+}
+
+static void* find_symbol(void* lib, const char* name) {
+	return dlsym(lib, name);
+}
+
+static void close_library(void* lib) {
+	dlclose(lib);
+}
+#endif
+
+// the guest handle plugins get, lives on the stack of invoke() for the duration of one syscall
+struct mips_vm_guest {
+	mips_vm_guest(executor& hart) : vm(hart), faulted(false), fault_store(false), fault_addr(0) {}
+
+	executor& vm;
+
+	// first failed memory access, raised as an address error if the handler fails
+	bool faulted;
+	bool fault_store;
+	uint32_t fault_addr;
+	std::string error;
+};
+
+// a plugin loaded into the process and the syscalls its init registered
+struct loaded_plugin {
+	struct registration {
+		uint32_t number;
+		mips_vm_syscall_fn fn;
+		void* user;
+		uint32_t flags;
+	};
+
+	loaded_plugin() : lib(nullptr), result(0) {}
+
+	void* lib;
+	int result; // of mips_vm_plugin_init, -1 if the library couldn't be loaded
+	std::string error; // printed again by every machine that asks for a plugin that failed
+	std::vector<registration> syscalls;
+};
+
+// every plugin of the process by absolute path. The mutex serializes loading, so no two inits run at the same time
+static std::mutex plugins_mutex;
+static std::unordered_map<std::string, loaded_plugin> loaded_plugins;
+static loaded_plugin* initializing_plugin; // the one whose init is running, under plugins_mutex
+
+const mips_vm_host_api* plugin_manager::host_api() {
+	static const mips_vm_host_api api = [] {
+		mips_vm_host_api api = mips_vm_host_api();
+		api.version = MIPS_VM_PLUGIN_API_VERSION;
+		api.size = sizeof(mips_vm_host_api);
+		api.register_syscall = &plugin_manager::register_syscall;
+		api.host = nullptr;
+		api.get_reg = &plugin_manager::get_reg;
+		api.set_reg = &plugin_manager::set_reg;
+		api.read = &plugin_manager::read;
+		api.write = &plugin_manager::write;
+		api.map = &plugin_manager::map;
+		api.set_error = &plugin_manager::set_error;
+		return api;
+	}();
+	return &api;
+}
+
+bool plugin_manager::load(const std::string& file) {
+	std::lock_guard<std::mutex> lock(plugins_mutex);
+
+	std::error_code ec;
+	std::string key = std::filesystem::absolute(file, ec).lexically_normal().string();
+	auto it = loaded_plugins.find(key);
+	if (it == loaded_plugins.end()) {
+		loaded_plugin& plugin = loaded_plugins[key];
+		std::string error;
+		plugin.lib = open_library(file, error);
+		if (!plugin.lib) {
+			plugin.result = -1;
+			plugin.error = "Failed to load plugin '" + file + "': " + error;
+		}
+		else if (auto init = reinterpret_cast<mips_vm_plugin_init_fn>(find_symbol(plugin.lib, MIPS_VM_PLUGIN_INIT_SYMBOL))) {
+			// syscalls it registered before failing point into it, it stays loaded either way
+			initializing_plugin = &plugin;
+			plugin.result = init(host_api());
+			initializing_plugin = nullptr;
+			if (plugin.result != 0) {
+				plugin.error = "Plugin '" + file + "' failed to initialize (" + std::to_string(plugin.result) + ")";
+			}
+		}
+		else {
+			plugin.result = -1;
+			plugin.error = "Plugin '" + file + "' doesn't export " + MIPS_VM_PLUGIN_INIT_SYMBOL;
+		}
+		it = loaded_plugins.find(key);
+	}
+
+	const loaded_plugin& plugin = it->second;
+	if (plugin.result != 0) {
+		printf("%s\n", plugin.error.c_str());
+		return false;
+	}
+	for (const loaded_plugin::registration& r : plugin.syscalls) {
+		if (!m_table.register_plugin(r.number, r.fn, r.user, !(r.flags & MIPS_VM_SYSCALL_THREAD_SAFE))) {
+			printf("Plugin '%s' can't register syscall %u, another plugin has it\n", file.c_str(), r.number);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void plugin_manager::invoke(executor& vm, const syscall_table::entry& entry, uint32_t number) {
+	mips_vm_guest guest(vm);
+	if (entry.plugin(&guest, entry.plugin_user) == 0) {
+		return;
+	}
+
+	if (guest.faulted) {
+		if (guest.fault_store) {
+			throw mips_exception_store("Invalid memory access for plugin syscall " + std::to_string(number), guest.fault_addr);
+		}
+		throw mips_exception_load("Invalid memory access for plugin syscall " + std::to_string(number), guest.fault_addr);
+	}
+	throw mips_exception_syscall("Plugin syscall " + std::to_string(number) + " failed" + (guest.error.empty() ? "" : ": " + guest.error));
+}
+
+int plugin_manager::register_syscall(void* host, uint32_t number, mips_vm_syscall_fn fn, void* user, uint32_t flags) {
+	// only while the plugin's init runs, the syscalls go into the table of every machine that loads it
+	loaded_plugin* plugin = initializing_plugin;
+	if (!plugin || !fn || number < FIRST_CUSTOM_SYSCALL || number >= MAX_SYSCALLS) {
+		return -1;
+	}
+	for (const loaded_plugin::registration& r : plugin->syscalls) {
+		if (r.number == number) {
+			return -1;
+		}
+	}
+
+	plugin->syscalls.push_back({ number, fn, user, flags });
+	return 0;
+}
+
+uint32_t plugin_manager::get_reg(mips_vm_guest* guest, uint32_t index) {
+	registers& regs = guest->vm.m_regs;
+	if (index < 32) {
+		return regs.regs[index];
+	}
+	if (index == MIPS_VM_REG_HI) {
+		return regs.hi;
+	}
+	if (index == MIPS_VM_REG_LO) {
+		return regs.lo;
+	}
+
+	return 0;
+}
+
+void plugin_manager::set_reg(mips_vm_guest* guest, uint32_t index, uint32_t value) {
+	registers& regs = guest->vm.m_regs;
+	if (index > 0 && index < 32) { // $zero stays zero
+		regs.regs[index] = value;
+	}
+	else if (index == MIPS_VM_REG_HI) {
+		regs.hi = value;
+	}
+	else if (index == MIPS_VM_REG_LO) {
+		regs.lo = value;
+	}
+}
+
+int plugin_manager::read(mips_vm_guest* guest, uint32_t addr, void* dst, uint32_t size) {
+	uint8_t* mem = map(guest, addr, size, false);
+	if (!mem) {
+		return -1;
+	}
+
+	memcpy(dst, mem, size);
+	return 0;
+}
+
+int plugin_manager::write(mips_vm_guest* guest, uint32_t addr, const void* src, uint32_t size) {
+	uint8_t* mem = map(guest, addr, size, true);
+	if (!mem) {
+		return -1;
+	}
+
+	memcpy(mem, src, size);
+	return 0;
+}
+
+uint8_t* plugin_manager::map(mips_vm_guest* guest, uint32_t addr, uint32_t size, int writable) {
+	uint8_t* mem = guest->vm.guest_memory(addr, size, writable != 0);
+	if (!mem && !guest->faulted) {
+		guest->faulted = true;
+		guest->fault_store = writable != 0;
+		guest->fault_addr = addr;
+	}
+	return mem;
+}
+
+void plugin_manager::set_error(mips_vm_guest* guest, const char* message) {
+	guest->error = message ? message : "";
+}
\ No newline at end of file
@@ -0,0 +1,33 @@
+#pragma once
+#include "pch.h"
+#include "plugin_api.h"
+#include "syscall_table.h"
+
+class executor;
+
+// Loads native syscall plugins (shared libraries, see plugin_api.h) and implements the host side of their ABI.
+// A plugin is loaded and initialized once per process with one host API table, every machine that asks for it (the
+// test runner sets up one per case) gets the syscalls it registered then. Plugins stay loaded until the process ends.
+class plugin_manager {
+public:
+	plugin_manager(syscall_table& table) : m_table(table) {}
+
+	bool load(const std::string& file);
+
+	// runs the plugin handler of `entry` on the hart, throws the guest exception if the handler fails
+	static void invoke(executor& vm, const syscall_table::entry& entry, uint32_t number);
+
+private:
+	// host API, see mips_vm_host_api
+	static int register_syscall(void* host, uint32_t number, mips_vm_syscall_fn fn, void* user, uint32_t flags);
+	static uint32_t get_reg(mips_vm_guest* guest, uint32_t index);
+	static void set_reg(mips_vm_guest* guest, uint32_t index, uint32_t value);
+	static int read(mips_vm_guest* guest, uint32_t addr, void* dst, uint32_t size);
+	static int write(mips_vm_guest* guest, uint32_t addr, const void* src, uint32_t size);
+	static uint8_t* map(mips_vm_guest* guest, uint32_t addr, uint32_t size, int writable);
+	static void set_error(mips_vm_guest* guest, const char* message);
+
+	static const mips_vm_host_api* host_api();
+
+	syscall_table& m_table;
+};
\ No newline at end of file
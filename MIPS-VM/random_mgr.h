@@ -1,39 +1,120 @@
 #pragma once
 #include "pch.h"
+#include "snapshot.h"
+
+// PCG32 (XSH RR 64/32) generator, 16 bytes of state.
+// A stream seeded with SET_SEED(id, seed) produces exactly the sequence of the reference
+// pcg32_srandom_r(&rng, seed, id) / pcg32_random_r(&rng) implementation, so every id is its own stream.
+struct pcg32 {
+	pcg32() : state(0), inc(1) {}
+	pcg32(uint64_t seed, uint64_t seq) {
+		state = 0;
+		inc = (seq << 1) | 1;
+		next();
+		state += seed;
+		next();
+	}
+
+	uint32_t next() {
+		uint64_t old = state;
+		state = old * 6364136223846793005ULL + inc;
+		uint32_t xorshifted = uint32_t(((old >> 18) ^ old) >> 27);
+		uint32_t rot = uint32_t(old >> 59);
+		return (xorshifted >> rot) | (xorshifted << ((0u - rot) & 31));
+	}
+
+	uint64_t state;
+	uint64_t inc;
+};
 
 class random_mgr {
 public:
+	// the host's entropy is read once per process, every machine gets a stream of its own from it (fuzz.h sets up
+	// thousands of machines a second, a random_device costs as much as the rest of one)
 	random_mgr() {
-		std::random_device rd;
-		m_gen = std::mt19937(rd());
+		static const uint64_t entropy = []() {
+			std::random_device rd;
+			return (uint64_t(rd()) << 32) | rd();
+		}();
+		static std::atomic<uint64_t> machines(0);
+		m_gen = pcg32(entropy, machines.fetch_add(1, std::memory_order_relaxed));
+	}
+
+	// streams without a SET_SEED start from this instead of a random seed, for runs that have to be reproducible
+	void seed(uint64_t seed) {
+		m_gen = pcg32(seed, 0);
 	}
 
 	void set_seed(uint32_t id, uint32_t seed) {
-		std::mt19937 gen(seed);
-		m_generators[id] = gen;
+		m_generators[id] = pcg32(seed, id);
 	}
 
 	uint32_t get_int(uint32_t id) {
-		auto gen = get_gen(id);
-		std::uniform_int_distribution<uint32_t> dist(0, std::numeric_limits<uint32_t>::max());
-		return dist(gen);
+		return get_gen(id).next();
 	}
 
+	// uniformly distributed in [0, max], unbiased (Lemire's multiply-shift rejection)
 	uint32_t get_int_range(uint32_t id, uint32_t max) {
-		auto gen = get_gen(id);
-		std::uniform_int_distribution<uint32_t> dist(0, max);
-		return dist(gen);
+		pcg32& gen = get_gen(id);
+
+		uint32_t range = max + 1;
+		if (range == 0) {
+			return gen.next(); // full 32 bit range
+		}
+
+		uint64_t m = uint64_t(gen.next()) * range;
+		uint32_t low = uint32_t(m);
+		if (low < range) {
+			uint32_t threshold = (0u - range) % range;
+			while (low < threshold) {
+				m = uint64_t(gen.next()) * range;
+				low = uint32_t(m);
+			}
+		}
+
+		return uint32_t(m >> 32);
 	}
 
+	// uniformly distributed in [0, 1), uses the top 24 bits of one output
 	float get_float(uint32_t id) {
-		auto gen = get_gen(id);
-		std::uniform_real_distribution<float> dist(0.f, 1.f);
-		return dist(gen);
+		return (get_gen(id).next() >> 8) * (1.f / 16777216.f);
+	}
+
+	// fill a (possibly unaligned) buffer with `words` consecutive outputs of the stream
+	void fill(uint32_t id, uint8_t* buf, uint32_t words) {
+		pcg32& stored = get_gen(id);
+		pcg32 gen = stored; // work on a local copy so the state stays in registers, written back below
+
+		for (uint32_t i = 0; i < words; i++) {
+			uint32_t val = gen.next();
+			memcpy(buf + i * sizeof(uint32_t), &val, sizeof(uint32_t));
+		}
+
+		stored = gen;
+	}
+
+	// every stream where it is, see checkpoint.h
+	void save(snapshot_writer& out) {
+		out.put(m_gen);
+		out.put(uint32_t(m_generators.size()));
+		for (auto& gen : m_generators) {
+			out.put(gen.first);
+			out.put(gen.second);
+		}
+	}
+
+	void restore(snapshot_reader& in) {
+		m_gen = in.get<pcg32>();
+		m_generators.clear();
+		for (uint32_t n = in.get<uint32_t>(); n; n--) {
+			uint32_t id = in.get<uint32_t>();
+			m_generators[id] = in.get<pcg32>();
+		}
 	}
 
 private:
 
-	std::mt19937 get_gen(uint32_t id) {
+	pcg32& get_gen(uint32_t id) {
 		auto gen = m_generators.find(id);
 		if (gen == m_generators.end()) {
 			return m_gen; // this id does not have a set seed, fall back to normal random
@@ -43,6 +124,6 @@ private:
 		}
 	}
 
-	std::mt19937 m_gen;
-	std::unordered_map<uint32_t, std::mt19937> m_generators;
+	pcg32 m_gen;
+	std::unordered_map<uint32_t, pcg32> m_generators;
 };
\ No newline at end of file
@@ -0,0 +1,272 @@
+#include "pch.h"
+#include "random_program.h"
+#include "instruction.h"
+#include "registers.h"
+#include "sections.h"
+#include "exceptions.h"
+
+constexpr uint32_t TEXT_ADDRESS = 0x00400000;
+constexpr uint32_t DATA_ADDRESS = 0x10010000;
+constexpr uint32_t DATA_SIZE = 0x400;
+
+constexpr uint32_t BASE = uint32_t(register_names::s0); // holds DATA_ADDRESS throughout
+constexpr uint32_t COUNTER = uint32_t(register_names::s1); // loop counter, then the checksum
+constexpr uint32_t MAX_SKIP = 4; // instructions a forward branch or jump skips at most
+constexpr uint32_t MAX_LOOP_BODY = 6;
+constexpr uint32_t MAX_LOOP_COUNT = 8;
+
+// what random instructions write, $s0, $s1 and the registers the handler and the epilogue use are left alone
+static const uint32_t pool[] = {
+	2, 3, 4, 5, 6, 7, // $v0-$v1, $a0-$a3
+	8, 9, 10, 11, 12, 13, 14, 15, 24, 25, // $t0-$t9
+	18, 19, 20, 21, 22, 23, // $s2-$s7
+};
+
+static const uint32_t boundary_values[] = {
+	0, 1, 2, 0xFFFFFFFF, 0x7FFFFFFF, 0x80000000, 0x7FFF, 0x8000, 0xFFFF, 0xFFFF8000,
+};
+
+static uint32_t encode_r(uint32_t rs, uint32_t rt, uint32_t rd, uint32_t shift, funct fn) {
+	return (rs << 21) | (rt << 16) | (rd << 11) | (shift << 6) | uint32_t(fn);
+}
+
+static uint32_t encode_i(instructions op, uint32_t rs, uint32_t rt, uint32_t imm) {
+	return (uint32_t(op) << 26) | (rs << 21) | (rt << 16) | (imm & 0xFFFF);
+}
+
+random_program::random_program(uint64_t seed, uint32_t length) : m_gen(seed, 0) {
+	for (uint32_t i = 0; i < DATA_SIZE / sizeof(uint32_t); i++) {
+		m_data.push_back(value());
+	}
+
+	// the exception handler goes on after the faulting instruction: epc += 4
+	const uint32_t k0 = uint32_t(register_names::k0);
+	m_ktext.push_back(encode_i(instructions::MFC0, 0, k0, 14 << 11));
+	m_ktext.push_back(encode_i(instructions::ADDIU, k0, k0, 4));
+	m_ktext.push_back(encode_i(instructions::MFC0, 4, k0, 14 << 11));
+	m_ktext.push_back(0x42000018); // ERET
+
+	m_text.push_back(encode_i(instructions::LUI, 0, BASE, DATA_ADDRESS >> 16));
+	for (uint32_t reg : pool) {
+		uint32_t init = value();
+		m_text.push_back(encode_i(instructions::LUI, 0, reg, init >> 16));
+		m_text.push_back(encode_i(instructions::ORI, reg, reg, init));
+	}
+
+	size_t end = m_text.size() + length;
+	while (m_text.size() < end) {
+		uint32_t remaining = uint32_t(end - m_text.size() - 1); // after the next instruction
+		uint32_t kind = next(100);
+		if (kind < 8) {
+			emit_branch(remaining);
+		}
+		else if (kind < 11 && remaining >= MAX_LOOP_BODY + 3) {
+			emit_loop();
+		}
+		else {
+			emit_simple();
+		}
+	}
+	emit_epilogue();
+}
+
+uint32_t random_program::next(uint32_t bound) {
+	return uint32_t((uint64_t(m_gen.next()) * bound) >> 32);
+}
+
+uint32_t random_program::value() {
+	// boundary values make overflows, traps and equal operands likely
+	if (next(4) == 0) {
+		return boundary_values[next(uint32_t(std::size(boundary_values)))];
+	}
+	return next(2) ? m_gen.next() : next(64) - 32;
+}
+
+uint32_t random_program::immediate() {
+	switch (next(4)) {
+	case 0:
+		return next(17) - 8;
+	case 1:
+		return next(2) ? 0x7FFF : 0x8000;
+	default:
+		return m_gen.next() & 0xFFFF;
+	}
+}
+
+uint32_t random_program::source() {
+	switch (next(16)) {
+	case 0:
+		return 0;
+	case 1:
+		return BASE;
+	default:
+		return pool[next(uint32_t(std::size(pool)))];
+	}
+}
+
+uint32_t random_program::destination() {
+	return next(32) ? pool[next(uint32_t(std::size(pool)))] : 0; // writes to $zero are dropped
+}
+
+void random_program::emit_simple() {
+	static const funct alu[] = { funct::ADD, funct::ADD, funct::ADDU, funct::SUB, funct::SUB, funct::SUBU, funct::AND, funct::OR, funct::XOR,
+		funct::NOR, funct::SLT, funct::SLTU };
+	static const funct shifts[] = { funct::SLL, funct::SRL, funct::SRA };
+	static const instructions alu_imm[] = { instructions::ADDI, instructions::ADDI, instructions::ADDIU, instructions::SLTI, instructions::SLTIU,
+		instructions::ANDI, instructions::ORI, instructions::LUI };
+	static const funct hi_lo[] = { funct::MULT, funct::MULTU, funct::DIV, funct::DIVU };
+	static const funct traps[] = { funct::TGE, funct::TGEU, funct::TLT, funct::TLTU, funct::TEQ, funct::TNE };
+	static const imm_trap_instructions imm_traps[] = { imm_trap_instructions::TGEI, imm_trap_instructions::TGEIU, imm_trap_instructions::TLTI,
+		imm_trap_instructions::TLTIU, imm_trap_instructions::TEQI, imm_trap_instructions::TNEI };
+	static const instructions loads[] = { instructions::LW, instructions::LH, instructions::LHU, instructions::LB, instructions::LBU };
+	static const uint32_t load_sizes[] = { 4, 2, 2, 1, 1 };
+	static const instructions stores[] = { instructions::SW, instructions::SH, instructions::SB };
+	static const uint32_t store_sizes[] = { 4, 2, 1 };
+
+	uint32_t kind = next(100);
+	if (kind < 30) {
+		m_text.push_back(encode_r(source(), source(), destination(), 0, alu[next(uint32_t(std::size(alu)))]));
+	}
+	else if (kind < 38) {
+		m_text.push_back(encode_r(0, source(), destination(), next(32), shifts[next(uint32_t(std::size(shifts)))]));
+	}
+	else if (kind < 52) {
+		instructions op = alu_imm[next(uint32_t(std::size(alu_imm)))];
+		m_text.push_back(encode_i(op, op == instructions::LUI ? 0 : source(), destination(), immediate()));
+	}
+	else if (kind < 60) {
+		switch (next(4)) {
+		case 0:
+			m_text.push_back((uint32_t(instructions::MUL) << 26) | encode_r(source(), source(), destination(), 0, funct(2)));
+			break;
+		case 1:
+			m_text.push_back(encode_r(source(), source(), 0, 0, hi_lo[next(uint32_t(std::size(hi_lo)))]));
+			break;
+		case 2:
+			m_text.push_back(encode_r(0, 0, destination(), 0, next(2) ? funct::MFHI : funct::MFLO));
+			break;
+		default:
+			m_text.push_back(encode_r(source(), 0, 0, 0, next(2) ? funct::MTHI : funct::MTLO));
+			break;
+		}
+	}
+	else if (kind < 66) {
+		if (next(2)) {
+			m_text.push_back(encode_r(source(), source(), 0, 0, traps[next(uint32_t(std::size(traps)))]));
+		}
+		else {
+			m_text.push_back(encode_i(instructions::TRAPI, source(), uint32_t(imm_traps[next(uint32_t(std::size(imm_traps)))]), immediate()));
+		}
+	}
+	else if (kind < 96) {
+		// aligned into .data mostly, sometimes unaligned, below .data or based on a random register
+		bool load = kind < 84;
+		uint32_t which = load ? next(uint32_t(std::size(loads))) : next(uint32_t(std::size(stores)));
+		uint32_t size = load ? load_sizes[which] : store_sizes[which];
+		uint32_t base = BASE;
+		uint32_t offset = next(DATA_SIZE / size) * size;
+		switch (next(32)) {
+		case 0:
+			offset |= size > 1 ? 1 : 0;
+			break;
+		case 1:
+			offset = 0x8000;
+			break;
+		case 2:
+			base = source();
+			break;
+		}
+		m_text.push_back(load ? encode_i(loads[which], base, destination(), offset) : encode_i(stores[which], base, source(), offset));
+	}
+	else {
+		// an LL/SC pair, the SC mostly succeeds
+		uint32_t reg = pool[next(uint32_t(std::size(pool)))];
+		uint32_t offset = next(DATA_SIZE / sizeof(uint32_t)) * sizeof(uint32_t);
+		m_text.push_back(encode_i(instructions::LL, BASE, reg, offset));
+		m_text.push_back(encode_i(instructions::ADDIU, reg, reg, immediate()));
+		m_text.push_back(encode_i(instructions::SC, BASE, reg, offset));
+	}
+}
+
+void random_program::emit_branch(uint32_t remaining) {
+	static const instructions branches[] = { instructions::BEQ, instructions::BNE, instructions::BLEZ, instructions::BGTZ };
+
+	// forward only, at most to the first instruction after the random ones
+	uint32_t skip = next(std::min(remaining, MAX_SKIP) + 1);
+	if (next(8) == 0) {
+		uint32_t target = TEXT_ADDRESS + uint32_t(m_text.size() + 1 + skip) * sizeof(uint32_t);
+		m_text.push_back((uint32_t(instructions::J) << 26) | ((target >> 2) & 0x3FFFFFF));
+		return;
+	}
+
+	instructions op = branches[next(uint32_t(std::size(branches)))];
+	bool two_registers = op == instructions::BEQ || op == instructions::BNE;
+	m_text.push_back(encode_i(op, source(), two_registers ? source() : 0, skip));
+}
+
+void random_program::emit_loop() {
+	// nothing in the body jumps or writes the counter, the loop runs its count (or once, when a branch skipped the setup)
+	uint32_t body = next(MAX_LOOP_BODY) + 1;
+	m_text.push_back(encode_i(instructions::ORI, 0, COUNTER, next(MAX_LOOP_COUNT - 1) + 2));
+	size_t start = m_text.size();
+	while (m_text.size() - start < body) {
+		emit_simple();
+	}
+	m_text.push_back(encode_i(instructions::ADDI, COUNTER, COUNTER, 0xFFFF)); // -1, ADDIU zero-extends its immediate here
+	m_text.push_back(encode_i(instructions::BGTZ, COUNTER, 0, uint32_t(int32_t(start) - int32_t(m_text.size() + 1))));
+}
+
+void random_program::emit_epilogue() {
+	const uint32_t at = uint32_t(register_names::at), k1 = uint32_t(register_names::k1), gp = uint32_t(register_names::gp), fp = uint32_t(register_names::fp);
+	const uint32_t a0 = uint32_t(register_names::a0), v0 = uint32_t(register_names::v0);
+
+	// checksum = rotl(checksum ^ x, 7) over the registers, hi, lo and .data
+	auto mix = [&](uint32_t reg) {
+		m_text.push_back(encode_r(COUNTER, reg, COUNTER, 0, funct::XOR));
+		m_text.push_back(encode_r(0, COUNTER, at, 7, funct::SLL));
+		m_text.push_back(encode_r(0, COUNTER, k1, 25, funct::SRL));
+		m_text.push_back(encode_r(at, k1, COUNTER, 0, funct::OR));
+	};
+	m_text.push_back(encode_r(0, 0, COUNTER, 0, funct::OR));
+	for (uint32_t reg : pool) {
+		mix(reg);
+	}
+	m_text.push_back(encode_r(0, 0, gp, 0, funct::MFHI));
+	mix(gp);
+	m_text.push_back(encode_r(0, 0, gp, 0, funct::MFLO));
+	mix(gp);
+
+	m_text.push_back(encode_i(instructions::ORI, 0, fp, DATA_SIZE / sizeof(uint32_t)));
+	m_text.push_back(encode_r(BASE, 0, gp, 0, funct::OR));
+	size_t loop = m_text.size();
+	m_text.push_back(encode_i(instructions::LW, gp, at, 0));
+	mix(at);
+	m_text.push_back(encode_i(instructions::ADDIU, gp, gp, sizeof(uint32_t)));
+	m_text.push_back(encode_i(instructions::ADDI, fp, fp, 0xFFFF));
+	m_text.push_back(encode_i(instructions::BGTZ, fp, 0, uint32_t(int32_t(loop) - int32_t(m_text.size() + 1))));
+
+	m_text.push_back(encode_r(COUNTER, 0, a0, 0, funct::OR));
+	m_text.push_back(encode_i(instructions::ORI, 0, v0, uint32_t(syscalls::PRINT_HEX)));
+	m_text.push_back(encode_r(0, 0, 0, 0, funct::SYSCALL));
+	m_text.push_back(encode_i(instructions::ORI, 0, a0, '\n'));
+	m_text.push_back(encode_i(instructions::ORI, 0, v0, uint32_t(syscalls::PRINT_CHAR)));
+	m_text.push_back(encode_r(0, 0, 0, 0, funct::SYSCALL));
+	m_text.push_back(encode_i(instructions::ORI, 0, v0, uint32_t(syscalls::EXIT)));
+	m_text.push_back(encode_r(0, 0, 0, 0, funct::SYSCALL));
+}
+
+static bool write_section(const std::string& file, uint32_t address, const std::vector<uint32_t>& words) {
+	std::ofstream out(file, std::ios::binary);
+	out.write(reinterpret_cast<const char*>(&address), sizeof(address));
+	out.write(reinterpret_cast<const char*>(words.data()), words.size() * sizeof(uint32_t));
+	if (!out) {
+		printf("Failed to write '%s'\n", file.c_str());
+		return false;
+	}
+	return true;
+}
+
+bool random_program::write(const std::string& name) const {
+	return write_section(name + section_names[TEXT], TEXT_ADDRESS, m_text) && write_section(name + section_names[DATA], DATA_ADDRESS, m_data) &&
+		write_section(name + section_names[KTEXT], EXCEPTION_HANDLER, m_ktext);
+}
\ No newline at end of file
@@ -0,0 +1,38 @@
+#pragma once
+#include "pch.h"
+#include "random_mgr.h"
+
+// Random programs for differential runs (lockstep.h). After setting its registers to random and boundary values a program
+// runs `length` random instructions: arithmetic, shifts, multiplication and division, loads and stores into a .data block of
+// random words, LL/SC, trap instructions, forward branches and jumps, and short counted loops. Much of it faults on purpose
+// (ADD, ADDI and SUB overflow, traps trap, DIV divides by zero, some accesses are unaligned or miss .data), the .ktext
+// exception handler skips the faulting instruction. The program always ends, printing a checksum of its registers and .data.
+//
+// The same seed gives the same program on every host.
+class random_program {
+public:
+	random_program(uint64_t seed, uint32_t length);
+
+	// writes <name>.text, <name>.data and <name>.ktext, false after printing why it can't
+	bool write(const std::string& name) const;
+
+	// instructions in .text and .ktext
+	uint32_t size() const { return uint32_t(m_text.size() + m_ktext.size()); }
+
+private:
+	uint32_t next(uint32_t bound); // uniformly distributed in [0, bound)
+	uint32_t value();
+	uint32_t immediate();
+	uint32_t source();
+	uint32_t destination();
+
+	void emit_simple(); // anything that doesn't jump
+	void emit_branch(uint32_t remaining);
+	void emit_loop();
+	void emit_epilogue();
+
+	pcg32 m_gen;
+	std::vector<uint32_t> m_text;
+	std::vector<uint32_t> m_data;
+	std::vector<uint32_t> m_ktext;
+};
\ No newline at end of file
@@ -32,4 +32,5 @@ struct registers {
 	uint32_t status; // $12
 	uint32_t cause; // $13
 	uint32_t epc; // $14
+	uint32_t ebase; // $15 (select 1), bits 0-9 (CPUNum) hold the hart id
 };
\ No newline at end of file
@@ -0,0 +1,191 @@
+#include "pch.h"
+#include "run_report.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+
+void run_report::sample_host_usage() {
+	FILETIME creation, exit, kernel, user;
+	if (GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user)) {
+		auto seconds = [](const FILETIME& t) {
+			return double((uint64_t(t.dwHighDateTime) << 32) | t.dwLowDateTime) / 1e7; // 100ns units
+		};
+		cpu_seconds = seconds(kernel) + seconds(user);
+	}
+
+	PROCESS_MEMORY_COUNTERS counters;
+	if (K32GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+		peak_rss = counters.PeakWorkingSetSize;
+	}
+}
+#else
+#include <sys/resource.h>
+
+void run_report::sample_host_usage() {
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0) {
+		return;
+	}
+
+	cpu_seconds = double(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) + double(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+#ifdef __APPLE__
+	peak_rss = uint64_t(usage.ru_maxrss); // bytes on macOS
+#else
+	peak_rss = uint64_t(usage.ru_maxrss) * 1024; // kilobytes everywhere else
+#endif
+}
+#endif
+
+static const char* exception_name(uint32_t type) {
+	switch (type) {
+	case INTERRUPT_EXCEPTION: return "interrupt";
+	case ADDRESS_EXCEPTION_LOAD: return "address_load";
+	case ADDRESS_EXCEPTION_STORE: return "address_store";
+	case SYSCALL_EXCEPTION: return "syscall";
+	case BREAKPOINT_EXCEPTION: return "breakpoint";
+	case RESERVED_INSTRUCTION_EXCEPTION: return "reserved_instruction";
+	case ARITHMETIC_OVERFLOW_EXCEPTION: return "arithmetic_overflow";
+	case TRAP_EXCEPTION: return "trap";
+	case DIVIDE_BY_ZERO_EXCEPTION: return "divide_by_zero";
+	case FLOATING_POINT_OVERFLOW: return "floating_point_overflow";
+	case FLOATING_POINT_UNDERFLOW: return "floating_point_underflow";
+	default: return nullptr;
+	}
+}
+
+static std::string exception_key(uint32_t type) {
+	const char* name = exception_name(type);
+	return name ? name : "exccode_" + std::to_string(type);
+}
+
+static std::string json_string(const std::string& str) {
+	std::string out = "\"";
+	for (char c : str) {
+		if (c == '"' || c == '\\') {
+			out += '\\';
+			out += c;
+		}
+		else if (uint8_t(c) < 0x20) {
+			char buf[8];
+			snprintf(buf, sizeof(buf), "\\u%04x", c);
+			out += buf;
+		}
+		else {
+			out += c;
+		}
+	}
+	return out + "\"";
+}
+
+static std::string csv_field(const std::string& str) {
+	if (str.find_first_of(",\"\r\n") == std::string::npos) {
+		return str;
+	}
+
+	std::string out = "\"";
+	for (char c : str) {
+		if (c == '"') {
+			out += '"';
+		}
+		out += c;
+	}
+	return out + "\"";
+}
+
+void run_stats::merge(const run_stats& other) {
+	for (uint32_t i = 0; i < NUM_SYSCALL_COUNTERS; i++) {
+		syscalls[i] += other.syscalls[i];
+	}
+	for (auto& it : other.high_syscalls) {
+		high_syscalls[it.first] += it.second;
+	}
+	for (uint32_t i = 0; i < NUM_EXCEPTION_COUNTERS; i++) {
+		exceptions[i] += other.exceptions[i];
+	}
+}
+
+bool run_report::write(const std::string& path) const {
+	FILE* f = fopen(path.c_str(), "w");
+	if (!f) {
+		return false;
+	}
+
+	uint64_t total = 0;
+	for (uint64_t count : instructions) {
+		total += count;
+	}
+	double mips = wall_seconds > 0 ? double(total) / wall_seconds / 1e6 : 0;
+
+	// syscall counts by number, including the custom ones above the counter array
+	std::vector<std::pair<uint32_t, uint64_t>> syscall_counts;
+	for (uint32_t i = 0; i < run_stats::NUM_SYSCALL_COUNTERS; i++) {
+		if (stats.syscalls[i]) {
+			syscall_counts.emplace_back(i, stats.syscalls[i]);
+		}
+	}
+	syscall_counts.insert(syscall_counts.end(), stats.high_syscalls.begin(), stats.high_syscalls.end());
+
+	bool csv = path.size() >= 4 && path.compare(path.size() - 4, 4, ".csv") == 0;
+	if (csv) {
+		fprintf(f, "key,value\n");
+		fprintf(f, "program,%s\n", csv_field(program).c_str());
+		fprintf(f, "exit_reason,%s\n", csv_field(exit_reason).c_str());
+		fprintf(f, "exit_code,%i\n", exit_code);
+		fprintf(f, "failed,%s\n", failed ? "true" : "false");
+		fprintf(f, "instructions,%llu\n", (unsigned long long)total);
+		for (size_t i = 0; i < instructions.size(); i++) {
+			fprintf(f, "instructions.hart%zu,%llu\n", i, (unsigned long long)instructions[i]);
+		}
+		fprintf(f, "wall_seconds,%.6f\n", wall_seconds);
+		fprintf(f, "cpu_seconds,%.6f\n", cpu_seconds);
+		fprintf(f, "mips,%.3f\n", mips);
+		for (auto& it : syscall_counts) {
+			fprintf(f, "syscalls.%u,%llu\n", it.first, (unsigned long long)it.second);
+		}
+		for (uint32_t i = 0; i < run_stats::NUM_EXCEPTION_COUNTERS; i++) {
+			if (stats.exceptions[i]) {
+				fprintf(f, "exceptions.%s,%llu\n", exception_key(i).c_str(), (unsigned long long)stats.exceptions[i]);
+			}
+		}
+		fprintf(f, "heap_peak_bytes,%u\n", heap_peak);
+		fprintf(f, "stack_depth_bytes,%u\n", stack_depth);
+		fprintf(f, "peak_rss_bytes,%llu\n", (unsigned long long)peak_rss);
+	}
+	else {
+		fprintf(f, "{\n");
+		fprintf(f, "  \"program\": %s,\n", json_string(program).c_str());
+		fprintf(f, "  \"exit_reason\": %s,\n", json_string(exit_reason).c_str());
+		fprintf(f, "  \"exit_code\": %i,\n", exit_code);
+		fprintf(f, "  \"failed\": %s,\n", failed ? "true" : "false");
+		fprintf(f, "  \"instructions\": %llu,\n", (unsigned long long)total);
+		fprintf(f, "  \"instructions_per_hart\": [");
+		for (size_t i = 0; i < instructions.size(); i++) {
+			fprintf(f, "%s%llu", i ? ", " : "", (unsigned long long)instructions[i]);
+		}
+		fprintf(f, "],\n");
+		fprintf(f, "  \"wall_seconds\": %.6f,\n", wall_seconds);
+		fprintf(f, "  \"cpu_seconds\": %.6f,\n", cpu_seconds);
+		fprintf(f, "  \"mips\": %.3f,\n", mips);
+		fprintf(f, "  \"syscalls\": {");
+		for (size_t i = 0; i < syscall_counts.size(); i++) {
+			fprintf(f, "%s\"%u\": %llu", i ? ", " : "", syscall_counts[i].first, (unsigned long long)syscall_counts[i].second);
+		}
+		fprintf(f, "},\n");
+		fprintf(f, "  \"exceptions\": {");
+		bool first = true;
+		for (uint32_t i = 0; i < run_stats::NUM_EXCEPTION_COUNTERS; i++) {
+			if (stats.exceptions[i]) {
+				fprintf(f, "%s\"%s\": %llu", first ? "" : ", ", exception_key(i).c_str(), (unsigned long long)stats.exceptions[i]);
+				first = false;
+			}
+		}
+		fprintf(f, "},\n");
+		fprintf(f, "  \"heap_peak_bytes\": %u,\n", heap_peak);
+		fprintf(f, "  \"stack_depth_bytes\": %u,\n", stack_depth);
+		fprintf(f, "  \"peak_rss_bytes\": %llu\n", (unsigned long long)peak_rss);
+		fprintf(f, "}\n");
+	}
+
+	return fclose(f) == 0;
+}
\ No newline at end of file
@@ -0,0 +1,59 @@
+#pragma once
+#include "pch.h"
+#include "exceptions.h"
+
+// Per-hart counters for the run report. They are only bumped on paths that already do real work (syscalls, exceptions),
+// so they are always on. The instruction count is the hart's m_tick.
+struct run_stats {
+	static constexpr uint32_t NUM_SYSCALL_COUNTERS = 64; // custom syscalls numbered above this are counted in a map
+	static constexpr uint32_t NUM_EXCEPTION_COUNTERS = 32; // ExcCode is 5 bits
+
+	run_stats() : syscalls{}, exceptions{} {}
+
+	void count_syscall(uint32_t num) {
+		if (num < NUM_SYSCALL_COUNTERS) {
+			syscalls[num]++;
+		}
+		else {
+			high_syscalls[num]++;
+		}
+	}
+
+	// exception_type() of a mips_exception, interrupts carry the pending bit above the ExcCode
+	void count_exception(uint32_t type) {
+		if (type != uint32_t(INVALID_EXCEPTION)) {
+			exceptions[type & (NUM_EXCEPTION_COUNTERS - 1)]++;
+		}
+	}
+
+	void merge(const run_stats& other);
+
+	std::array<uint64_t, NUM_SYSCALL_COUNTERS> syscalls;
+	std::map<uint32_t, uint64_t> high_syscalls;
+	std::array<uint64_t, NUM_EXCEPTION_COUNTERS> exceptions; // taken exceptions by ExcCode
+};
+
+// Machine readable summary of a run, written to the file given with --report
+struct run_report {
+	run_report() : exit_code(0), failed(false), wall_seconds(0), cpu_seconds(0), heap_peak(0), stack_depth(0), peak_rss(0) {}
+
+	std::string program;
+	std::string exit_reason;
+	int32_t exit_code;
+	bool failed; // ended with an error or a deadlock instead of EXIT or dropping off the bottom
+
+	std::vector<uint64_t> instructions; // per hart
+	double wall_seconds;
+	double cpu_seconds; // whole VM process, all harts
+	run_stats stats; // merged over all harts
+
+	uint32_t heap_peak; // highest sbrk break, relative to the heap start
+	uint32_t stack_depth; // bytes between the stack top and the lowest stack page the guest touched
+	uint64_t peak_rss; // bytes, whole VM process
+
+	// fills in cpu_seconds and peak_rss
+	void sample_host_usage();
+
+	// JSON, or CSV (one "key,value" line per entry) if the path ends in .csv
+	bool write(const std::string& path) const;
+};
\ No newline at end of file
@@ -0,0 +1,288 @@
+#include "pch.h"
+#include "scheduler.h"
+#include "exceptions.h"
+#include "helper.h"
+
+guest_scheduler::guest_scheduler() : m_queued(0), m_idle(0), m_next_id(1), m_blocked(0), m_done(false), m_halted(false) {}
+
+void guest_scheduler::init(uint32_t num_workers) {
+	m_queues.clear();
+	for (uint32_t i = 0; i < num_workers; i++) {
+		m_queues.emplace_back(new run_queue());
+	}
+}
+
+guest_thread* guest_scheduler::create_thread() {
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	uint32_t id = m_next_id++;
+	guest_thread* thread = new guest_thread(id);
+	m_threads[id].reset(thread);
+	return thread;
+}
+
+void guest_scheduler::push(uint32_t worker, guest_thread* thread) {
+	thread->status = guest_thread::state::runnable;
+	{
+		std::lock_guard<std::mutex> lock(m_queues[worker]->mutex);
+		m_queues[worker]->threads.push_back(thread);
+	}
+	m_queued++;
+	wake_idle();
+}
+
+void guest_scheduler::push_front(uint32_t worker, guest_thread* thread) {
+	thread->status = guest_thread::state::runnable;
+	{
+		std::lock_guard<std::mutex> lock(m_queues[worker]->mutex);
+		m_queues[worker]->threads.push_front(thread);
+	}
+	m_queued++;
+	wake_idle();
+}
+
+void guest_scheduler::wake_idle() {
+	// m_queued was raised before m_idle is read and next() does it the other way around,
+	// so either the idle worker sees the new thread or we see the idle worker
+	if (m_idle) {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_cv.notify_one();
+	}
+}
+
+guest_thread* guest_scheduler::pop_or_steal(uint32_t worker) {
+	if (!m_queued) {
+		return nullptr;
+	}
+
+	// own queue first, newest thread is the one most likely still in cache
+	{
+		run_queue& own = *m_queues[worker];
+		std::lock_guard<std::mutex> lock(own.mutex);
+		if (!own.threads.empty()) {
+			guest_thread* thread = own.threads.back();
+			own.threads.pop_back();
+			m_queued--;
+			return thread;
+		}
+	}
+
+	// steal the oldest thread from the next worker that has one
+	for (size_t i = 1; i < m_queues.size(); i++) {
+		run_queue& victim = *m_queues[(worker + i) % m_queues.size()];
+		std::lock_guard<std::mutex> lock(victim.mutex);
+		if (!victim.threads.empty()) {
+			guest_thread* thread = victim.threads.front();
+			victim.threads.pop_front();
+			m_queued--;
+			return thread;
+		}
+	}
+
+	return nullptr;
+}
+
+guest_thread* guest_scheduler::next(uint32_t worker) {
+	while (true) {
+		if (guest_thread* thread = pop_or_steal(worker)) {
+			thread->status = guest_thread::state::running;
+			return thread;
+		}
+
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_idle++;
+
+		// nobody is running a thread anymore, so nothing can become runnable again
+		if (m_idle == m_queues.size() && !m_queued) {
+			m_done = true;
+			m_cv.notify_all();
+		}
+
+		m_cv.wait(lock, [this] { return m_queued || m_done || m_halted; });
+		m_idle--;
+
+		if (m_done || m_halted) {
+			return nullptr;
+		}
+	}
+}
+
+bool guest_scheduler::deadlocked() {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_done && m_blocked;
+}
+
+void guest_scheduler::halt() {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_halted = true;
+	m_cv.notify_all();
+}
+
+bool guest_scheduler::join(guest_thread* self, uint32_t target, uint32_t& value) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	auto it = m_threads.find(target);
+	if (it == m_threads.end() || it->second.get() == self) {
+		throw mips_exception_syscall("Can't join thread " + std::to_string(target));
+	}
+	guest_thread* thread = it->second.get();
+	if (thread->joiner) {
+		throw mips_exception_syscall("Thread " + std::to_string(target) + " is already being joined");
+	}
+
+	if (thread->status == guest_thread::state::finished) {
+		value = thread->exit_value;
+		m_threads.erase(it);
+		return true;
+	}
+
+	thread->joiner = self;
+	self->status = guest_thread::state::blocked;
+	m_blocked++;
+	return false;
+}
+
+guest_thread* guest_scheduler::exit_thread(guest_thread* self, uint32_t value) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	self->exit_value = value;
+	self->status = guest_thread::state::finished;
+
+	guest_thread* joiner = self->joiner;
+	if (!joiner) {
+		return nullptr; // stays around until someone joins it
+	}
+
+	joiner->regs.regs[int(register_names::v0)] = value;
+	m_blocked--;
+	m_threads.erase(self->id);
+	return joiner;
+}
+
+bool guest_scheduler::futex_wait(guest_thread* self, uint32_t addr, uint32_t* word, uint32_t expected) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	if (atomic_load32(word) != expected) {
+		return false;
+	}
+
+	self->status = guest_thread::state::blocked;
+	self->futex_addr = addr;
+	m_futex_waiters[addr].push_back(self);
+	m_blocked++;
+	return true;
+}
+
+void guest_scheduler::futex_wake(uint32_t addr, uint32_t count, std::vector<guest_thread*>& woken) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	auto it = m_futex_waiters.find(addr);
+	if (it == m_futex_waiters.end()) {
+		return;
+	}
+
+	std::deque<guest_thread*>& waiters = it->second;
+	while (!waiters.empty() && woken.size() < count) {
+		woken.push_back(waiters.front());
+		waiters.pop_front();
+		m_blocked--;
+	}
+
+	if (waiters.empty()) {
+		m_futex_waiters.erase(it);
+	}
+}
+
+void guest_scheduler::save(snapshot_writer& out) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	out.put(m_next_id);
+	out.put(m_blocked);
+	out.put(uint32_t(m_threads.size()));
+	for (auto& it : m_threads) {
+		const guest_thread& thread = *it.second;
+		out.put(thread.id);
+		out.put(thread.status);
+		out.put(thread.regs);
+		thread.frames.save(out);
+		out.put(thread.kernelmode);
+		out.put(thread.exit_value);
+		out.put(thread.joiner ? thread.joiner->id : 0u);
+		out.put(thread.futex_addr);
+	}
+
+	out.put(uint32_t(m_queues.size()));
+	for (auto& queue : m_queues) {
+		std::lock_guard<std::mutex> queue_lock(queue->mutex);
+		out.put(uint32_t(queue->threads.size()));
+		for (guest_thread* thread : queue->threads) {
+			out.put(thread->id);
+		}
+	}
+
+	out.put(uint32_t(m_futex_waiters.size()));
+	for (auto& it : m_futex_waiters) {
+		out.put(it.first);
+		out.put(uint32_t(it.second.size()));
+		for (guest_thread* thread : it.second) {
+			out.put(thread->id);
+		}
+	}
+}
+
+void guest_scheduler::restore(snapshot_reader& in) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	auto thread_by_id = [this](uint32_t id) {
+		auto it = m_threads.find(id);
+		if (it == m_threads.end()) {
+			throw std::runtime_error("checkpoint refers to a guest thread that doesn't exist");
+		}
+		return it->second.get();
+	};
+
+	m_next_id = in.get<uint32_t>();
+	m_blocked = in.get<uint32_t>();
+	m_threads.clear();
+	std::vector<std::pair<guest_thread*, uint32_t>> joiners;
+	for (uint32_t n = in.get<uint32_t>(); n; n--) {
+		guest_thread* thread = new guest_thread(in.get<uint32_t>());
+		m_threads[thread->id].reset(thread);
+		thread->status = in.get<guest_thread::state>();
+		thread->regs = in.get<registers>();
+		thread->frames.restore(in);
+		thread->kernelmode = in.get<bool>();
+		thread->exit_value = in.get<uint32_t>();
+		joiners.emplace_back(thread, in.get<uint32_t>());
+		thread->futex_addr = in.get<uint32_t>();
+	}
+	for (auto& joiner : joiners) {
+		joiner.first->joiner = joiner.second ? thread_by_id(joiner.second) : nullptr;
+	}
+
+	if (in.get<uint32_t>() != m_queues.size()) {
+		throw std::runtime_error("checkpoint was taken with a different number of harts");
+	}
+	m_queued = 0;
+	for (auto& queue : m_queues) {
+		queue->threads.clear();
+		for (uint32_t n = in.get<uint32_t>(); n; n--) {
+			queue->threads.push_back(thread_by_id(in.get<uint32_t>()));
+			m_queued++;
+		}
+	}
+
+	m_futex_waiters.clear();
+	for (uint32_t n = in.get<uint32_t>(); n; n--) {
+		std::deque<guest_thread*>& waiters = m_futex_waiters[in.get<uint32_t>()];
+		for (uint32_t count = in.get<uint32_t>(); count; count--) {
+			waiters.push_back(thread_by_id(in.get<uint32_t>()));
+		}
+	}
+}
+
+guest_thread* guest_scheduler::find(uint32_t id) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto it = m_threads.find(id);
+	return it == m_threads.end() ? nullptr : it->second.get();
+}
\ No newline at end of file
@@ -0,0 +1,85 @@
+#pragma once
+#include "pch.h"
+#include "registers.h"
+#include "syscall_table.h"
+#include "snapshot.h"
+
+// A guest thread's saved context. While a hart runs the thread its state lives in the executor instead.
+struct guest_thread {
+	enum class state : int {
+		runnable,
+		running,
+		blocked, // in JOIN or FUTEX_WAIT
+		finished // exited, kept around until it is joined
+	};
+
+	guest_thread(uint32_t tid) : id(tid), status(state::runnable), kernelmode(false), exit_value(0), joiner(nullptr), futex_addr(0) {}
+
+	uint32_t id;
+	state status;
+
+	registers regs;
+	syscall_frame_stack frames;
+	bool kernelmode;
+
+	uint32_t exit_value;
+	guest_thread* joiner; // thread blocked in JOIN on this one
+	uint32_t futex_addr; // address the thread waits on while blocked in FUTEX_WAIT
+};
+
+// Schedules guest threads on the harts. Every hart has its own run queue: it pushes and pops at the back (newest first),
+// and an idle hart steals from the front of the other queues (oldest first, usually the biggest chunk of work).
+// Threads only switch when they yield, block or exit.
+class guest_scheduler {
+public:
+	guest_scheduler();
+
+	void init(uint32_t num_workers);
+
+	guest_thread* create_thread();
+	void push(uint32_t worker, guest_thread* thread);
+	void push_front(uint32_t worker, guest_thread* thread);
+
+	// next thread for this worker, waits while other workers are still running threads that may create more work.
+	// Returns nullptr once nothing can run anymore (every thread finished or blocked) or the machine halted.
+	guest_thread* next(uint32_t worker);
+	bool deadlocked();
+	void halt();
+
+	// JOIN: true if target already finished (value is its exit value and target is gone), otherwise self is now blocked
+	bool join(guest_thread* self, uint32_t target, uint32_t& value);
+	// returns the joiner that has to be made runnable, if any
+	guest_thread* exit_thread(guest_thread* self, uint32_t value);
+
+	// FUTEX_WAIT: blocks self unless the word no longer holds `expected`, checked under the same lock FUTEX_WAKE takes
+	bool futex_wait(guest_thread* self, uint32_t addr, uint32_t* word, uint32_t expected);
+	void futex_wake(uint32_t addr, uint32_t count, std::vector<guest_thread*>& woken);
+
+	// every thread and where it waits, see checkpoint.h. Contexts of running threads are stale, their harts save them.
+	// Only while no worker is in next(), restore after init()
+	void save(snapshot_writer& out);
+	void restore(snapshot_reader& in);
+	guest_thread* find(uint32_t id); // nullptr if there is no such thread
+
+private:
+	struct run_queue {
+		std::mutex mutex;
+		std::deque<guest_thread*> threads;
+	};
+
+	guest_thread* pop_or_steal(uint32_t worker);
+	void wake_idle();
+
+	std::vector<std::unique_ptr<run_queue>> m_queues;
+	std::atomic<uint32_t> m_queued; // threads sitting in any run queue
+	std::atomic<uint32_t> m_idle; // workers waiting in next()
+
+	std::mutex m_mutex; // guards everything below
+	std::condition_variable m_cv;
+	std::unordered_map<uint32_t, std::unique_ptr<guest_thread>> m_threads;
+	std::unordered_map<uint32_t, std::deque<guest_thread*>> m_futex_waiters; // woken in FIFO order
+	uint32_t m_next_id;
+	uint32_t m_blocked;
+	bool m_done;
+	bool m_halted;
+};
\ No newline at end of file
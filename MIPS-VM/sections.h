@@ -5,8 +5,13 @@ enum SECTION_FLAGS : int {
 	EXECUTABLE = (1 << 0),
 	MUTABLE = (1 << 1),
 	KERNEL = (1 << 2),
+	WATCHED = (1 << 3), // contains a page with a debugger watchpoint, accesses have to be checked against section::is_watched
+	DEVICE = (1 << 4), // device registers, loads and stores go through the device bus
 };
 
+// page size used to decide which accesses need a watchpoint check
+constexpr uint32_t WATCH_PAGE_SHIFT = 12;
+
 enum SECTIONS : int {
 	TEXT = 0,
 	DATA,
@@ -25,11 +30,102 @@ constexpr int section_protection[] = {
 	EXECUTABLE, MUTABLE, EXECUTABLE | KERNEL, MUTABLE | KERNEL
 };
 
+// Backing memory of a section. Either owned by the section (zero-initialized or loaded from a file),
+// or host memory mapped in from the outside (eg. a mmap'd file) which is handed back through `release` when the section goes away.
+// External memory may be reserved bigger than the section (`capacity`), the section can then grow into it with resize().
+// The size is published atomically: the heap grows under the syscall mutex while other harts look up addresses in it.
+class section_memory {
+public:
+	using release_fn = void(*)(uint8_t* mem, size_t size);
+
+	section_memory() : m_data(nullptr), m_size(0), m_capacity(0), m_release(nullptr) {}
+	explicit section_memory(size_t size) : m_owned(size, 0), m_release(nullptr) {
+		m_data = m_owned.data();
+		m_size = m_capacity = m_owned.size();
+	}
+	explicit section_memory(std::vector<uint8_t>&& buf) : m_owned(std::move(buf)), m_release(nullptr) {
+		m_data = m_owned.data();
+		m_size = m_capacity = m_owned.size();
+	}
+	section_memory(uint8_t* mem, size_t size, release_fn release) : m_data(mem), m_size(size), m_capacity(size), m_release(release) {}
+	section_memory(uint8_t* mem, size_t size, size_t capacity, release_fn release) : m_data(mem), m_size(size), m_capacity(capacity), m_release(release) {}
+
+	section_memory(const section_memory&) = delete;
+	section_memory& operator=(const section_memory&) = delete;
+
+	section_memory(section_memory&& other) noexcept : section_memory() {
+		*this = std::move(other);
+	}
+	section_memory& operator=(section_memory&& other) noexcept {
+		if (this != &other) {
+			release();
+			m_owned = std::move(other.m_owned);
+			m_data = other.m_data;
+			m_size.store(other.m_size.load(std::memory_order_relaxed), std::memory_order_relaxed);
+			m_capacity = other.m_capacity;
+			m_release = other.m_release;
+
+			other.m_data = nullptr;
+			other.m_size.store(0, std::memory_order_relaxed);
+			other.m_capacity = 0;
+			other.m_release = nullptr;
+		}
+		return *this;
+	}
+
+	~section_memory() {
+		release();
+	}
+
+	uint8_t* data() { return m_data; }
+	const uint8_t* data() const { return m_data; }
+	size_t size() const { return m_size.load(std::memory_order_acquire); }
+	size_t capacity() const { return m_capacity; }
+
+	// grow or shrink within the reserved capacity, the memory itself stays where it is. Grown memory has to be committed
+	// before, a hart that sees the new size may access it right away
+	bool resize(size_t size) {
+		if (size > m_capacity) {
+			return false;
+		}
+		m_size.store(size, std::memory_order_release);
+		return true;
+	}
+
+private:
+	void release() {
+		if (m_release && m_data) {
+			m_release(m_data, m_capacity);
+		}
+		m_owned.clear();
+		m_data = nullptr;
+		m_size.store(0, std::memory_order_relaxed);
+		m_capacity = 0;
+		m_release = nullptr;
+	}
+
+	std::vector<uint8_t> m_owned;
+	uint8_t* m_data;
+	std::atomic<size_t> m_size;
+	size_t m_capacity;
+	release_fn m_release;
+};
+
 struct section {
 	section() : address(0), flags(MUTABLE) {}
 	section(int32_t flag) : address(0), flags(flag) {}
 
+	// with WATCHED, whether [addr, addr + size) touches a page that has a watchpoint on it
+	bool is_watched(uint32_t addr, uint32_t size) const {
+		return is_watched_page(addr >> WATCH_PAGE_SHIFT) || is_watched_page((addr + size - 1) >> WATCH_PAGE_SHIFT);
+	}
+	bool is_watched_page(uint32_t page) const {
+		uint32_t index = page - (address >> WATCH_PAGE_SHIFT);
+		return index / 64 < watched_pages.size() && (watched_pages[index / 64] >> (index % 64) & 1);
+	}
+
 	uint32_t address;
-	std::vector<uint8_t> sect;
+	section_memory sect;
 	int32_t flags;
+	std::vector<uint64_t> watched_pages; // a bit per page, counted from the one the section starts in, kept by the debugger
 };
\ No newline at end of file
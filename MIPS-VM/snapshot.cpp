@@ -0,0 +1,123 @@
+#include "pch.h"
+#include "snapshot.h"
+#include "helper.h"
+
+constexpr uint32_t END_OF_PAGES = 0xFFFFFFFF;
+
+static bool zero_page(const uint8_t* data, size_t size) {
+	size_t i = 0;
+	for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+		uint64_t word;
+		memcpy(&word, data + i, sizeof(uint64_t));
+		if (word) {
+			return false;
+		}
+	}
+	for (; i < size; i++) {
+		if (data[i]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+snapshot_writer::snapshot_writer(FILE* file) : m_file(file), m_hash(HASH_SEED), m_failed(false) {}
+
+void snapshot_writer::put_bytes(const void* data, size_t size) {
+	m_hash = hash_bytes(m_hash, data, size);
+	if (size && fwrite(data, 1, size, m_file) != size) {
+		m_failed = true;
+	}
+}
+
+void snapshot_writer::put_string(const std::string& str) {
+	put(uint32_t(str.size()));
+	put_bytes(str.data(), str.size());
+}
+
+void snapshot_writer::put_memory(uint32_t address, const uint8_t* data, uint32_t size) {
+	put(address);
+	put(size);
+
+	// most of the stack and heap is never written, and reading an untouched page costs no host memory
+	for (uint32_t offset = 0; offset < size; offset += SNAPSHOT_PAGE_SIZE) {
+		uint32_t length = std::min(SNAPSHOT_PAGE_SIZE, size - offset);
+		if (!zero_page(data + offset, length)) {
+			put(offset);
+			put_bytes(data + offset, length);
+		}
+	}
+	put(END_OF_PAGES);
+}
+
+bool snapshot_writer::finish() {
+	uint64_t checksum = m_hash;
+	put(checksum);
+	return !m_failed && fflush(m_file) == 0;
+}
+
+bool snapshot_reader::open(const std::string& path) {
+	std::ifstream file(path, std::ios::binary);
+	if (!file.is_open()) {
+		return false;
+	}
+	m_data = std::vector<uint8_t>(std::istreambuf_iterator<char>(file), {});
+	m_pos = 0;
+
+	uint64_t checksum;
+	if (m_data.size() < sizeof(checksum)) {
+		return false;
+	}
+	m_end = m_data.size() - sizeof(checksum);
+	memcpy(&checksum, m_data.data() + m_end, sizeof(checksum));
+	return hash_bytes(HASH_SEED, m_data.data(), m_end) == checksum;
+}
+
+void snapshot_reader::get_bytes(void* data, size_t size) {
+	if (size > m_end - m_pos) {
+		throw std::runtime_error("checkpoint ends early");
+	}
+	memcpy(data, m_data.data() + m_pos, size);
+	m_pos += size;
+}
+
+std::string snapshot_reader::get_string() {
+	uint32_t size = get<uint32_t>();
+	if (size > m_end - m_pos) {
+		throw std::runtime_error("checkpoint ends early");
+	}
+	std::string str(reinterpret_cast<const char*>(m_data.data() + m_pos), size);
+	m_pos += size;
+	return str;
+}
+
+void snapshot_reader::get_memory(section& sect) {
+	uint32_t address = get<uint32_t>();
+	uint32_t size = get<uint32_t>();
+	if (address < sect.address || uint64_t(address) + size > uint64_t(sect.address) + sect.sect.size()) {
+		throw std::runtime_error("checkpoint has memory outside of the guest's sections");
+	}
+	uint8_t* data = sect.sect.data() + (address - sect.address);
+
+	// pages come in order, everything between two of them was zero. Only pages that aren't zero now get written,
+	// so restoring a mostly empty stack or heap doesn't commit host memory for it
+	uint32_t next = 0;
+	auto clear_until = [&](uint32_t end) {
+		for (; next < end; next += SNAPSHOT_PAGE_SIZE) {
+			uint32_t length = std::min(SNAPSHOT_PAGE_SIZE, size - next);
+			if (!zero_page(data + next, length)) {
+				memset(data + next, 0, length);
+			}
+		}
+	};
+
+	for (uint32_t offset = get<uint32_t>(); offset != END_OF_PAGES; offset = get<uint32_t>()) {
+		if (offset < next || offset >= size || offset % SNAPSHOT_PAGE_SIZE) {
+			throw std::runtime_error("checkpoint has a broken page list");
+		}
+		clear_until(offset);
+		get_bytes(data + offset, std::min(SNAPSHOT_PAGE_SIZE, size - offset));
+		next = offset + SNAPSHOT_PAGE_SIZE;
+	}
+	clear_until(size);
+}
\ No newline at end of file
@@ -0,0 +1,52 @@
+#pragma once
+#include "pch.h"
+#include "sections.h"
+
+constexpr uint32_t SNAPSHOT_PAGE_SIZE = 0x1000; // guest memory is written in pages, those that are all zero are left out
+
+// The byte stream of a checkpoint (checkpoint.h). Every part of the machine writes its own state with save() and reads it
+// back with restore(), in the same order. Values are stored in host byte order, a checkpoint is resumed by the same build.
+class snapshot_writer {
+public:
+	snapshot_writer(FILE* file);
+
+	template<class T> void put(const T& value) {
+		static_assert(std::is_trivially_copyable<T>::value, "only plain values can be written as they are");
+		put_bytes(&value, sizeof(T));
+	}
+	void put_bytes(const void* data, size_t size);
+	void put_string(const std::string& str);
+	// guest memory [address, address + size) backed by `data`
+	void put_memory(uint32_t address, const uint8_t* data, uint32_t size);
+
+	// appends the checksum, false if anything couldn't be written
+	bool finish();
+
+private:
+	FILE* m_file;
+	uint64_t m_hash; // of everything written so far
+	bool m_failed;
+};
+
+// Reads what a snapshot_writer wrote. Running past the end or finding something that doesn't fit the machine throws std::runtime_error
+class snapshot_reader {
+public:
+	// the whole file, false if it's truncated or corrupt
+	bool open(const std::string& path);
+
+	template<class T> T get() {
+		static_assert(std::is_trivially_copyable<T>::value, "only plain values can be read as they are");
+		T value;
+		get_bytes(&value, sizeof(T));
+		return value;
+	}
+	void get_bytes(void* data, size_t size);
+	std::string get_string();
+	// guest memory written by put_memory into `sect`, which has to contain it. Pages left out are zeroed
+	void get_memory(section& sect);
+
+private:
+	std::vector<uint8_t> m_data;
+	size_t m_pos;
+	size_t m_end; // where the checksum starts
+};
\ No newline at end of file
@@ -0,0 +1,136 @@
+#pragma once
+#include "pch.h"
+#include "registers.h"
+#include "plugin_api.h"
+#include "snapshot.h"
+
+class executor;
+
+constexpr uint32_t MAX_SYSCALLS = 1024; // size of the syscall table, guest handlers can be registered for numbers below this
+constexpr uint32_t FIRST_CUSTOM_SYSCALL = 50; // numbers below this are reserved for native syscalls
+
+// Flat syscall table indexed by the syscall number in $v0. An entry holds a native handler (an executor member function,
+// registered once while the machine is set up), a plugin handler (plugin_api.h, also registered at startup),
+// a guest handler registered with REGISTER_SYSCALL, or nothing (not implemented).
+class syscall_table {
+public:
+	using native_handler = bool(executor::*)(uint32_t a0, uint32_t a1, uint32_t a2); // returns false if it set the pc itself
+
+	struct entry {
+		entry() : native(nullptr), plugin(nullptr), plugin_user(nullptr), exclusive(false), guest(0) {}
+
+		native_handler native;
+		mips_vm_syscall_fn plugin;
+		void* plugin_user;
+		bool exclusive; // touches host state shared by the harts, runs under the machine's syscall mutex
+		std::atomic<uint32_t> guest; // .ktext address of the guest handler, 0 if none is registered
+	};
+
+	syscall_table() : m_entries(MAX_SYSCALLS) {}
+
+	void register_native(uint32_t code, native_handler handler, bool exclusive = true) {
+		m_entries[code].native = handler;
+		m_entries[code].exclusive = exclusive;
+	}
+
+	bool register_plugin(uint32_t code, mips_vm_syscall_fn handler, void* user, bool exclusive) {
+		if (code < FIRST_CUSTOM_SYSCALL || code >= MAX_SYSCALLS || m_entries[code].plugin) {
+			return false;
+		}
+		m_entries[code].plugin = handler;
+		m_entries[code].plugin_user = user;
+		m_entries[code].exclusive = exclusive;
+		return true;
+	}
+
+	// harts may be running syscalls while the guest registers a handler, they see either the old or the new address.
+	// Numbers a plugin handles can't be taken over
+	bool register_guest(uint32_t code, uint32_t addr) {
+		if (m_entries[code].plugin) {
+			return false;
+		}
+		m_entries[code].guest.store(addr, std::memory_order_release);
+		return true;
+	}
+
+	// nullptr if the number is outside the table
+	const entry* lookup(uint32_t code) const {
+		return code < MAX_SYSCALLS ? &m_entries[code] : nullptr;
+	}
+
+	// the guest handlers, native and plugin ones are registered again at startup (see checkpoint.h)
+	void save(snapshot_writer& out) const {
+		for (uint32_t code = 0; code < MAX_SYSCALLS; code++) {
+			if (uint32_t addr = m_entries[code].guest.load(std::memory_order_acquire)) {
+				out.put(code);
+				out.put(addr);
+			}
+		}
+		out.put(MAX_SYSCALLS);
+	}
+
+	void restore(snapshot_reader& in) {
+		for (uint32_t code = in.get<uint32_t>(); code != MAX_SYSCALLS; code = in.get<uint32_t>()) {
+			if (code > MAX_SYSCALLS || !register_guest(code, in.get<uint32_t>())) {
+				throw std::runtime_error("can't register the guest handler of syscall " + std::to_string(code) + " again");
+			}
+		}
+	}
+
+private:
+	std::vector<entry> m_entries; // never resized, entries are looked up without a lock
+};
+
+// Saved coproc 0 state of the kernelmode code a custom syscall interrupted. Every hart nests its own syscalls.
+class syscall_frame_stack {
+public:
+	void push_syscall_frame(registers& regs) {
+		syscall_frame frame;
+		frame.status = regs.status;
+		frame.cause = regs.cause;
+		frame.epc = regs.epc;
+		m_syscall_frames.push(frame);
+	}
+
+	bool pop_syscall_frame(registers& regs) {
+		if (m_syscall_frames.empty()) {
+			return false;
+		}
+
+		syscall_frame frame = m_syscall_frames.top();
+		regs.status = frame.status;
+		regs.cause = frame.cause;
+		regs.epc = frame.epc;
+
+		m_syscall_frames.pop();
+		return true;
+	}
+
+	void save(snapshot_writer& out) const {
+		std::stack<syscall_frame> frames = m_syscall_frames;
+		out.put(uint32_t(frames.size()));
+		for (; !frames.empty(); frames.pop()) { // innermost first
+			out.put(frames.top());
+		}
+	}
+
+	void restore(snapshot_reader& in) {
+		std::vector<syscall_frame> frames(in.get<uint32_t>());
+		for (syscall_frame& frame : frames) {
+			frame = in.get<syscall_frame>();
+		}
+		m_syscall_frames = std::stack<syscall_frame>();
+		for (auto frame = frames.rbegin(); frame != frames.rend(); ++frame) {
+			m_syscall_frames.push(*frame);
+		}
+	}
+
+private:
+	struct syscall_frame {
+		uint32_t status; // $12
+		uint32_t cause; // $13
+		uint32_t epc; // $14
+	};
+
+	std::stack<syscall_frame> m_syscall_frames;
+};
\ No newline at end of file
@@ -0,0 +1,503 @@
+#include "pch.h"
+#include "executor.h"
+#include "helper.h"
+#include "file_mgr.h"
+
+constexpr size_t STDIN_CHUNK_SIZE = 1 << 16; // stdin read for a READ_* syscall while other harts run, copied over piece by piece
+
+// Native syscall handlers. A new syscall gets a handler below and a line here, dispatch_syscall finds it in the syscall table
+void executor::register_native_syscalls() {
+    m_syscalls.register_native(uint32_t(syscalls::PRINT_INT), &executor::syscall_print_int);
+    m_syscalls.register_native(uint32_t(syscalls::PRINT_FLOAT), &executor::syscall_print_float);
+    m_syscalls.register_native(uint32_t(syscalls::PRINT_DBL), &executor::syscall_print_dbl);
+    m_syscalls.register_native(uint32_t(syscalls::PRINT_STRING), &executor::syscall_print_string);
+    m_syscalls.register_native(uint32_t(syscalls::SBRK), &executor::syscall_sbrk);
+    m_syscalls.register_native(uint32_t(syscalls::MALLOC), &executor::syscall_malloc);
+    m_syscalls.register_native(uint32_t(syscalls::FREE), &executor::syscall_free);
+    m_syscalls.register_native(uint32_t(syscalls::REALLOC), &executor::syscall_realloc);
+    m_syscalls.register_native(uint32_t(syscalls::CALLOC), &executor::syscall_calloc);
+    m_syscalls.register_native(uint32_t(syscalls::HEAP_STATS), &executor::syscall_heap_stats);
+    m_syscalls.register_native(uint32_t(syscalls::EXIT), &executor::syscall_exit);
+    m_syscalls.register_native(uint32_t(syscalls::PRINT_CHAR), &executor::syscall_print_char);
+    m_syscalls.register_native(uint32_t(syscalls::OPEN_FILE), &executor::syscall_open_file);
+    m_syscalls.register_native(uint32_t(syscalls::WRITE_FILE), &executor::syscall_write_file);
+    m_syscalls.register_native(uint32_t(syscalls::CLOSE_FILE), &executor::syscall_close_file);
+    m_syscalls.register_native(uint32_t(syscalls::EXIT2), &executor::syscall_exit2);
+    m_syscalls.register_native(uint32_t(syscalls::TIME), &executor::syscall_time);
+    m_syscalls.register_native(uint32_t(syscalls::MMAP_FILE), &executor::syscall_mmap_file);
+    m_syscalls.register_native(uint32_t(syscalls::MUNMAP), &executor::syscall_munmap);
+    m_syscalls.register_native(uint32_t(syscalls::PRINT_HEX), &executor::syscall_print_hex);
+    m_syscalls.register_native(uint32_t(syscalls::PRINT_BINARY), &executor::syscall_print_binary);
+    m_syscalls.register_native(uint32_t(syscalls::PRINT_UNSIGNED), &executor::syscall_print_unsigned);
+    m_syscalls.register_native(uint32_t(syscalls::SET_SEED), &executor::syscall_set_seed);
+    m_syscalls.register_native(uint32_t(syscalls::RAND_INT), &executor::syscall_rand_int);
+    m_syscalls.register_native(uint32_t(syscalls::RAND_INT_RANGE), &executor::syscall_rand_int_range);
+    m_syscalls.register_native(uint32_t(syscalls::RAND_FLOAT), &executor::syscall_rand_float);
+    m_syscalls.register_native(uint32_t(syscalls::RAND_DBL), &executor::syscall_rand_dbl);
+    m_syscalls.register_native(uint32_t(syscalls::RAND_FILL), &executor::syscall_rand_fill);
+    m_syscalls.register_native(uint32_t(syscalls::REGISTER_SYSCALL), &executor::syscall_register_syscall);
+
+    // waiting for stdin or the clock mustn't hold up the other harts' syscalls, these only lock the state they touch
+    m_syscalls.register_native(uint32_t(syscalls::READ_INT), &executor::syscall_read_int, false);
+    m_syscalls.register_native(uint32_t(syscalls::READ_FLOAT), &executor::syscall_read_float, false);
+    m_syscalls.register_native(uint32_t(syscalls::READ_DBL), &executor::syscall_read_dbl, false);
+    m_syscalls.register_native(uint32_t(syscalls::READ_STRING), &executor::syscall_read_string, false);
+    m_syscalls.register_native(uint32_t(syscalls::READ_CHAR), &executor::syscall_read_char, false);
+    m_syscalls.register_native(uint32_t(syscalls::READ_FILE), &executor::syscall_read_file, false);
+    m_syscalls.register_native(uint32_t(syscalls::SLEEP), &executor::syscall_sleep, false);
+
+    // thread syscalls can block the hart and only need the scheduler's locks
+    m_syscalls.register_native(uint32_t(syscalls::SPAWN), &executor::syscall_spawn, false);
+    m_syscalls.register_native(uint32_t(syscalls::JOIN), &executor::syscall_join, false);
+    m_syscalls.register_native(uint32_t(syscalls::YIELD), &executor::syscall_yield, false);
+    m_syscalls.register_native(uint32_t(syscalls::FUTEX_WAIT), &executor::syscall_futex_wait, false);
+    m_syscalls.register_native(uint32_t(syscalls::FUTEX_WAKE), &executor::syscall_futex_wake, false);
+    m_syscalls.register_native(uint32_t(syscalls::THREAD_EXIT), &executor::syscall_thread_exit, false);
+}
+
+bool executor::syscall_print_int(uint32_t a0, uint32_t a1, uint32_t a2) {
+    print("%i", a0);
+    return true;
+}
+
+bool executor::syscall_print_float(uint32_t a0, uint32_t a1, uint32_t a2) {
+    print("%f", m_regs.f[12]);
+    return true;
+}
+
+bool executor::syscall_print_dbl(uint32_t a0, uint32_t a1, uint32_t a2) {
+    print("%f", m_regs.f[12]);
+    return true;
+}
+
+bool executor::syscall_print_string(uint32_t a0, uint32_t a1, uint32_t a2) {
+    std::string_view str = guest_string(a0, "PRINT_STRING");
+    write_output(str.data(), str.size());
+    return true;
+}
+
+bool executor::syscall_read_int(uint32_t a0, uint32_t a1, uint32_t a2) {
+    std::lock_guard<std::mutex> lock(m_machine->input_mutex);
+    disable_conio_mode();
+    m_regs.regs[int(register_names::v0)] = m_machine->input->read_int();
+    m_machine->input->skip_line();
+    return true;
+}
+
+bool executor::syscall_read_float(uint32_t a0, uint32_t a1, uint32_t a2) {
+    std::lock_guard<std::mutex> lock(m_machine->input_mutex);
+    disable_conio_mode();
+    m_regs.f[0] = m_machine->input->read_float();
+    m_machine->input->skip_line();
+    return true;
+}
+
+bool executor::syscall_read_dbl(uint32_t a0, uint32_t a1, uint32_t a2) {
+    std::lock_guard<std::mutex> lock(m_machine->input_mutex);
+    disable_conio_mode();
+    m_regs.f[0] = m_machine->input->read_float();
+    m_machine->input->skip_line();
+    return true;
+}
+
+bool executor::syscall_read_string(uint32_t a0, uint32_t a1, uint32_t a2) {
+    std::unique_lock<std::mutex> lock(m_machine->syscall_mutex, std::defer_lock);
+    if (m_machine->num_harts > 1) {
+        lock.lock();
+    }
+    char* buf = reinterpret_cast<char*>(guest_buffer(a0, a1, true, "READ_STRING"));
+    if (!a1) {
+        return true; // no room for anything, not even the terminator
+    }
+
+    // with other harts the line is read before the buffer is looked up again, one of them may unmap it meanwhile
+    std::unique_ptr<char[]> line;
+    if (lock.owns_lock()) {
+        lock.unlock();
+        line.reset(new char[a1]);
+    }
+    char* to = line ? line.get() : buf;
+
+    // the line goes into the buffer, truncated to a1 - 1 characters. The rest of a longer line is dropped
+    size_t length;
+    {
+        std::lock_guard<std::mutex> input_lock(m_machine->input_mutex);
+        disable_conio_mode();
+        length = m_machine->input->read_line(to, a1);
+    }
+
+    // if space exists, add newline
+    if (length < a1 - 1) {
+        to[length] = '\n';
+        to[length + 1] = 0;
+    }
+
+    if (line) {
+        lock.lock();
+        buf = reinterpret_cast<char*>(guest_buffer(a0, a1, true, "READ_STRING"));
+        memcpy(buf, line.get(), std::min<size_t>(length + 2, a1));
+    }
+    return true;
+}
+
+bool executor::syscall_sbrk(uint32_t a0, uint32_t a1, uint32_t a2) {
+    m_regs.regs[int(register_names::v0)] = m_heap.sbrk(a0);
+    return true;
+}
+
+bool executor::syscall_malloc(uint32_t a0, uint32_t a1, uint32_t a2) {
+    m_regs.regs[int(register_names::v0)] = m_machine->allocator.malloc(a0);
+    return true;
+}
+
+bool executor::syscall_free(uint32_t a0, uint32_t a1, uint32_t a2) {
+    m_machine->allocator.free(a0);
+    return true;
+}
+
+bool executor::syscall_realloc(uint32_t a0, uint32_t a1, uint32_t a2) {
+    guest_allocator& allocator = m_machine->allocator;
+    if (!a0) {
+        m_regs.regs[int(register_names::v0)] = allocator.malloc(a1);
+        return true;
+    }
+    if (!a1) {
+        allocator.free(a0);
+        m_regs.regs[int(register_names::v0)] = 0;
+        return true;
+    }
+
+    // grows in place as long as the block is big enough already
+    uint32_t old_size = allocator.usable_size(a0);
+    if (a1 <= old_size) {
+        m_regs.regs[int(register_names::v0)] = a0;
+        return true;
+    }
+
+    uint32_t addr = allocator.malloc(a1);
+    if (addr) {
+        section* sect = get_section_for_address(addr);
+        memcpy(sect->sect.data() + get_offset_for_section(sect, addr), sect->sect.data() + get_offset_for_section(sect, a0), old_size);
+        allocator.free(a0);
+    }
+    m_regs.regs[int(register_names::v0)] = addr; // on failure the old block stays valid
+    return true;
+}
+
+bool executor::syscall_calloc(uint32_t a0, uint32_t a1, uint32_t a2) {
+    uint64_t size = uint64_t(a0) * a1;
+    uint32_t addr = size <= std::numeric_limits<uint32_t>::max() ? m_machine->allocator.malloc(uint32_t(size)) : 0;
+    if (addr) {
+        section* sect = get_section_for_address(addr);
+        memset(sect->sect.data() + get_offset_for_section(sect, addr), 0, size_t(size)); // freed blocks are reused as they are
+    }
+    m_regs.regs[int(register_names::v0)] = addr;
+    return true;
+}
+
+bool executor::syscall_heap_stats(uint32_t a0, uint32_t a1, uint32_t a2) {
+    std::string stats = m_machine->allocator.stats();
+    write_output(stats.data(), stats.size());
+    m_regs.regs[int(register_names::v0)] = m_machine->allocator.in_use();
+    m_regs.regs[int(register_names::v1)] = m_machine->allocator.peak();
+    return true;
+}
+
+bool executor::syscall_exit(uint32_t a0, uint32_t a1, uint32_t a2) {
+    throw mips_exception_exit();
+}
+
+bool executor::syscall_print_char(uint32_t a0, uint32_t a1, uint32_t a2) {
+    char c = char(a0);
+    write_output(&c, 1);
+    return true;
+}
+
+bool executor::syscall_read_char(uint32_t a0, uint32_t a1, uint32_t a2) {
+    std::lock_guard<std::mutex> lock(m_machine->input_mutex);
+    disable_conio_mode();
+    m_regs.regs[int(register_names::v0)] = m_machine->input->read_char();
+    return true;
+}
+
+// host path of a file a sandboxed guest names, false if it isn't a relative path that stays below the sandbox
+static bool sandboxed_path(const std::string& sandbox, std::string_view file, std::string& path) {
+    std::filesystem::path relative(file);
+    if (relative.empty() || relative.has_root_path()) {
+        return false;
+    }
+    for (const std::filesystem::path& part : relative) {
+        if (part == "..") {
+            return false;
+        }
+    }
+
+    path = (std::filesystem::path(sandbox) / relative).string();
+    return true;
+}
+
+bool executor::syscall_open_file(uint32_t a0, uint32_t a1, uint32_t a2) {
+    std::string_view filename = guest_string(a0, "OPEN_FILE"); // the NUL follows it in guest memory
+    std::string path;
+    if (!m_machine->sandbox.empty() && !sandboxed_path(m_machine->sandbox, filename, path)) {
+        m_regs.regs[int(register_names::v0)] = -1; // as if it didn't exist
+        return true;
+    }
+    m_regs.regs[int(register_names::v0)] = m_file_mgr.open_file(path.empty() ? filename.data() : path.c_str(), a1, a2);
+    return true;
+}
+
+bool executor::syscall_read_file(uint32_t a0, uint32_t a1, uint32_t a2) {
+    std::unique_lock<std::mutex> lock(m_machine->syscall_mutex);
+    uint8_t* buf = guest_buffer(a1, a2, true, "READ_FILE");
+    if (a0 != 0) {
+        m_regs.regs[int(register_names::v0)] = m_file_mgr.read_file(a0, buf, a2);
+        return true;
+    }
+
+    // stdin may wait for the user. Alone the hart reads straight into guest memory, with other harts it reads a chunk
+    // at a time without holding up their syscalls and copies it over (another hart may unmap the buffer meanwhile)
+    lock.unlock();
+    if (m_machine->num_harts == 1) {
+        std::lock_guard<std::mutex> input_lock(m_machine->input_mutex);
+        m_regs.regs[int(register_names::v0)] = uint32_t(m_machine->input->read(buf, a2));
+        return true;
+    }
+
+    std::unique_ptr<uint8_t[]> chunk(new uint8_t[std::min<size_t>(a2, STDIN_CHUNK_SIZE)]);
+    uint32_t done = 0;
+    while (done < a2) {
+        size_t wanted = std::min<size_t>(a2 - done, STDIN_CHUNK_SIZE);
+        size_t size;
+        {
+            std::lock_guard<std::mutex> input_lock(m_machine->input_mutex);
+            size = m_machine->input->read(chunk.get(), wanted);
+        }
+
+        lock.lock();
+        buf = guest_buffer(a1, a2, true, "READ_FILE");
+        memcpy(buf + done, chunk.get(), size);
+        lock.unlock();
+
+        done += uint32_t(size);
+        if (size < wanted) {
+            break; // the input ended
+        }
+    }
+    m_regs.regs[int(register_names::v0)] = done;
+    return true;
+}
+
+bool executor::syscall_write_file(uint32_t a0, uint32_t a1, uint32_t a2) {
+    const uint8_t* buf = guest_buffer(a1, a2, false, "WRITE_FILE");
+    if ((a0 == 1 || a0 == 2) && !m_machine->output->is_host_stdout()) {
+        if (a0 == 1) { // stderr isn't part of the output
+            write_output(reinterpret_cast<const char*>(buf), a2);
+        }
+        m_regs.regs[int(register_names::v0)] = a2;
+        return true;
+    }
+    m_regs.regs[int(register_names::v0)] = m_file_mgr.write_file(a0, buf, a2);
+    return true;
+}
+
+bool executor::syscall_close_file(uint32_t a0, uint32_t a1, uint32_t a2) {
+    m_file_mgr.close_file(a0);
+    return true;
+}
+
+bool executor::syscall_exit2(uint32_t a0, uint32_t a1, uint32_t a2) {
+    m_exit_code = a0;
+    throw mips_exception_exit("EXIT syscall invoked, terminating with value " + std::to_string(a0));
+}
+
+bool executor::syscall_time(uint32_t a0, uint32_t a1, uint32_t a2) {
+    // get time since epoch
+    uint64_t timestamp = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    m_regs.regs[int(register_names::a0)] = (uint32_t)(timestamp & 0xFFFFFFFF);
+    m_regs.regs[int(register_names::a1)] = (uint32_t)((timestamp >> 32) & 0xFFFFFFFF);
+    return true;
+}
+
+bool executor::syscall_mmap_file(uint32_t a0, uint32_t a1, uint32_t a2) {
+    std::string_view filename = guest_string(a0, "MMAP_FILE");
+    uint32_t size = 0;
+    std::string path;
+    if (!m_machine->sandbox.empty() && !sandboxed_path(m_machine->sandbox, filename, path)) {
+        m_regs.regs[int(register_names::v0)] = 0;
+        m_regs.regs[int(register_names::v1)] = 0;
+        return true;
+    }
+    release_unmapped_files();
+    m_regs.regs[int(register_names::v0)] = m_mapping_mgr.map_file(path.empty() ? filename.data() : path.c_str(), a1, size);
+    m_regs.regs[int(register_names::v1)] = size;
+    return true;
+}
+
+bool executor::syscall_munmap(uint32_t a0, uint32_t a1, uint32_t a2) {
+    m_regs.regs[int(register_names::v0)] = m_mapping_mgr.unmap(a0) ? 0 : -1;
+    release_unmapped_files();
+    return true;
+}
+
+bool executor::syscall_sleep(uint32_t a0, uint32_t a1, uint32_t a2) {
+    if (!m_machine->sandbox.empty()) {
+        return true; // an untrusted guest could block its host for weeks
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(a0));
+    return true;
+}
+
+bool executor::syscall_print_hex(uint32_t a0, uint32_t a1, uint32_t a2) {
+    print("%X", a0);
+    return true;
+}
+
+bool executor::syscall_print_binary(uint32_t a0, uint32_t a1, uint32_t a2) {
+    std::stringstream ss;
+    ss << std::bitset<32>(a0);
+    write_output(ss.str().data(), ss.str().size());
+    return true;
+}
+
+bool executor::syscall_print_unsigned(uint32_t a0, uint32_t a1, uint32_t a2) {
+    print("%u", a0);
+    return true;
+}
+
+bool executor::syscall_set_seed(uint32_t a0, uint32_t a1, uint32_t a2) {
+    m_random_mgr.set_seed(a0, a1);
+    return true;
+}
+
+bool executor::syscall_rand_int(uint32_t a0, uint32_t a1, uint32_t a2) {
+    m_regs.regs[int(register_names::a0)] = m_random_mgr.get_int(a0);
+    return true;
+}
+
+bool executor::syscall_rand_int_range(uint32_t a0, uint32_t a1, uint32_t a2) {
+    m_regs.regs[int(register_names::a0)] = m_random_mgr.get_int_range(a0, a1);
+    return true;
+}
+
+bool executor::syscall_rand_float(uint32_t a0, uint32_t a1, uint32_t a2) {
+    m_regs.f[0] = m_random_mgr.get_float(a0);
+    return true;
+}
+
+bool executor::syscall_rand_dbl(uint32_t a0, uint32_t a1, uint32_t a2) {
+    m_regs.f[0] = m_random_mgr.get_float(a0);
+    return true;
+}
+
+bool executor::syscall_rand_fill(uint32_t a0, uint32_t a1, uint32_t a2) {
+    uint64_t bytes = uint64_t(a2) * sizeof(uint32_t);
+    if (bytes > std::numeric_limits<uint32_t>::max()) {
+        throw mips_exception_store("Invalid memory access for RAND_FILL syscall", a1);
+    }
+
+    uint8_t* buf = guest_buffer(a1, uint32_t(bytes), true, "RAND_FILL");
+    m_random_mgr.fill(a0, buf, a2);
+    if (m_machine->big_endian) {
+        // the same words a little-endian program gets for the seed
+        for (uint32_t i = 0; i < a2; i++) {
+            uint32_t word;
+            memcpy(&word, buf + i * sizeof(uint32_t), sizeof(uint32_t));
+            word = swap_bytes(word);
+            memcpy(buf + i * sizeof(uint32_t), &word, sizeof(uint32_t));
+        }
+    }
+    return true;
+}
+
+bool executor::syscall_register_syscall(uint32_t a0, uint32_t a1, uint32_t a2) {
+    if (a0 < FIRST_CUSTOM_SYSCALL) { // first 50 syscalls are reserved
+        throw mips_exception_syscall("Syscalls 1-49 are reserved, can't register new syscall with number " + std::to_string(a0));
+    }
+    if (a0 >= MAX_SYSCALLS) {
+        throw mips_exception_syscall("Syscall number " + std::to_string(a0) + " is too big, custom syscalls have to be below " + std::to_string(MAX_SYSCALLS));
+    }
+    section* sect = nullptr;
+    if (!(sect = get_section_for_address(a1, true)) || !(sect->flags & EXECUTABLE) || !(sect->flags & KERNEL)) {
+        throw mips_exception_store("Invalid address for custom syscall handler", a1);
+    }
+
+    if (!m_syscalls.register_guest(a0, a1)) {
+        throw mips_exception_syscall("Syscall number " + std::to_string(a0) + " is already handled by a plugin");
+    }
+    return true;
+}
+
+bool executor::syscall_spawn(uint32_t a0, uint32_t a1, uint32_t a2) {
+    section* sect = get_section_for_address(a0);
+    if (!sect || !(sect->flags & EXECUTABLE) || (a0 & 0x3)) {
+        throw mips_exception_syscall("Invalid entry point for SPAWN syscall");
+    }
+
+    guest_scheduler& scheduler = m_machine->scheduler;
+    guest_thread* thread = scheduler.create_thread();
+    thread->regs.pc = a0;
+    thread->regs.regs[int(register_names::a0)] = a1;
+    thread->regs.regs[int(register_names::sp)] = a2;
+    thread->regs.regs[int(register_names::gp)] = m_regs.regs[int(register_names::gp)];
+
+    m_regs.regs[int(register_names::v0)] = thread->id;
+    scheduler.push(m_hart_id, thread);
+    return true;
+}
+
+bool executor::syscall_join(uint32_t a0, uint32_t a1, uint32_t a2) {
+    guest_scheduler& scheduler = m_machine->scheduler;
+    save_context(m_regs.pc + 0x4);
+
+    uint32_t value = 0;
+    if (scheduler.join(m_thread, a0, value)) {
+        m_regs.regs[int(register_names::v0)] = value; // already finished, keep running
+        return true;
+    }
+    switch_thread(); // THREAD_EXIT of the target puts the exit value into our $v0
+    return false;
+}
+
+bool executor::syscall_yield(uint32_t a0, uint32_t a1, uint32_t a2) {
+    guest_scheduler& scheduler = m_machine->scheduler;
+    save_context(m_regs.pc + 0x4);
+    scheduler.push_front(m_hart_id, m_thread); // behind everything else queued on this hart
+    switch_thread();
+    return false;
+}
+
+bool executor::syscall_futex_wait(uint32_t a0, uint32_t a1, uint32_t a2) {
+    guest_scheduler& scheduler = m_machine->scheduler;
+    uint8_t* word = (a0 & 0x3) ? nullptr : guest_memory(a0, sizeof(uint32_t), false);
+    if (!word) {
+        throw mips_exception_load("Invalid memory access for FUTEX_WAIT syscall", a0);
+    }
+
+    m_regs.regs[int(register_names::v0)] = 0; // woken up
+    save_context(m_regs.pc + 0x4);
+
+    if (!scheduler.futex_wait(m_thread, a0, reinterpret_cast<uint32_t*>(word), m_machine->big_endian ? swap_bytes(a1) : a1)) {
+        m_regs.regs[int(register_names::v0)] = 1; // value changed already, didn't wait
+        return true;
+    }
+    switch_thread();
+    return false;
+}
+
+bool executor::syscall_futex_wake(uint32_t a0, uint32_t a1, uint32_t a2) {
+    guest_scheduler& scheduler = m_machine->scheduler;
+    std::vector<guest_thread*> woken;
+    scheduler.futex_wake(a0, a1, woken);
+    for (guest_thread* thread : woken) {
+        scheduler.push(m_hart_id, thread);
+    }
+    m_regs.regs[int(register_names::v0)] = uint32_t(woken.size());
+    return true;
+}
+
+bool executor::syscall_thread_exit(uint32_t a0, uint32_t a1, uint32_t a2) {
+    m_exit_reason = "all guest threads finished";
+    exit_thread(a0);
+    return false;
+}
\ No newline at end of file
@@ -0,0 +1,134 @@
+#include "pch.h"
+#include "test_runner.h"
+#include "executor.h"
+
+test_runner::test_runner(const vm_options& options, const std::string& dir, uint32_t jobs) : m_options(options), m_dir(dir), m_jobs(jobs), m_next_report(0) {
+	// every case runs on its own, the debuggers, checkpoints and the report don't make sense here
+	m_options.debug = false;
+	m_options.gdb.clear();
+	m_options.report.clear();
+	m_options.checkpoint.dir.clear(); // the cases would fork from a multithreaded process and all write one file
+	m_options.checkpoint.resume.clear();
+	m_options.display.shm.clear(); // cases would share the one framebuffer
+	m_options.quiet = true;
+
+	if (!m_jobs) {
+		m_jobs = std::max(1u, std::thread::hardware_concurrency());
+	}
+}
+
+bool test_runner::collect() {
+	std::error_code error;
+	std::filesystem::directory_iterator it(m_dir, error);
+	if (error) {
+		printf("Can't open test directory '%s': %s\n", m_dir.c_str(), error.message().c_str());
+		return false;
+	}
+
+	for (const auto& entry : it) {
+		if (entry.is_regular_file(error) && entry.path().extension() == ".out") {
+			test_case test = test_case();
+			test.name = entry.path().stem().string();
+			m_cases.push_back(test);
+		}
+	}
+
+	std::sort(m_cases.begin(), m_cases.end(), [](const test_case& a, const test_case& b) { return a.name < b.name; });
+	return true;
+}
+
+static bool read_file(const std::string& file, std::string& out) {
+	std::ifstream in(file, std::ios::binary);
+	if (!in.is_open()) {
+		return false;
+	}
+	out.assign(std::istreambuf_iterator<char>(in), {});
+	return true;
+}
+
+void test_runner::run_case(test_case& test) {
+	std::string input, expected;
+	if (!read_file(m_dir + "/" + test.name + ".out", expected)) {
+		test.result = "can't read the expected output";
+		return;
+	}
+	read_file(m_dir + "/" + test.name + ".in", input); // no input file, no input
+
+	expected_output_sink output(expected);
+	vm_options options = m_options;
+	options.input = &input;
+	options.output = &output;
+	if (!options.display.dump.empty()) {
+		options.display.dump += "-" + test.name;
+	}
+
+	executor vm(options);
+	if (!vm.can_run()) {
+		test.result = "the VM could not be initialized";
+		return;
+	}
+	vm.run();
+
+	test.instructions = vm.instructions();
+	test.divergence = output.divergence();
+	test.passed = output.matched() && !vm.failed();
+	if (output.mismatched()) {
+		test.result = "output differs at byte " + std::to_string(test.divergence);
+	}
+	else if (!output.matched()) {
+		test.result = "output ends at byte " + std::to_string(test.divergence) + " of " + std::to_string(expected.size()) + " (" + vm.exit_reason() + ")";
+	}
+	else if (vm.failed()) {
+		test.result = vm.exit_reason();
+	}
+}
+
+void test_runner::report_finished() {
+	for (; m_next_report < m_cases.size() && m_cases[m_next_report].done; m_next_report++) {
+		const test_case& test = m_cases[m_next_report];
+		if (test.passed) {
+			printf("PASS %s (%llu instructions)\n", test.name.c_str(), (unsigned long long)test.instructions);
+		}
+		else {
+			printf("FAIL %s: %s (%llu instructions)\n", test.name.c_str(), test.result.c_str(), (unsigned long long)test.instructions);
+		}
+	}
+	fflush(stdout);
+}
+
+bool test_runner::run() {
+	if (!collect()) {
+		return false;
+	}
+	if (m_cases.empty()) {
+		printf("No test cases (<name>.out files) in '%s'\n", m_dir.c_str());
+		return false;
+	}
+
+	auto start = std::chrono::steady_clock::now();
+
+	std::atomic<size_t> next(0);
+	auto worker = [this, &next]() {
+		for (size_t i = next++; i < m_cases.size(); i = next++) {
+			run_case(m_cases[i]);
+
+			std::lock_guard<std::mutex> lock(m_report_lock);
+			m_cases[i].done = true;
+			report_finished();
+		}
+	};
+
+	std::vector<std::thread> workers;
+	for (uint32_t i = 1; i < std::min<size_t>(m_jobs, m_cases.size()); i++) {
+		workers.emplace_back(worker);
+	}
+	worker();
+	for (auto& thread : workers) {
+		thread.join();
+	}
+
+	std::chrono::duration<double> wall = std::chrono::steady_clock::now() - start;
+	size_t passed = std::count_if(m_cases.begin(), m_cases.end(), [](const test_case& test) { return test.passed; });
+	printf("\n%zu of %zu test cases passed (%.2f s)\n", passed, m_cases.size(), wall.count());
+	return passed == m_cases.size();
+}
\ No newline at end of file
@@ -0,0 +1,37 @@
+#pragma once
+#include "pch.h"
+#include "options.h"
+
+// Runs the program once per test case of a directory: <name>.out is the expected output and <name>.in the input
+// (empty if there is none). Cases run in parallel, each on its own machine with in-memory stdin and stdout, and a
+// case stops at the first byte of output that differs from the expected output.
+class test_runner {
+public:
+	test_runner(const vm_options& options, const std::string& dir, uint32_t jobs);
+
+	// runs every case, prints a line per case (in name order) and a summary. True if every case passed
+	bool run();
+
+private:
+	struct test_case {
+		std::string name;
+		bool done;
+		bool passed;
+		uint64_t divergence; // first byte of output that differs or is missing
+		uint64_t instructions;
+		std::string result;
+	};
+
+	bool collect();
+	void run_case(test_case& test);
+	// prints the finished cases in order, as far as they are done
+	void report_finished();
+
+	vm_options m_options;
+	std::string m_dir;
+	uint32_t m_jobs;
+	std::vector<test_case> m_cases;
+
+	std::mutex m_report_lock;
+	size_t m_next_report; // first case that hasn't been printed yet
+};
\ No newline at end of file
@@ -0,0 +1,281 @@
+#include "pch.h"
+#include "translation_cache.h"
+#include "translator.h"
+#include "helper.h"
+
+static const char CACHE_MAGIC[8] = { 'M', 'I', 'P', 'S', 'V', 'M', 'C', 0 };
+
+#ifdef _WIN32
+#include <windows.h>
+
+static uint8_t* map_cache_file(const char* file, size_t& size) {
+	HANDLE f = CreateFileA(file, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (f == INVALID_HANDLE_VALUE) {
+		return nullptr;
+	}
+
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(f, &file_size) || file_size.QuadPart == 0) {
+		CloseHandle(f);
+		return nullptr;
+	}
+	size = size_t(file_size.QuadPart);
+
+	HANDLE mapping = CreateFileMappingA(f, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	CloseHandle(f);
+	if (!mapping) {
+		return nullptr;
+	}
+
+	void* mem = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping); // the view keeps the mapping alive
+	return reinterpret_cast<uint8_t*>(mem);
+}
+
+static void unmap_cache_file(uint8_t* mem, size_t size) {
+	UnmapViewOfFile(mem);
+}
+
+static bool make_directory(const std::string& dir) {
+	return CreateDirectoryA(dir.c_str(), nullptr) || GetLastError() == ERROR_ALREADY_EXISTS;
+}
+
+static bool replace_file(const std::string& from, const std::string& to) {
+	return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+}
+
+static std::string temp_name(const std::string& file) {
+	return file + ".tmp" + std::to_string(GetCurrentProcessId());
+}
+#else
+#include <dlfcn.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static uint8_t* map_cache_file(const char* file, size_t& size) {
+	int fd = open(file, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return nullptr;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+		close(fd);
+		return nullptr;
+	}
+	size = size_t(st.st_size);
+
+	void* mem = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd); // the mapping keeps the file alive, even if another VM replaces it meanwhile
+	return mem == MAP_FAILED ? nullptr : reinterpret_cast<uint8_t*>(mem);
+}
+
+static void unmap_cache_file(uint8_t* mem, size_t size) {
+	munmap(mem, size);
+}
+
+static bool make_directory(const std::string& dir) {
+	return mkdir(dir.c_str(), 0755) == 0 || errno == EEXIST;
+}
+
+static bool replace_file(const std::string& from, const std::string& to) {
+	return rename(from.c_str(), to.c_str()) == 0; // atomic, readers see the old or the new file
+}
+
+static std::string temp_name(const std::string& file) {
+	return file + ".tmp" + std::to_string(getpid());
+}
+#endif
+
+translation_cache::~translation_cache() {
+	unmap();
+#ifndef _WIN32
+	if (m_library) {
+		dlclose(m_library);
+	}
+#endif
+}
+
+uint64_t translation_cache::key(const std::array<section, NUM_SECTIONS>& sections, bool big_endian) {
+	uint64_t hash = hash_bytes(HASH_SEED, &TRANSLATION_CACHE_VERSION, sizeof(TRANSLATION_CACHE_VERSION));
+	uint32_t order = big_endian;
+	hash = hash_bytes(hash, &order, sizeof(uint32_t));
+	for (int i = 0; i < NUM_SECTIONS; i++) {
+		uint32_t size = uint32_t(sections[i].sect.size());
+		hash = hash_bytes(hash, &sections[i].address, sizeof(uint32_t));
+		hash = hash_bytes(hash, &size, sizeof(uint32_t));
+		hash = hash_bytes(hash, sections[i].sect.data(), size);
+	}
+	return hash;
+}
+
+std::string translation_cache::path(const char* extension) const {
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx", (unsigned long long)m_key);
+	return m_dir + "/" + name + extension;
+}
+
+void translation_cache::open(const std::array<section, NUM_SECTIONS>& sections, const std::string& program, bool big_endian) {
+	m_key = key(sections, big_endian);
+	if (!make_directory(m_dir)) {
+		printf("Translation cache: can't create directory '%s'\n", m_dir.c_str());
+		return;
+	}
+
+#ifndef _WIN32 // native code calls back into the VM executable, which only works with the ELF dynamic linker
+	if (load_native()) {
+		return;
+	}
+
+	// no (usable) native code, (re)write the source it is built from
+	std::string source = path(".cpp"), tmp = temp_name(source);
+	translator generator(sections, analysis(sections), program, m_key, big_endian);
+	if (!generator.write(tmp) || !replace_file(tmp, source)) {
+		std::remove(tmp.c_str());
+		return;
+	}
+	printf("Translation cache: no native code for this program yet, build it with\n"
+		"  g++ -O2 -std=c++17 -shared -fPIC -DMIPS_VM_TRANSLATION_LIBRARY -IMIPS-VM %s -o %s\n", source.c_str(), path(".so").c_str());
+#endif
+}
+
+const code_analysis& translation_cache::analysis(const std::array<section, NUM_SECTIONS>& sections) {
+	if (m_has_analysis) {
+		return m_analysis;
+	}
+	m_has_analysis = true;
+
+	if (!load_analysis(sections)) {
+		m_analysis.analyze(sections);
+		if (!store_analysis(sections)) {
+			printf("Translation cache: failed to write '%s'\n", path(".mvc").c_str());
+		}
+	}
+	return m_analysis;
+}
+
+// FNV-1a over 64-bit words rather than bytes, an eighth of the multiplications; the tail is hashed bytewise
+uint64_t translation_cache::checksum(uint64_t hash, const void* data, size_t size) {
+	const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+	size_t words = size / sizeof(uint64_t);
+	for (size_t i = 0; i < words; i++) {
+		uint64_t word;
+		memcpy(&word, bytes + i * sizeof(uint64_t), sizeof(uint64_t));
+		hash = (hash ^ word) * 0x100000001B3ull;
+		hash ^= hash >> 32; // the multiplication only carries upwards, fold the high half back in
+	}
+	return hash_bytes(hash, bytes + words * sizeof(uint64_t), size - words * sizeof(uint64_t));
+}
+
+bool translation_cache::load_analysis(const std::array<section, NUM_SECTIONS>& sections) {
+	std::string file = path(".mvc");
+	m_mapping = map_cache_file(file.c_str(), m_mapping_size);
+	if (!m_mapping) {
+		return false; // not cached yet
+	}
+
+	const header* h = reinterpret_cast<const header*>(m_mapping);
+	bool valid = m_mapping_size >= sizeof(header) && !memcmp(h->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) && h->version == TRANSLATION_CACHE_VERSION &&
+		h->header_size == sizeof(header) && h->key == m_key;
+	for (int i = 0; valid && i < NUM_SECTIONS; i++) {
+		valid = h->section_address[i] == sections[i].address && h->section_size[i] == sections[i].sect.size();
+	}
+
+	const decoded_instruction* instructions = reinterpret_cast<const decoded_instruction*>(m_mapping + sizeof(header));
+	const code_block* blocks = valid ? reinterpret_cast<const code_block*>(instructions + h->num_instructions) : nullptr;
+	valid = valid && h->num_instructions == (sections[TEXT].sect.size() + sections[KTEXT].sect.size()) / 4 &&
+		m_mapping_size == sizeof(header) + uint64_t(h->num_instructions) * sizeof(decoded_instruction) + uint64_t(h->num_blocks) * sizeof(code_block) &&
+		checksum(checksum(HASH_SEED, instructions, h->num_instructions * sizeof(decoded_instruction)), blocks, h->num_blocks * sizeof(code_block)) == h->checksum;
+
+	// the translator indexes the instruction stream with the blocks, they have to stay inside their section
+	for (uint32_t i = 0; valid && i < h->num_blocks; i++) {
+		const code_block& b = blocks[i];
+		const section& sect = sections[b.sect == KTEXT ? KTEXT : TEXT];
+		valid = (b.sect == TEXT || b.sect == KTEXT) && b.start >= sect.address && b.start < b.end && b.end - sect.address <= sect.sect.size() &&
+			!((b.end - b.start) & 0x3) && uint64_t(b.first) + (b.end - b.start) / 4 <= h->num_instructions;
+	}
+
+	if (!valid) {
+		printf("Translation cache: '%s' is stale or corrupt, rebuilding it\n", file.c_str());
+		unmap();
+		return false;
+	}
+
+	m_analysis.view(instructions, h->num_instructions, blocks, h->num_blocks);
+	return true;
+}
+
+bool translation_cache::store_analysis(const std::array<section, NUM_SECTIONS>& sections) {
+	header h = header();
+	memcpy(h.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+	h.version = TRANSLATION_CACHE_VERSION;
+	h.header_size = sizeof(header);
+	h.key = m_key;
+	for (int i = 0; i < NUM_SECTIONS; i++) {
+		h.section_address[i] = sections[i].address;
+		h.section_size[i] = uint32_t(sections[i].sect.size());
+	}
+	h.num_instructions = m_analysis.num_instructions();
+	h.num_blocks = m_analysis.num_blocks();
+
+	size_t instructions_size = h.num_instructions * sizeof(decoded_instruction), blocks_size = h.num_blocks * sizeof(code_block);
+	h.checksum = checksum(checksum(HASH_SEED, m_analysis.instructions(), instructions_size), m_analysis.blocks(), blocks_size);
+
+	std::string file = path(".mvc"), tmp = temp_name(file);
+	{
+		std::ofstream out(tmp, std::ios::binary);
+		out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+		out.write(reinterpret_cast<const char*>(m_analysis.instructions()), instructions_size);
+		out.write(reinterpret_cast<const char*>(m_analysis.blocks()), blocks_size);
+		if (!out.good()) {
+			out.close();
+			std::remove(tmp.c_str());
+			return false;
+		}
+	}
+
+	if (!replace_file(tmp, file)) {
+		std::remove(tmp.c_str());
+		return false;
+	}
+	return true;
+}
+
+bool translation_cache::load_native() {
+#ifdef _WIN32
+	return false;
+#else
+	std::string file = path(".so");
+	struct stat st;
+	if (stat(file.c_str(), &st) != 0) {
+		return false; // not built yet
+	}
+
+	void* lib = dlopen(file.c_str(), RTLD_NOW | RTLD_LOCAL); // contains a slash, so it's never searched for
+	if (!lib) {
+		printf("Translation cache: failed to load '%s' (%s), the VM has to be linked with -rdynamic\n", file.c_str(), dlerror());
+		return true; // nothing wrong with the entry, run interpreted
+	}
+
+	auto get_program = reinterpret_cast<const aot_program* (*)()>(dlsym(lib, AOT_PROGRAM_SYMBOL));
+	const aot_program* program = get_program ? get_program() : nullptr;
+	if (!program || program->version != AOT_ABI_VERSION || program->key != m_key) {
+		printf("Translation cache: '%s' is stale, rebuild it\n", file.c_str());
+		dlclose(lib);
+		std::remove(file.c_str());
+		return false;
+	}
+
+	m_library = lib;
+	m_native = program;
+	return true;
+#endif
+}
+
+void translation_cache::unmap() {
+	if (m_mapping) {
+		unmap_cache_file(m_mapping, m_mapping_size);
+		m_mapping = nullptr;
+		m_mapping_size = 0;
+	}
+}
\ No newline at end of file
@@ -0,0 +1,63 @@
+#pragma once
+#include "pch.h"
+#include "sections.h"
+#include "code_analysis.h"
+#include "aot.h"
+
+constexpr uint32_t TRANSLATION_CACHE_VERSION = 3;
+
+// Persistent on-disk cache of everything derived from a program's code, keyed by a hash of its loaded sections so a
+// changed program simply gets a new entry. An entry in the cache directory consists of
+//   <key>.mvc  the code analysis (predecoded instructions, basic blocks, CFG validation), mapped straight into memory
+//   <key>.cpp  the translated source (translator.h), rewritten while there is no native code for it
+//   <key>.so   the native code, built from the .cpp (see README), loaded on the next start
+// Files are written under a temporary name and renamed into place. An analysis with the wrong version, key, section
+// layout, size or checksum, or native code for another key or runtime version, counts as missing and is rebuilt. A start
+// that finds usable native code doesn't touch the analysis, it's only loaded (or built) when the source is rewritten or
+// the analysis is asked for.
+class translation_cache {
+public:
+	translation_cache(const std::string& dir) : m_dir(dir), m_key(0), m_has_analysis(false), m_mapping(nullptr), m_mapping_size(0), m_library(nullptr), m_native(nullptr) {}
+	~translation_cache();
+
+	static uint64_t key(const std::array<section, NUM_SECTIONS>& sections, bool big_endian);
+
+	// looks up (or creates) the entry for the sections, problems with the cache are reported but never fatal
+	void open(const std::array<section, NUM_SECTIONS>& sections, const std::string& program, bool big_endian);
+
+	// the entry's analysis, loaded or built the first time it's needed
+	const code_analysis& analysis(const std::array<section, NUM_SECTIONS>& sections);
+	// the entry's native code, nullptr if it hasn't been built
+	const aot_program* native() const { return m_native; }
+
+private:
+	struct header {
+		char magic[8];
+		uint32_t version;
+		uint32_t header_size;
+		uint64_t key;
+		uint32_t section_address[NUM_SECTIONS];
+		uint32_t section_size[NUM_SECTIONS];
+		uint32_t num_instructions;
+		uint32_t num_blocks;
+		uint64_t checksum; // of everything after the header, see checksum()
+	};
+
+	std::string path(const char* extension) const;
+
+	static uint64_t checksum(uint64_t hash, const void* data, size_t size);
+	bool load_analysis(const std::array<section, NUM_SECTIONS>& sections);
+	bool store_analysis(const std::array<section, NUM_SECTIONS>& sections);
+	bool load_native(); // false if the entry needs its source (re)written
+	void unmap();
+
+	std::string m_dir;
+	uint64_t m_key;
+	code_analysis m_analysis;
+	bool m_has_analysis;
+
+	uint8_t* m_mapping; // the .mvc file while the analysis views it
+	size_t m_mapping_size;
+	void* m_library;
+	const aot_program* m_native;
+};
\ No newline at end of file
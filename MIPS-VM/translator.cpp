@@ -0,0 +1,310 @@
+#include "pch.h"
+#include "translator.h"
+#include "aot.h"
+#include "disassembler.h"
+#include "exceptions.h"
+#include "helper.h"
+
+static void append(std::string& out, const char* fmt, ...) {
+	char buf[512];
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, args);
+	va_end(args);
+	out += buf;
+}
+
+translator::translator(const std::array<section, NUM_SECTIONS>& sections, const code_analysis& analysis, const std::string& program, uint64_t key, bool big_endian) :
+	m_sections(sections), m_analysis(analysis), m_program(program), m_key(key), m_big_endian(big_endian), m_instructions(0), m_interpreted(0) {}
+
+bool translator::emit_instruction(std::string& body, uint32_t pc, const decoded_instruction& decoded, uint32_t index, bool& uses_state) {
+	instruction inst(decoded.hex);
+	char fallback[96]; // the interpreter does it, the block goes on if dispatch would advance pc
+	snprintf(fallback, sizeof(fallback), "aot_runtime::interpret(vm, tick + %u, 0x%08Xu, 0x%08Xu)", index, pc, inst.hex);
+
+	uint32_t rs = inst.r.rs, rt = inst.r.rt, rd = inst.r.rd;
+	uint32_t imm = inst.i.imm; // zero extended, like the interpreter uses it for ADDIU, SLTIU, ANDI and ORI
+	int32_t simm = bit_cast<int16_t>(inst.i.imm);
+
+	append(body, "\t// 0x%08X: %s\n", pc, disassemble(inst, pc).c_str());
+	m_instructions++;
+
+	// $zero is never written, the interpreter resets it after every instruction anyway
+	auto set = [&](uint32_t reg, const std::string& value) {
+		if (reg) {
+			append(body, "\tr[%u] = %s;\n", reg, value.c_str());
+		}
+	};
+	auto reg = [](uint32_t index) { return "r[" + std::to_string(index) + "]"; };
+	auto hex = [](uint32_t value) { char buf[16]; snprintf(buf, sizeof(buf), "0x%08Xu", value); return std::string(buf); };
+
+	// faulting or watched accesses go through the interpreter, which raises the exception or reports to the debugger
+	auto memory = [&](uint32_t size, bool store, bool sign) {
+		append(body, "\t{\n\t\tuint8_t* p = aot_runtime::access(vm, r[%u] + 0x%08Xu, %u, %s);\n", rs, uint32_t(simm), size, store ? "true" : "false");
+		append(body, "\t\tif (!p) return %s;\n", fallback);
+		if (store) {
+			if (size == 1) {
+				append(body, "\t\t*p = uint8_t(r[%u]);\n", rt);
+			}
+			else {
+				const char* type = size == 2 ? "uint16_t" : "uint32_t";
+				append(body, m_big_endian ? "\t\t%s v = swap_bytes(%s(r[%u]));\n\t\tmemcpy(p, &v, %u);\n" : "\t\t%s v = %s(r[%u]);\n\t\tmemcpy(p, &v, %u);\n", type, type, rt, size);
+			}
+		}
+		else if (rt) {
+			const char* type = size == 1 ? (sign ? "int8_t" : "uint8_t") : size == 2 ? (sign ? "int16_t" : "uint16_t") : "uint32_t";
+			append(body, "\t\t%s v;\n\t\tmemcpy(&v, p, %u);\n", type, size);
+			if (m_big_endian && size > 1) {
+				body += "\t\tv = swap_bytes_as(v);\n";
+			}
+			append(body, "\t\tr[%u] = uint32_t(%s);\n", rt, sign ? "int32_t(v)" : "v");
+		}
+		body += "\t}\n";
+		return false;
+	};
+
+	auto leave = [&](const std::string& target, bool advanced) {
+		append(body, "\taot_runtime::leave(vm, tick + %u, %s);\n\treturn %s;\n", index, target.c_str(), advanced ? "true" : "false");
+		return true;
+	};
+
+	auto interpreted = [&](bool ends) {
+		m_interpreted++;
+		if (ends) {
+			append(body, "\treturn %s;\n", fallback);
+			return true;
+		}
+		append(body, "\tif (!%s) return false;\n", fallback);
+		return false;
+	};
+
+	switch (inst.r.opcode) {
+	case uint32_t(instructions::R_FORMAT):
+		switch (inst.r.funct) {
+		case uint32_t(funct::SLL): set(rd, reg(rt) + " << " + std::to_string(inst.r.shift)); return false;
+		case uint32_t(funct::SRL): set(rd, reg(rt) + " >> " + std::to_string(inst.r.shift)); return false;
+		case uint32_t(funct::SRA): set(rd, "uint32_t(int32_t(" + reg(rt) + ") >> " + std::to_string(inst.r.shift) + ")"); return false;
+		case uint32_t(funct::SLT): set(rd, "int32_t(" + reg(rs) + ") < int32_t(" + reg(rt) + ")"); return false;
+		case uint32_t(funct::SLTU): set(rd, reg(rs) + " < " + reg(rt)); return false;
+		case uint32_t(funct::ADDU): set(rd, reg(rs) + " + " + reg(rt)); return false;
+		case uint32_t(funct::SUBU): set(rd, reg(rs) + " - " + reg(rt)); return false;
+		case uint32_t(funct::AND): set(rd, reg(rs) + " & " + reg(rt)); return false;
+		case uint32_t(funct::OR): set(rd, reg(rs) + " | " + reg(rt)); return false;
+		case uint32_t(funct::XOR): set(rd, reg(rs) + " ^ " + reg(rt)); return false;
+		case uint32_t(funct::NOR): set(rd, "~(" + reg(rs) + " | " + reg(rt) + ")"); return false;
+		case uint32_t(funct::MFHI): uses_state = true; set(rd, "s.hi"); return false;
+		case uint32_t(funct::MFLO): uses_state = true; set(rd, "s.lo"); return false;
+		case uint32_t(funct::MTHI): uses_state = true; append(body, "\ts.hi = r[%u];\n", rs); return false;
+		case uint32_t(funct::MTLO): uses_state = true; append(body, "\ts.lo = r[%u];\n", rs); return false;
+		case uint32_t(funct::MULT):
+		case uint32_t(funct::MULTU):
+		{
+			// MULT widens the unsigned registers too, just like the interpreter
+			const char* type = inst.r.funct == uint32_t(funct::MULT) ? "int64_t" : "uint64_t";
+			uses_state = true;
+			append(body, "\t{\n\t\t%s res = %s(r[%u]) * %s(r[%u]);\n\t\ts.hi = uint32_t(res >> 32);\n\t\ts.lo = uint32_t(res & 0xFFFFFFFF);\n\t}\n", type, type, rs, type, rt);
+			return false;
+		}
+		case uint32_t(funct::ADD):
+		case uint32_t(funct::SUB):
+		{
+			// overflow raises the exception in the interpreter
+			bool add = inst.r.funct == uint32_t(funct::ADD);
+			append(body, "\t{\n\t\tint32_t a = int32_t(r[%u]), b = int32_t(r[%u]);\n", rs, rt);
+			if (add) {
+				append(body, "\t\tif ((b > 0 && a > INT32_MAX - b) || (b < 0 && a < INT32_MIN - b)) return %s;\n", fallback);
+			}
+			else {
+				append(body, "\t\tif ((b < 0 && a > INT32_MAX + b) || (b > 0 && a < INT32_MIN + b)) return %s;\n", fallback);
+			}
+			if (rd) {
+				append(body, "\t\tr[%u] = uint32_t(a) %c uint32_t(b);\n", rd, add ? '+' : '-');
+			}
+			body += "\t}\n";
+			return false;
+		}
+		case uint32_t(funct::DIV):
+		case uint32_t(funct::DIVU):
+		{
+			const char* type = inst.r.funct == uint32_t(funct::DIV) ? "int32_t" : "uint32_t";
+			uses_state = true;
+			append(body, "\tif (r[%u] == 0) return %s;\n", rt, fallback);
+			append(body, "\t{\n\t\t%s a = %s(r[%u]), b = %s(r[%u]);\n\t\ts.hi = uint32_t(a %% b);\n\t\ts.lo = uint32_t(a / b);\n\t}\n", type, type, rs, type, rt);
+			return false;
+		}
+		case uint32_t(funct::JR):
+			return leave(reg(rs), false);
+		case uint32_t(funct::JALR):
+			append(body, "\tr[31] = 0x%08Xu;\n", pc + 4); // before reading rs, like the interpreter
+			return leave(reg(rs), false);
+		case uint32_t(funct::SYNC):
+			body += "\tstd::atomic_thread_fence(std::memory_order_seq_cst);\n";
+			return false;
+		case uint32_t(funct::SYSCALL):
+		case uint32_t(funct::BREAK):
+			return interpreted(true);
+		}
+		return interpreted(false); // traps
+	case uint32_t(instructions::MFC0):
+		return interpreted(inst.r.funct == 0x18); // ERET ends the block
+	case uint32_t(instructions::MUL):
+		set(rd, reg(rs) + " * " + reg(rt));
+		return false;
+	case uint32_t(instructions::J):
+		return leave(hex(decoded.target), false);
+	case uint32_t(instructions::JAL):
+		append(body, "\tr[31] = 0x%08Xu;\n", pc + 4);
+		return leave(hex(decoded.target), false);
+	case uint32_t(instructions::ADDIU): set(rt, reg(rs) + " + " + hex(imm)); return false;
+	case uint32_t(instructions::SLTI): set(rt, "int32_t(" + reg(rs) + ") < " + std::to_string(simm)); return false;
+	case uint32_t(instructions::SLTIU): set(rt, reg(rs) + " < " + hex(imm)); return false;
+	case uint32_t(instructions::ANDI): set(rt, reg(rs) + " & " + hex(imm)); return false;
+	case uint32_t(instructions::ORI): set(rt, reg(rs) + " | " + hex(imm)); return false;
+	case uint32_t(instructions::LUI): set(rt, hex(imm << 16)); return false;
+	case uint32_t(instructions::ADDI):
+		append(body, "\t{\n\t\tint32_t a = int32_t(r[%u]), b = %d;\n", rs, simm);
+		append(body, "\t\tif ((b > 0 && a > INT32_MAX - b) || (b < 0 && a < INT32_MIN - b)) return %s;\n", fallback);
+		if (rt) {
+			append(body, "\t\tr[%u] = uint32_t(a) + uint32_t(b);\n", rt);
+		}
+		body += "\t}\n";
+		return false;
+	case uint32_t(instructions::BEQ):
+	case uint32_t(instructions::BNE):
+	case uint32_t(instructions::BLEZ):
+	case uint32_t(instructions::BGTZ):
+	{
+		std::string cond;
+		switch (inst.i.opcode) {
+		case uint32_t(instructions::BEQ): cond = reg(rs) + " == " + reg(rt); break;
+		case uint32_t(instructions::BNE): cond = reg(rs) + " != " + reg(rt); break;
+		case uint32_t(instructions::BLEZ): cond = "int32_t(" + reg(rs) + ") <= 0"; break;
+		default: cond = "int32_t(" + reg(rs) + ") > 0"; break;
+		}
+		append(body, "\tif (%s) {\n\t\taot_runtime::leave(vm, tick + %u, 0x%08Xu);\n\t\treturn false;\n\t}\n", cond.c_str(), index, decoded.target);
+		return leave(hex(pc + 4), true);
+	}
+	case uint32_t(instructions::LW): return memory(4, false, false);
+	case uint32_t(instructions::LH): return memory(2, false, true);
+	case uint32_t(instructions::LHU): return memory(2, false, false);
+	case uint32_t(instructions::LB): return memory(1, false, true);
+	case uint32_t(instructions::LBU): return memory(1, false, false);
+	case uint32_t(instructions::SW): return memory(4, true, false);
+	case uint32_t(instructions::SH): return memory(2, true, false);
+	case uint32_t(instructions::SB): return memory(1, true, false);
+	}
+	return interpreted(false); // LL/SC, coprocessor 1, trap immediates and anything invalid
+}
+
+void translator::emit_block(std::string& out, const code_block& b) {
+	std::string body;
+	bool uses_state = false;
+	bool ended = false;
+
+	uint32_t index = 0;
+	for (uint32_t pc = b.start; pc < b.end && !ended; pc += 4, index++) {
+		ended = emit_instruction(body, pc, m_analysis.instructions()[b.first + index], index, uses_state);
+	}
+	if (!ended) {
+		append(body, "\taot_runtime::leave(vm, tick + %u, 0x%08Xu);\n\treturn true;\n", index - 1, b.end);
+	}
+
+	append(out, "static bool block_%08X(executor& vm) {\n", b.start);
+	if (body.find("r[") != std::string::npos) {
+		out += "\tuint32_t* r = aot_runtime::regs(vm);\n";
+	}
+	if (uses_state) {
+		out += "\tregisters& s = aot_runtime::state(vm);\n";
+	}
+	out += "\tuint64_t tick = aot_runtime::tick(vm);\n";
+	out += body;
+	out += "}\n\n";
+}
+
+void translator::emit_section(std::string& out, int sect) {
+	const section& s = m_sections[sect];
+
+	// the section file as the VM reads it, address first
+	std::vector<uint8_t> file(4);
+	memcpy(file.data(), &s.address, 4);
+	file.insert(file.end(), s.sect.data(), s.sect.data() + s.sect.size());
+
+	// back to the big-endian image the VM swaps again when it loads it
+	if (m_big_endian) {
+		for (size_t i = 0; i < file.size(); i += sizeof(uint32_t)) {
+			if (i == 0 || (s.flags & EXECUTABLE)) {
+				uint32_t word;
+				memcpy(&word, file.data() + i, sizeof(uint32_t));
+				word = swap_bytes(word);
+				memcpy(file.data() + i, &word, sizeof(uint32_t));
+			}
+		}
+	}
+
+	append(out, "static const uint8_t section_%s[%u] = {", section_names[sect] + 1, uint32_t(file.size()));
+	for (size_t i = 0; i < file.size(); i++) {
+		append(out, "%s0x%02X,", i % 24 ? " " : "\n\t", file[i]);
+	}
+	out += "\n};\n\n";
+}
+
+bool translator::write(const std::string& path) {
+	const code_block* blocks = m_analysis.blocks();
+	uint32_t num_blocks = m_analysis.num_blocks();
+
+	std::string out;
+	out += "// Generated by the MIPS VM translator from " + m_program + ", do not edit.\n";
+	out += "// Runner: g++ -O2 -std=c++17 -pthread -DMIPS_VM_NO_MAIN -I<MIPS-VM> <this file> <MIPS-VM>/*.cpp -ldl\n";
+	out += "// Cache entry: g++ -O2 -std=c++17 -shared -fPIC -DMIPS_VM_TRANSLATION_LIBRARY -I<MIPS-VM> <this file> -o <key>.so\n";
+	out += "#include \"pch.h\"\n#include \"aot.h\"\n#include \"plugin_api.h\"\n\n";
+
+	for (uint32_t i = 0; i < num_blocks; i++) {
+		emit_block(out, blocks[i]);
+	}
+
+	out += "static const aot_block blocks[] = {\n";
+	for (uint32_t i = 0; i < num_blocks; i++) {
+		append(out, "\t{ 0x%08Xu, block_%08X },\n", blocks[i].start, blocks[i].start);
+	}
+	out += "};\n\n";
+
+	for (int i = 0; i < NUM_SECTIONS; i++) {
+		if (m_sections[i].sect.size()) {
+			emit_section(out, i);
+		}
+	}
+
+	std::string name;
+	for (char c : m_program) {
+		if (c == '\\' || c == '"') {
+			name += '\\';
+		}
+		name += c;
+	}
+
+	out += "static const aot_program program = {\n";
+	append(out, "\t%u,\n\t0x%016llXull,\n", AOT_ABI_VERSION, (unsigned long long)m_key);
+	out += "\t\"" + name + "\",\n\t{ ";
+	for (int i = 0; i < NUM_SECTIONS; i++) {
+		out += m_sections[i].sect.size() ? std::string("section_") + (section_names[i] + 1) : "nullptr";
+		out += i + 1 < NUM_SECTIONS ? ", " : " },\n\t{ ";
+	}
+	for (int i = 0; i < NUM_SECTIONS; i++) {
+		append(out, "%u%s", m_sections[i].sect.size() ? uint32_t(m_sections[i].sect.size()) + 4 : 0, i + 1 < NUM_SECTIONS ? ", " : " },\n");
+	}
+	append(out, "\tblocks,\n\t%u,\n\t%u\n};\n\n", num_blocks, uint32_t(m_big_endian));
+	out += "extern \"C\" MIPS_VM_PLUGIN_EXPORT const aot_program* " AOT_PROGRAM_SYMBOL "() {\n\treturn &program;\n}\n\n";
+	out += "#ifndef MIPS_VM_TRANSLATION_LIBRARY\nint main(int argc, char** argv) {\n\treturn vm_main(argc, argv, &program);\n}\n#endif\n";
+
+	std::ofstream file(path, std::ios::binary);
+	if (!file.is_open() || !file.write(out.data(), out.size())) {
+		printf("Failed to write the translated program to '%s'\n", path.c_str());
+		return false;
+	}
+	return true;
+}
+
+std::string translator::summary() const {
+	return std::to_string(m_instructions) + " instructions in " + std::to_string(m_analysis.num_blocks()) + " blocks (" + std::to_string(m_interpreted) + " handed to the interpreter, " +
+		std::to_string(m_analysis.invalid_targets()) + " static jumps out of the code)";
+}
\ No newline at end of file
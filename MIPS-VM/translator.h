@@ -0,0 +1,36 @@
+#pragma once
+#include "pch.h"
+#include "sections.h"
+#include "instruction.h"
+#include "code_analysis.h"
+
+// Static binary translator. Writes each basic block of .text and .ktext (see code_analysis.h) out as a C++ function
+// on top of aot_runtime (aot.h), together with the section files and the address to block table. Compiled with the
+// VM sources and MIPS_VM_NO_MAIN this gives a native runner for the program, compiled as a shared library with
+// MIPS_VM_TRANSLATION_LIBRARY it's the native code of a translation cache entry (translation_cache.h). Either way it
+// behaves exactly like the interpreter (same memory model, syscalls, exceptions and instruction count).
+//
+// Jumps through registers are resolved at run time through the block table, addresses the translator didn't see as
+// leaders are interpreted until they reach one.
+class translator {
+public:
+	translator(const std::array<section, NUM_SECTIONS>& sections, const code_analysis& analysis, const std::string& program, uint64_t key, bool big_endian);
+
+	// writes the C++ source, false (after printing why) if it can't
+	bool write(const std::string& path);
+	std::string summary() const;
+
+private:
+	void emit_block(std::string& out, const code_block& b);
+	// one instruction, index is its position in the block. Returns true if it ended the block (the code returns)
+	bool emit_instruction(std::string& body, uint32_t pc, const decoded_instruction& decoded, uint32_t index, bool& uses_state);
+	void emit_section(std::string& out, int sect);
+
+	const std::array<section, NUM_SECTIONS>& m_sections;
+	const code_analysis& m_analysis;
+	std::string m_program;
+	uint64_t m_key; // translation_cache::key of the sections
+	bool m_big_endian; // the sections hold a big-endian program, code in host order (see byte_order.h)
+	uint32_t m_instructions; // translated instructions
+	uint32_t m_interpreted; // of those, handed to the interpreter every time
+};
\ No newline at end of file
@@ -1,2 +1,3 @@
 if not exist "out\" mkdir out
-g++ -O2 -std=c++17 MIPS-VM/*.cpp -o out/mips_vm.exe
\ No newline at end of file
+g++ -O2 -std=c++17 MIPS-VM/*.cpp -o out/mips_vm.exe
+g++ -O2 -std=c++17 -shared -IMIPS-VM plugins/buffer_ops.cpp -o out/buffer_ops.dll
\ No newline at end of file
@@ -1,2 +1,3 @@
 mkdir -p out
-g++ -O2 -std=c++17 MIPS-VM/*.cpp -o out/mips_vm.out
+g++ -O2 -std=c++17 -pthread -rdynamic MIPS-VM/*.cpp -o out/mips_vm.out -ldl
+g++ -O2 -std=c++17 -shared -fPIC -IMIPS-VM plugins/buffer_ops.cpp -o out/buffer_ops.so
@@ -0,0 +1,97 @@
+// Reference syscall plugin: memcpy, memset and CRC32 on guest buffers.
+//
+//   syscall 100 MemCopy  $a0 = destination, $a1 = source, $a2 = bytes     $v0 = destination (overlapping ranges are fine)
+//   syscall 101 MemSet   $a0 = destination, $a1 = byte, $a2 = bytes       $v0 = destination
+//   syscall 102 Crc32    $a0 = buffer, $a1 = bytes, $a2 = crc so far (0)  $v0 = CRC-32 (IEEE 802.3, same as zlib's crc32)
+//
+// Build: g++ -O2 -shared -fPIC -IMIPS-VM plugins/buffer_ops.cpp -o out/buffer_ops.so
+// Use:   mips_vm.out --plugin out/buffer_ops.so program
+#include "plugin_api.h"
+#include <cstring>
+
+enum : uint32_t {
+	SYSCALL_MEM_COPY = 100,
+	SYSCALL_MEM_SET = 101,
+	SYSCALL_CRC32 = 102,
+};
+
+static const mips_vm_host_api* api;
+static uint32_t crc_table[256];
+
+static int mem_copy(mips_vm_guest* guest, void*) {
+	uint32_t dst = api->get_reg(guest, MIPS_VM_REG_A0);
+	uint32_t src = api->get_reg(guest, MIPS_VM_REG_A1);
+	uint32_t size = api->get_reg(guest, MIPS_VM_REG_A2);
+
+	if (size) {
+		const uint8_t* from = api->map(guest, src, size, 0);
+		uint8_t* to = api->map(guest, dst, size, 1);
+		if (!from || !to) {
+			return -1;
+		}
+		memmove(to, from, size);
+	}
+
+	api->set_reg(guest, MIPS_VM_REG_V0, dst);
+	return 0;
+}
+
+static int mem_set(mips_vm_guest* guest, void*) {
+	uint32_t dst = api->get_reg(guest, MIPS_VM_REG_A0);
+	uint32_t value = api->get_reg(guest, MIPS_VM_REG_A1);
+	uint32_t size = api->get_reg(guest, MIPS_VM_REG_A2);
+
+	if (size) {
+		uint8_t* to = api->map(guest, dst, size, 1);
+		if (!to) {
+			return -1;
+		}
+		memset(to, int(value & 0xFF), size);
+	}
+
+	api->set_reg(guest, MIPS_VM_REG_V0, dst);
+	return 0;
+}
+
+static int crc32(mips_vm_guest* guest, void*) {
+	uint32_t buf = api->get_reg(guest, MIPS_VM_REG_A0);
+	uint32_t size = api->get_reg(guest, MIPS_VM_REG_A1);
+	uint32_t crc = ~api->get_reg(guest, MIPS_VM_REG_A2);
+
+	if (size) {
+		const uint8_t* data = api->map(guest, buf, size, 0);
+		if (!data) {
+			return -1;
+		}
+		for (uint32_t i = 0; i < size; i++) {
+			crc = crc_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+		}
+	}
+
+	api->set_reg(guest, MIPS_VM_REG_V0, ~crc);
+	return 0;
+}
+
+extern "C" MIPS_VM_PLUGIN_EXPORT int mips_vm_plugin_init(const mips_vm_host_api* host) {
+	if (host->version < 1) {
+		return -1;
+	}
+	api = host;
+
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t c = i;
+		for (int bit = 0; bit < 8; bit++) {
+			c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+		}
+		crc_table[i] = c;
+	}
+
+	// nothing but guest memory is touched, so the syscalls can run on several harts at once
+	if (api->register_syscall(api->host, SYSCALL_MEM_COPY, mem_copy, nullptr, MIPS_VM_SYSCALL_THREAD_SAFE) != 0 ||
+		api->register_syscall(api->host, SYSCALL_MEM_SET, mem_set, nullptr, MIPS_VM_SYSCALL_THREAD_SAFE) != 0 ||
+		api->register_syscall(api->host, SYSCALL_CRC32, crc32, nullptr, MIPS_VM_SYSCALL_THREAD_SAFE) != 0) {
+		return -1;
+	}
+
+	return 0;
+}
\ No newline at end of file